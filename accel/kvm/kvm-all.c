@@ -107,6 +107,12 @@ struct KVMState
     KVMMemoryListener memory_listener;
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
 
+    /* listener of each address space id, for the dirty ring entries */
+    int nr_as;
+    KVMMemoryListener **as_listeners;
+    /* entries of each vcpu dirty ring, 0 if dirty bitmaps are used */
+    uint32_t dirty_ring_size;
+
     /* memory encryption */
     void *memcrypt_handle;
     int (*memcrypt_encrypt_data)(void *handle, uint8_t *ptr, uint64_t len);
@@ -145,6 +151,11 @@ int kvm_get_max_memslots(void)
     return s->nr_slots;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->dirty_ring_size;
+}
+
 bool kvm_memcrypt_enabled(void)
 {
     if (kvm_state && kvm_state->memcrypt_handle) {
@@ -304,6 +315,15 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        ret = munmap(cpu->kvm_dirty_gfns,
+                     s->dirty_ring_size * sizeof(struct kvm_dirty_gfn));
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
@@ -368,6 +388,22 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL,
+                                   s->dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+        cpu->kvm_fetch_index = 0;
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -472,6 +508,115 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+
+    if (as_id >= s->nr_as || slot_id >= s->nr_slots) {
+        return;
+    }
+    kml = s->as_listeners[as_id];
+    if (!kml) {
+        return;
+    }
+    mem = &kml->slots[slot_id];
+    /* Stale entry of a removed slot, see kvm_dirty_ring_flush */
+    if (!mem->memory_size || offset >= mem->memory_size / getpagesize()) {
+        return;
+    }
+
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * getpagesize(),
+                                        getpagesize(), DIRTY_CLIENTS_NOCODE);
+}
+
+/* Collect the entries of @cpu's dirty ring.  Returns how many there were. */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfn;
+    uint32_t count = 0;
+
+    if (!cpu->kvm_dirty_gfns) {
+        return 0;
+    }
+
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index &
+                                   (s->dirty_ring_size - 1)];
+        /* Read the entry only after KVM has filled it */
+        if (!(atomic_load_acquire(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, gfn->slot >> 16, gfn->slot & 0xffff,
+                                 gfn->offset);
+        atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+
+    /* Account the pages to the vcpu for cpu_dirty_limit_set */
+    atomic_add(&cpu->dirty_pages, count);
+    return count;
+}
+
+/*
+ * Move the entries of all dirty rings to the dirty bitmaps and let KVM
+ * write protect those pages again.  Entries that a running vcpu has not
+ * flushed to its ring yet are collected by a later call; they all are
+ * once the vcpus are stopped.  Called with the BQL held.
+ */
+void kvm_dirty_ring_reap(void)
+{
+    KVMState *s = kvm_state;
+    CPUState *cpu;
+    uint64_t total = 0;
+    int ret;
+
+    if (!kvm_dirty_ring_enabled()) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            fprintf(stderr, "%s: KVM_RESET_DIRTY_RINGS failed: %s\n",
+                    __func__, strerror(-ret));
+            abort();
+        }
+    }
+}
+
+static void do_kvm_dirty_ring_flush(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* Nothing to do, leaving KVM_RUN is what flushes the vcpu's entries */
+}
+
+/*
+ * Like kvm_dirty_ring_reap, but first wait for each vcpu to leave
+ * KVM_RUN, so that all pages dirtied until now are in the rings.  Must
+ * be used before a slot is removed: ring entries only name the slot, so
+ * entries collected later would be resolved against whatever slot takes
+ * its place.  Called with the BQL held, which run_on_cpu drops while it
+ * waits.
+ */
+static void kvm_dirty_ring_flush(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->created) {
+            run_on_cpu(cpu, do_kvm_dirty_ring_flush, RUN_ON_CPU_NULL);
+        }
+    }
+    kvm_dirty_ring_reap();
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
@@ -489,6 +634,12 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     KVMSlot *mem;
     hwaddr start_addr, size;
 
+    if (s->dirty_ring_size) {
+        /* KVM_GET_DIRTY_LOG is not available with dirty rings */
+        kvm_dirty_ring_reap();
+        return 0;
+    }
+
     size = kvm_align_section(section, &start_addr);
     if (size) {
         mem = kvm_lookup_matching_slot(kml, start_addr, size);
@@ -792,7 +943,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             return;
         }
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(kml, section);
+            if (kvm_state->dirty_ring_size) {
+                kvm_dirty_ring_flush();
+            } else {
+                kvm_physical_sync_dirty_bitmap(kml, section);
+            }
         }
 
         /* unregister the slot */
@@ -812,6 +967,9 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = memory_region_get_ram_addr(mr) +
+                            section->offset_within_region +
+                            (start_addr - section->offset_within_address_space);
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem, true);
@@ -928,6 +1086,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    if (as_id < s->nr_as) {
+        s->as_listeners[as_id] = kml;
+    }
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -1591,6 +1752,12 @@ static int kvm_init(MachineState *ms)
         s->nr_slots = 32;
     }
 
+    s->nr_as = kvm_check_extension(s, KVM_CAP_MULTI_ADDRESS_SPACE);
+    if (s->nr_as <= 1) {
+        s->nr_as = 1;
+    }
+    s->as_listeners = g_new0(KVMMemoryListener *, s->nr_as);
+
     kvm_type = qemu_opt_get(qemu_get_machine_opts(), "kvm-type");
     if (mc->kvm_type) {
         type = mc->kvm_type(ms, kvm_type);
@@ -1626,6 +1793,29 @@ static int kvm_init(MachineState *ms)
 
     s->vmfd = ret;
 
+    s->dirty_ring_size = machine_kvm_dirty_ring_size(ms);
+    if (s->dirty_ring_size) {
+        uint64_t ring_bytes = s->dirty_ring_size *
+                              sizeof(struct kvm_dirty_gfn);
+
+        /* Returns the maximum size of a ring in bytes, 0 if unsupported */
+        ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+        if (ret <= 0 || ring_bytes > ret) {
+            error_report("KVM dirty ring size %" PRIu32 " is not supported "
+                         "(maximum %d entries)", s->dirty_ring_size,
+                         ret > 0 ? ret / (int)sizeof(struct kvm_dirty_gfn)
+                                 : 0);
+            ret = -EINVAL;
+            goto err;
+        }
+        ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+        if (ret) {
+            error_report("Enabling the KVM dirty ring failed: %s",
+                         strerror(-ret));
+            goto err;
+        }
+    }
+
     /* check the vcpu limits */
     soft_vcpus_limit = kvm_recommended_vcpus(s);
     hard_vcpus_limit = kvm_max_vcpus(s);
@@ -2055,6 +2245,14 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* The exit flushed this vcpu's entries, make room for more */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap();
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
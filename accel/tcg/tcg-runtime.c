@@ -30,6 +30,7 @@
 #include "exec/tb-lookup.h"
 #include "disas/disas.h"
 #include "exec/log.h"
+#include "qemu/exec-trace.h"
 
 /* 32-bit helpers */
 
@@ -167,3 +168,22 @@ void HELPER(exit_atomic)(CPUArchState *env)
 {
     cpu_loop_exit_atomic(ENV_GET_CPU(env), GETPC());
 }
+
+static inline ExecTraceBuffer *exec_trace_buffer(CPUState *cpu)
+{
+    if (unlikely(!cpu->exec_trace)) {
+        cpu->exec_trace = exec_trace_buffer_new(cpu->cpu_index);
+    }
+    return cpu->exec_trace;
+}
+
+void HELPER(exec_trace_tb)(CPUArchState *env, uint32_t id)
+{
+    exec_trace_record_tb(exec_trace_buffer(ENV_GET_CPU(env)), id);
+}
+
+void HELPER(exec_trace_mem)(CPUArchState *env, target_ulong addr,
+                            uint32_t info)
+{
+    exec_trace_record_mem(exec_trace_buffer(ENV_GET_CPU(env)), addr, info);
+}
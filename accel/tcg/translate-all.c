@@ -50,6 +50,8 @@
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
+#include "qemu/interval-tree.h"
+#include "qemu/rcu.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
 #include "exec/log.h"
@@ -105,8 +107,6 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned long *code_bitmap;
     unsigned int code_write_count;
-#else
-    unsigned long flags;
 #endif
 #ifndef CONFIG_USER_ONLY
     QemuSpin lock;
@@ -206,6 +206,173 @@ static int v_l2_levels;
 
 static void *l1_map[V_L1_MAX_SIZE];
 
+#ifdef CONFIG_USER_ONLY
+/*
+ * In user mode, the l1_map only holds PageDescs for pages that contain
+ * translated code.  The protection flags of guest pages are kept in an
+ * interval tree of non-overlapping ranges instead, so that mapping,
+ * protecting or unmapping a huge range costs O(log n + k) in the number
+ * k of ranges it touches, and sparse mappings do not populate the l1_map.
+ *
+ * The tree is only modified with mmap_lock held.  A node is never changed
+ * once it is in the tree: resizing a range or changing its flags replaces
+ * the node, and the old one is freed after an RCU grace period.  This lets
+ * page_get_flags() and page_check_range() look the tree up without the
+ * lock and always see a consistent range; they take the lock only when
+ * they find nothing, since a lockless lookup can miss a range that is
+ * being replaced.
+ */
+typedef struct PageFlagsNode {
+    struct rcu_head rcu;
+    IntervalTreeNode itree;
+    int flags;
+} PageFlagsNode;
+
+static IntervalTreeRoot pageflags_root;
+
+/* All TBs linked to the l1_map, by guest virtual address range */
+static IntervalTreeRoot tb_root;
+
+static PageFlagsNode *pageflags_find(target_ulong start, target_ulong last)
+{
+    IntervalTreeNode *n = interval_tree_iter_first(&pageflags_root,
+                                                   start, last);
+
+    return n ? container_of(n, PageFlagsNode, itree) : NULL;
+}
+
+static PageFlagsNode *pageflags_next(PageFlagsNode *p, target_ulong start,
+                                     target_ulong last)
+{
+    IntervalTreeNode *n = interval_tree_iter_next(&p->itree, start, last);
+
+    return n ? container_of(n, PageFlagsNode, itree) : NULL;
+}
+
+static void pageflags_create(target_ulong start, target_ulong last, int flags)
+{
+    PageFlagsNode *p = g_new(PageFlagsNode, 1);
+
+    p->itree.start = start;
+    p->itree.last = last;
+    p->flags = flags;
+    interval_tree_insert(&p->itree, &pageflags_root);
+}
+
+static void pageflags_delete(PageFlagsNode *p)
+{
+    interval_tree_remove(&p->itree, &pageflags_root);
+    g_free_rcu(p, rcu);
+}
+
+/* Replace @p with a new node for [start, last] */
+static void pageflags_replace(PageFlagsNode *p, target_ulong start,
+                              target_ulong last, int flags)
+{
+    pageflags_delete(p);
+    pageflags_create(start, last, flags);
+}
+
+/* Drop the flags of [start, last], splitting the ranges at its edges */
+static void pageflags_unset(target_ulong start, target_ulong last)
+{
+    PageFlagsNode *p, *next;
+
+    for (p = pageflags_find(start, last); p; p = next) {
+        target_ulong p_start = p->itree.start;
+        target_ulong p_last = p->itree.last;
+
+        next = pageflags_next(p, start, last);
+        if (p_start < start) {
+            if (p_last > last) {
+                pageflags_create(last + 1, p_last, p->flags);
+            }
+            pageflags_replace(p, p_start, start - 1, p->flags);
+        } else if (p_last > last) {
+            pageflags_replace(p, last + 1, p_last, p->flags);
+        } else {
+            pageflags_delete(p);
+        }
+    }
+}
+
+/*
+ * Give @flags to [start, last], which must not be covered by any range,
+ * merging it with the neighbouring ranges when they have the same flags.
+ */
+static void pageflags_create_merge(target_ulong start, target_ulong last,
+                                   int flags)
+{
+    PageFlagsNode *prev = NULL;
+    PageFlagsNode *next = NULL;
+
+    if (start != 0) {
+        prev = pageflags_find(start - 1, start - 1);
+        if (prev && prev->flags != flags) {
+            prev = NULL;
+        }
+    }
+    if (last + 1 != 0) {
+        next = pageflags_find(last + 1, last + 1);
+        if (next && next->flags != flags) {
+            next = NULL;
+        }
+    }
+
+    if (prev && next) {
+        target_ulong next_last = next->itree.last;
+
+        pageflags_delete(next);
+        pageflags_replace(prev, prev->itree.start, next_last, flags);
+    } else if (prev) {
+        pageflags_replace(prev, prev->itree.start, last, flags);
+    } else if (next) {
+        pageflags_replace(next, start, next->itree.last, flags);
+    } else {
+        pageflags_create(start, last, flags);
+    }
+}
+
+/* Set and clear flags of the mapped pages in [start, last] */
+static void pageflags_set_clear(target_ulong start, target_ulong last,
+                                int set_flags, int clear_flags)
+{
+    PageFlagsNode *p, *next;
+
+    for (p = pageflags_find(start, last); p; p = next) {
+        target_ulong p_start = p->itree.start;
+        target_ulong p_last = p->itree.last;
+        int flags = (p->flags & ~clear_flags) | set_flags;
+
+        next = pageflags_next(p, start, last);
+        if (flags == p->flags) {
+            continue;
+        }
+        if (p_start < start) {
+            pageflags_create(p_start, start - 1, p->flags);
+            p_start = start;
+        }
+        if (p_last > last) {
+            pageflags_create(last + 1, p_last, p->flags);
+            p_last = last;
+        }
+        pageflags_replace(p, p_start, p_last, flags);
+    }
+}
+
+static void tb_record(TranslationBlock *tb)
+{
+    tb->itree.start = tb->pc;
+    tb->itree.last = tb->pc + tb->size - 1;
+    interval_tree_insert(&tb->itree, &tb_root);
+}
+
+static void tb_unrecord(TranslationBlock *tb)
+{
+    interval_tree_remove(&tb->itree, &tb_root);
+}
+#endif
+
 /* code generation context */
 TCGContext tcg_init_ctx;
 __thread TCGContext *tcg_ctx;
@@ -1214,6 +1381,9 @@ static void page_flush_tb(void)
     for (i = 0; i < l1_sz; i++) {
         page_flush_tb_1(v_l2_levels, l1_map + i);
     }
+#ifdef CONFIG_USER_ONLY
+    tb_root.root = NULL;
+#endif
 }
 
 static gboolean tb_host_size_iter(gpointer key, gpointer value, gpointer data)
@@ -1455,6 +1625,9 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
             tb_page_remove(p, tb);
             invalidate_page_bitmap(p);
         }
+#ifdef CONFIG_USER_ONLY
+        tb_unrecord(tb);
+#endif
     }
 
     /* remove the TB from the hash list */
@@ -1548,25 +1721,21 @@ static inline void tb_page_add(PageDesc *p, TranslationBlock *tb,
     invalidate_page_bitmap(p);
 
 #if defined(CONFIG_USER_ONLY)
-    if (p->flags & PAGE_WRITE) {
-        target_ulong addr;
-        PageDesc *p2;
+    if (page_get_flags(page_addr) & PAGE_WRITE) {
+        target_ulong last;
+        PageFlagsNode *p2;
         int prot;
 
         /* force the host page as non writable (writes will have a
            page fault + mprotect overhead) */
         page_addr &= qemu_host_page_mask;
+        last = page_addr + qemu_host_page_size - 1;
         prot = 0;
-        for (addr = page_addr; addr < page_addr + qemu_host_page_size;
-            addr += TARGET_PAGE_SIZE) {
-
-            p2 = page_find(addr >> TARGET_PAGE_BITS);
-            if (!p2) {
-                continue;
-            }
+        for (p2 = pageflags_find(page_addr, last); p2;
+             p2 = pageflags_next(p2, page_addr, last)) {
             prot |= p2->flags;
-            p2->flags &= ~PAGE_WRITE;
-          }
+        }
+        pageflags_set_clear(page_addr, last, 0, PAGE_WRITE);
         mprotect(g2h(page_addr), qemu_host_page_size,
                  (prot & PAGE_BITS) & ~PAGE_WRITE);
         if (DEBUG_TB_INVALIDATE_GATE) {
@@ -1628,6 +1797,9 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     } else {
         tb->page_addr[1] = -1;
     }
+#ifdef CONFIG_USER_ONLY
+    tb_record(tb);
+#endif
 
     if (!(tb->cflags & CF_NOCACHE)) {
         void *existing_tb = NULL;
@@ -1646,6 +1818,9 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                 tb_page_remove(p2, tb);
                 invalidate_page_bitmap(p2);
             }
+#ifdef CONFIG_USER_ONLY
+            tb_unrecord(tb);
+#endif
             tb = existing_tb;
         }
     }
@@ -1972,9 +2147,6 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
  */
 #ifdef CONFIG_SOFTMMU
 void tb_invalidate_phys_range(ram_addr_t start, ram_addr_t end)
-#else
-void tb_invalidate_phys_range(target_ulong start, target_ulong end)
-#endif
 {
     struct page_collection *pages;
     tb_page_addr_t next;
@@ -1995,6 +2167,24 @@ void tb_invalidate_phys_range(target_ulong start, target_ulong end)
     }
     page_collection_unlock(pages);
 }
+#else
+void tb_invalidate_phys_range(target_ulong start, target_ulong end)
+{
+    target_ulong last = end - 1;
+    IntervalTreeNode *n, *next;
+
+    assert_memory_lock();
+
+    /* @end is 0 for a range that extends to the top of the address space */
+    if (last < start) {
+        return;
+    }
+    for (n = interval_tree_iter_first(&tb_root, start, last); n; n = next) {
+        next = interval_tree_iter_next(n, start, last);
+        tb_phys_invalidate__locked(container_of(n, TranslationBlock, itree));
+    }
+}
+#endif
 
 #ifdef CONFIG_SOFTMMU
 /* len must be <= 8 and start must be a multiple of len.
@@ -2351,88 +2541,37 @@ void cpu_interrupt(CPUState *cpu, int mask)
  * Walks guest process memory "regions" one by one
  * and calls callback function 'fn' for each region.
  */
-struct walk_memory_regions_data {
-    walk_memory_regions_fn fn;
-    void *priv;
-    target_ulong start;
-    int prot;
-};
-
-static int walk_memory_regions_end(struct walk_memory_regions_data *data,
-                                   target_ulong end, int new_prot)
-{
-    if (data->start != -1u) {
-        int rc = data->fn(data->priv, data->start, end, data->prot);
-        if (rc != 0) {
-            return rc;
-        }
-    }
-
-    data->start = (new_prot ? end : -1u);
-    data->prot = new_prot;
-
-    return 0;
-}
-
-static int walk_memory_regions_1(struct walk_memory_regions_data *data,
-                                 target_ulong base, int level, void **lp)
+int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
 {
-    target_ulong pa;
-    int i, rc;
-
-    if (*lp == NULL) {
-        return walk_memory_regions_end(data, base, 0);
-    }
-
-    if (level == 0) {
-        PageDesc *pd = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            int prot = pd[i].flags;
+    PageFlagsNode *p;
+    target_ulong start = 0, end = 0;
+    unsigned long prot = 0;
+    bool in_region = false;
+    int rc = 0;
 
-            pa = base | (i << TARGET_PAGE_BITS);
-            if (prot != data->prot) {
-                rc = walk_memory_regions_end(data, pa, prot);
-                if (rc != 0) {
-                    return rc;
-                }
-            }
-        }
-    } else {
-        void **pp = *lp;
-
-        for (i = 0; i < V_L2_SIZE; ++i) {
-            pa = base | ((target_ulong)i <<
-                (TARGET_PAGE_BITS + V_L2_BITS * level));
-            rc = walk_memory_regions_1(data, pa, level - 1, pp + i);
+    mmap_lock();
+    for (p = pageflags_find(0, -1); p; p = pageflags_next(p, 0, -1)) {
+        /* adjacent ranges can have the same flags after being split */
+        if (in_region && (p->itree.start != end || p->flags != prot)) {
+            rc = fn(priv, start, end, prot);
             if (rc != 0) {
-                return rc;
+                break;
             }
+            in_region = false;
         }
-    }
-
-    return 0;
-}
-
-int walk_memory_regions(void *priv, walk_memory_regions_fn fn)
-{
-    struct walk_memory_regions_data data;
-    uintptr_t i, l1_sz = v_l1_size;
-
-    data.fn = fn;
-    data.priv = priv;
-    data.start = -1u;
-    data.prot = 0;
-
-    for (i = 0; i < l1_sz; i++) {
-        target_ulong base = i << (v_l1_shift + TARGET_PAGE_BITS);
-        int rc = walk_memory_regions_1(&data, base, v_l2_levels, l1_map + i);
-        if (rc != 0) {
-            return rc;
+        if (!in_region) {
+            start = p->itree.start;
+            prot = p->flags;
+            in_region = true;
         }
+        end = p->itree.last + 1;
+    }
+    if (rc == 0 && in_region) {
+        rc = fn(priv, start, end, prot);
     }
+    mmap_unlock();
 
-    return walk_memory_regions_end(&data, 0, 0);
+    return rc;
 }
 
 static int dump_region(void *priv, target_ulong start,
@@ -2461,13 +2600,37 @@ void page_dump(FILE *f)
 
 int page_get_flags(target_ulong address)
 {
-    PageDesc *p;
+    PageFlagsNode *p;
+    int flags;
+
+    rcu_read_lock();
+    p = pageflags_find(address, address);
+    flags = p ? p->flags : 0;
+    rcu_read_unlock();
+
+    /* a miss may be due to a concurrent update: check again with the lock */
+    if (p || have_mmap_lock()) {
+        return flags;
+    }
+    mmap_lock();
+    p = pageflags_find(address, address);
+    flags = p ? p->flags : 0;
+    mmap_unlock();
+    return flags;
+}
+
+bool page_find_mapped(target_ulong start, target_ulong last,
+                      target_ulong *found)
+{
+    PageFlagsNode *p;
 
-    p = page_find(address >> TARGET_PAGE_BITS);
+    assert_memory_lock();
+    p = pageflags_find(start, last);
     if (!p) {
-        return 0;
+        return false;
     }
-    return p->flags;
+    *found = MAX(start, p->itree.start);
+    return true;
 }
 
 /* Modify the flags of a page and invalidate the code if necessary.
@@ -2475,7 +2638,8 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    target_ulong last;
+    PageFlagsNode *p;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2487,33 +2651,73 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
     assert_memory_lock();
 
     start = start & TARGET_PAGE_MASK;
-    end = TARGET_PAGE_ALIGN(end);
+    last = TARGET_PAGE_ALIGN(end) - 1;
 
     if (flags & PAGE_WRITE) {
         flags |= PAGE_WRITE_ORG;
-    }
-
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
 
         /* If the write protection bit is set, then we invalidate
            the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
-            tb_invalidate_phys_page(addr, 0);
+        for (p = pageflags_find(start, last); p;
+             p = pageflags_next(p, start, last)) {
+            if (!(p->flags & PAGE_WRITE)) {
+                tb_invalidate_phys_range(MAX(start, p->itree.start),
+                                         MIN(last, p->itree.last) + 1);
+            }
         }
-        p->flags = flags;
+    }
+
+    pageflags_unset(start, last);
+    if (flags) {
+        pageflags_create_merge(start, last, flags);
+    }
+}
+
+static int pageflags_check(target_ulong start, target_ulong last, int flags)
+{
+    for (;;) {
+        PageFlagsNode *p = pageflags_find(start, last);
+        int p_flags;
+
+        if (!p || start < p->itree.start) {
+            return -1;
+        }
+        p_flags = p->flags;
+        if (!(p_flags & PAGE_VALID)) {
+            return -1;
+        }
+        if ((flags & PAGE_READ) && !(p_flags & PAGE_READ)) {
+            return -1;
+        }
+        if (flags & PAGE_WRITE) {
+            if (!(p_flags & PAGE_WRITE_ORG)) {
+                return -1;
+            }
+            /* unprotect the page if it was put read-only because it
+               contains translated code */
+            if (!(p_flags & PAGE_WRITE)) {
+                if (!page_unprotect(start, 0)) {
+                    return -1;
+                }
+                /* page_unprotect() works on one page at a time */
+                start = (start & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+                if (start == 0 || start > last) {
+                    return 0;
+                }
+                continue;
+            }
+        }
+        if (last <= p->itree.last) {
+            return 0;
+        }
+        start = p->itree.last + 1;
     }
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
-    target_ulong end;
-    target_ulong addr;
+    target_ulong last;
+    int ret;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2525,43 +2729,23 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     if (len == 0) {
         return 0;
     }
-    if (start + len - 1 < start) {
+    last = start + len - 1;
+    if (last < start) {
         /* We've wrapped around.  */
         return -1;
     }
 
-    /* must do before we loose bits in the next step */
-    end = TARGET_PAGE_ALIGN(start + len);
-    start = start & TARGET_PAGE_MASK;
-
-    for (addr = start, len = end - start;
-         len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
-            return -1;
-        }
-        if (!(p->flags & PAGE_VALID)) {
-            return -1;
-        }
+    rcu_read_lock();
+    ret = pageflags_check(start, last, flags);
+    rcu_read_unlock();
 
-        if ((flags & PAGE_READ) && !(p->flags & PAGE_READ)) {
-            return -1;
-        }
-        if (flags & PAGE_WRITE) {
-            if (!(p->flags & PAGE_WRITE_ORG)) {
-                return -1;
-            }
-            /* unprotect the page if it was put read-only because it
-               contains translated code */
-            if (!(p->flags & PAGE_WRITE)) {
-                if (!page_unprotect(addr, 0)) {
-                    return -1;
-                }
-            }
-        }
+    /* a failure may be due to a concurrent update: check again with the lock */
+    if (ret < 0 && !have_mmap_lock()) {
+        mmap_lock();
+        ret = pageflags_check(start, last, flags);
+        mmap_unlock();
     }
-    return 0;
+    return ret;
 }
 
 /* called from signal handler: invalidate the code and unprotect the
@@ -2574,15 +2758,15 @@ int page_unprotect(target_ulong address, uintptr_t pc)
 {
     unsigned int prot;
     bool current_tb_invalidated;
-    PageDesc *p;
-    target_ulong host_start, host_end, addr;
+    PageFlagsNode *p;
+    target_ulong host_start, host_last, addr, len;
 
     /* Technically this isn't safe inside a signal handler.  However we
        know this only ever happens in a synchronous SEGV handler, so in
        practice it seems to be ok.  */
     mmap_lock();
 
-    p = page_find(address >> TARGET_PAGE_BITS);
+    p = pageflags_find(address, address);
     if (!p) {
         mmap_unlock();
         return 0;
@@ -2605,14 +2789,18 @@ int page_unprotect(target_ulong address, uintptr_t pc)
 #endif
         } else {
             host_start = address & qemu_host_page_mask;
-            host_end = host_start + qemu_host_page_size;
+            host_last = host_start + qemu_host_page_size - 1;
 
+            pageflags_set_clear(host_start, host_last, PAGE_WRITE, 0);
             prot = 0;
-            for (addr = host_start; addr < host_end; addr += TARGET_PAGE_SIZE) {
-                p = page_find(addr >> TARGET_PAGE_BITS);
-                p->flags |= PAGE_WRITE;
+            for (p = pageflags_find(host_start, host_last); p;
+                 p = pageflags_next(p, host_start, host_last)) {
                 prot |= p->flags;
+            }
 
+            for (addr = host_start, len = qemu_host_page_size;
+                 len != 0;
+                 len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
                 /* and since the content will be modified, we must invalidate
                    the corresponding translated code. */
                 current_tb_invalidated |= tb_invalidate_phys_page(addr, pc);
@@ -17,6 +17,8 @@
 #include "exec/gen-icount.h"
 #include "exec/log.h"
 #include "exec/translator.h"
+#include "disas/disas.h"
+#include "qemu/exec-trace.h"
 
 /* Pairs with tcg_clear_temp_count.
    To be called by #TranslatorOps.{translate_insn,tb_stop} if
@@ -31,10 +33,30 @@ void translator_loop_temp_check(DisasContextBase *db)
     }
 }
 
+/* Record the guest code of a TB so that the exec trace can refer to it */
+static void translator_exec_trace_define(DisasContextBase *db, CPUState *cpu,
+                                         uint32_t trace_id)
+{
+    char *disas = NULL;
+    size_t len = 0;
+#ifndef _WIN32
+    FILE *f = open_memstream(&disas, &len);
+
+    if (f) {
+        target_disas(f, cpu, db->pc_first, db->tb->size);
+        fclose(f);
+    }
+#endif
+    exec_trace_define_tb(trace_id, db->pc_first, db->tb->size,
+                         db->tb->icount, disas, disas ? len : 0);
+    free(disas);
+}
+
 void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                      CPUState *cpu, TranslationBlock *tb)
 {
     int bp_insn = 0;
+    uint32_t trace_id = 0;
 
     /* Initialize DisasContext */
     db->tb = tb;
@@ -64,6 +86,15 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
     /* Start translating.  */
     gen_tb_start(db->tb);
+    if (exec_trace_enabled) {
+        /* Logged from the TB itself so that chained TBs are seen too */
+        TCGv_i32 id;
+
+        trace_id = exec_trace_new_tb_id();
+        id = tcg_const_i32(trace_id);
+        gen_helper_exec_trace_tb(cpu_env, id);
+        tcg_temp_free_i32(id);
+    }
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -128,6 +159,10 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
     db->tb->size = db->pc_next - db->pc_first;
     db->tb->icount = db->num_insns;
 
+    if (exec_trace_enabled) {
+        translator_exec_trace_define(db, cpu, trace_id);
+    }
+
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)
         && qemu_log_in_addr_range(db->pc_first)) {
@@ -38,6 +38,70 @@ host_memory_backend_get_name(HostMemoryBackend *backend)
     return object_get_canonical_path(OBJECT(backend));
 }
 
+/* Backends whose preallocation waits for host_memory_backend_prealloc_end */
+static bool prealloc_deferred;
+static GSList *prealloc_pending;
+
+/* Describe the memory of @backend in @region; the result must be freed */
+static char *host_memory_backend_prealloc_region(HostMemoryBackend *backend,
+                                                 MemPrealloc *region)
+{
+    char *id = host_memory_backend_get_name(backend);
+    char *name = g_strdup_printf("memory backend %s", id);
+
+    g_free(id);
+    region->name = name;
+    region->fd = memory_region_get_fd(&backend->mr);
+    region->area = memory_region_get_ram_ptr(&backend->mr);
+    region->size = memory_region_size(&backend->mr);
+    region->host_nodes = NULL;
+    region->max_node = 0;
+    if (backend->policy != HOST_MEM_POLICY_DEFAULT) {
+        /* Touch the pages from the nodes that they are bound to */
+        region->host_nodes = backend->host_nodes;
+        region->max_node = MAX_NODES;
+    }
+    return name;
+}
+
+static void host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         Error **errp)
+{
+    MemPrealloc region;
+    char *name = host_memory_backend_prealloc_region(backend, &region);
+
+    os_mem_prealloc_batch(&region, 1, smp_cpus, errp);
+    g_free(name);
+}
+
+void host_memory_backend_prealloc_begin(void)
+{
+    prealloc_deferred = true;
+}
+
+void host_memory_backend_prealloc_end(Error **errp)
+{
+    int n = g_slist_length(prealloc_pending);
+    MemPrealloc *regions = g_new(MemPrealloc, n);
+    char **names = g_new0(char *, n + 1);
+    GSList *l;
+    int i = 0;
+
+    prealloc_deferred = false;
+    prealloc_pending = g_slist_reverse(prealloc_pending);
+    for (l = prealloc_pending; l; l = l->next) {
+        names[i] = host_memory_backend_prealloc_region(l->data, &regions[i]);
+        i++;
+    }
+
+    os_mem_prealloc_batch(regions, n, smp_cpus, errp);
+
+    g_slist_free_full(prealloc_pending, (GDestroyNotify)object_unref);
+    prealloc_pending = NULL;
+    g_strfreev(names);
+    g_free(regions);
+}
+
 static void
 host_memory_backend_get_size(Object *obj, Visitor *v, const char *name,
                              void *opaque, Error **errp)
@@ -237,11 +301,7 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
-        void *ptr = memory_region_get_ram_ptr(&backend->mr);
-        uint64_t sz = memory_region_size(&backend->mr);
-
-        os_mem_prealloc(fd, ptr, sz, smp_cpus, &local_err);
+        host_memory_backend_prealloc(backend, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -373,9 +433,11 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * This is necessary to guarantee memory is allocated with
          * specified NUMA policy in place.
          */
-        if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            smp_cpus, &local_err);
+        if (backend->prealloc && prealloc_deferred) {
+            object_ref(OBJECT(backend));
+            prealloc_pending = g_slist_prepend(prealloc_pending, backend);
+        } else if (backend->prealloc) {
+            host_memory_backend_prealloc(backend, &local_err);
             if (local_err) {
                 goto out;
             }
@@ -28,6 +28,7 @@
 #include "monitor/monitor.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-misc.h"
+#include "qapi/qapi-commands-migration.h"
 #include "qapi/qapi-events-run-state.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/error-report.h"
@@ -49,10 +50,12 @@
 #include "qemu/option.h"
 #include "qemu/bitmap.h"
 #include "qemu/seqlock.h"
+#include "qemu/units.h"
 #include "tcg.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
 #include "hw/boards.h"
+#include "trace-root.h"
 
 #ifdef CONFIG_LINUX
 
@@ -79,10 +82,20 @@ int64_t max_advance;
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
 
+/* vcpu dirty rate limit in MiB/s, 0 if disabled; protected by the BQL */
+static QEMUTimer *dirty_limit_timer;
+static uint64_t dirty_limit;
+static int64_t dirty_limit_last_ns;
+
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
 #define CPU_THROTTLE_TIMESLICE_NS 10000000
 
+/* Period over which the vcpu dirty rates are measured */
+#define DIRTY_LIMIT_PERIOD_NS (1000 * SCALE_MS)
+/* Maximum decrease of a vcpu throttle percentage in one period */
+#define DIRTY_LIMIT_PCT_STEP 10
+
 bool cpu_is_stopped(CPUState *cpu)
 {
     return cpu->stopped || !runstate_is_running();
@@ -770,45 +783,55 @@ static const VMStateDescription vmstate_timers = {
     }
 };
 
+/* A vcpu can be throttled both globally and by its dirty rate limit */
+static int cpu_throttle_cpu_percentage(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               atomic_read(&cpu->dirty_limit_pct));
+}
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
-    double pct;
-    double throttle_ratio;
-    long sleeptime_ns;
+    long sleeptime_ns = opaque.host_ulong;
 
-    if (!cpu_throttle_get_percentage()) {
-        return;
+    if (cpu_throttle_cpu_percentage(cpu)) {
+        qemu_mutex_unlock_iothread();
+        g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
+        qemu_mutex_lock_iothread();
     }
-
-    pct = (double)cpu_throttle_get_percentage()/100;
-    throttle_ratio = pct / (1 - pct);
-    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
-
-    qemu_mutex_unlock_iothread();
-    g_usleep(sleeptime_ns / 1000); /* Convert ns to us for usleep call */
-    qemu_mutex_lock_iothread();
     atomic_set(&cpu->throttle_thread_scheduled, 0);
 }
 
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
-    double pct;
+    int pct, max_pct = 0;
+    int64_t period_ns;
+
+    CPU_FOREACH(cpu) {
+        max_pct = MAX(max_pct, cpu_throttle_cpu_percentage(cpu));
+    }
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!max_pct) {
         return;
     }
+
+    /*
+     * The most throttled vcpu runs for CPU_THROTTLE_TIMESLICE_NS in each
+     * period; every vcpu sleeps for its own percentage of the period.
+     */
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - (double)max_pct / 100);
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        pct = cpu_throttle_cpu_percentage(cpu);
+        if (pct && !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_ULONG(period_ns * pct / 100));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage()/100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1-pct));
+                                   period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -838,6 +861,111 @@ int cpu_throttle_get_percentage(void)
     return atomic_read(&throttle_percentage);
 }
 
+/*
+ * The dirty rate of a vcpu is roughly proportional to the time it runs,
+ * so scale its run time by limit / rate.  Throttling is released more
+ * slowly than it is applied, to avoid oscillating around the limit.
+ */
+static int cpu_dirty_limit_adjust(int pct, uint64_t rate, uint64_t limit)
+{
+    double run = (100 - pct) * (double)limit / MAX(rate, 1);
+    int new_pct = 100 - MIN(run, 100);
+
+    if (new_pct < pct) {
+        new_pct = MAX(new_pct, pct - DIRTY_LIMIT_PCT_STEP);
+    }
+    return MIN(new_pct, CPU_THROTTLE_PCT_MAX);
+}
+
+static void cpu_dirty_limit_timer_tick(void *opaque)
+{
+    uint64_t limit = dirty_limit;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT);
+    int64_t elapsed_ns = MAX(now - dirty_limit_last_ns, 1);
+    CPUState *cpu;
+
+    if (!limit) {
+        return;
+    }
+
+    /* KVM only accounts the pages when its dirty rings are collected */
+    kvm_dirty_ring_reap();
+
+    CPU_FOREACH(cpu) {
+        unsigned long pages = atomic_read(&cpu->dirty_pages);
+        uint64_t rate;
+        int pct;
+
+        rate = (double)(pages - cpu->dirty_pages_prev) * TARGET_PAGE_SIZE /
+               MiB * NANOSECONDS_PER_SECOND / elapsed_ns;
+        cpu->dirty_pages_prev = pages;
+        pct = cpu_dirty_limit_adjust(cpu->dirty_limit_pct, rate, limit);
+        cpu->dirty_rate = rate;
+        atomic_set(&cpu->dirty_limit_pct, pct);
+        trace_cpu_dirty_limit(cpu->cpu_index, rate, pct);
+    }
+    dirty_limit_last_ns = now;
+
+    if (!timer_pending(throttle_timer)) {
+        timer_mod(throttle_timer, now + CPU_THROTTLE_TIMESLICE_NS);
+    }
+    timer_mod(dirty_limit_timer, now + DIRTY_LIMIT_PERIOD_NS);
+}
+
+void cpu_dirty_limit_set(uint64_t limit)
+{
+    CPUState *cpu;
+
+    if (!cpu_dirty_limit_active()) {
+        kvm_dirty_ring_reap();
+        CPU_FOREACH(cpu) {
+            cpu->dirty_pages_prev = atomic_read(&cpu->dirty_pages);
+        }
+        dirty_limit_last_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT);
+        timer_mod(dirty_limit_timer,
+                  dirty_limit_last_ns + DIRTY_LIMIT_PERIOD_NS);
+    }
+    dirty_limit = MAX(limit, 1);
+}
+
+void cpu_dirty_limit_stop(void)
+{
+    CPUState *cpu;
+
+    dirty_limit = 0;
+    timer_del(dirty_limit_timer);
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_limit_pct, 0);
+        cpu->dirty_rate = 0;
+    }
+}
+
+bool cpu_dirty_limit_active(void)
+{
+    return dirty_limit != 0;
+}
+
+VcpuDirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    VcpuDirtyLimitInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitInfoList *entry = g_new0(VcpuDirtyLimitInfoList, 1);
+
+        entry->value = g_new0(VcpuDirtyLimitInfo, 1);
+        entry->value->cpu_index = cpu->cpu_index;
+        entry->value->limit_rate = dirty_limit;
+        entry->value->current_rate = cpu->dirty_rate;
+        entry->value->throttle_percentage =
+            atomic_read(&cpu->dirty_limit_pct);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 void cpu_ticks_init(void)
 {
     seqlock_init(&timers_state.vm_clock_seqlock);
@@ -845,6 +973,8 @@ void cpu_ticks_init(void)
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
     throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
                                            cpu_throttle_timer_tick, NULL);
+    dirty_limit_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
+                                     cpu_dirty_limit_timer_tick, NULL);
 }
 
 void configure_icount(QemuOpts *opts, Error **errp)
@@ -37,6 +37,119 @@ int dma_memory_set(AddressSpace *as, dma_addr_t addr, uint8_t c, dma_addr_t len)
     return error;
 }
 
+/* Caches that currently have a window.  Protected by the BQL. */
+static QLIST_HEAD(, DMACache) dma_cache_mapped =
+    QLIST_HEAD_INITIALIZER(dma_cache_mapped);
+
+/* Drop the windows that were looked up in a FlatView that is now gone */
+static void dma_cache_commit(MemoryListener *listener)
+{
+    DMACache *cache, *next;
+
+    QLIST_FOREACH_SAFE(cache, &dma_cache_mapped, link, next) {
+        if (cache->mrc.fv != address_space_to_flatview(cache->as)) {
+            dma_cache_invalidate(cache);
+        }
+    }
+}
+
+/*
+ * The commit callback is called at the end of every transaction, whatever
+ * the address space, so the listener is registered for
+ * address_space_memory only because it has to be registered for one.
+ */
+static MemoryListener dma_cache_listener = {
+    .commit = dma_cache_commit,
+};
+
+void dma_cache_init(DMACache *cache, AddressSpace *as, DMADirection dir)
+{
+    cache->as = as;
+    cache->dir = dir;
+    cache->base = 0;
+    cache->mrc = MEMORY_REGION_CACHE_INVALID;
+    cache->mapped = false;
+}
+
+void dma_cache_invalidate(DMACache *cache)
+{
+    if (cache->mapped) {
+        QLIST_REMOVE(cache, link);
+        cache->mapped = false;
+    }
+    address_space_cache_destroy(&cache->mrc);
+    cache->mrc = MEMORY_REGION_CACHE_INVALID;
+}
+
+void dma_cache_destroy(DMACache *cache)
+{
+    dma_cache_invalidate(cache);
+    cache->as = NULL;
+}
+
+/*
+ * Map the window that holds [addr, addr + len).  RAM almost never shares
+ * a page with anything else, so if the start of the window is not in the
+ * same section as addr, a second lookup from addr is not worth it and the
+ * access goes through dma_memory_rw() instead.
+ */
+static bool dma_cache_map(DMACache *cache, dma_addr_t addr, dma_addr_t len)
+{
+    dma_addr_t base = QEMU_ALIGN_DOWN(addr, DMA_CACHE_WINDOW);
+    dma_addr_t end = base + DMA_CACHE_WINDOW;
+    bool is_write = cache->dir == DMA_DIRECTION_FROM_DEVICE;
+
+    if (len > end - addr) {
+        return false;
+    }
+
+    cache->base = base;
+    address_space_cache_init(&cache->mrc, cache->as, base, end - base,
+                             is_write);
+    if (!dma_cache_hit(cache, addr, len)) {
+        dma_cache_invalidate(cache);
+        return false;
+    }
+
+    if (!dma_cache_listener.address_space) {
+        memory_listener_register(&dma_cache_listener, &address_space_memory);
+    }
+    QLIST_INSERT_HEAD(&dma_cache_mapped, cache, link);
+    cache->mapped = true;
+    return true;
+}
+
+/*
+ * Out of line part of dma_cache_read and dma_cache_write, called when the
+ * access misses the current window.
+ */
+int dma_cache_rw_slow(DMACache *cache, dma_addr_t addr,
+                      void *buf, dma_addr_t len, DMADirection dir)
+{
+    hwaddr offset;
+
+    if (dir != cache->dir && dir == DMA_DIRECTION_FROM_DEVICE) {
+        /* Never write through a window that was mapped for reading */
+        return dma_memory_rw_relaxed(cache->as, addr, buf, len, dir);
+    }
+
+    dma_cache_invalidate(cache);
+    if (!len || !dma_cache_map(cache, addr, len)) {
+        trace_dma_cache_miss(cache, addr, len);
+        return dma_memory_rw_relaxed(cache->as, addr, buf, len, dir);
+    }
+
+    trace_dma_cache_map(cache, cache->base, cache->mrc.len);
+    offset = addr - cache->base;
+    if (dir == DMA_DIRECTION_TO_DEVICE) {
+        address_space_read_cached(&cache->mrc, offset, buf, len);
+    } else {
+        address_space_write_cached(&cache->mrc, offset, buf, len);
+        address_space_cache_invalidate(&cache->mrc, offset, len);
+    }
+    return 0;
+}
+
 void qemu_sglist_init(QEMUSGList *qsg, DeviceState *dev, int alloc_hint,
                       AddressSpace *as)
 {
@@ -157,7 +270,7 @@ static void dma_blk_cb(void *opaque, int ret)
     if (dbs->iov.size == 0) {
         trace_dma_map_wait(dbs);
         dbs->bh = aio_bh_new(dbs->ctx, reschedule_dma, dbs);
-        cpu_register_map_client(dbs->bh);
+        address_space_register_map_client(dbs->sg->as, dbs->bh);
         return;
     }
 
@@ -183,7 +296,7 @@ static void dma_aio_cancel(BlockAIOCB *acb)
         blk_aio_cancel_async(dbs->acb);
     }
     if (dbs->bh) {
-        cpu_unregister_map_client(dbs->bh);
+        address_space_unregister_map_client(dbs->sg->as, dbs->bh);
         qemu_bh_delete(dbs->bh);
         dbs->bh = NULL;
     }
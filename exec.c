@@ -1286,11 +1286,18 @@ void cpu_abort(CPUState *cpu, const char *fmt, ...)
 static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
 {
     RAMBlock *block;
+    IntervalTreeNode *node;
 
     block = atomic_rcu_read(&ram_list.mru_block);
     if (block && addr - block->offset < block->max_length) {
         return block;
     }
+    node = interval_tree_iter_first(&ram_list.offset_tree, addr, addr);
+    if (node) {
+        block = container_of(node, RAMBlock, offset_node);
+        goto found;
+    }
+    /* The index can miss blocks that are being moved by an update */
     RAMBLOCK_FOREACH(block) {
         if (addr - block->offset < block->max_length) {
             goto found;
@@ -1904,7 +1911,7 @@ static void *file_ram_alloc(RAMBlock *block,
  */
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
-    RAMBlock *block, *next_block;
+    IntervalTreeNode *node, *next_node;
     ram_addr_t offset = RAM_ADDR_MAX, mingap = RAM_ADDR_MAX;
 
     assert(size != 0); /* it would hand out same offset multiple times */
@@ -1913,21 +1920,27 @@ static ram_addr_t find_ram_offset(ram_addr_t size)
         return 0;
     }
 
-    RAMBLOCK_FOREACH(block) {
+    /* The index returns the blocks in order of offset */
+    for (node = interval_tree_iter_first(&ram_list.offset_tree,
+                                         0, RAM_ADDR_MAX);
+         node; node = interval_tree_iter_next(node, 0, RAM_ADDR_MAX)) {
         ram_addr_t candidate, next = RAM_ADDR_MAX;
 
         /* Align blocks to start on a 'long' in the bitmap
          * which makes the bitmap sync'ing take the fast path.
          */
-        candidate = block->offset + block->max_length;
+        candidate = node->last + 1;
         candidate = ROUND_UP(candidate, BITS_PER_LONG << TARGET_PAGE_BITS);
 
         /* Search for the closest following block
          * and find the gap.
          */
-        RAMBLOCK_FOREACH(next_block) {
-            if (next_block->offset >= candidate) {
-                next = MIN(next, next_block->offset);
+        for (next_node = interval_tree_iter_next(node, 0, RAM_ADDR_MAX);
+             next_node;
+             next_node = interval_tree_iter_next(next_node, 0, RAM_ADDR_MAX)) {
+            if (next_node->start >= candidate) {
+                next = next_node->start;
+                break;
             }
         }
 
@@ -2187,6 +2200,30 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
     }
 }
 
+/* Called with the ramlist lock held */
+static void ram_block_index_add(RAMBlock *block)
+{
+    block->offset_node.start = block->offset;
+    block->offset_node.last = block->offset + block->max_length - 1;
+    interval_tree_insert(&block->offset_node, &ram_list.offset_tree);
+
+    if (block->host) {
+        block->host_node.start = (uintptr_t)block->host;
+        block->host_node.last = (uintptr_t)block->host + block->max_length - 1;
+        interval_tree_insert(&block->host_node, &ram_list.host_tree);
+    }
+}
+
+/* Called with the ramlist lock held */
+static void ram_block_index_del(RAMBlock *block)
+{
+    interval_tree_remove(&block->offset_node, &ram_list.offset_tree);
+    /* Xen maps blocks lazily; they are not in host_tree then */
+    if (block->host_node.last) {
+        interval_tree_remove(&block->host_node, &ram_list.host_tree);
+    }
+}
+
 static void ram_block_add(RAMBlock *new_block, Error **errp, bool shared)
 {
     RAMBlock *block;
@@ -2244,6 +2281,7 @@ static void ram_block_add(RAMBlock *new_block, Error **errp, bool shared)
     } else { /* list is empty */
         QLIST_INSERT_HEAD_RCU(&ram_list.blocks, new_block, next);
     }
+    ram_block_index_add(new_block);
     ram_list.mru_block = NULL;
 
     /* Write list before version */
@@ -2445,6 +2483,7 @@ void qemu_ram_free(RAMBlock *block)
 
     qemu_mutex_lock_ramlist();
     QLIST_REMOVE_RCU(block, next);
+    ram_block_index_del(block);
     ram_list.mru_block = NULL;
     /* Write list before version */
     smp_wmb();
@@ -2597,6 +2636,7 @@ RAMBlock *qemu_ram_block_from_host(void *ptr, bool round_offset,
                                    ram_addr_t *offset)
 {
     RAMBlock *block;
+    IntervalTreeNode *node;
     uint8_t *host = ptr;
 
     if (xen_enabled()) {
@@ -2617,6 +2657,14 @@ RAMBlock *qemu_ram_block_from_host(void *ptr, bool round_offset,
         goto found;
     }
 
+    node = interval_tree_iter_first(&ram_list.host_tree, (uintptr_t)host,
+                                    (uintptr_t)host);
+    if (node) {
+        block = container_of(node, RAMBlock, host_node);
+        goto found;
+    }
+
+    /* The index can miss blocks that are being moved by an update */
     RAMBLOCK_FOREACH(block) {
         /* This case append when the block is not mapped. */
         if (block->host == NULL) {
@@ -2703,6 +2751,13 @@ void memory_notdirty_write_complete(NotDirtyInfo *ndi)
         ndi->pages = NULL;
     }
 
+    /* Account the page to the vcpu for cpu_dirty_limit_set */
+    if (ndi->cpu &&
+        !cpu_physical_memory_get_dirty_flag(ndi->ram_addr,
+                                            DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&ndi->cpu->dirty_pages);
+    }
+
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
@@ -3501,53 +3556,49 @@ void cpu_flush_icache_range(hwaddr start, hwaddr len)
                                      NULL, len, FLUSH_CACHE);
 }
 
-typedef struct {
+typedef struct BounceBuffer {
     MemoryRegion *mr;
     void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
+    QLIST_ENTRY(BounceBuffer) link;
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
-typedef struct MapClient {
+typedef struct AddressSpaceMapClient {
     QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+} AddressSpaceMapClient;
 
-static void cpu_unregister_map_client_do(MapClient *client)
+static void
+address_space_unregister_map_client_do(AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+/* Called with as->bounce_lock held */
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->bounce_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    if (as->bounce_buffer_size < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -3563,28 +3614,20 @@ void cpu_exec_init_all(void)
     finalize_target_page_bits();
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
-}
-
-static void cpu_notify_map_clients(void)
-{
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->bounce_lock);
 }
 
 static bool flatview_access_valid(FlatView *fv, hwaddr addr, hwaddr len,
@@ -3654,8 +3697,8 @@ flatview_extend_translation(FlatView *fv, hwaddr addr,
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -3679,26 +3722,44 @@ void *address_space_map(AddressSpace *as,
     mr = flatview_translate(fv, addr, &xlat, &l, is_write, attrs);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations */
+        l = MIN(l, TARGET_PAGE_SIZE);
+
+        qemu_mutex_lock(&as->bounce_lock);
+        l = MIN(l, as->max_bounce_buffer_size - as->bounce_buffer_size);
+        if (l == 0) {
+            as->bounce_buffer_failures++;
+            trace_address_space_map_bounce_full(as, addr,
+                                                as->bounce_buffer_size);
+            qemu_mutex_unlock(&as->bounce_lock);
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+        atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size + l);
+        as->bounce_buffer_peak = MAX(as->bounce_buffer_peak,
+                                     as->bounce_buffer_size);
+        as->bounce_buffer_maps++;
+        trace_address_space_map_bounce(as, addr, l, as->bounce_buffer_size);
+
+        bounce = g_new(BounceBuffer, 1);
+        bounce->buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
+        bounce->addr = addr;
+        bounce->len = l;
+        QLIST_INSERT_HEAD(&as->bounce_buffers, bounce, link);
+        qemu_mutex_unlock(&as->bounce_lock);
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             flatview_read(fv, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
 
@@ -3711,6 +3772,27 @@ void *address_space_map(AddressSpace *as,
     return ptr;
 }
 
+/* Finds and takes the bounce buffer of @as at @buffer, if it is one */
+static BounceBuffer *address_space_take_bounce(AddressSpace *as, void *buffer)
+{
+    BounceBuffer *bounce;
+
+    /* Do not take the lock for mappings of RAM, the common case */
+    if (!atomic_read(&as->bounce_buffer_size)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&as->bounce_lock);
+    QLIST_FOREACH(bounce, &as->bounce_buffers, link) {
+        if (bounce->buffer == buffer) {
+            QLIST_REMOVE(bounce, link);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&as->bounce_lock);
+    return bounce;
+}
+
 /* Unmaps a memory region previously mapped by address_space_map().
  * Will also mark the memory as dirty if is_write == 1.  access_len gives
  * the amount of memory that was actually read or written by the caller.
@@ -3718,7 +3800,9 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
+    BounceBuffer *bounce = address_space_take_bounce(as, buffer);
+
+    if (!bounce) {
         MemoryRegion *mr;
         ram_addr_t addr1;
 
@@ -3734,14 +3818,19 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         return;
     }
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
-    }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
+    }
+    qemu_vfree(bounce->buffer);
+    memory_region_unref(bounce->mr);
+
+    qemu_mutex_lock(&as->bounce_lock);
+    atomic_set(&as->bounce_buffer_size, as->bounce_buffer_size - bounce->len);
+    trace_address_space_unmap_bounce(as, bounce->addr, bounce->len,
+                                     as->bounce_buffer_size);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->bounce_lock);
+    g_free(bounce);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -1044,6 +1044,23 @@ STEXI
 @item migrate_pause
 @findex migrate_pause
 Pause an ongoing migration.  Currently it only supports postcopy.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:l,sample_pages:l?",
+        .params     = "second [sample_pages]",
+        .help       = "start measuring the guest dirty page rate for "
+                      "'second' seconds, sampling 'sample_pages' pages "
+                      "per GiB of memory",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties its memory for
+@var{second} seconds; see @code{info dirty_rate} for the result.
 ETEXI
 
     {
@@ -29,6 +29,7 @@
 #include "qapi/error.h"
 #include "qapi/opts-visitor.h"
 #include "qapi/qapi-builtin-visit.h"
+#include "qapi/qapi-visit-migration.h"
 #include "qapi/qapi-commands-block.h"
 #include "qapi/qapi-commands-char.h"
 #include "qapi/qapi-commands-migration.h"
@@ -260,6 +261,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->multifd_bytes >> 10);
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
+        if (info->ram->mapped_ram_bytes) {
+            monitor_printf(mon, "mapped ram bytes: %" PRIu64 " kbytes\n",
+                           info->ram->mapped_ram_bytes >> 10);
+        }
 
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
@@ -293,6 +298,25 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache useful hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_useful_hit);
+        monitor_printf(mon, "xbzrle cache collision: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_collision);
+    }
+
+    if (info->has_dirty_sync) {
+        monitor_printf(mon, "dirty sync threads: %" PRIu64 "\n",
+                       info->dirty_sync->threads);
+        monitor_printf(mon, "dirty sync log time: %" PRIu64 " us "
+                       "(total %" PRIu64 " us)\n",
+                       info->dirty_sync->log_sync,
+                       info->dirty_sync->total_log_sync);
+        monitor_printf(mon, "dirty sync merge time: %" PRIu64 " us "
+                       "(total %" PRIu64 " us)\n",
+                       info->dirty_sync->bitmap_merge,
+                       info->dirty_sync->total_bitmap_merge);
     }
 
     if (info->has_compression) {
@@ -328,6 +352,25 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_postcopy_requests) {
+        Visitor *v;
+        char *str;
+
+        monitor_printf(mon, "postcopy requests: %" PRIu64 "\n",
+                       info->postcopy_requests->requests);
+        monitor_printf(mon, "postcopy prefetched pages: %" PRIu64 "\n",
+                       info->postcopy_requests->prefetched_pages);
+        monitor_printf(mon, "postcopy request latency max: %" PRIu64 " us\n",
+                       info->postcopy_requests->latency_max);
+        v = string_output_visitor_new(false, &str);
+        visit_type_intList(v, NULL,
+                           &info->postcopy_requests->latency_histogram, NULL);
+        visit_complete(v, &str);
+        monitor_printf(mon, "postcopy request latency histogram: %s\n", str);
+        g_free(str);
+        visit_free(v);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -408,6 +451,22 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
             params->max_cpu_throttle);
+        assert(params->has_vcpu_dirty_limit);
+        monitor_printf(mon, "%s: %" PRIu64 " MiB/s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT),
+            params->vcpu_dirty_limit);
+        assert(params->has_postcopy_prefetch_pages);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES),
+            params->postcopy_prefetch_pages);
+        assert(params->has_postcopy_fault_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS),
+            params->postcopy_fault_threads);
+        assert(params->has_device_state_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DEVICE_STATE_THREADS),
+            params->device_state_threads);
         assert(params->has_tls_creds);
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_CREDS),
@@ -435,6 +494,18 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_CHANNELS),
             params->multifd_channels);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
+            MultiFDCompression_str(params->multifd_compression));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL),
+            params->multifd_zlib_level);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL),
+            params->multifd_zstd_level);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_BITMAP_SYNC_THREADS),
+            params->bitmap_sync_threads);
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -455,6 +526,32 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockInfoList *block;
+
+    monitor_printf(mon, "Status: %s\n",
+                   DirtyRateStatus_str(info->status));
+    monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+    monitor_printf(mon, "Period: %" PRId64 " s\n", info->calc_time);
+    monitor_printf(mon, "Sample pages: %" PRId64 " per GiB\n",
+                   info->sample_pages);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MiB/s\n",
+                       info->dirty_rate);
+    }
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRId64 " MiB/s (%" PRId64 "/%" PRId64
+                       " sampled pages dirty)\n",
+                       block->value->id, block->value->dirty_rate,
+                       block->value->dirty_pages,
+                       block->value->sampled_pages);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoFastList *cpu_list, *cpu;
@@ -1682,6 +1779,21 @@ void hmp_migrate_pause(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (!err) {
+        monitor_printf(mon, "Measuring the dirty page rate for %" PRId64
+                       " seconds, see 'info dirty_rate'\n", sec);
+    }
+    hmp_handle_error(mon, &err);
+}
+
 /* Kept for backwards compatibility */
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
@@ -1774,6 +1886,22 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_max_cpu_throttle = true;
         visit_type_int(v, param, &p->max_cpu_throttle, &err);
         break;
+    case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+        p->has_vcpu_dirty_limit = true;
+        visit_type_int(v, param, &p->vcpu_dirty_limit, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_PAGES:
+        p->has_postcopy_prefetch_pages = true;
+        visit_type_int(v, param, &p->postcopy_prefetch_pages, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS:
+        p->has_postcopy_fault_threads = true;
+        visit_type_int(v, param, &p->postcopy_fault_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_DEVICE_STATE_THREADS:
+        p->has_device_state_threads = true;
+        visit_type_int(v, param, &p->device_state_threads, &err);
+        break;
     case MIGRATION_PARAMETER_TLS_CREDS:
         p->has_tls_creds = true;
         p->tls_creds = g_new0(StrOrNull, 1);
@@ -1822,6 +1950,23 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_channels = true;
         visit_type_int(v, param, &p->multifd_channels, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_COMPRESSION:
+        p->has_multifd_compression = true;
+        visit_type_MultiFDCompression(v, param, &p->multifd_compression,
+                                      &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL:
+        p->has_multifd_zlib_level = true;
+        visit_type_int(v, param, &p->multifd_zlib_level, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_ZSTD_LEVEL:
+        p->has_multifd_zstd_level = true;
+        visit_type_int(v, param, &p->multifd_zstd_level, &err);
+        break;
+    case MIGRATION_PARAMETER_BITMAP_SYNC_THREADS:
+        p->has_bitmap_sync_threads = true;
+        visit_type_int(v, param, &p->bitmap_sync_threads, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         visit_type_size(v, param, &cache_size, &err);
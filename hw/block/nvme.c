@@ -50,10 +50,15 @@
 
 static void nvme_process_sq(void *opaque);
 
+static bool nvme_addr_is_cmb(NvmeCtrl *n, hwaddr addr)
+{
+    return n->cmbsz && addr >= n->ctrl_mem.addr &&
+           addr < (n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size));
+}
+
 static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
 {
-    if (n->cmbsz && addr >= n->ctrl_mem.addr &&
-                addr < (n->ctrl_mem.addr + int128_get64(n->ctrl_mem.size))) {
+    if (nvme_addr_is_cmb(n, addr)) {
         memcpy(buf, (void *)&n->cmbuf[addr - n->ctrl_mem.addr], size);
     } else {
         pci_dma_read(&n->parent_obj, addr, buf, size);
@@ -268,8 +273,7 @@ static void nvme_post_cqes(void *opaque)
         req->cqe.sq_head = cpu_to_le16(sq->head);
         addr = cq->dma_addr + cq->tail * n->cqe_size;
         nvme_inc_cq_tail(cq);
-        pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
-            sizeof(req->cqe));
+        dma_cache_write(&cq->dma_cache, addr, &req->cqe, sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     if (cq->tail != cq->head) {
@@ -419,6 +423,7 @@ static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
     n->sq[sq->sqid] = NULL;
     timer_del(sq->timer);
     timer_free(sq->timer);
+    dma_cache_destroy(&sq->dma_cache);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -476,6 +481,8 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
     sq->io_req = g_new(NvmeRequest, sq->size);
+    dma_cache_init(&sq->dma_cache, pci_get_address_space(&n->parent_obj),
+                   DMA_DIRECTION_TO_DEVICE);
 
     QTAILQ_INIT(&sq->req_list);
     QTAILQ_INIT(&sq->out_req_list);
@@ -534,6 +541,7 @@ static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    dma_cache_destroy(&cq->dma_cache);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -573,6 +581,8 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    dma_cache_init(&cq->dma_cache, pci_get_address_space(&n->parent_obj),
+                   DMA_DIRECTION_FROM_DEVICE);
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
@@ -778,7 +788,11 @@ static void nvme_process_sq(void *opaque)
 
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
-        nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
+        if (nvme_addr_is_cmb(n, addr)) {
+            nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
+        } else {
+            dma_cache_read(&sq->dma_cache, addr, &cmd, sizeof(cmd));
+        }
         nvme_inc_sq_head(sq);
 
         req = QTAILQ_FIRST(&sq->req_list);
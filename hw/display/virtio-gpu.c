@@ -1410,6 +1410,7 @@ static const VMStateDescription vmstate_virtio_gpu = {
     .name = "virtio-gpu",
     .minimum_version_id = VIRTIO_GPU_VM_VERSION,
     .version_id = VIRTIO_GPU_VM_VERSION,
+    .parallel_save = true,
     .fields = (VMStateField[]) {
         VMSTATE_VIRTIO_DEVICE /* core */,
         {
@@ -914,11 +914,8 @@ static int ahci_populate_sglist(AHCIDevice *ad, QEMUSGList *sglist,
     uint16_t prdtl = le16_to_cpu(cmd->prdtl);
     uint64_t cfis_addr = le64_to_cpu(cmd->tbl_addr);
     uint64_t prdt_addr = cfis_addr + 0x80;
-    dma_addr_t prdt_len = (prdtl * sizeof(AHCI_SG));
-    dma_addr_t real_prdt_len = prdt_len;
-    uint8_t *prdt;
+    AHCI_SG tbl;
     int i;
-    int r = 0;
     uint64_t sum = 0;
     int off_idx = -1;
     int64_t off_pos = -1;
@@ -933,56 +930,44 @@ static int ahci_populate_sglist(AHCIDevice *ad, QEMUSGList *sglist,
         return -1;
     }
 
-    /* map PRDT */
-    if (!(prdt = dma_memory_map(ad->hba->as, prdt_addr, &prdt_len,
-                                DMA_DIRECTION_TO_DEVICE))){
-        trace_ahci_populate_sglist_no_map(ad->hba, ad->port_no);
-        return -1;
-    }
-
-    if (prdt_len < real_prdt_len) {
-        trace_ahci_populate_sglist_short_map(ad->hba, ad->port_no);
-        r = -1;
-        goto out;
-    }
-
     /* Get entries in the PRDT, init a qemu sglist accordingly */
-    if (prdtl > 0) {
-        AHCI_SG *tbl = (AHCI_SG *)prdt;
-        sum = 0;
-        for (i = 0; i < prdtl; i++) {
-            tbl_entry_size = prdt_tbl_entry_size(&tbl[i]);
-            if (offset < (sum + tbl_entry_size)) {
-                off_idx = i;
-                off_pos = offset - sum;
-                break;
-            }
-            sum += tbl_entry_size;
+    for (i = 0; i < prdtl; i++) {
+        if (dma_cache_read(&ad->tbl_cache, prdt_addr + i * sizeof(tbl),
+                           &tbl, sizeof(tbl))) {
+            trace_ahci_populate_sglist_no_map(ad->hba, ad->port_no);
+            return -1;
         }
-        if ((off_idx == -1) || (off_pos < 0) || (off_pos > tbl_entry_size)) {
-            trace_ahci_populate_sglist_bad_offset(ad->hba, ad->port_no,
-                                                  off_idx, off_pos);
-            r = -1;
-            goto out;
+        tbl_entry_size = prdt_tbl_entry_size(&tbl);
+        if (offset < (sum + tbl_entry_size)) {
+            off_idx = i;
+            off_pos = offset - sum;
+            break;
         }
+        sum += tbl_entry_size;
+    }
+    if ((off_idx == -1) || (off_pos < 0) || (off_pos > tbl_entry_size)) {
+        trace_ahci_populate_sglist_bad_offset(ad->hba, ad->port_no,
+                                              off_idx, off_pos);
+        return -1;
+    }
 
-        qemu_sglist_init(sglist, qbus->parent, (prdtl - off_idx),
-                         ad->hba->as);
-        qemu_sglist_add(sglist, le64_to_cpu(tbl[off_idx].addr) + off_pos,
-                        MIN(prdt_tbl_entry_size(&tbl[off_idx]) - off_pos,
-                            limit));
+    qemu_sglist_init(sglist, qbus->parent, (prdtl - off_idx),
+                     ad->hba->as);
+    qemu_sglist_add(sglist, le64_to_cpu(tbl.addr) + off_pos,
+                    MIN(prdt_tbl_entry_size(&tbl) - off_pos, limit));
 
-        for (i = off_idx + 1; i < prdtl && sglist->size < limit; i++) {
-            qemu_sglist_add(sglist, le64_to_cpu(tbl[i].addr),
-                            MIN(prdt_tbl_entry_size(&tbl[i]),
-                                limit - sglist->size));
+    for (i = off_idx + 1; i < prdtl && sglist->size < limit; i++) {
+        if (dma_cache_read(&ad->tbl_cache, prdt_addr + i * sizeof(tbl),
+                           &tbl, sizeof(tbl))) {
+            trace_ahci_populate_sglist_no_map(ad->hba, ad->port_no);
+            qemu_sglist_destroy(sglist);
+            return -1;
         }
+        qemu_sglist_add(sglist, le64_to_cpu(tbl.addr),
+                        MIN(prdt_tbl_entry_size(&tbl),
+                            limit - sglist->size));
     }
-
-out:
-    dma_memory_unmap(ad->hba->as, prdt, prdt_len,
-                     DMA_DIRECTION_TO_DEVICE, prdt_len);
-    return r;
+    return 0;
 }
 
 static void ncq_err(NCQTransferState *ncq_tfs)
@@ -1272,8 +1257,7 @@ static int handle_cmd(AHCIState *s, int port, uint8_t slot)
     IDEState *ide_state;
     uint64_t tbl_addr;
     AHCICmdHdr *cmd;
-    uint8_t *cmd_fis;
-    dma_addr_t cmd_len;
+    uint8_t cmd_fis[0x80];
 
     if (s->dev[port].port.ifs[0].status & (BUSY_STAT|DRQ_STAT)) {
         /* Engine currently busy, try again later */
@@ -1297,16 +1281,11 @@ static int handle_cmd(AHCIState *s, int port, uint8_t slot)
     }
 
     tbl_addr = le64_to_cpu(cmd->tbl_addr);
-    cmd_len = 0x80;
-    cmd_fis = dma_memory_map(s->as, tbl_addr, &cmd_len,
-                             DMA_DIRECTION_FROM_DEVICE);
-    if (!cmd_fis) {
+    if (dma_cache_read(&s->dev[port].tbl_cache, tbl_addr,
+                       cmd_fis, sizeof(cmd_fis))) {
+        ahci_trigger_irq(s, &s->dev[port], AHCI_PORT_IRQ_BIT_HBFS);
         trace_handle_cmd_badfis(s, port);
         return -1;
-    } else if (cmd_len != 0x80) {
-        ahci_trigger_irq(s, &s->dev[port], AHCI_PORT_IRQ_BIT_HBFS);
-        trace_handle_cmd_badmap(s, port, cmd_len);
-        goto out;
     }
     if (trace_event_get_state_backends(TRACE_HANDLE_CMD_FIS_DUMP)) {
         char *pretty_fis = ahci_pretty_buffer_fis(cmd_fis, 0x80);
@@ -1323,10 +1302,6 @@ static int handle_cmd(AHCIState *s, int port, uint8_t slot)
             break;
     }
 
-out:
-    dma_memory_unmap(s->as, cmd_fis, cmd_len, DMA_DIRECTION_FROM_DEVICE,
-                     cmd_len);
-
     if (s->dev[port].port.ifs[0].status & (BUSY_STAT|DRQ_STAT)) {
         /* async command, complete later */
         s->dev[port].busy_slot = slot;
@@ -1553,6 +1528,7 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
         ide_register_restart_cb(&ad->port);
+        dma_cache_init(&ad->tbl_cache, as, DMA_DIRECTION_TO_DEVICE);
     }
     g_free(irqs);
 }
@@ -1569,6 +1545,7 @@ void ahci_uninit(AHCIState *s)
 
             ide_exit(s);
         }
+        dma_cache_destroy(&ad->tbl_cache);
         object_unparent(OBJECT(&ad->port));
     }
 
@@ -1600,6 +1577,7 @@ void ahci_reset(AHCIState *s)
         pr->scr_ctl = 0;
         pr->cmd = PORT_CMD_SPIN_UP | PORT_CMD_POWER_ON;
         ahci_reset_port(s, i);
+        dma_cache_invalidate(&s->dev[i].tbl_cache);
     }
 }
 
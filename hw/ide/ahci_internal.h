@@ -319,6 +319,7 @@ struct AHCIDevice {
     int32_t busy_slot;
     bool init_d2h_sent;
     AHCICmdHdr *cur_cmd;
+    DMACache tbl_cache;
     NCQTransferState ncq_tfs[AHCI_MAX_CMDS];
 };
 
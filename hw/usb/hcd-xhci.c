@@ -491,7 +491,7 @@ static inline void xhci_dma_read_u32s(XHCIState *xhci, dma_addr_t addr,
 
     assert((len % sizeof(uint32_t)) == 0);
 
-    dma_memory_read(xhci->as, addr, buf, len);
+    dma_cache_read(&xhci->ctx_cache, addr, buf, len);
 
     for (i = 0; i < (len / sizeof(uint32_t)); i++) {
         buf[i] = le32_to_cpu(buf[i]);
@@ -511,7 +511,7 @@ static inline void xhci_dma_write_u32s(XHCIState *xhci, dma_addr_t addr,
     for (i = 0; i < n; i++) {
         tmp[i] = cpu_to_le32(buf[i]);
     }
-    dma_memory_write(xhci->as, addr, tmp, len);
+    dma_cache_write(&xhci->ctx_cache, addr, tmp, len);
 }
 
 static XHCIPort *xhci_lookup_port(XHCIState *xhci, struct USBPort *uport)
@@ -657,7 +657,7 @@ static void xhci_write_event(XHCIState *xhci, XHCIEvent *event, int v)
                                ev_trb.status, ev_trb.control);
 
     addr = intr->er_start + TRB_SIZE*intr->er_ep_idx;
-    dma_memory_write(xhci->as, addr, &ev_trb, TRB_SIZE);
+    dma_cache_write(&xhci->event_cache, addr, &ev_trb, TRB_SIZE);
 
     intr->er_ep_idx++;
     if (intr->er_ep_idx >= intr->er_size) {
@@ -709,6 +709,8 @@ static void xhci_ring_init(XHCIState *xhci, XHCIRing *ring,
 {
     ring->dequeue = base;
     ring->ccs = 1;
+    dma_cache_destroy(&ring->cache);
+    dma_cache_init(&ring->cache, xhci->as, DMA_DIRECTION_TO_DEVICE);
 }
 
 static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
@@ -718,7 +720,7 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
 
     while (1) {
         TRBType type;
-        dma_memory_read(xhci->as, ring->dequeue, trb, TRB_SIZE);
+        dma_cache_read(&ring->cache, ring->dequeue, trb, TRB_SIZE);
         trb->addr = ring->dequeue;
         trb->ccs = ring->ccs;
         le64_to_cpus(&trb->parameter);
@@ -753,7 +755,7 @@ static TRBType xhci_ring_fetch(XHCIState *xhci, XHCIRing *ring, XHCITRB *trb,
     }
 }
 
-static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
+static int xhci_ring_chain_length(XHCIState *xhci, XHCIRing *ring)
 {
     XHCITRB trb;
     int length = 0;
@@ -765,7 +767,7 @@ static int xhci_ring_chain_length(XHCIState *xhci, const XHCIRing *ring)
 
     while (1) {
         TRBType type;
-        dma_memory_read(xhci->as, dequeue, &trb, TRB_SIZE);
+        dma_cache_read(&ring->cache, dequeue, &trb, TRB_SIZE);
         le64_to_cpus(&trb.parameter);
         le32_to_cpus(&trb.status);
         le32_to_cpus(&trb.control);
@@ -885,8 +887,13 @@ static void xhci_alloc_streams(XHCIEPContext *epctx, dma_addr_t base)
 
 static void xhci_free_streams(XHCIEPContext *epctx)
 {
+    unsigned int i;
+
     assert(epctx->pstreams != NULL);
 
+    for (i = 0; i < epctx->nr_pstreams; i++) {
+        dma_cache_destroy(&epctx->pstreams[i].ring.cache);
+    }
     g_free(epctx->pstreams);
     epctx->pstreams = NULL;
     epctx->nr_pstreams = 0;
@@ -1282,6 +1289,7 @@ static TRBCCode xhci_disable_ep(XHCIState *xhci, unsigned int slotid,
     }
 
     timer_free(epctx->kick_timer);
+    dma_cache_destroy(&epctx->ring.cache);
     g_free(epctx);
     slot->eps[epid-1] = NULL;
 
@@ -2703,6 +2711,10 @@ void usb_xhci_reset(XHCIState *xhci)
         xhci->intr[i].ev_buffer_put = 0;
         xhci->intr[i].ev_buffer_get = 0;
     }
+
+    dma_cache_invalidate(&xhci->cmd_ring.cache);
+    dma_cache_invalidate(&xhci->ctx_cache);
+    dma_cache_invalidate(&xhci->event_cache);
 }
 
 static uint64_t xhci_cap_read(void *ptr, hwaddr reg, unsigned size)
@@ -3531,6 +3543,10 @@ void usb_xhci_realize(XHCIState *xhci, DeviceState *dev, Error **errp)
 
     xhci->mfwrap_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xhci_mfwrap_timer, xhci);
     xhci->device = dev;
+
+    dma_cache_init(&xhci->cmd_ring.cache, xhci->as, DMA_DIRECTION_TO_DEVICE);
+    dma_cache_init(&xhci->ctx_cache, xhci->as, DMA_DIRECTION_FROM_DEVICE);
+    dma_cache_init(&xhci->event_cache, xhci->as, DMA_DIRECTION_FROM_DEVICE);
 }
 
 void usb_xhci_unrealize(XHCIState *xhci, DeviceState *dev, Error **errp)
@@ -3547,6 +3563,10 @@ void usb_xhci_unrealize(XHCIState *xhci, DeviceState *dev, Error **errp)
         xhci->mfwrap_timer = NULL;
     }
 
+    dma_cache_destroy(&xhci->cmd_ring.cache);
+    dma_cache_destroy(&xhci->ctx_cache);
+    dma_cache_destroy(&xhci->event_cache);
+
     memory_region_del_subregion(&xhci->mem, &xhci->mem_cap);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_oper);
     memory_region_del_subregion(&xhci->mem, &xhci->mem_runtime);
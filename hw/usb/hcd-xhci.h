@@ -145,6 +145,8 @@ typedef enum TRBCCode {
 typedef struct XHCIRing {
     dma_addr_t dequeue;
     bool ccs;
+    /* Window into guest memory for the TRBs */
+    DMACache cache;
 } XHCIRing;
 
 typedef struct XHCIPort {
@@ -241,6 +243,10 @@ struct XHCIState {
 
     XHCIRing cmd_ring;
 
+    /* Windows into guest memory for device contexts and events */
+    DMACache ctx_cache;
+    DMACache event_cache;
+
     bool nec_quirks;
 };
 
@@ -288,6 +288,7 @@ typedef struct mips_elf_abiflags_v0 {
 #define STT_FUNC    2
 #define STT_SECTION 3
 #define STT_FILE    4
+#define STT_GNU_IFUNC 10
 
 #define ELF_ST_BIND(x)		((x) >> 4)
 #define ELF_ST_TYPE(x)		(((unsigned int) x) & 0xf)
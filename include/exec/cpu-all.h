@@ -260,6 +260,9 @@ int walk_memory_regions(void *, walk_memory_regions_fn);
 int page_get_flags(target_ulong address);
 void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
+/* Find the first page in [start, last] with any flag set */
+bool page_find_mapped(target_ulong start, target_ulong last,
+                      target_ulong *found);
 #endif
 
 CPUArchState *cpu_copy(CPUArchState *env);
@@ -22,6 +22,7 @@
 
 #include "qemu-common.h"
 #include "exec/tb-context.h"
+#include "qemu/interval-tree.h"
 #include "sysemu/cpus.h"
 
 /* allow to see translation results - the slowdown should be negligible, so we leave it */
@@ -369,6 +370,10 @@ struct TranslationBlock {
        The list is protected by the TB's page('s) lock(s) */
     uintptr_t page_next[2];
     tb_page_addr_t page_addr[2];
+#ifdef CONFIG_USER_ONLY
+    /* guest virtual address range of the code; protected by mmap_lock */
+    IntervalTreeNode itree;
+#endif
 
     /* jmp_lock placed here to fill a 4-byte hole. Its documentation is below */
     QemuSpin jmp_lock;
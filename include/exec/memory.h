@@ -25,6 +25,7 @@
 #include "qemu/notify.h"
 #include "qom/object.h"
 #include "qemu/rcu.h"
+#include "qemu/thread.h"
 #include "hw/qdev-core.h"
 
 #define RAM_ADDR_INVALID (~(ram_addr_t)0)
@@ -381,6 +382,8 @@ struct MemoryRegion {
     int32_t priority;
     QTAILQ_HEAD(, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
+    QLIST_HEAD(, MemoryRegion) aliases;
+    QLIST_ENTRY(MemoryRegion) aliases_link;
     QTAILQ_HEAD(, CoalescedMemoryRange) coalesced;
     const char *name;
     unsigned ioeventfd_nb;
@@ -434,6 +437,9 @@ struct MemoryListener {
 /**
  * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
+/* Default for AddressSpace.max_bounce_buffer_size */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
 struct AddressSpace {
     /* All fields are private. */
     struct rcu_head rcu;
@@ -447,6 +453,22 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     QTAILQ_HEAD(, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+
+    /*
+     * Total size of the bounce buffers that address_space_map() can hand
+     * out at any time, when the memory is not directly accessible.  Can be
+     * changed before the address space is used.
+     */
+    size_t max_bounce_buffer_size;
+    /* Protects the bounce buffers, their statistics and the map clients */
+    QemuMutex bounce_lock;
+    /* Total size of the bounce buffers in use; read atomically */
+    size_t bounce_buffer_size;
+    size_t bounce_buffer_peak;
+    uint64_t bounce_buffer_maps;
+    uint64_t bounce_buffer_failures;
+    QLIST_HEAD(, BounceBuffer) bounce_buffers;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
 };
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
@@ -2041,10 +2063,13 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, hwaddr len,
 /* address_space_map: map a physical memory region into a host virtual address
  *
  * May map a subset of the requested range, given by and returned in @plen.
- * May return %NULL if resources needed to perform the mapping are exhausted.
+ * May return %NULL if resources needed to perform the mapping are exhausted,
+ * i.e. when memory that is not directly accessible has to go through bounce
+ * buffers and @as has already handed out max_bounce_buffer_size bytes of
+ * them.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -2069,6 +2094,23 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* address_space_register_map_client: ask to be told when mapping can work
+ *
+ * Schedules @bh once some bounce buffers of @as are released, or right away
+ * if there are some available.  @bh is unregistered when it is scheduled.
+ *
+ * @as: #AddressSpace whose address_space_map() failed
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel address_space_register_map_client()
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
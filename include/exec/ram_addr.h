@@ -37,6 +37,8 @@ struct RAMBlock {
     char idstr[256];
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
+    IntervalTreeNode offset_node;
+    IntervalTreeNode host_node;
     QLIST_HEAD(, RAMBlockNotifier) ramblock_notifiers;
     int fd;
     size_t page_size;
@@ -50,6 +52,15 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /* offset of each page in the migration file during lazy restore */
+    uint64_t *lazy_offsets;
+    /*
+     * with mapped RAM, the pages that are present in the migration file,
+     * and where the bitmap and the pages are in the file
+     */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -5,6 +5,7 @@
 #include "qemu/thread.h"
 #include "qemu/rcu.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/interval-tree.h"
 
 typedef struct RAMBlockNotifier RAMBlockNotifier;
 
@@ -49,6 +50,14 @@ typedef struct RAMList {
     RAMBlock *mru_block;
     /* RCU-enabled, writes protected by the ramlist lock. */
     QLIST_HEAD(, RAMBlock) blocks;
+    /*
+     * The same blocks, indexed by ram_addr_t and by host address.
+     * RCU-enabled, writes protected by the ramlist lock.  Lookups may miss
+     * a block while the trees are being rebalanced, and then fall back to
+     * walking the list.
+     */
+    IntervalTreeRoot offset_tree;
+    IntervalTreeRoot host_tree;
     DirtyMemoryBlocks *dirty_memory[DIRTY_MEMORY_NUM];
     uint32_t version;
     QLIST_HEAD(, RAMBlockNotifier) ramblock_notifiers;
@@ -25,6 +25,10 @@
 #include "io/task.h"
 #include "qemu/sockets.h"
 
+#if defined(CONFIG_LINUX) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define QEMU_MSG_ZEROCOPY
+#endif
+
 #define TYPE_QIO_CHANNEL_SOCKET "qio-channel-socket"
 #define QIO_CHANNEL_SOCKET(obj)                                     \
     OBJECT_CHECK(QIOChannelSocket, (obj), TYPE_QIO_CHANNEL_SOCKET)
@@ -48,6 +52,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* MSG_ZEROCOPY sends, and completions read from the error queue */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
@@ -45,6 +45,7 @@ enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS,
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
 };
 
 
@@ -137,6 +138,12 @@ struct QIOChannelClass {
                      off_t offset,
                      int whence,
                      Error **errp);
+    ssize_t (*io_writev_zero_copy)(QIOChannel *ioc,
+                                   const struct iovec *iov,
+                                   size_t niov,
+                                   Error **errp);
+    int (*io_flush)(QIOChannel *ioc,
+                    Error **errp);
     void (*io_set_aio_fd_handler)(QIOChannel *ioc,
                                   AioContext *ctx,
                                   IOHandler *io_read,
@@ -350,6 +357,45 @@ int qio_channel_writev_all(QIOChannel *ioc,
                            size_t niov,
                            Error **erp);
 
+/**
+ * qio_channel_writev_zero_copy_all:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_writev_all(), but the data may be
+ * sent directly from the memory regions referenced by @iov
+ * after the function returns, instead of being copied first.
+ * The caller must not free or reuse the memory until a
+ * subsequent qio_channel_flush() returns; if the contents
+ * change in the meantime, either version may be sent.
+ *
+ * It is an error to call this unless qio_channel_has_feature()
+ * returns a true value for QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY.
+ *
+ * Returns: 0 if all bytes were queued, or -1 on error
+ */
+int qio_channel_writev_zero_copy_all(QIOChannel *ioc,
+                                     const struct iovec *iov,
+                                     size_t niov,
+                                     Error **errp);
+
+/**
+ * qio_channel_flush:
+ * @ioc: the channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait until the data queued by qio_channel_writev_zero_copy_all()
+ * has been sent, so that its memory can be reused.  Channels that
+ * never defer writes return immediately.
+ *
+ * Returns: 0 if all data was sent without copying, 1 if the
+ *          channel had to copy some of it after all, or -1 on error
+ */
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp);
+
 /**
  * qio_channel_readv:
  * @ioc: the channel object
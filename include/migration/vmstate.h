@@ -181,6 +181,19 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * The state does not depend on other devices and its callbacks do not
+     * need the BQL, so with the x-parallel-device-state capability it may
+     * be saved and loaded in a worker thread, after the other sections of
+     * the same priority.
+     */
+    bool parallel;
+    /*
+     * Only saving may happen in a worker thread; the destination still
+     * loads the state with the BQL held, e.g. because it updates the
+     * memory map.
+     */
+    bool parallel_save;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
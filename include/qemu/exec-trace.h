@@ -0,0 +1,138 @@
+/*
+ * Binary execution trace
+ *
+ * Copyright (c) 2019 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_EXEC_TRACE_H
+#define QEMU_EXEC_TRACE_H
+
+#include "qemu/option.h"
+
+/*
+ * The binary execution trace is a low-overhead alternative to
+ * "-d exec,in_asm".  Every vCPU owns a single-producer ring of 64-bit
+ * records which is drained to disk by a dedicated writer thread; the
+ * disassembly of each translation block is recorded once, at translation
+ * time, and only the TB id is logged when the block executes.  Use
+ * scripts/exec-trace-decode.py to turn the resulting file back into an
+ * instruction trace.
+ *
+ * Records are made of one or more host-endian 64-bit words.  The low
+ * byte of the first word holds the record type.
+ */
+#define EXEC_TRACE_MAGIC    0x5145584543545243ULL   /* "QEXECTRC" */
+#define EXEC_TRACE_VERSION  1
+
+/* File header flags */
+#define EXEC_TRACE_F_MEM    (1 << 0)
+
+/* Chunk types */
+enum {
+    EXEC_TRACE_CHUNK_RECORDS = 1,   /* per-vCPU record words */
+    EXEC_TRACE_CHUNK_TB = 2,        /* translation block definitions */
+};
+
+/* Record types */
+enum {
+    /* bits 32..63: TB id */
+    EXEC_TRACE_REC_TB = 1,
+    /* bits 8..15: trace_mem_get_info() value; next word: guest vaddr */
+    EXEC_TRACE_REC_MEM = 2,
+};
+
+typedef struct ExecTraceHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+} ExecTraceHeader;
+
+typedef struct ExecTraceChunk {
+    uint32_t type;
+    uint32_t cpu_index;
+    uint32_t length;        /* payload length in bytes */
+    uint32_t dropped;       /* records lost since the previous chunk */
+} ExecTraceChunk;
+
+/* Followed by @disas_len bytes of disassembly text (not NUL-terminated) */
+typedef struct ExecTraceTBDef {
+    uint64_t pc;
+    uint32_t id;
+    uint32_t size;
+    uint32_t icount;
+    uint32_t disas_len;
+} ExecTraceTBDef;
+
+typedef struct ExecTraceBuffer ExecTraceBuffer;
+
+extern bool exec_trace_enabled;
+extern bool exec_trace_mem_enabled;
+extern QemuOptsList qemu_exec_trace_opts;
+
+/**
+ * exec_trace_opt_parse:
+ * @optarg: A string argument of --exec-trace command line argument
+ *
+ * Parse the option and remember the settings; exec_trace_init() must be
+ * called afterwards to actually start tracing.
+ */
+void exec_trace_opt_parse(const char *optarg);
+
+/**
+ * exec_trace_init:
+ *
+ * Open the trace file and start the writer thread, if tracing was
+ * requested on the command line.  Returns false and sets @errp on failure.
+ */
+bool exec_trace_init(Error **errp);
+
+/**
+ * exec_trace_flush:
+ *
+ * Synchronously write out all pending records.  Registered with atexit()
+ * by exec_trace_init().
+ */
+void exec_trace_flush(void);
+
+/**
+ * exec_trace_fork_start:
+ *
+ * Called by linux-user before fork(), with the other vCPUs stopped.
+ * Writes out all pending records and holds the locks across the fork.
+ */
+void exec_trace_fork_start(void);
+
+/**
+ * exec_trace_fork_end:
+ * @child: true in the child process
+ * @keep: trace buffer of the vCPU that survives in the child
+ *
+ * Called by linux-user after fork().  The child continues the trace in a
+ * file of its own, named after the parent's file with ".<pid>" appended;
+ * its translation blocks must be flushed so that they are defined again
+ * in that file.
+ */
+void exec_trace_fork_end(int child, ExecTraceBuffer *keep);
+
+ExecTraceBuffer *exec_trace_buffer_new(int cpu_index);
+
+/**
+ * exec_trace_buffer_release:
+ *
+ * Called when the owning vCPU goes away; the buffer is freed by the
+ * writer thread once its contents have been written out.
+ */
+void exec_trace_buffer_release(ExecTraceBuffer *buf);
+
+void exec_trace_record_tb(ExecTraceBuffer *buf, uint32_t id);
+void exec_trace_record_mem(ExecTraceBuffer *buf, uint64_t vaddr,
+                           uint8_t info);
+
+uint32_t exec_trace_new_tb_id(void);
+void exec_trace_define_tb(uint32_t id, uint64_t pc, uint32_t size,
+                          uint32_t icount, const char *disas, size_t len);
+
+#endif /* QEMU_EXEC_TRACE_H */
@@ -0,0 +1,91 @@
+/*
+ * Augmented interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * A balanced binary search tree of closed intervals [start, last], keyed
+ * by @start and augmented with the largest @last of each subtree, so that
+ * all the intervals overlapping a query range can be found in O(log n + k).
+ * Closed intervals let a range end at the very top of the address space.
+ * Intervals may overlap each other.
+ *
+ * Nodes are embedded in the user's structures; the tree never allocates.
+ *
+ * Updates must be serialized by the caller.  interval_tree_iter_first() may
+ * run concurrently with updates, provided that removed nodes are only freed
+ * after an RCU grace period: it then returns either NULL or a node that was
+ * in the tree at some point during the lookup, but it can miss intervals
+ * that are being moved around by a concurrent update.  Callers that need a
+ * definite negative answer must repeat the lookup with updates excluded.
+ * interval_tree_iter_next() always requires updates to be excluded.
+ */
+
+typedef struct IntervalTreeNode IntervalTreeNode;
+
+struct IntervalTreeNode {
+    IntervalTreeNode *parent;
+    IntervalTreeNode *left;
+    IntervalTreeNode *right;
+    uint64_t start;             /* inclusive */
+    uint64_t last;              /* inclusive */
+    uint64_t subtree_last;      /* private */
+    int height;                 /* private */
+};
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+static inline bool interval_tree_is_empty(const IntervalTreeRoot *root)
+{
+    return root->root == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ * @node: node to insert, with @start and @last filled in
+ * @root: the tree
+ *
+ * Add @node to @root.  Intervals with the same @start are allowed.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ * @node: node to remove; it must be in @root
+ * @root: the tree
+ *
+ * @node can be modified and inserted again as soon as this returns, but
+ * concurrent lookups may still be reading it.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ * @root: the tree
+ * @start: first value of the query range
+ * @last: last value of the query range, inclusive
+ *
+ * Returns: the overlapping node with the lowest @start, or NULL.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ * @node: a node returned by a previous lookup with the same range
+ * @start: first value of the query range
+ * @last: last value of the query range, inclusive
+ *
+ * Returns: the next overlapping node in order of @start, or NULL.  It is
+ * safe to remove @node after this call, e.g. to remove all nodes in a range.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+#endif
@@ -570,6 +570,40 @@ void qemu_set_tty_echo(int fd, bool echo);
 void os_mem_prealloc(int fd, char *area, size_t sz, int smp_cpus,
                      Error **errp);
 
+/**
+ * MemPrealloc:
+ * @name: name of the memory, for tracing and error messages
+ * @fd: file descriptor backing the memory, or -1
+ * @area: start of the memory
+ * @size: size of the memory
+ * @host_nodes: bitmap of the host NUMA nodes that the memory is bound
+ * to, or %NULL; the pages are then touched from CPUs of these nodes
+ * @max_node: number of bits in @host_nodes
+ */
+typedef struct MemPrealloc {
+    const char *name;
+    int fd;
+    char *area;
+    size_t size;
+    const unsigned long *host_nodes;
+    unsigned long max_node;
+} MemPrealloc;
+
+/**
+ * os_mem_prealloc_batch:
+ * @regions: the memory to preallocate
+ * @nregions: the number of elements in @regions
+ * @smp_cpus: the maximum number of threads
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Like os_mem_prealloc, but touches all of @regions in parallel, each
+ * with a set of threads of its own.  The regions bound to the same host
+ * nodes share out the threads that a single one of them would get,
+ * according to their size.  Concurrent calls are serialized.
+ */
+void os_mem_prealloc_batch(const MemPrealloc *regions, int nregions,
+                           int smp_cpus, Error **errp);
+
 /**
  * qemu_get_pmem_size:
  * @filename: path to a pmem file
@@ -18,6 +18,7 @@ struct qht {
     qht_cmp_func_t cmp;
     QemuMutex lock; /* serializes setters of ht->map */
     unsigned int mode;
+    size_t n_resizes;
 };
 
 /**
@@ -29,6 +30,11 @@ struct qht {
  *         chain, excluding empty chains.
  * @occupancy: frequency distribution representing chain occupancy rate.
  *             Valid range: from 0.0 (empty) to 1.0 (full occupancy).
+ * @migrating_head_buckets: number of head buckets of the previous map that
+ *                          an ongoing resize has yet to migrate. Their
+ *                          entries are included in @entries, but not in
+ *                          @chain and @occupancy.
+ * @resizes: number of times the hash table has been resized.
  *
  * An entry is a pointer-hash pair.
  * Each bucket can host several entries.
@@ -40,6 +46,8 @@ struct qht_stats {
     size_t entries;
     struct qdist chain;
     struct qdist occupancy;
+    size_t migrating_head_buckets;
+    size_t resizes;
 };
 
 typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
@@ -166,6 +174,9 @@ bool qht_reset_size(struct qht *ht, size_t n_elems);
  * @ht: QHT to be resized
  * @n_elems: number of entries the resized hash table should be optimized for
  *
+ * Lookups and updates can proceed while entries are being migrated to the
+ * resized table; this function returns once the migration is complete.
+ *
  * Returns true on success.
  * Returns false if the resize was not necessary and therefore not performed.
  * See also: qht_reset_size().
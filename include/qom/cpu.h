@@ -258,6 +258,7 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
@@ -338,6 +339,7 @@ struct qemu_work_item;
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
  *                        to @trace_dstate).
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
+ * @exec_trace: Binary execution trace buffer, allocated on first use.
  * @ignore_memory_transaction_failures: Cached copy of the MachineState
  *    flag of the same name: allows the board to suppress calling of the
  *    CPU do_transaction_failed hook function.
@@ -415,11 +417,16 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    /* KVM dirty ring of the vcpu and next entry to collect from it */
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
     DECLARE_BITMAP(trace_dstate, CPU_TRACE_DSTATE_MAX_EVENTS);
 
+    struct ExecTraceBuffer *exec_trace;
+
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index;
     int cluster_index;
@@ -435,6 +442,14 @@ struct CPUState {
      */
     bool throttle_thread_scheduled;
 
+    /* Pages this vcpu dirtied for migration (counted by TCG, or by KVM
+     * with a dirty ring), and the dirty rate limiter state derived from them
+     */
+    unsigned long dirty_pages;
+    unsigned long dirty_pages_prev;
+    uint64_t dirty_rate;
+    int dirty_limit_pct;
+
     bool ignore_memory_transaction_failures;
 
     /* Note that this is accessed at the start of every TB via a negative
@@ -857,6 +872,36 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_dirty_limit_set:
+ * @limit: Maximum dirty page rate of each vcpu, in MiB/s.
+ *
+ * Measures how fast each vcpu dirties guest memory for migration and
+ * throttles the vcpus that are faster than @limit, each in proportion to
+ * how much faster it is; other vcpus keep running at full speed.  This
+ * stacks with cpu_throttle_set, the larger percentage wins.
+ *
+ * Dirty pages are only accounted to vcpus by TCG and by KVM with a dirty
+ * ring, and only while dirty logging is active.  Like cpu_throttle_set,
+ * this can be called again to change the limit and remains in effect
+ * until cpu_dirty_limit_stop.
+ */
+void cpu_dirty_limit_set(uint64_t limit);
+
+/**
+ * cpu_dirty_limit_stop:
+ *
+ * Stops the vcpu dirty rate limiting started by cpu_dirty_limit_set.
+ */
+void cpu_dirty_limit_stop(void);
+
+/**
+ * cpu_dirty_limit_active:
+ *
+ * Returns: %true if the vcpu dirty rate is being limited, %false otherwise.
+ */
+bool cpu_dirty_limit_active(void);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
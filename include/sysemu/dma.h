@@ -147,6 +147,81 @@ static inline void dma_memory_unmap(AddressSpace *as,
                         dir == DMA_DIRECTION_FROM_DEVICE, access_len);
 }
 
+/*
+ * A DMACache speeds up small, repeated accesses to the same area of guest
+ * memory, such as descriptor rings and device contexts.  It keeps a
+ * #MemoryRegionCache for the DMA_CACHE_WINDOW-sized window that holds the
+ * last access, so that accesses that hit RAM in that window are a plain
+ * memcpy instead of a walk of the address space's dispatch tree.
+ *
+ * The window holds a reference to the FlatView it was looked up in.  A
+ * memory listener drops it as soon as a transaction changes the FlatView
+ * of the address space, so that a window neither outlives a change to
+ * the memory map nor pins the old one.  Accesses to anything but RAM, or
+ * that cross a window boundary, simply go through dma_memory_rw().
+ *
+ * A cache is set up for one direction: the window of a
+ * DMA_DIRECTION_TO_DEVICE cache may include ROM and is only used for
+ * reads, while a DMA_DIRECTION_FROM_DEVICE cache is used for both reads
+ * and writes.  Since the listener runs under the BQL, a DMACache must
+ * only be used with the BQL held.
+ */
+#define DMA_CACHE_WINDOW 4096
+
+typedef struct DMACache {
+    AddressSpace *as;
+    DMADirection dir;
+    dma_addr_t base;
+    MemoryRegionCache mrc;
+    /* on the list of caches with a window, if mapped */
+    bool mapped;
+    QLIST_ENTRY(DMACache) link;
+} DMACache;
+
+void dma_cache_init(DMACache *cache, AddressSpace *as, DMADirection dir);
+/* Release the current window, e.g. on device reset */
+void dma_cache_invalidate(DMACache *cache);
+void dma_cache_destroy(DMACache *cache);
+int dma_cache_rw_slow(DMACache *cache, dma_addr_t addr,
+                      void *buf, dma_addr_t len, DMADirection dir);
+
+static inline bool dma_cache_hit(DMACache *cache, dma_addr_t addr,
+                                 dma_addr_t len)
+{
+    dma_addr_t offset = addr - cache->base;
+
+    return cache->mrc.ptr &&
+           offset < cache->mrc.len && len <= cache->mrc.len - offset;
+}
+
+static inline int dma_cache_read(DMACache *cache, dma_addr_t addr,
+                                 void *buf, dma_addr_t len)
+{
+    dma_barrier(cache->as, DMA_DIRECTION_TO_DEVICE);
+
+    if (likely(dma_cache_hit(cache, addr, len))) {
+        address_space_read_cached(&cache->mrc, addr - cache->base, buf, len);
+        return 0;
+    }
+    return dma_cache_rw_slow(cache, addr, buf, len, DMA_DIRECTION_TO_DEVICE);
+}
+
+static inline int dma_cache_write(DMACache *cache, dma_addr_t addr,
+                                  const void *buf, dma_addr_t len)
+{
+    dma_barrier(cache->as, DMA_DIRECTION_FROM_DEVICE);
+
+    if (likely(cache->dir == DMA_DIRECTION_FROM_DEVICE &&
+               dma_cache_hit(cache, addr, len))) {
+        address_space_write_cached(&cache->mrc, addr - cache->base,
+                                   (void *)buf, len);
+        address_space_cache_invalidate(&cache->mrc, addr - cache->base, len);
+        return 0;
+    }
+    return dma_cache_rw_slow(cache, addr, (void *)buf, len,
+                             DMA_DIRECTION_FROM_DEVICE);
+}
+
 #define DEFINE_LDST_DMA(_lname, _sname, _bits, _end) \
     static inline uint##_bits##_t ld##_lname##_##_end##_dma(AddressSpace *as, \
                                                             dma_addr_t addr) \
@@ -69,4 +69,22 @@ bool host_memory_backend_is_mapped(HostMemoryBackend *backend);
 size_t host_memory_backend_pagesize(HostMemoryBackend *memdev);
 char *host_memory_backend_get_name(HostMemoryBackend *backend);
 
+/**
+ * host_memory_backend_prealloc_begin:
+ *
+ * Defer the preallocation of the memory backends that are created from
+ * now on, until host_memory_backend_prealloc_end() preallocates all of
+ * them in parallel.  Used for the backends on the command line.
+ */
+void host_memory_backend_prealloc_begin(void);
+
+/**
+ * host_memory_backend_prealloc_end:
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Preallocate the backends whose preallocation was deferred since
+ * host_memory_backend_prealloc_begin().
+ */
+void host_memory_backend_prealloc_end(Error **errp);
+
 #endif
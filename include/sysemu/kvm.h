@@ -238,6 +238,21 @@ bool kvm_arm_supports_user_irq(void);
  */
 bool kvm_memcrypt_enabled(void);
 
+/**
+ * kvm_dirty_ring_enabled - return whether KVM logs dirty pages in per-vCPU
+ *                          rings instead of bitmaps
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_reap - collect the pages in the dirty rings of all vCPUs
+ *
+ * Sets them dirty in the memory API bitmaps, and adds them to the
+ * dirty_pages counter of the vCPU that dirtied them.  Called with the
+ * BQL held.
+ */
+void kvm_dirty_ring_reap(void);
+
 /**
  * kvm_memcrypt_encrypt_data: encrypt the memory range
  *
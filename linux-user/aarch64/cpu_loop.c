@@ -120,6 +120,10 @@ void cpu_loop(CPUARMState *env)
             queue_signal(env, info.si_signo, QEMU_SI_FAULT, &info);
             break;
         case EXCP_DEBUG:
+            if (passthrough_call(env)) {
+                break;
+            }
+            /* fall through */
         case EXCP_BKPT:
             info.si_signo = TARGET_SIGTRAP;
             info.si_errno = 0;
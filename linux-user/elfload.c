@@ -1903,6 +1903,9 @@ static abi_ulong create_elf_tables(abi_ulong p, int argc, int envc,
     size = (DLINFO_ITEMS + 1) * 2;
     if (k_platform)
         size += 2;
+    if (info->vdso) {
+        size += 2;
+    }
 #ifdef DLINFO_ARCH_ITEMS
     size += DLINFO_ARCH_ITEMS * 2;
 #endif
@@ -1978,6 +1981,9 @@ static abi_ulong create_elf_tables(abi_ulong p, int argc, int envc,
     if (u_platform) {
         NEW_AUX_ENT(AT_PLATFORM, u_platform);
     }
+    if (info->vdso) {
+        NEW_AUX_ENT(AT_SYSINFO_EHDR, info->vdso);
+    }
     NEW_AUX_ENT (AT_NULL, 0);
 #undef NEW_AUX_ENT
 
@@ -2656,6 +2662,110 @@ give_up:
     g_free(syms);
 }
 
+/* Report the functions exported by the shared object mapped from FD.
+   The mapping covers LEN bytes at guest address START, from file offset
+   OFFSET; only functions whose code lies in an executable segment within
+   the mapping are passed to FN.  */
+void elf_foreach_dynamic_func(int fd, abi_ulong offset, abi_ulong start,
+                              abi_ulong len, elf_dynamic_func_fn fn,
+                              void *opaque)
+{
+    struct elfhdr ehdr;
+    struct elf_phdr *phdr = NULL;
+    struct elf_shdr *shdr = NULL;
+    struct elf_sym *syms = NULL;
+    char *strings = NULL;
+    abi_ulong load_bias = 0, seg_start = 0, seg_end = 0;
+    uint64_t strsz, symsz;
+    int i, sym_idx = -1, str_idx;
+    size_t size;
+
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)
+        || !elf_check_ident(&ehdr)) {
+        return;
+    }
+    bswap_ehdr(&ehdr);
+    if (!elf_check_ehdr(&ehdr) || ehdr.e_type != ET_DYN
+        || ehdr.e_shentsize != sizeof(struct elf_shdr)) {
+        return;
+    }
+
+    size = ehdr.e_phnum * sizeof(struct elf_phdr);
+    phdr = g_malloc(size);
+    if (pread(fd, phdr, size, ehdr.e_phoff) != size) {
+        goto out;
+    }
+    bswap_phdr(phdr, ehdr.e_phnum);
+    for (i = 0; i < ehdr.e_phnum; i++) {
+        if (phdr[i].p_type == PT_LOAD && (phdr[i].p_flags & PF_X)
+            && phdr[i].p_offset >= offset
+            && phdr[i].p_offset - offset < len) {
+            load_bias = start + (phdr[i].p_offset - offset) - phdr[i].p_vaddr;
+            seg_start = phdr[i].p_vaddr + load_bias;
+            seg_end = MIN(seg_start + phdr[i].p_memsz, start + len);
+            break;
+        }
+    }
+    if (i == ehdr.e_phnum) {
+        goto out;
+    }
+
+    size = ehdr.e_shnum * sizeof(struct elf_shdr);
+    shdr = g_malloc(size);
+    if (pread(fd, shdr, size, ehdr.e_shoff) != size) {
+        goto out;
+    }
+    bswap_shdr(shdr, ehdr.e_shnum);
+    for (i = 0; i < ehdr.e_shnum; i++) {
+        if (shdr[i].sh_type == SHT_DYNSYM) {
+            sym_idx = i;
+            break;
+        }
+    }
+    if (sym_idx < 0 || shdr[sym_idx].sh_link >= ehdr.e_shnum) {
+        goto out;
+    }
+    str_idx = shdr[sym_idx].sh_link;
+
+    strsz = shdr[str_idx].sh_size;
+    symsz = shdr[sym_idx].sh_size;
+    strings = g_try_malloc(strsz + 1);
+    syms = g_try_malloc(symsz);
+    if (!strings || !syms
+        || pread(fd, strings, strsz, shdr[str_idx].sh_offset) != strsz
+        || pread(fd, syms, symsz, shdr[sym_idx].sh_offset) != symsz) {
+        goto out;
+    }
+    strings[strsz] = 0;
+
+    for (i = 0; i < symsz / sizeof(struct elf_sym); i++) {
+        struct elf_sym *sym = &syms[i];
+        int type, bind;
+        abi_ulong addr;
+
+        bswap_sym(sym);
+        type = ELF_ST_TYPE(sym->st_info);
+        bind = ELF_ST_BIND(sym->st_info);
+        if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE
+            || (type != STT_FUNC && type != STT_GNU_IFUNC)
+            || (bind != STB_GLOBAL && bind != STB_WEAK)
+            || sym->st_name >= strsz) {
+            continue;
+        }
+        addr = sym->st_value + load_bias;
+        if (addr < seg_start || addr >= seg_end) {
+            continue;
+        }
+        fn(strings + sym->st_name, addr, type == STT_GNU_IFUNC, opaque);
+    }
+
+ out:
+    g_free(phdr);
+    g_free(shdr);
+    g_free(strings);
+    g_free(syms);
+}
+
 uint32_t get_elf_eflags(int fd)
 {
     struct elfhdr ehdr;
@@ -2764,6 +2874,7 @@ int load_elf_binary(struct linux_binprm *bprm, struct image_info *info)
 #endif
     }
 
+    info->vdso = vdso_load();
     bprm->p = create_elf_tables(bprm->p, bprm->argc, bprm->envc, &elf_ex,
                                 info, (elf_interpreter ? &interp_info : NULL));
     info->start_stack = bprm->p;
@@ -18,6 +18,8 @@
  */
 
 #include "qemu/osdep.h"
+#include <sys/syscall.h>
+#include "qemu/timer.h"
 #include "qemu.h"
 #include "cpu_loop-common.h"
 
@@ -80,15 +82,46 @@ static void set_idt(int n, unsigned int dpl)
 }
 #endif
 
+/*
+ * Like Linux, let rdtscp return the current CPU and NUMA node; the vDSO
+ * relies on this to implement getcpu().  Asking the host takes a system
+ * call, so the value is refreshed at most every TSC_AUX_REFRESH_NS, and
+ * right after the guest changes its CPU affinity.  The host can move the
+ * thread in between, but the result of getcpu() is only a hint anyway.
+ */
+#define TSC_AUX_REFRESH_NS  SCALE_MS
+
+static __thread int64_t tsc_aux_expire;
+
+static void update_tsc_aux(CPUX86State *env)
+{
+    unsigned cpu, node;
+    int64_t now;
+
+    if (!(env->features[FEAT_8000_0001_EDX] & CPUID_EXT2_RDTSCP)) {
+        return;
+    }
+    now = get_clock();
+    if (now < tsc_aux_expire) {
+        return;
+    }
+    if (syscall(__NR_getcpu, &cpu, &node, NULL) == 0) {
+        env->tsc_aux = (node << 12) | (cpu & 0xfff);
+    }
+    tsc_aux_expire = now + TSC_AUX_REFRESH_NS;
+}
+
 void cpu_loop(CPUX86State *env)
 {
     CPUState *cs = CPU(x86_env_get_cpu(env));
     int trapnr;
     abi_ulong pc;
     abi_ulong ret;
+    abi_ulong num;
     target_siginfo_t info;
 
     for(;;) {
+        update_tsc_aux(env);
         cpu_exec_start(cs);
         trapnr = cpu_exec(cs);
         cpu_exec_end(cs);
@@ -97,8 +130,9 @@ void cpu_loop(CPUX86State *env)
         switch(trapnr) {
         case 0x80:
             /* linux syscall from int $0x80 */
+            num = env->regs[R_EAX];
             ret = do_syscall(env,
-                             env->regs[R_EAX],
+                             num,
                              env->regs[R_EBX],
                              env->regs[R_ECX],
                              env->regs[R_EDX],
@@ -111,12 +145,16 @@ void cpu_loop(CPUX86State *env)
             } else if (ret != -TARGET_QEMU_ESIGRETURN) {
                 env->regs[R_EAX] = ret;
             }
+            if (num == TARGET_NR_sched_setaffinity) {
+                tsc_aux_expire = 0;
+            }
             break;
 #ifndef TARGET_ABI32
         case EXCP_SYSCALL:
             /* linux syscall from syscall instruction */
+            num = env->regs[R_EAX];
             ret = do_syscall(env,
-                             env->regs[R_EAX],
+                             num,
                              env->regs[R_EDI],
                              env->regs[R_ESI],
                              env->regs[R_EDX],
@@ -129,6 +167,9 @@ void cpu_loop(CPUX86State *env)
             } else if (ret != -TARGET_QEMU_ESIGRETURN) {
                 env->regs[R_EAX] = ret;
             }
+            if (num == TARGET_NR_sched_setaffinity) {
+                tsc_aux_expire = 0;
+            }
             break;
 #endif
         case EXCP0B_NOSEG:
@@ -225,6 +266,9 @@ void cpu_loop(CPUX86State *env)
             /* just indicate that signals should be handled asap */
             break;
         case EXCP_DEBUG:
+            if (passthrough_call(env)) {
+                break;
+            }
             info.si_signo = TARGET_SIGTRAP;
             info.si_errno = 0;
             info.si_code = TARGET_TRAP_BRKPT;
@@ -35,6 +35,7 @@
 #include "qemu/envlist.h"
 #include "elf.h"
 #include "trace/control.h"
+#include "qemu/exec-trace.h"
 #include "target_elf.h"
 #include "cpu_loop-common.h"
 
@@ -115,11 +116,15 @@ void fork_start(void)
     start_exclusive();
     mmap_fork_start();
     cpu_list_lock();
+    vdso_fork_start();
+    exec_trace_fork_start();
 }
 
 void fork_end(int child)
 {
     mmap_fork_end(child);
+    vdso_fork_end(child);
+    exec_trace_fork_end(child, thread_cpu->exec_trace);
     if (child) {
         CPUState *cpu, *next_cpu;
         /* Child processes created by fork() only have a single thread.
@@ -131,6 +136,10 @@ void fork_end(int child)
         }
         qemu_init_cpu_list();
         gdbserver_fork(thread_cpu);
+        if (exec_trace_enabled) {
+            /* Define the translation blocks again in the child's trace */
+            tb_flush(thread_cpu);
+        }
         /* qemu_init_cpu_list() takes care of reinitializing the
          * exclusive state, so we don't need to end_exclusive() here.
          */
@@ -385,6 +394,33 @@ static void handle_arg_trace(const char *arg)
     trace_file = trace_opt_parse(arg);
 }
 
+static void handle_arg_exec_trace(const char *arg)
+{
+    exec_trace_opt_parse(arg);
+}
+
+static void handle_arg_passthrough(const char *arg)
+{
+    passthrough_parse(arg);
+}
+
+static void handle_arg_no_vdso(const char *arg)
+{
+    vdso_enabled = false;
+}
+
+static const char *zygote_path;
+static void handle_arg_zygote(const char *arg)
+{
+    zygote_path = arg;
+}
+
+static const char *zygote_server_path;
+static void handle_arg_zygote_server(const char *arg)
+{
+    zygote_server_path = arg;
+}
+
 struct qemu_argument {
     const char *argv;
     const char *env;
@@ -436,6 +472,19 @@ static const struct qemu_argument arg_table[] = {
      "",           "Seed for pseudo-random number generator"},
     {"trace",      "QEMU_TRACE",       true,  handle_arg_trace,
      "",           "[[enable=]<pattern>][,events=<file>][,file=<file>]"},
+    {"exec-trace", "QEMU_EXEC_TRACE",  true,  handle_arg_exec_trace,
+     "",           "[file=]<file>[,mem=on|off] binary execution trace"},
+    {"passthrough", "QEMU_PASSTHROUGH", true, handle_arg_passthrough,
+     "func[,...]", "run library functions on the host "
+     "(use '-passthrough help' for a list)"},
+    {"no-vdso",    "QEMU_NO_VDSO",     false, handle_arg_no_vdso,
+     "",           "do not map a vDSO, so that all system calls are made"},
+    {"zygote",     "QEMU_ZYGOTE",      true,  handle_arg_zygote,
+     "path",       "run the program in a process forked by the zygote "
+     "listening on 'path'"},
+    {"zygote-server", "",              true,  handle_arg_zygote_server,
+     "path",       "pre-initialize, then fork a process for each request "
+     "received on 'path'"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -574,6 +623,10 @@ static int parse_args(int argc, char **argv)
     }
 
     if (optind >= argc) {
+        if (zygote_server_path) {
+            /* the program will come with each request */
+            return optind;
+        }
         (void) fprintf(stderr, "qemu: no user program specified\n");
         exit(EXIT_FAILURE);
     }
@@ -598,7 +651,8 @@ int main(int argc, char **argv, char **envp)
     int target_argc;
     int i;
     int ret;
-    int execfd;
+    int execfd = 0;
+    bool tcg_initialized = false;
 
     module_call_init(MODULE_INIT_TRACE);
     qemu_init_cpu_list();
@@ -627,13 +681,40 @@ int main(int argc, char **argv, char **envp)
     srand(time(NULL));
 
     qemu_add_opts(&qemu_trace_opts);
+    qemu_add_opts(&qemu_exec_trace_opts);
 
     optind = parse_args(argc, argv);
 
+    if (zygote_server_path) {
+        /* Do the program independent initialization once and for all */
+        tcg_exec_init(0);
+        tcg_initialized = true;
+
+        /* Returns in a child process, with the command line of a client */
+        zygote_server(zygote_server_path, &argc, &argv, &execfd);
+        envlist_free(envlist);
+        envlist = envlist_create();
+        for (wrk = environ; *wrk != NULL; wrk++) {
+            (void) envlist_setenv(envlist, *wrk);
+        }
+        zygote_server_path = NULL;
+        optind = parse_args(argc, argv);
+    } else if (zygote_path) {
+        /* Only returns if the zygote could not be reached */
+        zygote_client(zygote_path, argc, argv, environ);
+    }
+
     if (!trace_init_backends()) {
         exit(1);
     }
     trace_init_file(trace_file);
+    exec_trace_init(&error_fatal);
+
+    /* Passthrough breakpoints would be removed by a debugger detaching */
+    if (gdbstub_port) {
+        passthrough_disable();
+    }
+    passthrough_init();
 
     /* Zero out regs */
     memset(regs, 0, sizeof(struct target_pt_regs));
@@ -648,7 +729,9 @@ int main(int argc, char **argv, char **envp)
 
     init_qemu_uname_release();
 
-    execfd = qemu_getauxval(AT_EXECFD);
+    if (execfd == 0) {
+        execfd = qemu_getauxval(AT_EXECFD);
+    }
     if (execfd == 0) {
         execfd = open(filename, O_RDONLY);
         if (execfd < 0) {
@@ -663,7 +746,9 @@ int main(int argc, char **argv, char **envp)
     cpu_type = parse_cpu_model(cpu_model);
 
     /* init tcg before creating CPUs and to get qemu_host_page_size */
-    tcg_exec_init(0);
+    if (!tcg_initialized) {
+        tcg_exec_init(0);
+    }
 
     /* Reserving *too* much vm space via mmap can run into problems
        with rlimits, oom due to page table creation, etc.  We will still try it,
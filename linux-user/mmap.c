@@ -206,7 +206,7 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
 {
     abi_ulong addr;
     abi_ulong end_addr;
-    int prot;
+    target_ulong mapped;
     int looped = 0;
 
     if (size > reserved_va) {
@@ -218,26 +218,22 @@ static abi_ulong mmap_find_vma_reserved(abi_ulong start, abi_ulong size)
     if (end_addr > reserved_va) {
         end_addr = reserved_va;
     }
-    addr = end_addr - qemu_host_page_size;
 
     while (1) {
-        if (addr > end_addr) {
+        addr = end_addr - size;
+        if (addr > end_addr || addr == 0) {
             if (looped) {
                 return (abi_ulong)-1;
             }
             end_addr = reserved_va;
-            addr = end_addr - qemu_host_page_size;
             looped = 1;
             continue;
         }
-        prot = page_get_flags(addr);
-        if (prot) {
-            end_addr = addr;
-        }
-        if (addr && addr + size == end_addr) {
+        /* Skip below the lowest mapping in the way, if any */
+        if (!page_find_mapped(addr, end_addr - 1, &mapped)) {
             break;
         }
-        addr -= qemu_host_page_size;
+        end_addr = mapped & qemu_host_page_mask;
     }
 
     if (start == mmap_next_start) {
@@ -570,6 +566,8 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
     printf("\n");
 #endif
     tb_invalidate_phys_range(start, start + len);
+    passthrough_mmap(start, len, prot, fd, offset);
+    vdso_munmap(start, len);
     mmap_unlock();
     return start;
 fail:
@@ -677,6 +675,8 @@ int target_munmap(abi_ulong start, abi_ulong len)
     if (ret == 0) {
         page_set_flags(start, start + len, 0);
         tb_invalidate_phys_range(start, start + len);
+        passthrough_munmap(start, len);
+        vdso_munmap(start, len);
     }
     mmap_unlock();
     return ret;
@@ -757,6 +757,7 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
         prot = page_get_flags(old_addr);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        vdso_munmap(old_addr, old_size);
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size);
     mmap_unlock();
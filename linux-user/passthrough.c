@@ -0,0 +1,696 @@
+/*
+ *  Host library passthrough for user mode emulation
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Calls to a configured set of well-known library functions (string and
+ * memory functions, libm, zlib checksums) are served by the host library
+ * instead of translating the guest implementation.
+ *
+ * Whenever the guest maps an executable segment of a shared object, its
+ * dynamic symbol table is scanned and a debug breakpoint is planted at the
+ * entry of every passthrough function.  Hitting the breakpoint makes
+ * cpu_exec() return EXCP_DEBUG to cpu_loop(), which calls passthrough_call()
+ * to fetch the arguments following the target calling convention, run the
+ * host function and emulate the return to the caller.
+ *
+ * glibc selects the implementation of most string functions at load time
+ * through GNU indirect functions.  For those, the resolver is intercepted
+ * instead and returns a slot in a guest page owned by QEMU; the slots carry
+ * breakpoints of their own, so that calls through the PLT end up here too.
+ *
+ * Symbols that are not in the table are never intercepted and keep running
+ * as translated code.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include <zlib.h>
+#include "qemu.h"
+#include "qom/cpu.h"
+
+#if defined(TARGET_X86_64) || defined(TARGET_AARCH64)
+#define PASSTHROUGH_SUPPORTED
+#endif
+
+#define PT_NARGS 6
+
+typedef enum {
+    PT_INT,         /* integer and pointer arguments and return value */
+    PT_D_D,         /* double f(double) */
+    PT_D_DD,        /* double f(double, double) */
+    PT_F_F,         /* float f(float) */
+} PassthroughKind;
+
+typedef struct PassthroughFunc {
+    const char *name;
+    PassthroughKind kind;
+    union {
+        /* Returns 0 or a negative target errno if the arguments are bad */
+        abi_long (*i)(const abi_ulong *args, abi_ulong *ret);
+        double (*d_d)(double);
+        double (*d_dd)(double, double);
+        float (*f_f)(float);
+    };
+} PassthroughFunc;
+
+typedef struct PassthroughSite {
+    uint64_t addr;                  /* hash key, must be first */
+    const PassthroughFunc *func;
+    bool resolver;                  /* addr is a GNU ifunc resolver */
+    bool slot;                      /* addr is in passthrough_slots */
+} PassthroughSite;
+
+typedef union {
+    double d;
+    uint64_t ll;
+} PassthroughDouble;
+
+typedef union {
+    float f;
+    uint32_t l;
+} PassthroughFloat;
+
+static bool passthrough_enabled;
+static bool passthrough_all;
+static GHashTable *passthrough_names;   /* enabled function names */
+
+static abi_long pt_memcpy(const abi_ulong *args, abi_ulong *ret)
+{
+    if (!access_ok(VERIFY_WRITE, args[0], args[2]) ||
+        !access_ok(VERIFY_READ, args[1], args[2])) {
+        return -TARGET_EFAULT;
+    }
+    memcpy(g2h(args[0]), g2h(args[1]), args[2]);
+    *ret = args[0];
+    return 0;
+}
+
+static abi_long pt_memmove(const abi_ulong *args, abi_ulong *ret)
+{
+    if (!access_ok(VERIFY_WRITE, args[0], args[2]) ||
+        !access_ok(VERIFY_READ, args[1], args[2])) {
+        return -TARGET_EFAULT;
+    }
+    memmove(g2h(args[0]), g2h(args[1]), args[2]);
+    *ret = args[0];
+    return 0;
+}
+
+static abi_long pt_memset(const abi_ulong *args, abi_ulong *ret)
+{
+    if (!access_ok(VERIFY_WRITE, args[0], args[2])) {
+        return -TARGET_EFAULT;
+    }
+    memset(g2h(args[0]), args[1], args[2]);
+    *ret = args[0];
+    return 0;
+}
+
+static abi_long pt_memcmp(const abi_ulong *args, abi_ulong *ret)
+{
+    if (!access_ok(VERIFY_READ, args[0], args[2]) ||
+        !access_ok(VERIFY_READ, args[1], args[2])) {
+        return -TARGET_EFAULT;
+    }
+    *ret = (abi_long)memcmp(g2h(args[0]), g2h(args[1]), args[2]);
+    return 0;
+}
+
+static abi_long pt_memchr(const abi_ulong *args, abi_ulong *ret)
+{
+    void *p;
+
+    if (!access_ok(VERIFY_READ, args[0], args[2])) {
+        return -TARGET_EFAULT;
+    }
+    p = memchr(g2h(args[0]), args[1], args[2]);
+    *ret = p ? h2g(p) : 0;
+    return 0;
+}
+
+static abi_long pt_strlen(const abi_ulong *args, abi_ulong *ret)
+{
+    abi_long len = target_strlen(args[0]);
+
+    if (len < 0) {
+        return len;
+    }
+    *ret = len;
+    return 0;
+}
+
+static abi_long pt_strcmp(const abi_ulong *args, abi_ulong *ret)
+{
+    if (target_strlen(args[0]) < 0 || target_strlen(args[1]) < 0) {
+        return -TARGET_EFAULT;
+    }
+    *ret = (abi_long)strcmp(g2h(args[0]), g2h(args[1]));
+    return 0;
+}
+
+static abi_long pt_strcpy(const abi_ulong *args, abi_ulong *ret)
+{
+    abi_long len = target_strlen(args[1]);
+
+    if (len < 0 || !access_ok(VERIFY_WRITE, args[0], len + 1)) {
+        return -TARGET_EFAULT;
+    }
+    memmove(g2h(args[0]), g2h(args[1]), len + 1);
+    *ret = args[0];
+    return 0;
+}
+
+static abi_long pt_strchr(const abi_ulong *args, abi_ulong *ret)
+{
+    char *p;
+
+    if (target_strlen(args[0]) < 0) {
+        return -TARGET_EFAULT;
+    }
+    p = strchr(g2h(args[0]), args[1]);
+    *ret = p ? h2g(p) : 0;
+    return 0;
+}
+
+static abi_long pt_strrchr(const abi_ulong *args, abi_ulong *ret)
+{
+    char *p;
+
+    if (target_strlen(args[0]) < 0) {
+        return -TARGET_EFAULT;
+    }
+    p = strrchr(g2h(args[0]), args[1]);
+    *ret = p ? h2g(p) : 0;
+    return 0;
+}
+
+static abi_long pt_crc32(const abi_ulong *args, abi_ulong *ret)
+{
+    uInt len = args[2];
+
+    if (!args[1]) {
+        *ret = crc32(args[0], NULL, 0);
+        return 0;
+    }
+    if (!access_ok(VERIFY_READ, args[1], len)) {
+        return -TARGET_EFAULT;
+    }
+    *ret = crc32(args[0], g2h(args[1]), len);
+    return 0;
+}
+
+static abi_long pt_adler32(const abi_ulong *args, abi_ulong *ret)
+{
+    uInt len = args[2];
+
+    if (!args[1]) {
+        *ret = adler32(args[0], NULL, 0);
+        return 0;
+    }
+    if (!access_ok(VERIFY_READ, args[1], len)) {
+        return -TARGET_EFAULT;
+    }
+    *ret = adler32(args[0], g2h(args[1]), len);
+    return 0;
+}
+
+static const PassthroughFunc passthrough_funcs[] = {
+    /* libc */
+    { "memcpy", PT_INT, { .i = pt_memcpy } },
+    { "memmove", PT_INT, { .i = pt_memmove } },
+    { "memset", PT_INT, { .i = pt_memset } },
+    { "memcmp", PT_INT, { .i = pt_memcmp } },
+    { "bcmp", PT_INT, { .i = pt_memcmp } },
+    { "memchr", PT_INT, { .i = pt_memchr } },
+    { "strlen", PT_INT, { .i = pt_strlen } },
+    { "strcmp", PT_INT, { .i = pt_strcmp } },
+    { "strcpy", PT_INT, { .i = pt_strcpy } },
+    { "strchr", PT_INT, { .i = pt_strchr } },
+    { "strrchr", PT_INT, { .i = pt_strrchr } },
+    /* libm */
+    { "sin", PT_D_D, { .d_d = sin } },
+    { "cos", PT_D_D, { .d_d = cos } },
+    { "tan", PT_D_D, { .d_d = tan } },
+    { "asin", PT_D_D, { .d_d = asin } },
+    { "acos", PT_D_D, { .d_d = acos } },
+    { "atan", PT_D_D, { .d_d = atan } },
+    { "sinh", PT_D_D, { .d_d = sinh } },
+    { "cosh", PT_D_D, { .d_d = cosh } },
+    { "tanh", PT_D_D, { .d_d = tanh } },
+    { "exp", PT_D_D, { .d_d = exp } },
+    { "exp2", PT_D_D, { .d_d = exp2 } },
+    { "expm1", PT_D_D, { .d_d = expm1 } },
+    { "log", PT_D_D, { .d_d = log } },
+    { "log2", PT_D_D, { .d_d = log2 } },
+    { "log10", PT_D_D, { .d_d = log10 } },
+    { "log1p", PT_D_D, { .d_d = log1p } },
+    { "sqrt", PT_D_D, { .d_d = sqrt } },
+    { "cbrt", PT_D_D, { .d_d = cbrt } },
+    { "pow", PT_D_DD, { .d_dd = pow } },
+    { "atan2", PT_D_DD, { .d_dd = atan2 } },
+    { "hypot", PT_D_DD, { .d_dd = hypot } },
+    { "fmod", PT_D_DD, { .d_dd = fmod } },
+    { "sinf", PT_F_F, { .f_f = sinf } },
+    { "cosf", PT_F_F, { .f_f = cosf } },
+    { "expf", PT_F_F, { .f_f = expf } },
+    { "logf", PT_F_F, { .f_f = logf } },
+    { "sqrtf", PT_F_F, { .f_f = sqrtf } },
+    /* zlib */
+    { "crc32", PT_INT, { .i = pt_crc32 } },
+    { "adler32", PT_INT, { .i = pt_adler32 } },
+};
+
+#if defined(TARGET_X86_64)
+
+static abi_ulong pt_get_pc(CPUArchState *env)
+{
+    return env->eip;
+}
+
+static void pt_get_args(CPUArchState *env, abi_ulong *args)
+{
+    static const int regs[PT_NARGS] = { R_EDI, R_ESI, R_EDX, R_ECX, 8, 9 };
+    int i;
+
+    for (i = 0; i < PT_NARGS; i++) {
+        args[i] = env->regs[regs[i]];
+    }
+}
+
+static double pt_get_double(CPUArchState *env, int n)
+{
+    PassthroughDouble u = { .ll = env->xmm_regs[n].ZMM_Q(0) };
+
+    return u.d;
+}
+
+static float pt_get_float(CPUArchState *env, int n)
+{
+    PassthroughFloat u = { .l = env->xmm_regs[n].ZMM_L(0) };
+
+    return u.f;
+}
+
+static void pt_set_ret(CPUArchState *env, abi_ulong val)
+{
+    env->regs[R_EAX] = val;
+}
+
+static void pt_set_double(CPUArchState *env, double val)
+{
+    PassthroughDouble u = { .d = val };
+
+    env->xmm_regs[0].ZMM_Q(0) = u.ll;
+}
+
+static void pt_set_float(CPUArchState *env, float val)
+{
+    PassthroughFloat u = { .f = val };
+
+    env->xmm_regs[0].ZMM_L(0) = u.l;
+}
+
+static bool pt_return(CPUArchState *env)
+{
+    abi_ulong ra;
+
+    if (get_user_u64(ra, env->regs[R_ESP])) {
+        return false;
+    }
+    env->regs[R_ESP] += 8;
+    env->eip = ra;
+    return true;
+}
+
+#elif defined(TARGET_AARCH64)
+
+static abi_ulong pt_get_pc(CPUArchState *env)
+{
+    return env->pc;
+}
+
+static void pt_get_args(CPUArchState *env, abi_ulong *args)
+{
+    int i;
+
+    for (i = 0; i < PT_NARGS; i++) {
+        args[i] = env->xregs[i];
+    }
+}
+
+static double pt_get_double(CPUArchState *env, int n)
+{
+    PassthroughDouble u = { .ll = aa64_vfp_qreg(env, n)[0] };
+
+    return u.d;
+}
+
+static float pt_get_float(CPUArchState *env, int n)
+{
+    PassthroughFloat u = { .l = aa64_vfp_qreg(env, n)[0] };
+
+    return u.f;
+}
+
+static void pt_set_ret(CPUArchState *env, abi_ulong val)
+{
+    env->xregs[0] = val;
+}
+
+/* Writing a scalar FP register clears the rest of the vector register */
+static void pt_set_double(CPUArchState *env, double val)
+{
+    PassthroughDouble u = { .d = val };
+    uint64_t *q = aa64_vfp_qreg(env, 0);
+
+    q[0] = u.ll;
+    q[1] = 0;
+}
+
+static void pt_set_float(CPUArchState *env, float val)
+{
+    PassthroughFloat u = { .f = val };
+    uint64_t *q = aa64_vfp_qreg(env, 0);
+
+    q[0] = u.l;
+    q[1] = 0;
+}
+
+static bool pt_return(CPUArchState *env)
+{
+    env->pc = env->xregs[30];
+    return true;
+}
+
+#endif
+
+#ifdef PASSTHROUGH_SUPPORTED
+/* All of the following are protected by mmap_lock */
+static GHashTable *passthrough_sites;   /* guest address -> site */
+static abi_ulong passthrough_slots;     /* guest page holding ifunc slots */
+static abi_ulong passthrough_slot_addr[ARRAY_SIZE(passthrough_funcs)];
+#endif
+
+void passthrough_parse(const char *arg)
+{
+    gchar **names, **p;
+    size_t i;
+
+    if (!passthrough_names) {
+        passthrough_names = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    names = g_strsplit(arg, ",", -1);
+    for (p = names; *p; p++) {
+        if (!**p) {
+            continue;
+        }
+        if (!strcmp(*p, "help")) {
+            printf("Functions that can be passed through to the host:\n");
+            for (i = 0; i < ARRAY_SIZE(passthrough_funcs); i++) {
+                printf("%s\n", passthrough_funcs[i].name);
+            }
+            exit(EXIT_SUCCESS);
+        }
+        if (!strcmp(*p, "all")) {
+            passthrough_all = true;
+            continue;
+        }
+        for (i = 0; i < ARRAY_SIZE(passthrough_funcs); i++) {
+            if (!strcmp(*p, passthrough_funcs[i].name)) {
+                g_hash_table_add(passthrough_names,
+                                 (gpointer)passthrough_funcs[i].name);
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(passthrough_funcs)) {
+            fprintf(stderr, "qemu: unknown passthrough function '%s'\n", *p);
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_strfreev(names);
+    passthrough_enabled = true;
+}
+
+void passthrough_init(void)
+{
+#ifdef PASSTHROUGH_SUPPORTED
+    if (passthrough_enabled) {
+        passthrough_sites = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                  NULL, g_free);
+    }
+#else
+    if (passthrough_enabled) {
+        fprintf(stderr, "qemu: host library passthrough is not supported "
+                "for this target\n");
+        passthrough_enabled = false;
+    }
+#endif
+}
+
+void passthrough_disable(void)
+{
+    passthrough_enabled = false;
+}
+
+#ifdef PASSTHROUGH_SUPPORTED
+
+static void passthrough_bp_insert(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUState *other;
+
+    CPU_FOREACH(other) {
+        cpu_breakpoint_insert(other, data.target_ptr, BP_GDB, NULL);
+    }
+}
+
+static void passthrough_bp_remove(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUState *other;
+
+    CPU_FOREACH(other) {
+        cpu_breakpoint_remove(other, data.target_ptr, BP_GDB);
+    }
+}
+
+/*
+ * Breakpoint lists are not protected against concurrent translation, so
+ * other threads must be stopped while they are updated.  Libraries are
+ * normally loaded before the first thread is created, in which case the
+ * update can be done right away.
+ */
+static void passthrough_bp_update(abi_ulong addr, bool insert)
+{
+    run_on_cpu_func func = insert ? passthrough_bp_insert
+                                  : passthrough_bp_remove;
+
+    if (thread_cpu && CPU_NEXT(first_cpu)) {
+        async_safe_run_on_cpu(thread_cpu, func, RUN_ON_CPU_TARGET_PTR(addr));
+    } else {
+        func(first_cpu, RUN_ON_CPU_TARGET_PTR(addr));
+    }
+}
+
+static const PassthroughFunc *passthrough_find(const char *name)
+{
+    size_t i;
+
+    if (!passthrough_all && !g_hash_table_contains(passthrough_names, name)) {
+        return NULL;
+    }
+    for (i = 0; i < ARRAY_SIZE(passthrough_funcs); i++) {
+        if (!strcmp(name, passthrough_funcs[i].name)) {
+            return &passthrough_funcs[i];
+        }
+    }
+    return NULL;
+}
+
+static void passthrough_add_site(abi_ulong addr, const PassthroughFunc *func,
+                                 bool resolver, bool slot)
+{
+    PassthroughSite *site;
+
+    if (g_hash_table_contains(passthrough_sites, &(uint64_t){ addr })) {
+        return;
+    }
+    site = g_new0(PassthroughSite, 1);
+    site->addr = addr;
+    site->func = func;
+    site->resolver = resolver;
+    site->slot = slot;
+    g_hash_table_insert(passthrough_sites, &site->addr, site);
+    passthrough_bp_update(addr, true);
+}
+
+/* Returns the guest address that calls to an ifunc'ed @func resolve to */
+static abi_ulong passthrough_slot(const PassthroughFunc *func)
+{
+    size_t idx = func - passthrough_funcs;
+
+    if (!passthrough_slots) {
+        abi_long page = target_mmap(0, TARGET_PAGE_SIZE, PROT_READ | PROT_EXEC,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (page == -1) {
+            return 0;
+        }
+        passthrough_slots = page;
+    }
+    if (!passthrough_slot_addr[idx]) {
+        /* One instruction-aligned slot per function; nothing is ever run */
+        passthrough_slot_addr[idx] = passthrough_slots + idx * 16;
+        passthrough_add_site(passthrough_slot_addr[idx], func, false, true);
+    }
+    return passthrough_slot_addr[idx];
+}
+
+static void passthrough_add_func(const char *name, abi_ulong addr,
+                                 bool ifunc, void *opaque)
+{
+    const PassthroughFunc *func = passthrough_find(name);
+
+    if (!func) {
+        return;
+    }
+    if (ifunc && !passthrough_slot(func)) {
+        return;
+    }
+    qemu_log_mask(CPU_LOG_PAGE, "passthrough: %s%s at 0x" TARGET_ABI_FMT_lx
+                  "\n", name, ifunc ? " (ifunc)" : "", addr);
+    passthrough_add_site(addr, func, ifunc, false);
+}
+
+static gboolean passthrough_site_in_range(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    PassthroughSite *site = value;
+    abi_ulong *range = opaque;
+
+    if (!site->slot && site->addr >= range[0] && site->addr < range[1]) {
+        passthrough_bp_update(site->addr, false);
+        return true;
+    }
+    return false;
+}
+
+/* Called with mmap_lock held */
+void passthrough_munmap(abi_ulong start, abi_ulong len)
+{
+    abi_ulong range[2] = { start, start + len };
+
+    if (!passthrough_enabled || !passthrough_sites) {
+        return;
+    }
+    g_hash_table_foreach_remove(passthrough_sites, passthrough_site_in_range,
+                                range);
+}
+
+/* Called with mmap_lock held */
+void passthrough_mmap(abi_ulong start, abi_ulong len, int prot, int fd,
+                      abi_ulong offset)
+{
+    if (!passthrough_enabled || !passthrough_sites) {
+        return;
+    }
+    passthrough_munmap(start, len);
+    if (fd < 0 || !(prot & PROT_EXEC)) {
+        return;
+    }
+    elf_foreach_dynamic_func(fd, offset, start, len, passthrough_add_func,
+                             NULL);
+}
+
+bool passthrough_call(CPUArchState *env)
+{
+    PassthroughSite *site;
+    const PassthroughFunc *func;
+    abi_ulong args[PT_NARGS];
+    abi_ulong ret;
+    uint64_t pc;
+    bool resolver;
+    abi_long err;
+
+    if (!passthrough_enabled) {
+        return false;
+    }
+
+    pc = pt_get_pc(env);
+    mmap_lock();
+    site = g_hash_table_lookup(passthrough_sites, &pc);
+    func = site ? site->func : NULL;
+    resolver = site && site->resolver;
+    ret = resolver ? passthrough_slot_addr[func - passthrough_funcs] : 0;
+    mmap_unlock();
+    if (!func) {
+        return false;
+    }
+
+    if (resolver) {
+        pt_set_ret(env, ret);
+        return pt_return(env);
+    }
+
+    switch (func->kind) {
+    case PT_INT:
+        pt_get_args(env, args);
+        err = func->i(args, &ret);
+        if (err) {
+            target_siginfo_t info = {
+                .si_signo = TARGET_SIGSEGV,
+                .si_code = TARGET_SEGV_MAPERR,
+            };
+
+            /* Same outcome as running the guest code on a bad pointer */
+            queue_signal(env, info.si_signo, QEMU_SI_FAULT, &info);
+            return true;
+        }
+        pt_set_ret(env, ret);
+        break;
+    case PT_D_D:
+        pt_set_double(env, func->d_d(pt_get_double(env, 0)));
+        break;
+    case PT_D_DD:
+        pt_set_double(env, func->d_dd(pt_get_double(env, 0),
+                                      pt_get_double(env, 1)));
+        break;
+    case PT_F_F:
+        pt_set_float(env, func->f_f(pt_get_float(env, 0)));
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    return pt_return(env);
+}
+
+#else
+
+void passthrough_mmap(abi_ulong start, abi_ulong len, int prot, int fd,
+                      abi_ulong offset)
+{
+}
+
+void passthrough_munmap(abi_ulong start, abi_ulong len)
+{
+}
+
+bool passthrough_call(CPUArchState *env)
+{
+    return false;
+}
+
+#endif
@@ -52,6 +52,7 @@ struct image_info {
         uint32_t        elf_flags;
         int		personality;
         abi_ulong       alignment;
+        abi_ulong       vdso;
 
         /* The fields below are used in FDPIC mode.  */
         abi_ulong       loadmap_addr;
@@ -198,6 +199,11 @@ int loader_exec(int fdexec, const char *filename, char **argv, char **envp,
 int info_is_fdpic(struct image_info *info);
 
 uint32_t get_elf_eflags(int fd);
+typedef void (*elf_dynamic_func_fn)(const char *name, abi_ulong addr,
+                                    bool ifunc, void *opaque);
+void elf_foreach_dynamic_func(int fd, abi_ulong offset, abi_ulong start,
+                              abi_ulong len, elf_dynamic_func_fn fn,
+                              void *opaque);
 int load_elf_binary(struct linux_binprm *bprm, struct image_info *info);
 int load_flt_binary(struct linux_binprm *bprm, struct image_info *info);
 
@@ -450,6 +456,26 @@ void mmap_fork_end(int child);
 /* main.c */
 extern unsigned long guest_stack_size;
 
+/* passthrough.c */
+void passthrough_parse(const char *arg);
+void passthrough_init(void);
+void passthrough_disable(void);
+void passthrough_mmap(abi_ulong start, abi_ulong len, int prot, int fd,
+                      abi_ulong offset);
+void passthrough_munmap(abi_ulong start, abi_ulong len);
+bool passthrough_call(CPUArchState *env);
+
+/* vdso.c */
+extern bool vdso_enabled;
+abi_ulong vdso_load(void);
+void vdso_munmap(abi_ulong start, abi_ulong len);
+void vdso_fork_start(void);
+void vdso_fork_end(int child);
+
+/* zygote.c */
+void zygote_client(const char *path, int argc, char **argv, char **envp);
+void zygote_server(const char *path, int *pargc, char ***pargv, int *pexecfd);
+
 /* user access */
 
 #define VERIFY_READ 0
@@ -111,6 +111,7 @@
 
 #include "qemu.h"
 #include "fd-trans.h"
+#include "qemu/exec-trace.h"
 
 #ifndef CLONE_IO
 #define CLONE_IO                0x80000000      /* Clone io context */
@@ -6994,6 +6995,7 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
                           NULL, NULL, 0);
             }
             thread_cpu = NULL;
+            exec_trace_buffer_release(cpu->exec_trace);
             object_unref(OBJECT(cpu));
             g_free(ts);
             rcu_unregister_thread();
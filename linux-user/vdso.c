@@ -0,0 +1,341 @@
+/*
+ *  Guest vDSO for user mode emulation
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Like the kernel, QEMU maps a small shared library into every guest
+ * process and passes its address in AT_SYSINFO_EHDR.  The C library then
+ * resolves clock_gettime, gettimeofday, time and getcpu to it, so that
+ * these calls run as translated code instead of going through the system
+ * call emulation.
+ *
+ * The vDSO computes the time from the guest cycle counter, which under
+ * TCG is the host's, and from a time page laid out as described in
+ * vdso.h.  A thread keeps the page in sync with the host clocks: it
+ * measures the counter frequency over each update interval and picks the
+ * next scaling factor so that the guest clocks stay continuous and
+ * monotonic while converging to the host clocks by the following update.
+ * When the page cannot be trusted the vDSO simply makes the system call.
+ *
+ * The time page is a memfd mapped read-only into the guest and writable
+ * into QEMU, VDSO_DATA_OFFSET bytes below the image.  The file descriptor
+ * is closed as soon as both mappings exist, so the guest never sees it.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu.h"
+#include "vdso.h"
+
+#if defined(TARGET_X86_64)
+#define HAVE_VDSO
+#include "x86_64/vdso-image.inc"
+#endif
+
+#ifdef HAVE_VDSO
+
+/* Interval between updates of the time page, and before the first one */
+#define VDSO_UPDATE_NS      NANOSECONDS_PER_SECOND
+#define VDSO_CALIBRATE_NS   (10 * SCALE_MS)
+/* Without updates for this long, the guest falls back to system calls */
+#define VDSO_MAX_DELTA_SEC  4
+
+typedef struct VdsoSample {
+    uint64_t cycles;
+    int64_t mono;
+    int64_t real;
+} VdsoSample;
+
+bool vdso_enabled = true;
+
+static abi_ulong vdso_data_addr;
+static uint8_t *vdso_data;
+static uint32_t vdso_flags;
+
+/* Protects the fields below and the time page against fork */
+static QemuMutex vdso_lock;
+static uint32_t vdso_seq;
+static VdsoSample vdso_last;
+static uint64_t vdso_cycle_last;
+static uint64_t vdso_max_delta;
+static uint64_t vdso_mult;
+static int64_t vdso_mono_base;
+
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * NANOSECONDS_PER_SECOND + ts->tv_nsec;
+}
+
+static void vdso_sample(VdsoSample *s)
+{
+    struct timespec mono, real;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    s->cycles = cpu_get_host_ticks();
+    clock_gettime(CLOCK_REALTIME, &real);
+    s->mono = timespec_to_ns(&mono);
+    s->real = timespec_to_ns(&real);
+}
+
+static void vdso_publish(uint32_t flags, int64_t real_base)
+{
+    uint8_t *p = vdso_data;
+
+    stl_le_p(p + VDSO_SEQ, ++vdso_seq);
+    smp_wmb();
+    stl_le_p(p + VDSO_FLAGS, flags);
+    stq_le_p(p + VDSO_CYCLE_LAST, vdso_cycle_last);
+    stq_le_p(p + VDSO_MAX_DELTA, vdso_max_delta);
+    stq_le_p(p + VDSO_MULT, vdso_mult);
+    stl_le_p(p + VDSO_SHIFT, 32);
+    stq_le_p(p + VDSO_MONO_BASE, vdso_mono_base);
+    stq_le_p(p + VDSO_REAL_BASE, real_base);
+    smp_wmb();
+    stl_le_p(p + VDSO_SEQ, ++vdso_seq);
+}
+
+static void vdso_update(void)
+{
+    VdsoSample now;
+    int64_t elapsed, base, skew;
+    uint64_t delta, hz, interval_cycles;
+
+    vdso_sample(&now);
+    delta = now.cycles - vdso_last.cycles;
+    elapsed = now.mono - vdso_last.mono;
+    vdso_last = now;
+
+    if (elapsed <= 0 || elapsed > UINT32_MAX || (int64_t)delta <= 0) {
+        /*
+         * The counter does not work or went backwards, or this thread did
+         * not run for so long that the guest already uses system calls.
+         */
+        vdso_publish(vdso_flags & ~VDSO_F_CLOCK, 0);
+        return;
+    }
+    hz = muldiv64(delta, NANOSECONDS_PER_SECOND, elapsed);
+    interval_cycles = muldiv64(hz, VDSO_UPDATE_NS, NANOSECONDS_PER_SECOND);
+    if (interval_cycles == 0) {
+        vdso_publish(vdso_flags & ~VDSO_F_CLOCK, 0);
+        return;
+    }
+
+    /* Continue from the time the guest currently computes, if possible */
+    base = now.mono;
+    delta = now.cycles - vdso_cycle_last;
+    if ((vdso_flags & VDSO_F_CLOCK) && vdso_mult && delta <= vdso_max_delta) {
+        uint64_t lo, hi;
+
+        mulu64(&lo, &hi, delta, vdso_mult);
+        base = vdso_mono_base + (int64_t)((lo >> 32) | (hi << 32));
+        if (base < now.mono - VDSO_UPDATE_NS / 2) {
+            /* Too far behind to catch up smoothly, jump forward */
+            base = now.mono;
+        }
+    }
+
+    /* Reach the host clock again by the next update, without going back */
+    skew = MIN(base - now.mono, VDSO_UPDATE_NS / 2);
+    vdso_mult = ((uint64_t)(VDSO_UPDATE_NS - skew) << 32) / interval_cycles;
+    vdso_mono_base = base;
+    vdso_cycle_last = now.cycles;
+    vdso_max_delta = hz * VDSO_MAX_DELTA_SEC;
+    vdso_flags |= VDSO_F_CLOCK;
+    vdso_publish(vdso_flags, base + now.real - now.mono);
+}
+
+static void *vdso_update_thread(void *opaque)
+{
+    int64_t interval = VDSO_CALIBRATE_NS;
+
+    for (;;) {
+        g_usleep(interval / SCALE_US);
+        qemu_mutex_lock(&vdso_lock);
+        vdso_update();
+        qemu_mutex_unlock(&vdso_lock);
+        interval = VDSO_UPDATE_NS;
+    }
+    return NULL;
+}
+
+static void vdso_start_thread(void)
+{
+    QemuThread thread;
+
+    vdso_sample(&vdso_last);
+    qemu_thread_create(&thread, "vdso", vdso_update_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+static uint32_t vdso_target_flags(void)
+{
+#if defined(TARGET_X86_64)
+    CPUX86State *env = thread_cpu->env_ptr;
+
+    /* cpu_loop refreshes TSC_AUX periodically in this case */
+    if (env->features[FEAT_8000_0001_EDX] & CPUID_EXT2_RDTSCP) {
+        return VDSO_F_RDTSCP;
+    }
+#endif
+    return 0;
+}
+
+abi_ulong vdso_load(void)
+{
+    abi_ulong image_size = HOST_PAGE_ALIGN(sizeof(vdso_image));
+    abi_ulong data_size = qemu_host_page_size;
+    abi_ulong addr, image_addr;
+    void *p;
+    int fd;
+
+    if (!vdso_enabled || data_size > VDSO_DATA_OFFSET) {
+        return 0;
+    }
+
+    fd = qemu_memfd_create("qemu-vdso", data_size, false, 0, 0, NULL);
+    if (fd < 0) {
+        return 0;
+    }
+    p = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        goto fail_fd;
+    }
+
+    /* Reserve the whole range, so that the gap stays inaccessible */
+    addr = target_mmap(0, VDSO_DATA_OFFSET + image_size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == -1) {
+        goto fail_unmap;
+    }
+    image_addr = addr + VDSO_DATA_OFFSET;
+    if (target_mmap(addr, data_size, PROT_READ, MAP_SHARED | MAP_FIXED,
+                    fd, 0) == -1 ||
+        target_mmap(image_addr, image_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == -1) {
+        target_munmap(addr, VDSO_DATA_OFFSET + image_size);
+        goto fail_unmap;
+    }
+    memcpy(g2h(image_addr), vdso_image, sizeof(vdso_image));
+    target_mprotect(image_addr, image_size, PROT_READ | PROT_EXEC);
+    close(fd);
+
+    vdso_data = p;
+    vdso_data_addr = addr;
+    vdso_flags = vdso_target_flags();
+    qemu_mutex_init(&vdso_lock);
+    vdso_start_thread();
+    return image_addr;
+
+fail_unmap:
+    munmap(p, data_size);
+fail_fd:
+    close(fd);
+    return 0;
+}
+
+void vdso_munmap(abi_ulong start, abi_ulong len)
+{
+    if (vdso_data_addr &&
+        vdso_data_addr < start + len &&
+        start < vdso_data_addr + qemu_host_page_size) {
+        /* The guest no longer sees the time page at its original address */
+        vdso_data_addr = 0;
+    }
+}
+
+void vdso_fork_start(void)
+{
+    if (vdso_data) {
+        qemu_mutex_lock(&vdso_lock);
+    }
+}
+
+/*
+ * The child must not share the time page with its parent, whose updates
+ * it cannot synchronize with; give it a copy and an update thread of its
+ * own.  If the guest has unmapped or moved the page, the child simply
+ * keeps reading the parent's page, which is never written by the child.
+ */
+void vdso_fork_end(int child)
+{
+    size_t data_size = qemu_host_page_size;
+    void *p;
+    int fd;
+
+    if (!vdso_data) {
+        return;
+    }
+    if (!child) {
+        qemu_mutex_unlock(&vdso_lock);
+        return;
+    }
+
+    qemu_mutex_init(&vdso_lock);
+    if (!vdso_data_addr) {
+        goto fail;
+    }
+    fd = qemu_memfd_create("qemu-vdso", data_size, false, 0, 0, NULL);
+    if (fd < 0) {
+        goto fail;
+    }
+    p = mmap(NULL, data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        goto fail;
+    }
+    memcpy(p, vdso_data, data_size);
+    if (mmap(g2h(vdso_data_addr), data_size, PROT_READ,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        /* The old mapping is still in place */
+        munmap(p, data_size);
+        close(fd);
+        goto fail;
+    }
+    close(fd);
+    munmap(vdso_data, data_size);
+    vdso_data = p;
+    vdso_start_thread();
+    return;
+
+fail:
+    vdso_data = NULL;
+}
+
+#else
+
+bool vdso_enabled;
+
+abi_ulong vdso_load(void)
+{
+    return 0;
+}
+
+void vdso_munmap(abi_ulong start, abi_ulong len)
+{
+}
+
+void vdso_fork_start(void)
+{
+}
+
+void vdso_fork_end(int child)
+{
+}
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Layout of the time page shared between QEMU and the guest vDSO
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef LINUX_USER_VDSO_H
+#define LINUX_USER_VDSO_H
+
+/*
+ * This file is included by the vDSO assembly sources, so it may only
+ * contain preprocessor definitions.
+ *
+ * The guest maps the time page read-only, VDSO_DATA_OFFSET bytes below
+ * the vDSO image.  QEMU updates it under a sequence counter: @seq is odd
+ * while an update is in progress.  A timestamp is computed from the host
+ * cycle counter as
+ *
+ *     base + (((cycles - cycle_last) * mult) >> shift)
+ *
+ * where cycles - cycle_last must not exceed max_delta; otherwise the
+ * vDSO falls back to the system call.  All fields are in guest byte
+ * order, which on the supported targets is also the host's.
+ */
+#define VDSO_SEQ            0       /* uint32_t */
+#define VDSO_FLAGS          4       /* uint32_t */
+#define VDSO_CYCLE_LAST     8       /* uint64_t */
+#define VDSO_MAX_DELTA      16      /* uint64_t */
+#define VDSO_MULT           24      /* uint64_t */
+#define VDSO_SHIFT          32      /* uint32_t */
+#define VDSO_MONO_BASE      40      /* uint64_t, nanoseconds */
+#define VDSO_REAL_BASE      48      /* uint64_t, nanoseconds */
+
+/* The clock fields are valid; cleared when the host has no usable counter */
+#define VDSO_F_CLOCK        1
+/*
+ * rdtscp returns the host CPU and node; cpu_loop refreshes them every
+ * millisecond at most, and after sched_setaffinity
+ */
+#define VDSO_F_RDTSCP       2
+
+/* The largest page size of any host that can use the vDSO */
+#define VDSO_DATA_OFFSET    0x10000
+
+#endif
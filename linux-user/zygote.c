@@ -0,0 +1,660 @@
+/*
+ *  Zygote process server for user mode emulation
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A zygote is a QEMU process that has already gone through the program
+ * independent part of the startup (dynamic linking of QEMU itself, QOM
+ * type registration, TCG context and code buffer setup) and then waits for
+ * requests on a local socket.  For each request it forks a child, which
+ * takes over the command line, environment, working directory and standard
+ * file descriptors of the requesting process and carries on with the
+ * normal startup from there.
+ *
+ * The requesting process is an ordinary QEMU invocation (typically through
+ * binfmt_misc) run with -zygote or QEMU_ZYGOTE.  It forwards the signals it
+ * receives to the child and exits with the child's exit status.  If the
+ * zygote cannot be reached, or cannot reproduce the state of the process,
+ * the client simply runs the program itself.
+ *
+ * The descriptors that the client inherited are the ones without
+ * FD_CLOEXEC; all of them are passed, at the same numbers, and the child
+ * closes the ones of its own that are not close-on-exec.  The child also
+ * takes the resource limits of the client.  It stays in the session and
+ * process group of the zygote, however: a process cannot join a process
+ * group of another session.  Instead the client forwards SIGTSTP and
+ * SIGCONT and stops along with the child, so job control keeps working
+ * from the point of view of the shell.
+ *
+ * The socket is only accessible to its owner, and connections from other
+ * users are rejected, since the children run with the credentials of the
+ * zygote.
+ *
+ * All messages are in host byte order:
+ *   client -> server: ZygoteRequest, with the inherited file descriptors
+ *                     attached as SCM_RIGHTS, followed by the working
+ *                     directory, argv and envp as NUL-terminated strings;
+ *                     then one uint32_t per signal to be forwarded.
+ *   server -> client: an int32_t that is 0 once the child took over the
+ *                     state of the client, or a negative errno value if it
+ *                     could not; then the int32_t wait status of the child.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <poll.h>
+#include "qemu/units.h"
+#include "qemu/sockets.h"
+#include "qemu/cutils.h"
+#include "qemu.h"
+#include "elf.h"
+
+#define ZYGOTE_MAGIC    0x5a59474fu     /* "ZYGO" */
+/* SCM_MAX_FD, the most descriptors that one message can carry */
+#define ZYGOTE_MAX_FDS  253
+#define ZYGOTE_MAX_DATA (16 * MiB)
+
+typedef struct ZygoteRequest {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t umask;
+    int32_t execfd;                 /* AT_EXECFD, or 0 */
+    uint32_t data_len;
+    uint32_t nfds;
+    /* numbers of the attached descriptors in the client */
+    int32_t fds[ZYGOTE_MAX_FDS];
+    uint64_t rlimits[RLIM_NLIMITS][2];
+} ZygoteRequest;
+
+typedef struct ZygoteChild {
+    pid_t pid;
+    int fd;
+} ZygoteChild;
+
+/* Signals that a terminal or a build system may send to a job */
+static const int zygote_fwd_signals[] = {
+    SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGUSR1, SIGUSR2, SIGTSTP, SIGCONT,
+};
+
+static int zygote_sig_pipe[2] = { -1, -1 };
+
+static void zygote_sig_handler(int sig)
+{
+    uint32_t val = sig;
+    int saved_errno = errno;
+    ssize_t unused __attribute__((unused));
+
+    unused = write(zygote_sig_pipe[1], &val, sizeof(val));
+    errno = saved_errno;
+}
+
+static bool zygote_read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t ret = read(fd, p, len);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool zygote_write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t ret = write(fd, p, len);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static void zygote_sig_pipe_init(void)
+{
+    if (pipe(zygote_sig_pipe) < 0) {
+        perror("qemu: zygote pipe");
+        exit(EXIT_FAILURE);
+    }
+    qemu_set_cloexec(zygote_sig_pipe[0]);
+    qemu_set_cloexec(zygote_sig_pipe[1]);
+    qemu_set_nonblock(zygote_sig_pipe[0]);
+    qemu_set_nonblock(zygote_sig_pipe[1]);
+}
+
+static int zygote_socket(const char *path, struct sockaddr_un *addr)
+{
+    int fd;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    pstrcpy(addr->sun_path, sizeof(addr->sun_path), path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        qemu_set_cloexec(fd);
+    }
+    return fd;
+}
+
+/*
+ * Collect the descriptors of this process that are not close-on-exec,
+ * except @skip.  Returns false if there are more than ZYGOTE_MAX_FDS.
+ */
+static bool zygote_inherited_fds(int *fds, int *nfds, int skip)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *de;
+    bool ret = true;
+
+    *nfds = 0;
+    if (!dir) {
+        return false;
+    }
+    while ((de = readdir(dir))) {
+        int fd, flags;
+
+        if (qemu_strtoi(de->d_name, NULL, 10, &fd) < 0 ||
+            fd == dirfd(dir) || fd == skip) {
+            continue;
+        }
+        flags = fcntl(fd, F_GETFD);
+        if (flags < 0 || (flags & FD_CLOEXEC)) {
+            continue;
+        }
+        if (*nfds == ZYGOTE_MAX_FDS) {
+            ret = false;
+            break;
+        }
+        fds[(*nfds)++] = fd;
+    }
+    closedir(dir);
+    return ret;
+}
+
+/* Exit like the child did */
+static void QEMU_NORETURN zygote_client_exit(int status)
+{
+    if (WIFSIGNALED(status)) {
+        int sig = WTERMSIG(status);
+        struct rlimit nodump = { 0, 0 };
+
+        /* the child has already dumped core, if it had to */
+        setrlimit(RLIMIT_CORE, &nodump);
+        signal(sig, SIG_DFL);
+        raise(sig);
+        exit(128 + sig);
+    }
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+}
+
+void zygote_client(const char *path, int argc, char **argv, char **envp)
+{
+    struct sockaddr_un addr;
+    ZygoteRequest req = { .magic = ZYGOTE_MAGIC };
+    int nfds;
+    union {
+        char buf[CMSG_SPACE(sizeof(req.fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+    };
+    struct cmsghdr *cmsg;
+    struct rlimit rlim;
+    GString *data;
+    char *cwd;
+    mode_t mask;
+    int32_t status;
+    int envc, fd, i;
+
+    fd = zygote_socket(path, &addr);
+    if (fd < 0) {
+        return;
+    }
+    if (!zygote_inherited_fds(req.fds, &nfds, fd)) {
+        /* too many to pass in one message: run the program ourselves */
+        close(fd);
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        /* no zygote around: run the program ourselves */
+        close(fd);
+        return;
+    }
+
+    cwd = g_get_current_dir();
+    data = g_string_new(NULL);
+    g_string_append_len(data, cwd, strlen(cwd) + 1);
+    for (i = 0; i < argc; i++) {
+        g_string_append_len(data, argv[i], strlen(argv[i]) + 1);
+    }
+    for (envc = 0; envp[envc]; envc++) {
+        g_string_append_len(data, envp[envc], strlen(envp[envc]) + 1);
+    }
+    g_free(cwd);
+
+    mask = umask(0);
+    umask(mask);
+    for (i = 0; i < RLIM_NLIMITS; i++) {
+        if (getrlimit(i, &rlim) < 0) {
+            rlim.rlim_cur = rlim.rlim_max = RLIM_INFINITY;
+        }
+        req.rlimits[i][0] = rlim.rlim_cur;
+        req.rlimits[i][1] = rlim.rlim_max;
+    }
+    req.argc = argc;
+    req.envc = envc;
+    req.umask = mask;
+    req.execfd = qemu_getauxval(AT_EXECFD);
+    req.data_len = data->len;
+    req.nfds = nfds;
+
+    if (nfds) {
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), req.fds, nfds * sizeof(int));
+    }
+
+    /*
+     * Nothing has been started until the child acknowledges, so it is
+     * safe to fall back before that.
+     */
+    if (sendmsg(fd, &msg, 0) != sizeof(req) ||
+        !zygote_write_full(fd, data->str, data->len) ||
+        !zygote_read_full(fd, &status, sizeof(status)) || status < 0) {
+        g_string_free(data, true);
+        close(fd);
+        return;
+    }
+    g_string_free(data, true);
+
+    zygote_sig_pipe_init();
+    for (i = 0; i < ARRAY_SIZE(zygote_fwd_signals); i++) {
+        struct sigaction act = { .sa_handler = zygote_sig_handler };
+
+        sigaction(zygote_fwd_signals[i], &act, NULL);
+    }
+
+    for (;;) {
+        struct pollfd pfd[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = zygote_sig_pipe[0], .events = POLLIN },
+        };
+        uint32_t sig;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents & POLLIN &&
+            zygote_read_full(zygote_sig_pipe[0], &sig, sizeof(sig))) {
+            zygote_write_full(fd, &sig, sizeof(sig));
+            if (sig == SIGTSTP) {
+                /* stop along with the child, so that the shell notices */
+                raise(SIGSTOP);
+            }
+        }
+        if (pfd[0].revents) {
+            if (zygote_read_full(fd, &status, sizeof(status))) {
+                zygote_client_exit(status);
+            }
+            break;
+        }
+    }
+    fprintf(stderr, "qemu: lost connection to zygote '%s'\n", path);
+    exit(EXIT_FAILURE);
+}
+
+static void zygote_sigchld(int sig)
+{
+    zygote_sig_handler(sig);
+}
+
+/*
+ * Read a request from @fd.  The received file descriptors are stored in
+ * @fds even if the request turns out to be malformed, in which case false
+ * is returned.
+ */
+static bool zygote_recv_request(int fd, ZygoteRequest *req, int *fds,
+                                int *nfds, char **pdata)
+{
+    union {
+        char buf[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    *nfds = 0;
+    do {
+        ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
+    }
+    if (ret != sizeof(*req) || req->magic != ZYGOTE_MAGIC ||
+        *nfds != req->nfds || req->data_len > ZYGOTE_MAX_DATA) {
+        return false;
+    }
+
+    *pdata = g_malloc(req->data_len + 1);
+    (*pdata)[req->data_len] = 0;
+    return zygote_read_full(fd, *pdata, req->data_len);
+}
+
+/* Tell the client that the child could not take over, and give up */
+static void QEMU_NORETURN zygote_child_fail(int conn_fd, int err)
+{
+    int32_t val = -err;
+
+    zygote_write_full(conn_fd, &val, sizeof(val));
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * Called in the freshly forked child, where all the received descriptors
+ * are close-on-exec; does not return on failure
+ */
+static void zygote_setup_child(const ZygoteRequest *req, int *fds,
+                               const char *data, int conn_fd, int *pargc,
+                               char ***pargv, int *pexecfd)
+{
+    const char *p = data, *end = data + req->data_len;
+    int own_fds[ZYGOTE_MAX_FDS];
+    int nown, top = conn_fd;
+    struct rlimit rlim;
+    char **argv, **envp;
+    int32_t ok = 0;
+    int i;
+
+    /* What the zygote itself inherited must not show through */
+    if (!zygote_inherited_fds(own_fds, &nown, -1)) {
+        zygote_child_fail(conn_fd, EMFILE);
+    }
+    for (i = 0; i < nown; i++) {
+        close(own_fds[i]);
+    }
+
+    /*
+     * Move the connection and the received descriptors out of the way,
+     * then put the latter into place
+     */
+    for (i = 0; i < req->nfds; i++) {
+        top = MAX(top, req->fds[i]);
+    }
+    if (conn_fd <= top) {
+        int fd = fcntl(conn_fd, F_DUPFD_CLOEXEC, top + 1);
+
+        if (fd < 0) {
+            zygote_child_fail(conn_fd, errno);
+        }
+        close(conn_fd);
+        conn_fd = fd;
+    }
+    for (i = 0; i < req->nfds; i++) {
+        int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, top + 1);
+
+        if (fd < 0) {
+            zygote_child_fail(conn_fd, errno);
+        }
+        close(fds[i]);
+        fds[i] = fd;
+    }
+    for (i = 0; i < req->nfds; i++) {
+        if (dup2(fds[i], req->fds[i]) < 0) {
+            zygote_child_fail(conn_fd, errno);
+        }
+        close(fds[i]);
+    }
+    /* like AT_EXECFD, the descriptor is passed on to the guest */
+    *pexecfd = req->execfd;
+
+    /* only now, as a lower RLIMIT_NOFILE would get in the way above */
+    for (i = 0; i < RLIM_NLIMITS; i++) {
+        rlim.rlim_cur = req->rlimits[i][0];
+        rlim.rlim_max = req->rlimits[i][1];
+        if (setrlimit(i, &rlim) < 0 && errno != EINVAL) {
+            /* e.g. a hard limit above the zygote's */
+            zygote_child_fail(conn_fd, errno);
+        }
+    }
+
+    if (chdir(p) < 0) {
+        zygote_child_fail(conn_fd, errno);
+    }
+    p += strlen(p) + 1;
+    umask(req->umask);
+
+    if (!zygote_write_full(conn_fd, &ok, sizeof(ok))) {
+        _exit(EXIT_FAILURE);
+    }
+    close(conn_fd);
+
+    argv = g_new0(char *, req->argc + 1);
+    for (i = 0; i < req->argc && p < end; i++) {
+        argv[i] = (char *)p;
+        p += strlen(p) + 1;
+    }
+    envp = g_new0(char *, req->envc + 1);
+    for (i = 0; i < req->envc && p < end; i++) {
+        envp[i] = (char *)p;
+        p += strlen(p) + 1;
+    }
+    environ = envp;
+    *pargc = req->argc;
+    *pargv = argv;
+}
+
+void zygote_server(const char *path, int *pargc, char ***pargv, int *pexecfd)
+{
+    struct sockaddr_un addr;
+    struct sigaction act = { .sa_handler = zygote_sigchld };
+    GArray *children = g_array_new(false, false, sizeof(ZygoteChild));
+    mode_t old_mask;
+    int listen_fd;
+    int i, ret;
+
+    listen_fd = zygote_socket(path, &addr);
+    if (listen_fd < 0) {
+        fprintf(stderr, "qemu: invalid zygote socket path '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    /* Children run as the zygote's user, so only it may connect */
+    old_mask = umask(0077);
+    ret = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (ret < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "qemu: could not listen on '%s': %s\n", path,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    zygote_sig_pipe_init();
+    sigaction(SIGCHLD, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        struct pollfd *pfds;
+        int npfds = 2 + children->len;
+        uint32_t sig;
+        pid_t pid;
+        int status;
+
+        pfds = g_new0(struct pollfd, npfds);
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = zygote_sig_pipe[0];
+        pfds[1].events = POLLIN;
+        for (i = 0; i < children->len; i++) {
+            pfds[2 + i].fd = g_array_index(children, ZygoteChild, i).fd;
+            pfds[2 + i].events = POLLIN;
+        }
+        if (poll(pfds, npfds, -1) < 0 && errno != EINTR) {
+            perror("qemu: zygote poll");
+            exit(EXIT_FAILURE);
+        }
+
+        /* signals forwarded by clients, or client gone */
+        for (i = 0; i < children->len; i++) {
+            ZygoteChild *c = &g_array_index(children, ZygoteChild, i);
+
+            if (c->fd < 0 || !pfds[2 + i].revents) {
+                continue;
+            }
+            if (zygote_read_full(c->fd, &sig, sizeof(sig))) {
+                kill(c->pid, sig);
+            } else {
+                kill(c->pid, SIGKILL);
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+
+        /* reap children and report their exit status */
+        if (pfds[1].revents & POLLIN) {
+            while (read(zygote_sig_pipe[0], &sig, sizeof(sig)) > 0) {
+                /* drain */
+            }
+        }
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (i = 0; i < children->len; i++) {
+                ZygoteChild *c = &g_array_index(children, ZygoteChild, i);
+                int32_t val = status;
+
+                if (c->pid == pid) {
+                    if (c->fd >= 0) {
+                        zygote_write_full(c->fd, &val, sizeof(val));
+                        close(c->fd);
+                    }
+                    g_array_remove_index_fast(children, i);
+                    break;
+                }
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            ZygoteRequest req;
+            ZygoteChild child;
+            struct ucred cred;
+            socklen_t len = sizeof(cred);
+            int fds[ZYGOTE_MAX_FDS];
+            char *data = NULL;
+            int nfds = 0, conn_fd;
+
+            conn_fd = accept(listen_fd, NULL, NULL);
+            if (conn_fd >= 0 &&
+                (getsockopt(conn_fd, SOL_SOCKET, SO_PEERCRED, &cred,
+                            &len) < 0 || cred.uid != getuid())) {
+                close(conn_fd);
+                conn_fd = -1;
+            }
+            if (conn_fd >= 0) {
+                qemu_set_cloexec(conn_fd);
+                if (!zygote_recv_request(conn_fd, &req, fds, &nfds, &data)) {
+                    for (i = 0; i < nfds; i++) {
+                        close(fds[i]);
+                    }
+                    g_free(data);
+                    close(conn_fd);
+                    conn_fd = -1;
+                }
+            }
+            if (conn_fd >= 0) {
+                pid = fork();
+                if (pid == 0) {
+                    /* the child serves the request */
+                    signal(SIGCHLD, SIG_DFL);
+                    signal(SIGPIPE, SIG_DFL);
+                    close(listen_fd);
+                    close(zygote_sig_pipe[0]);
+                    close(zygote_sig_pipe[1]);
+                    for (i = 0; i < children->len; i++) {
+                        ZygoteChild *c = &g_array_index(children,
+                                                        ZygoteChild, i);
+                        if (c->fd >= 0) {
+                            close(c->fd);
+                        }
+                    }
+                    g_array_free(children, true);
+                    g_free(pfds);
+                    zygote_setup_child(&req, fds, data, conn_fd, pargc,
+                                       pargv, pexecfd);
+                    return;
+                }
+                for (i = 0; i < nfds; i++) {
+                    close(fds[i]);
+                }
+                g_free(data);
+                if (pid < 0) {
+                    /* the client runs the program itself */
+                    int32_t val = -errno;
+
+                    zygote_write_full(conn_fd, &val, sizeof(val));
+                    close(conn_fd);
+                } else {
+                    child.pid = pid;
+                    child.fd = conn_fd;
+                    g_array_append_val(children, child);
+                }
+            }
+        }
+        g_free(pfds);
+    }
+}
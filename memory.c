@@ -31,6 +31,7 @@
 #include "sysemu/sysemu.h"
 #include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
+#include "qapi/qapi-commands-misc.h"
 
 //#define DEBUG_UNASSIGNED
 
@@ -39,6 +40,18 @@ static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
 
+/*
+ * Parts of the memory tree that may render differently at the end of the
+ * current transaction, as MemoryRegionDamage entries.  Each FlatView is
+ * rendered again only where it is damaged; if memory_region_damage_all is
+ * set, all of them are generated from scratch.
+ */
+static GArray *memory_region_damage;
+static bool memory_region_damage_all;
+
+/* Beyond this, patching a FlatView is no cheaper than rendering it again */
+#define MEMORY_REGION_DAMAGE_MAX    1024
+
 static QTAILQ_HEAD(, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
@@ -98,6 +111,11 @@ static AddrRange addrrange_intersection(AddrRange r1, AddrRange r2)
     return addrrange_make(start, int128_sub(end, start));
 }
 
+typedef struct MemoryRegionDamage {
+    MemoryRegion *mr;
+    AddrRange range;            /* relative to the start of @mr */
+} MemoryRegionDamage;
+
 enum ListenerDirection { Forward, Reverse };
 
 #define MEMORY_LISTENER_CALL_GLOBAL(_callback, _direction, _args...)    \
@@ -587,6 +605,23 @@ static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
     return NULL;
 }
 
+/* Return the index of the first range of @view that ends after @addr. */
+static unsigned flatview_bsearch(FlatView *view, Int128 addr)
+{
+    unsigned lo = 0, hi = view->nr;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (int128_le(addrrange_end(view->ranges[mid].addr), addr)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /* Render a memory region into the global view.  Ranges in @view obscure
  * ranges in @mr.
  */
@@ -651,7 +686,8 @@ static void render_memory_region(FlatView *view,
     fr.has_coalesced_range = 0;
 
     /* Render the region itself into any gaps left by the current view. */
-    for (i = 0; i < view->nr && int128_nz(remain); ++i) {
+    for (i = flatview_bsearch(view, base); i < view->nr && int128_nz(remain);
+         ++i) {
         if (int128_ge(base, addrrange_end(view->ranges[i].addr))) {
             continue;
         }
@@ -724,10 +760,26 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
+/* Simplify @view, build its dispatch tree and register it for its root. */
+static void flatview_finish(FlatView *view)
+{
+    int i;
+
+    flatview_simplify(view);
+
+    view->dispatch = address_space_dispatch_new(view);
+    for (i = 0; i < view->nr; i++) {
+        MemoryRegionSection mrs =
+            section_from_flat_range(&view->ranges[i], view);
+        flatview_add_to_dispatch(view, &mrs);
+    }
+    address_space_dispatch_compact(view->dispatch);
+    g_hash_table_replace(flat_views, view->root, view);
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
-    int i;
     FlatView *view;
 
     view = flatview_new(mr);
@@ -737,16 +789,177 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
                              addrrange_make(int128_zero(), int128_2_64()),
                              false, false);
     }
-    flatview_simplify(view);
+    flatview_finish(view);
 
-    view->dispatch = address_space_dispatch_new(view);
-    for (i = 0; i < view->nr; i++) {
-        MemoryRegionSection mrs =
-            section_from_flat_range(&view->ranges[i], view);
-        flatview_add_to_dispatch(view, &mrs);
+    return view;
+}
+
+/*
+ * Translate @range of @mr into addresses of the FlatView rooted at @root,
+ * going up through containers and aliases, and append them to @windows.
+ * Returns false if this takes too long, in which case the FlatView should
+ * be rendered from scratch.
+ */
+static bool flatview_add_damage(GArray *windows, unsigned *budget,
+                                MemoryRegion *root, MemoryRegion *mr,
+                                AddrRange range)
+{
+    MemoryRegion *alias;
+    AddrRange clip;
+
+    if (!int128_nz(range.size)) {
+        return true;
     }
-    address_space_dispatch_compact(view->dispatch);
-    g_hash_table_replace(flat_views, mr, view);
+    if (!*budget || windows->len >= MEMORY_REGION_DAMAGE_MAX) {
+        return false;
+    }
+    --*budget;
+
+    if (mr == root) {
+        /* Like render_memory_region, place the root at its own address */
+        range = addrrange_shift(range, int128_make64(mr->addr));
+        clip = addrrange_make(int128_zero(), int128_2_64());
+        if (addrrange_intersects(range, clip)) {
+            range = addrrange_intersection(range, clip);
+            g_array_append_val(windows, range);
+        }
+        return true;
+    }
+
+    if (mr->container) {
+        AddrRange up = addrrange_shift(range, int128_make64(mr->addr));
+
+        clip = addrrange_make(int128_zero(), mr->container->size);
+        if (addrrange_intersects(up, clip) &&
+            !flatview_add_damage(windows, budget, root, mr->container,
+                                 addrrange_intersection(up, clip))) {
+            return false;
+        }
+    }
+    QLIST_FOREACH(alias, &mr->aliases, aliases_link) {
+        Int128 offset = int128_make64(alias->alias_offset);
+
+        clip = addrrange_make(offset, alias->size);
+        if (addrrange_intersects(range, clip) &&
+            !flatview_add_damage(windows, budget, root, alias,
+                                 addrrange_shift(addrrange_intersection(range,
+                                                                        clip),
+                                                 int128_neg(offset)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static gint addrrange_cmp(gconstpointer a_, gconstpointer b_)
+{
+    const AddrRange *a = a_, *b = b_;
+
+    if (int128_lt(a->start, b->start)) {
+        return -1;
+    }
+    return int128_eq(a->start, b->start) ? 0 : 1;
+}
+
+/*
+ * Collect the parts of the FlatView rooted at @root that the pending damage
+ * can affect, as a sorted list of disjoint ranges.  Returns false if the
+ * FlatView should be rendered from scratch instead.
+ */
+static bool flatview_get_damage(MemoryRegion *root, GArray *windows)
+{
+    unsigned budget = MEMORY_REGION_DAMAGE_MAX * 16;
+    unsigned i, j;
+
+    for (i = 0; memory_region_damage && i < memory_region_damage->len; i++) {
+        MemoryRegionDamage *d =
+            &g_array_index(memory_region_damage, MemoryRegionDamage, i);
+
+        if (!flatview_add_damage(windows, &budget, root, d->mr, d->range)) {
+            return false;
+        }
+    }
+
+    g_array_sort(windows, addrrange_cmp);
+    for (i = 0, j = 0; i < windows->len; i++) {
+        AddrRange w = g_array_index(windows, AddrRange, i);
+        AddrRange *prev = j ? &g_array_index(windows, AddrRange, j - 1) : NULL;
+
+        if (prev && int128_le(w.start, addrrange_end(*prev))) {
+            Int128 end = int128_max(addrrange_end(*prev), addrrange_end(w));
+
+            prev->size = int128_sub(end, prev->start);
+        } else {
+            g_array_index(windows, AddrRange, j++) = w;
+        }
+    }
+    g_array_set_size(windows, j);
+    return true;
+}
+
+/*
+ * Append the parts of the ranges of @old, starting from *@pos, that are
+ * within [@start, @end) to @view.
+ */
+static void flatview_copy_ranges(FlatView *view, FlatView *old, unsigned *pos,
+                                 Int128 start, Int128 end)
+{
+    AddrRange clip;
+
+    if (int128_ge(start, end)) {
+        return;
+    }
+    clip = addrrange_make(start, int128_sub(end, start));
+
+    while (*pos < old->nr && int128_lt(old->ranges[*pos].addr.start, end)) {
+        FlatRange fr = old->ranges[*pos];
+
+        if (addrrange_intersects(fr.addr, clip)) {
+            AddrRange tmp = addrrange_intersection(fr.addr, clip);
+
+            fr.offset_in_region +=
+                int128_get64(int128_sub(tmp.start, fr.addr.start));
+            fr.addr = tmp;
+            fr.has_coalesced_range = 0;
+            flatview_insert(view, view->nr, &fr);
+        }
+        if (int128_gt(addrrange_end(old->ranges[*pos].addr), end)) {
+            /* The rest is copied or rendered again by the caller */
+            break;
+        }
+        ++*pos;
+    }
+}
+
+/*
+ * Generate the FlatView for the root of @old, knowing that it can only
+ * differ from @old within @windows: copy the ranges of @old outside them
+ * and render the memory topology only inside them.
+ *
+ * This is still linear in the number of ranges of the view: they are
+ * copied one by one, and the dispatch tree is built from scratch since
+ * its sections point to their FlatView and subpages belong to a single
+ * dispatch, so nothing can be shared with the old one.  What patching
+ * saves is walking the whole memory tree, and the insertions in the
+ * middle of the view that rendering from scratch does for each region.
+ */
+static FlatView *flatview_patch(FlatView *old, GArray *windows)
+{
+    FlatView *view = flatview_new(old->root);
+    Int128 done = int128_zero();
+    unsigned pos = 0, i;
+
+    for (i = 0; i < windows->len; i++) {
+        AddrRange *w = &g_array_index(windows, AddrRange, i);
+
+        flatview_copy_ranges(view, old, &pos, done, w->start);
+        render_memory_region(view, old->root, int128_zero(), *w,
+                             false, false);
+        done = addrrange_end(*w);
+    }
+    flatview_copy_ranges(view, old, &pos, done, int128_2_64());
+    flatview_finish(view);
+    trace_flatview_patch(view, old, windows->len);
 
     return view;
 }
@@ -1003,6 +1216,54 @@ static void flatviews_reset(void)
     }
 }
 
+/*
+ * Regenerate the FlatViews at the end of a transaction.  Those that the
+ * damage cannot reach are kept, the others are patched where possible.
+ */
+static void flatviews_update(void)
+{
+    GHashTable *old_views = flat_views;
+    GArray *windows;
+    AddressSpace *as;
+
+    if (!old_views || memory_region_damage_all) {
+        flatviews_reset();
+        goto out;
+    }
+
+    flat_views = NULL;
+    flatviews_init();
+
+    windows = g_array_new(false, false, sizeof(AddrRange));
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view;
+
+        if (g_hash_table_lookup(flat_views, physmr)) {
+            continue;
+        }
+
+        old_view = g_hash_table_lookup(old_views, physmr);
+        g_array_set_size(windows, 0);
+        if (!old_view || !flatview_get_damage(physmr, windows)) {
+            generate_memory_topology(physmr);
+        } else if (windows->len) {
+            flatview_patch(old_view, windows);
+        } else {
+            flatview_ref(old_view);
+            g_hash_table_replace(flat_views, physmr, old_view);
+        }
+    }
+    g_array_free(windows, true);
+    g_hash_table_unref(old_views);
+
+out:
+    if (memory_region_damage) {
+        g_array_set_size(memory_region_damage, 0);
+    }
+    memory_region_damage_all = false;
+}
+
 static void address_space_set_flatview(AddressSpace *as)
 {
     FlatView *old_view = address_space_to_flatview(as);
@@ -1059,6 +1320,91 @@ static void address_space_update_topology(AddressSpace *as)
     address_space_set_flatview(as);
 }
 
+/*
+ * Schedule an update of the FlatViews at the end of the transaction, which
+ * renders [@offset, @offset + @size) of @mr again.
+ */
+static void memory_region_update_range(MemoryRegion *mr, hwaddr offset,
+                                       Int128 size)
+{
+    MemoryRegionDamage d = {
+        .mr = mr,
+        .range = addrrange_make(int128_make64(offset), size),
+    };
+
+    memory_region_update_pending = true;
+    if (memory_region_damage_all) {
+        return;
+    }
+    if (!memory_region_damage) {
+        memory_region_damage = g_array_new(false, false,
+                                           sizeof(MemoryRegionDamage));
+    }
+    if (memory_region_damage->len >= MEMORY_REGION_DAMAGE_MAX) {
+        memory_region_damage_all = true;
+        return;
+    }
+    g_array_append_val(memory_region_damage, d);
+}
+
+/* Schedule an update that renders all FlatViews from scratch. */
+static void memory_region_update_all(void)
+{
+    memory_region_update_pending = true;
+    memory_region_damage_all = true;
+}
+
+static void memory_region_forget_damage(MemoryRegion *mr)
+{
+    unsigned i;
+
+    for (i = 0; memory_region_damage && i < memory_region_damage->len; ) {
+        if (g_array_index(memory_region_damage, MemoryRegionDamage, i).mr ==
+            mr) {
+            g_array_remove_index_fast(memory_region_damage, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * @subregion is about to move away from its place in @mr.  Damage that
+ * was recorded within it earlier in the transaction would be looked for
+ * in the wrong place, so record it in @mr, where @subregion is now.
+ */
+static void memory_region_move_damage(MemoryRegion *mr,
+                                      MemoryRegion *subregion)
+{
+    unsigned budget = MEMORY_REGION_DAMAGE_MAX * 16;
+    GArray *windows;
+    unsigned i, n;
+
+    if (memory_region_damage_all || !memory_region_damage ||
+        !memory_region_damage->len) {
+        return;
+    }
+
+    windows = g_array_new(false, false, sizeof(AddrRange));
+    n = memory_region_damage->len;
+    for (i = 0; i < n; i++) {
+        MemoryRegionDamage d =
+            g_array_index(memory_region_damage, MemoryRegionDamage, i);
+
+        if (!flatview_add_damage(windows, &budget, subregion, d.mr,
+                                 d.range)) {
+            memory_region_update_all();
+            break;
+        }
+    }
+    for (i = 0; !memory_region_damage_all && i < windows->len; i++) {
+        AddrRange *w = &g_array_index(windows, AddrRange, i);
+
+        memory_region_update_range(mr, int128_get64(w->start), w->size);
+    }
+    g_array_free(windows, true);
+}
+
 void memory_region_transaction_begin(void)
 {
     qemu_flush_coalesced_mmio_buffer();
@@ -1075,13 +1421,18 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
-            flatviews_reset();
+            flatviews_update();
 
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                FlatView *old_view = address_space_to_flatview(as);
+
                 address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (ioeventfd_update_pending ||
+                    address_space_to_flatview(as) != old_view) {
+                    address_space_update_ioeventfds(as);
+                }
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
@@ -1672,6 +2023,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, owner, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    QLIST_INSERT_HEAD(&orig->aliases, mr, aliases_link);
 }
 
 void memory_region_init_rom_nomigrate(MemoryRegion *mr,
@@ -1757,6 +2109,18 @@ static void memory_region_finalize(Object *obj)
         memory_region_del_subregion(mr, subregion);
     }
     memory_region_transaction_commit();
+    memory_region_forget_damage(mr);
+
+    if (mr->alias && mr->aliases_link.le_prev) {
+        QLIST_REMOVE(mr, aliases_link);
+    }
+    while (!QLIST_EMPTY(&mr->aliases)) {
+        MemoryRegion *alias = QLIST_FIRST(&mr->aliases);
+
+        /* Dangling aliases must not be rendered anymore anyway */
+        QLIST_REMOVE(alias, aliases_link);
+        alias->aliases_link.le_prev = NULL;
+    }
 
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
@@ -2022,7 +2386,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_range(mr, 0, mr->size);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2095,7 +2461,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_range(mr, 0, mr->size);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2105,7 +2473,9 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_range(mr, 0, mr->size);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2115,7 +2485,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_range(mr, 0, mr->size);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2358,7 +2730,9 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_range(mr, subregion->addr, subregion->size);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2394,10 +2768,13 @@ void memory_region_del_subregion(MemoryRegion *mr,
 {
     memory_region_transaction_begin();
     assert(subregion->container == mr);
+    memory_region_move_damage(mr, subregion);
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_range(mr, subregion->addr, subregion->size);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2408,7 +2785,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update_range(mr, 0, mr->size);
     memory_region_transaction_commit();
 }
 
@@ -2423,8 +2800,8 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_update_range(mr, 0, int128_max(s, mr->size));
     mr->size = s;
-    memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
 
@@ -2446,6 +2823,17 @@ static void memory_region_readd_subregion(MemoryRegion *mr)
 void memory_region_set_address(MemoryRegion *mr, hwaddr addr)
 {
     if (addr != mr->addr) {
+        if (mr->container) {
+            /* Re-adding the region only damages its new location */
+            memory_region_move_damage(mr->container, mr);
+            if (mr->container->enabled && mr->enabled) {
+                memory_region_update_range(mr->container, mr->addr, mr->size);
+            }
+        }
+        if (flat_views && g_hash_table_contains(flat_views, mr)) {
+            /* FlatViews place their root at its address */
+            memory_region_damage_all = true;
+        }
         mr->addr = addr;
         memory_region_readd_subregion(mr);
     }
@@ -2461,7 +2849,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_range(mr, 0, mr->size);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2585,7 +2975,7 @@ void memory_global_dirty_log_start(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_all();
     memory_region_transaction_commit();
 }
 
@@ -2595,7 +2985,7 @@ static void memory_global_dirty_log_do_stop(void)
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_all();
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2739,6 +3129,14 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->ioeventfds = NULL;
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    as->bounce_buffer_peak = 0;
+    as->bounce_buffer_maps = 0;
+    as->bounce_buffer_failures = 0;
+    qemu_mutex_init(&as->bounce_lock);
+    QLIST_INIT(&as->bounce_buffers);
+    QLIST_INIT(&as->map_client_list);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_update_topology(as);
     address_space_update_ioeventfds(as);
@@ -2747,7 +3145,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 static void do_address_space_destroy(AddressSpace *as)
 {
     assert(QTAILQ_EMPTY(&as->listeners));
+    assert(QLIST_EMPTY(&as->bounce_buffers));
+    assert(QLIST_EMPTY(&as->map_client_list));
 
+    qemu_mutex_destroy(&as->bounce_lock);
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
@@ -2772,6 +3173,31 @@ void address_space_destroy(AddressSpace *as)
     call_rcu(as, do_address_space_destroy, rcu);
 }
 
+BounceBufferInfoList *qmp_query_bounce_buffers(Error **errp)
+{
+    BounceBufferInfoList *head = NULL, **tail = &head;
+    AddressSpace *as;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        BounceBufferInfoList *elem = g_new0(BounceBufferInfoList, 1);
+        BounceBufferInfo *info = g_new0(BounceBufferInfo, 1);
+
+        info->address_space = g_strdup(as->name);
+        qemu_mutex_lock(&as->bounce_lock);
+        info->max_size = as->max_bounce_buffer_size;
+        info->size = as->bounce_buffer_size;
+        info->peak_size = as->bounce_buffer_peak;
+        info->maps = as->bounce_buffer_maps;
+        info->failures = as->bounce_buffer_failures;
+        qemu_mutex_unlock(&as->bounce_lock);
+
+        elem->value = info;
+        *tail = elem;
+        tail = &elem->next;
+    }
+    return head;
+}
+
 static const char *memory_region_type(MemoryRegion *mr)
 {
     if (memory_region_is_ram_device(mr)) {
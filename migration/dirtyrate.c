@@ -0,0 +1,249 @@
+/*
+ * Dirty page rate measurement
+ *
+ * A random sample of the pages of each RAM block is hashed, and hashed
+ * again after the measurement period; the share of sampled pages whose
+ * hash changed estimates the share of the block that the guest dirtied.
+ * Unlike the dirty-pages-rate of a running migration, this does not
+ * need dirty logging and has no effect on the guest.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "exec/ram_addr.h"
+#include "qemu/rcu_queue.h"
+#include "trace.h"
+
+#define MIN_CALC_TIME_SEC       1
+#define MAX_CALC_TIME_SEC       60
+#define MIN_SAMPLE_PAGES        128
+#define MAX_SAMPLE_PAGES        16384
+#define DEFAULT_SAMPLE_PAGES    512
+
+typedef struct DirtyRateBlock {
+    char idstr[256];
+    uint64_t size;
+    uint64_t nr_samples;
+    uint64_t *offsets;
+    uint32_t *hashes;
+    uint64_t dirty_pages;
+} DirtyRateBlock;
+
+typedef struct DirtyRateMeasure {
+    int64_t calc_time;
+    int64_t sample_pages;
+    int64_t start_time;
+    int64_t elapsed_ms;
+    DirtyRateBlock *blocks;
+    int nr_blocks;
+} DirtyRateMeasure;
+
+/*
+ * The measurement thread owns the result while the status is
+ * DIRTY_RATE_STATUS_MEASURING; QMP commands, which run under the BQL,
+ * only read it once the status is DIRTY_RATE_STATUS_MEASURED.
+ */
+static int dirty_rate_status = DIRTY_RATE_STATUS_UNSTARTED;
+static DirtyRateMeasure dirty_rate;
+
+static uint32_t dirty_rate_hash_page(RAMBlock *block, uint64_t offset)
+{
+    return crc32c(0xffffffff, block->host + offset, TARGET_PAGE_SIZE);
+}
+
+static void dirty_rate_free_blocks(DirtyRateMeasure *m)
+{
+    int i;
+
+    for (i = 0; i < m->nr_blocks; i++) {
+        g_free(m->blocks[i].offsets);
+        g_free(m->blocks[i].hashes);
+    }
+    g_free(m->blocks);
+    m->blocks = NULL;
+    m->nr_blocks = 0;
+}
+
+/* Pick and hash the sample pages of every RAM block.  */
+static void dirty_rate_sample_blocks(DirtyRateMeasure *m)
+{
+    RAMBlock *block;
+    int n = 0;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (qemu_ram_is_migratable(block)) {
+            n++;
+        }
+    }
+    m->blocks = g_new0(DirtyRateBlock, n);
+
+    RAMBLOCK_FOREACH(block) {
+        DirtyRateBlock *b;
+        uint64_t pages, i;
+
+        if (!qemu_ram_is_migratable(block)) {
+            continue;
+        }
+        if (m->nr_blocks == n) {
+            /* Hotplugged after we counted them */
+            break;
+        }
+        pages = block->used_length >> TARGET_PAGE_BITS;
+        b = &m->blocks[m->nr_blocks];
+        b->nr_samples = MIN(pages, m->sample_pages * block->used_length / GiB);
+        if (!b->nr_samples) {
+            /* Too small to say anything meaningful */
+            continue;
+        }
+        pstrcpy(b->idstr, sizeof(b->idstr), block->idstr);
+        b->size = block->used_length;
+        b->offsets = g_new(uint64_t, b->nr_samples);
+        b->hashes = g_new(uint32_t, b->nr_samples);
+        for (i = 0; i < b->nr_samples; i++) {
+            uint64_t page = (((uint64_t)g_random_int() << 32) |
+                             g_random_int()) % pages;
+
+            b->offsets[i] = page << TARGET_PAGE_BITS;
+            b->hashes[i] = dirty_rate_hash_page(block, b->offsets[i]);
+        }
+        m->nr_blocks++;
+    }
+    rcu_read_unlock();
+}
+
+/* Count the sample pages that changed since dirty_rate_sample_blocks.  */
+static void dirty_rate_compare_blocks(DirtyRateMeasure *m)
+{
+    int i;
+
+    rcu_read_lock();
+    for (i = 0; i < m->nr_blocks; i++) {
+        DirtyRateBlock *b = &m->blocks[i];
+        RAMBlock *block = qemu_ram_block_by_name(b->idstr);
+        uint64_t j;
+
+        b->dirty_pages = 0;
+        if (!block || block->used_length != b->size) {
+            /* Unplugged or resized, count it as entirely dirty */
+            b->dirty_pages = b->nr_samples;
+            continue;
+        }
+        for (j = 0; j < b->nr_samples; j++) {
+            if (dirty_rate_hash_page(block, b->offsets[j]) != b->hashes[j]) {
+                b->dirty_pages++;
+            }
+        }
+    }
+    rcu_read_unlock();
+}
+
+/* Estimated number of MiB of a block that were dirtied.  */
+static double dirty_rate_block_dirty_mb(const DirtyRateBlock *b)
+{
+    return (double)b->dirty_pages / b->nr_samples * b->size / MiB;
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    DirtyRateMeasure *m = opaque;
+    int64_t start_ms;
+
+    rcu_register_thread();
+
+    start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    atomic_set(&m->start_time, start_ms / 1000);
+    dirty_rate_sample_blocks(m);
+    trace_dirty_rate_start(m->calc_time, m->sample_pages, m->nr_blocks);
+
+    g_usleep(m->calc_time * G_USEC_PER_SEC);
+
+    dirty_rate_compare_blocks(m);
+    m->elapsed_ms = MAX(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms, 1);
+    trace_dirty_rate_end(m->elapsed_ms);
+
+    atomic_mb_set(&dirty_rate_status, DIRTY_RATE_STATUS_MEASURED);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, Error **errp)
+{
+    QemuThread thread;
+
+    if (calc_time < MIN_CALC_TIME_SEC || calc_time > MAX_CALC_TIME_SEC) {
+        error_setg(errp, "calc-time must be between %d and %d seconds",
+                   MIN_CALC_TIME_SEC, MAX_CALC_TIME_SEC);
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < MIN_SAMPLE_PAGES ||
+               sample_pages > MAX_SAMPLE_PAGES) {
+        error_setg(errp, "sample-pages must be between %d and %d",
+                   MIN_SAMPLE_PAGES, MAX_SAMPLE_PAGES);
+        return;
+    }
+    if (atomic_read(&dirty_rate_status) == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "the dirty page rate is already being measured");
+        return;
+    }
+
+    atomic_set(&dirty_rate_status, DIRTY_RATE_STATUS_MEASURING);
+    dirty_rate_free_blocks(&dirty_rate);
+    dirty_rate.calc_time = calc_time;
+    dirty_rate.sample_pages = sample_pages;
+    dirty_rate.start_time = 0;
+    dirty_rate.elapsed_ms = 0;
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, &dirty_rate,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateBlockInfoList **tail = &info->blocks;
+    double seconds, total = 0;
+    int i;
+
+    info->status = atomic_mb_read(&dirty_rate_status);
+    info->start_time = atomic_read(&dirty_rate.start_time);
+    info->calc_time = dirty_rate.calc_time;
+    info->sample_pages = dirty_rate.sample_pages;
+    if (info->status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    seconds = dirty_rate.elapsed_ms / 1000.0;
+    info->has_blocks = true;
+    for (i = 0; i < dirty_rate.nr_blocks; i++) {
+        DirtyRateBlock *b = &dirty_rate.blocks[i];
+        DirtyRateBlockInfoList *entry = g_new0(DirtyRateBlockInfoList, 1);
+
+        entry->value = g_new0(DirtyRateBlockInfo, 1);
+        entry->value->id = g_strdup(b->idstr);
+        entry->value->size = b->size;
+        entry->value->sampled_pages = b->nr_samples;
+        entry->value->dirty_pages = b->dirty_pages;
+        entry->value->dirty_rate = dirty_rate_block_dirty_mb(b) / seconds;
+        total += dirty_rate_block_dirty_mb(b);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->has_dirty_rate = true;
+    info->dirty_rate = total / seconds;
+
+    return info;
+}
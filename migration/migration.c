@@ -14,11 +14,13 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "rdma.h"
 #include "ram.h"
@@ -44,8 +46,10 @@
 #include "trace.h"
 #include "exec/target_page.h"
 #include "io/channel-buffer.h"
+#include "io/channel-socket.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
+#include "sysemu/kvm.h"
 #include "monitor/monitor.h"
 #include "net/announce.h"
 
@@ -82,6 +86,17 @@
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
+/* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
+#define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
+/* 0: means the library default, 1: best speed, ... 20: best ratio */
+#define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+#define DEFAULT_MIGRATE_BITMAP_SYNC_THREADS 4
+/* Dirty page rate of each vcpu with the dirty-limit capability, in MiB/s */
+#define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT 1
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES 0
+#define DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS 1
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREADS 4
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -148,9 +163,12 @@ void migration_object_init(void)
     current_incoming->postcopy_remote_fds =
         g_array_new(FALSE, TRUE, sizeof(struct PostCopyFD));
     qemu_mutex_init(&current_incoming->rp_mutex);
+    qemu_mutex_init(&current_incoming->page_request_mutex);
+    qemu_mutex_init(&current_incoming->page_stats_mutex);
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
-    qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_mutex_init(&current_incoming->postcopy_pause_mutex);
+    qemu_cond_init(&current_incoming->postcopy_pause_cond);
 
     init_dirty_bitmap_incoming_migration();
 
@@ -205,7 +223,10 @@ void migration_incoming_state_destroy(void)
     }
 
     if (mis->from_src_file) {
-        qemu_fclose(mis->from_src_file);
+        /* Lazy restore closes the file once it has read all of RAM */
+        if (!mis->lazy_restore) {
+            qemu_fclose(mis->from_src_file);
+        }
         mis->from_src_file = NULL;
     }
     if (mis->postcopy_remote_fds) {
@@ -364,6 +385,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -409,6 +432,11 @@ static void process_incoming_migration_bh(void *opaque)
 
     dirty_bitmap_mig_before_vm_start();
 
+    /* Lazy restore may have failed to load RAM already */
+    if (mis->state == MIGRATION_STATUS_FAILED) {
+        autostart = false;
+    }
+
     if (!global_state_received() ||
         global_state_get_runstate() == RUN_STATE_RUNNING) {
         if (autostart) {
@@ -769,12 +797,28 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->block_incremental = s->parameters.block_incremental;
     params->has_multifd_channels = true;
     params->multifd_channels = s->parameters.multifd_channels;
+    params->has_multifd_compression = true;
+    params->multifd_compression = s->parameters.multifd_compression;
+    params->has_multifd_zlib_level = true;
+    params->multifd_zlib_level = s->parameters.multifd_zlib_level;
+    params->has_multifd_zstd_level = true;
+    params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_bitmap_sync_threads = true;
+    params->bitmap_sync_threads = s->parameters.bitmap_sync_threads;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
     params->max_postcopy_bandwidth = s->parameters.max_postcopy_bandwidth;
     params->has_max_cpu_throttle = true;
     params->max_cpu_throttle = s->parameters.max_cpu_throttle;
+    params->has_vcpu_dirty_limit = true;
+    params->vcpu_dirty_limit = s->parameters.vcpu_dirty_limit;
+    params->has_postcopy_prefetch_pages = true;
+    params->postcopy_prefetch_pages = s->parameters.postcopy_prefetch_pages;
+    params->has_postcopy_fault_threads = true;
+    params->postcopy_fault_threads = s->parameters.postcopy_fault_threads;
+    params->has_device_state_threads = true;
+    params->device_state_threads = s->parameters.device_state_threads;
     params->has_announce_initial = true;
     params->announce_initial = s->parameters.announce_initial;
     params->has_announce_max = true;
@@ -840,8 +884,15 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->postcopy_requests = ram_counters.postcopy_requests;
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
+    info->ram->mapped_ram_bytes = ram_counters.mapped_ram_bytes;
     info->ram->pages_per_second = s->pages_per_second;
 
+    if (ram_counters.dirty_sync_count) {
+        info->has_dirty_sync = true;
+        info->dirty_sync = g_malloc0(sizeof(*info->dirty_sync));
+        *info->dirty_sync = dirty_sync_counters;
+    }
+
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
@@ -851,6 +902,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
+        info->xbzrle_cache->cache_useful_hit =
+            xbzrle_counters.cache_useful_hit;
+        info->xbzrle_cache->cache_collision = xbzrle_counters.cache_collision;
     }
 
     if (migrate_use_compression()) {
@@ -982,6 +1037,13 @@ static bool migrate_caps_check(bool *cap_list,
     }
 #endif
 
+#ifndef QEMU_MSG_ZEROCOPY
+    if (cap_list[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND]) {
+        error_setg(errp, "Zero copy send is not supported on this host");
+        return false;
+    }
+#endif
+
 #ifndef CONFIG_REPLICATION
     if (cap_list[MIGRATION_CAPABILITY_X_COLO]) {
         error_setg(errp, "QEMU compiled without replication module"
@@ -1022,6 +1084,68 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_X_LAZY_RESTORE]) {
+        /* Both need the userfaultfd and the RAM of the destination */
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Lazy restore is not compatible with postcopy");
+            return false;
+        }
+        /*
+         * The pages must be at a known place in the file, without reading
+         * through all of it first
+         */
+        if (!cap_list[MIGRATION_CAPABILITY_X_MAPPED_RAM]) {
+            error_setg(errp, "Lazy restore requires x-mapped-ram");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_MAPPED_RAM]) {
+        /* Pages are written to the file only once, in their last version */
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Mapped RAM is not compatible with postcopy "
+                       "or COLO");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_XBZRLE]) {
+            error_setg(errp, "Mapped RAM is not compatible with multifd, "
+                       "compression or XBZRLE");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Zero copy send requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD_ZERO_PAGE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Multifd zero page detection requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_LIMIT]) {
+        /*
+         * Dirty pages are accounted to the vcpu that wrote them by TCG, and
+         * by KVM only with dirty rings: dirty bitmaps are global.
+         */
+        if (!tcg_enabled() && !kvm_dirty_ring_enabled()) {
+            error_setg(errp, "Dirty limit requires TCG, or KVM with the "
+                       "kvm-dirty-ring-size machine option");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+            error_setg(errp, "Dirty limit is not compatible with "
+                       "auto-converge");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1043,16 +1167,20 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_CANCELLING:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_COLO:
+        info->has_status = true;
+        break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_PAUSED:
     case MIGRATION_STATUS_POSTCOPY_RECOVER:
-    case MIGRATION_STATUS_FAILED:
-    case MIGRATION_STATUS_COLO:
         info->has_status = true;
+        fill_destination_postcopy_request_info(info);
         break;
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        fill_destination_postcopy_request_info(info);
         break;
     }
     info->status = mis->state;
@@ -1158,6 +1286,36 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+#ifndef CONFIG_ZSTD
+    if (params->has_multifd_compression &&
+        params->multifd_compression == MULTIFD_COMPRESSION_ZSTD) {
+        error_setg(errp, "QEMU was built without zstd support");
+        return false;
+    }
+#endif
+
+    if (params->has_multifd_zlib_level &&
+        (params->multifd_zlib_level > 9)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zlib_level",
+                   "is invalid, it should be in the range of 0 to 9");
+        return false;
+    }
+
+    if (params->has_multifd_zstd_level &&
+        (params->multifd_zstd_level > 20)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zstd_level",
+                   "is invalid, it should be in the range of 0 to 20");
+        return false;
+    }
+
+    if (params->has_bitmap_sync_threads &&
+        (params->bitmap_sync_threads < 1 ||
+         params->bitmap_sync_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "bitmap_sync_threads",
+                   "is invalid, it should be in the range of 1 to 64");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1177,6 +1335,39 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_vcpu_dirty_limit && params->vcpu_dirty_limit < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "vcpu_dirty_limit",
+                   "is invalid, it must be at least 1");
+        return false;
+    }
+
+    if (params->has_postcopy_prefetch_pages &&
+        params->postcopy_prefetch_pages > 64) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_pages",
+                   "is invalid, it should be in the range of 0 to 64");
+        return false;
+    }
+
+    if (params->has_postcopy_fault_threads &&
+        (params->postcopy_fault_threads < 1 ||
+         params->postcopy_fault_threads > 16)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_fault_threads",
+                   "is invalid, it should be in the range of 1 to 16");
+        return false;
+    }
+
+    if (params->has_device_state_threads &&
+        (params->device_state_threads < 1 ||
+         params->device_state_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "device_state_threads",
+                   "is invalid, it should be in the range of 1 to 64");
+        return false;
+    }
+
     if (params->has_announce_initial &&
         params->announce_initial > 100000) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
@@ -1268,6 +1459,18 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_multifd_channels) {
         dest->multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_compression) {
+        dest->multifd_compression = params->multifd_compression;
+    }
+    if (params->has_multifd_zlib_level) {
+        dest->multifd_zlib_level = params->multifd_zlib_level;
+    }
+    if (params->has_multifd_zstd_level) {
+        dest->multifd_zstd_level = params->multifd_zstd_level;
+    }
+    if (params->has_bitmap_sync_threads) {
+        dest->bitmap_sync_threads = params->bitmap_sync_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
@@ -1277,6 +1480,18 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_max_cpu_throttle) {
         dest->max_cpu_throttle = params->max_cpu_throttle;
     }
+    if (params->has_vcpu_dirty_limit) {
+        dest->vcpu_dirty_limit = params->vcpu_dirty_limit;
+    }
+    if (params->has_postcopy_prefetch_pages) {
+        dest->postcopy_prefetch_pages = params->postcopy_prefetch_pages;
+    }
+    if (params->has_postcopy_fault_threads) {
+        dest->postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+    if (params->has_device_state_threads) {
+        dest->device_state_threads = params->device_state_threads;
+    }
     if (params->has_announce_initial) {
         dest->announce_initial = params->announce_initial;
     }
@@ -1364,6 +1579,18 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_multifd_channels) {
         s->parameters.multifd_channels = params->multifd_channels;
     }
+    if (params->has_multifd_compression) {
+        s->parameters.multifd_compression = params->multifd_compression;
+    }
+    if (params->has_multifd_zlib_level) {
+        s->parameters.multifd_zlib_level = params->multifd_zlib_level;
+    }
+    if (params->has_multifd_zstd_level) {
+        s->parameters.multifd_zstd_level = params->multifd_zstd_level;
+    }
+    if (params->has_bitmap_sync_threads) {
+        s->parameters.bitmap_sync_threads = params->bitmap_sync_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
@@ -1378,6 +1605,22 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_max_cpu_throttle) {
         s->parameters.max_cpu_throttle = params->max_cpu_throttle;
     }
+    if (params->has_vcpu_dirty_limit) {
+        s->parameters.vcpu_dirty_limit = params->vcpu_dirty_limit;
+        if (cpu_dirty_limit_active()) {
+            cpu_dirty_limit_set(s->parameters.vcpu_dirty_limit);
+        }
+    }
+    if (params->has_postcopy_prefetch_pages) {
+        s->parameters.postcopy_prefetch_pages =
+            params->postcopy_prefetch_pages;
+    }
+    if (params->has_postcopy_fault_threads) {
+        s->parameters.postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+    if (params->has_device_state_threads) {
+        s->parameters.device_state_threads = params->device_state_threads;
+    }
     if (params->has_announce_initial) {
         s->parameters.announce_initial = params->announce_initial;
     }
@@ -1875,6 +2118,14 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
         return false;
     }
 
+    /* The compression buffer is reused as soon as it has been queued */
+    if (migrate_zero_copy_send() &&
+        migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "Zero copy send is not compatible with "
+                   "multifd compression");
+        return false;
+    }
+
     if (blk || blk_inc) {
         if (migrate_use_block() || migrate_use_block_incremental()) {
             error_setg(errp, "Command options are incompatible with "
@@ -1924,6 +2175,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2051,6 +2304,33 @@ bool migrate_postcopy_blocktime(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
 }
 
+int migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_pages;
+}
+
+int migrate_postcopy_fault_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_fault_threads;
+}
+
+int migrate_device_state_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.device_state_threads;
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -2114,6 +2394,60 @@ bool migrate_ignore_shared(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
 }
 
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_LAZY_RESTORE];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
+bool migrate_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
+bool migrate_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD_ZERO_PAGE];
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_PARALLEL_DEVICE_STATE];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -2151,6 +2485,51 @@ int migrate_multifd_channels(void)
     return s->parameters.multifd_channels;
 }
 
+MultiFDCompression migrate_multifd_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_compression;
+}
+
+int migrate_multifd_zlib_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zlib_level;
+}
+
+int migrate_multifd_zstd_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.multifd_zstd_level;
+}
+
+uint64_t migrate_vcpu_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.vcpu_dirty_limit;
+}
+
+int migrate_bitmap_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.bitmap_sync_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2987,7 +3366,8 @@ static MigThrError migration_detect_error(MigrationState *s)
 /* How many bytes have we transferred since the beggining of the migration */
 static uint64_t migration_total_bytes(MigrationState *s)
 {
-    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes;
+    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes +
+        ram_counters.mapped_ram_bytes;
 }
 
 static void migration_calculate_complete(MigrationState *s)
@@ -3105,6 +3485,8 @@ static void migration_iteration_finish(MigrationState *s)
     cpu_throttle_stop();
 
     qemu_mutex_lock_iothread();
+    /* Likewise for the vcpu dirty limit, whose timer needs the BQL */
+    cpu_dirty_limit_stop();
     switch (s->state) {
     case MIGRATION_STATUS_COMPLETED:
         migration_calculate_complete(s);
@@ -3392,6 +3774,18 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-channels", MigrationState,
                       parameters.multifd_channels,
                       DEFAULT_MIGRATE_MULTIFD_CHANNELS),
+    DEFINE_PROP_MULTIFD_COMPRESSION("multifd-compression", MigrationState,
+                      parameters.multifd_compression,
+                      DEFAULT_MIGRATE_MULTIFD_COMPRESSION),
+    DEFINE_PROP_UINT8("multifd-zlib-level", MigrationState,
+                      parameters.multifd_zlib_level,
+                      DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL),
+    DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
+                      parameters.multifd_zstd_level,
+                      DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("bitmap-sync-threads", MigrationState,
+                      parameters.bitmap_sync_threads,
+                      DEFAULT_MIGRATE_BITMAP_SYNC_THREADS),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -3401,6 +3795,18 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("max-cpu-throttle", MigrationState,
                       parameters.max_cpu_throttle,
                       DEFAULT_MIGRATE_MAX_CPU_THROTTLE),
+    DEFINE_PROP_UINT64("vcpu-dirty-limit", MigrationState,
+                      parameters.vcpu_dirty_limit,
+                      DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT),
+    DEFINE_PROP_UINT8("postcopy-prefetch-pages", MigrationState,
+                      parameters.postcopy_prefetch_pages,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_PAGES),
+    DEFINE_PROP_UINT8("postcopy-fault-threads", MigrationState,
+                      parameters.postcopy_fault_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS),
+    DEFINE_PROP_UINT8("device-state-threads", MigrationState,
+                      parameters.device_state_threads,
+                      DEFAULT_MIGRATE_DEVICE_STATE_THREADS),
     DEFINE_PROP_SIZE("announce-initial", MigrationState,
                       parameters.announce_initial,
                       DEFAULT_MIGRATE_ANNOUNCE_INITIAL),
@@ -3427,6 +3833,15 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-lazy-restore", MIGRATION_CAPABILITY_X_LAZY_RESTORE),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_X_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+                        MIGRATION_CAPABILITY_X_ZERO_COPY_SEND),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+                        MIGRATION_CAPABILITY_X_MULTIFD_ZERO_PAGE),
+    DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
+    DEFINE_PROP_MIG_CAP("x-parallel-device-state",
+                        MIGRATION_CAPABILITY_X_PARALLEL_DEVICE_STATE),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -3481,9 +3896,17 @@ static void migration_instance_init(Object *obj)
     params->has_x_checkpoint_delay = true;
     params->has_block_incremental = true;
     params->has_multifd_channels = true;
+    params->has_multifd_compression = true;
+    params->has_multifd_zlib_level = true;
+    params->has_multifd_zstd_level = true;
+    params->has_bitmap_sync_threads = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
+    params->has_vcpu_dirty_limit = true;
+    params->has_postcopy_prefetch_pages = true;
+    params->has_postcopy_fault_threads = true;
+    params->has_device_state_threads = true;
     params->has_announce_initial = true;
     params->has_announce_max = true;
     params->has_announce_rounds = true;
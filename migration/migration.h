@@ -27,6 +27,9 @@ struct PostcopyBlocktimeContext;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
+/* Buckets of the postcopy page request latency histogram */
+#define POSTCOPY_LATENCY_BUCKETS 16
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -42,7 +45,8 @@ struct MigrationIncomingState {
 
     size_t         largest_page_size;
     bool           have_fault_thread;
-    QemuThread     fault_thread;
+    struct PostcopyFaultThread *fault_threads;
+    int            nr_fault_threads;
     QemuSemaphore  fault_thread_sem;
     /* Set this when we want the fault thread to quit */
     bool           fault_thread_quit;
@@ -59,10 +63,28 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
+    /* Serializes page requests to the source, and protects last_rb */
+    QemuMutex page_request_mutex;
+    /* Protects the fields below */
+    QemuMutex page_stats_mutex;
+    /* Host pages the guest faulted on, to the time they were requested */
+    GHashTable *page_requested;
+    /* Number of entries in page_requested, also read without the lock */
+    unsigned int page_requested_count;
+    /* Page request statistics, latencies in microseconds */
+    uint64_t page_requests;
+    uint64_t page_prefetches;
+    uint64_t page_request_latency_max;
+    uint64_t page_request_latency[POSTCOPY_LATENCY_BUCKETS];
     void     *postcopy_tmp_page;
     void     *postcopy_tmp_zero_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
+    /*
+     * The fault thread serves faults from the migration file rather than
+     * the source, until all of RAM is loaded
+     */
+    bool      lazy_restore;
 
     QEMUBH *bh;
 
@@ -83,7 +105,10 @@ struct MigrationIncomingState {
     /* notify PAUSED postcopy incoming migrations to try to continue */
     bool postcopy_recover_triggered;
     QemuSemaphore postcopy_pause_sem_dst;
-    QemuSemaphore postcopy_pause_sem_fault;
+    /* wakes up the fault threads paused until postcopy_resume_count moves */
+    QemuMutex postcopy_pause_mutex;
+    QemuCond postcopy_pause_cond;
+    unsigned int postcopy_resume_count;
 
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
@@ -95,6 +120,7 @@ void migration_incoming_state_destroy(void);
  * Functions to work with blocktime context
  */
 void fill_destination_postcopy_migration_info(MigrationInfo *info);
+void fill_destination_postcopy_request_info(MigrationInfo *info);
 
 #define TYPE_MIGRATION "migration"
 
@@ -266,11 +292,22 @@ bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
+bool migrate_lazy_restore(void);
+bool migrate_mapped_ram(void);
+bool migrate_zero_copy_send(void);
+bool migrate_multifd_zero_page(void);
+bool migrate_dirty_limit(void);
+bool migrate_parallel_device_state(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
+MultiFDCompression migrate_multifd_compression(void);
+int migrate_multifd_zlib_level(void);
+int migrate_multifd_zstd_level(void);
+int migrate_bitmap_sync_threads(void);
+uint64_t migrate_vcpu_dirty_limit(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -290,6 +327,9 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+int migrate_postcopy_prefetch_pages(void);
+int migrate_postcopy_fault_threads(void);
+int migrate_device_state_threads(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
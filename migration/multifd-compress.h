@@ -0,0 +1,43 @@
+/*
+ * Compression methods for multifd channels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MULTIFD_COMPRESS_H
+#define QEMU_MIGRATION_MULTIFD_COMPRESS_H
+
+/*
+ * Each channel has a compression stream of its own, so that channels
+ * compress in parallel.  The pages of a packet are compressed into one
+ * buffer, and the stream is flushed at the end of the packet, so that the
+ * receiving channel can decompress them into the pages of that packet.
+ */
+typedef struct MultiFDCompressMethods {
+    /* Returns the stream state of a sending channel, or NULL on error */
+    void *(*send_setup)(int level, Error **errp);
+    void (*send_cleanup)(void *opaque);
+    /*
+     * Compress the @niov pages of @iov into @buf, which holds @size bytes.
+     * Returns the compressed size, or -1 on error.
+     */
+    ssize_t (*send_prepare)(void *opaque, const struct iovec *iov, int niov,
+                            uint8_t *buf, size_t size, Error **errp);
+    /* Returns the stream state of a receiving channel, or NULL on error */
+    void *(*recv_setup)(Error **errp);
+    void (*recv_cleanup)(void *opaque);
+    /*
+     * Decompress the @size bytes of @buf into the @niov pages of @iov.
+     * Returns 0, or -1 on error.
+     */
+    int (*recv_pages)(void *opaque, const uint8_t *buf, size_t size,
+                      const struct iovec *iov, int niov, Error **errp);
+} MultiFDCompressMethods;
+
+extern const MultiFDCompressMethods multifd_zlib_methods;
+#ifdef CONFIG_ZSTD
+extern const MultiFDCompressMethods multifd_zstd_methods;
+#endif
+
+#endif
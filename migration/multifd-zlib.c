@@ -0,0 +1,123 @@
+/*
+ * zlib compression for multifd channels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qapi/error.h"
+#include "exec/target_page.h"
+#include "multifd-compress.h"
+
+typedef struct {
+    z_stream zs;
+    /*
+     * The guest may write to a page while it is being compressed, which
+     * zlib does not support; it compresses a copy instead.
+     */
+    uint8_t *page;
+} MultiFDZlibSend;
+
+static void *zlib_send_setup(int level, Error **errp)
+{
+    MultiFDZlibSend *z = g_new0(MultiFDZlibSend, 1);
+
+    if (deflateInit(&z->zs, level) != Z_OK) {
+        error_setg(errp, "multifd: deflate init failed: %s",
+                   z->zs.msg ? z->zs.msg : "unknown error");
+        g_free(z);
+        return NULL;
+    }
+    z->page = g_malloc(qemu_target_page_size());
+    return z;
+}
+
+static void zlib_send_cleanup(void *opaque)
+{
+    MultiFDZlibSend *z = opaque;
+
+    deflateEnd(&z->zs);
+    g_free(z->page);
+    g_free(z);
+}
+
+static ssize_t zlib_send_prepare(void *opaque, const struct iovec *iov,
+                                 int niov, uint8_t *buf, size_t size,
+                                 Error **errp)
+{
+    MultiFDZlibSend *z = opaque;
+    z_stream *zs = &z->zs;
+    int i, ret;
+
+    zs->next_out = buf;
+    zs->avail_out = size;
+    for (i = 0; i < niov; i++) {
+        assert(iov[i].iov_len <= qemu_target_page_size());
+        memcpy(z->page, iov[i].iov_base, iov[i].iov_len);
+        zs->next_in = z->page;
+        zs->avail_in = iov[i].iov_len;
+
+        ret = deflate(zs, i == niov - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        if (ret != Z_OK || zs->avail_in || !zs->avail_out) {
+            /* With no space left, the flush may be incomplete */
+            error_setg(errp, "multifd: deflate failed: %s",
+                       zs->msg ? zs->msg : "output buffer full");
+            return -1;
+        }
+    }
+    return size - zs->avail_out;
+}
+
+static void *zlib_recv_setup(Error **errp)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+
+    if (inflateInit(zs) != Z_OK) {
+        error_setg(errp, "multifd: inflate init failed: %s",
+                   zs->msg ? zs->msg : "unknown error");
+        g_free(zs);
+        return NULL;
+    }
+    return zs;
+}
+
+static void zlib_recv_cleanup(void *opaque)
+{
+    z_stream *zs = opaque;
+
+    inflateEnd(zs);
+    g_free(zs);
+}
+
+static int zlib_recv_pages(void *opaque, const uint8_t *buf, size_t size,
+                           const struct iovec *iov, int niov, Error **errp)
+{
+    z_stream *zs = opaque;
+    int i, ret;
+
+    zs->next_in = (uint8_t *)buf;
+    zs->avail_in = size;
+    for (i = 0; i < niov; i++) {
+        zs->next_out = iov[i].iov_base;
+        zs->avail_out = iov[i].iov_len;
+
+        ret = inflate(zs, Z_SYNC_FLUSH);
+        if (ret != Z_OK || zs->avail_out) {
+            error_setg(errp, "multifd: inflate failed on page %d of %d: %s",
+                       i, niov, zs->msg ? zs->msg : "short packet");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const MultiFDCompressMethods multifd_zlib_methods = {
+    .send_setup = zlib_send_setup,
+    .send_cleanup = zlib_send_cleanup,
+    .send_prepare = zlib_send_prepare,
+    .recv_setup = zlib_recv_setup,
+    .recv_cleanup = zlib_recv_cleanup,
+    .recv_pages = zlib_recv_pages,
+};
@@ -0,0 +1,127 @@
+/*
+ * zstd compression for multifd channels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zstd.h>
+#include "qapi/error.h"
+#include "multifd-compress.h"
+
+static void *zstd_send_setup(int level, Error **errp)
+{
+    ZSTD_CStream *zcs = ZSTD_createCStream();
+    size_t ret;
+
+    if (!zcs) {
+        error_setg(errp, "multifd: could not create zstd stream");
+        return NULL;
+    }
+    ret = ZSTD_initCStream(zcs, level);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd: zstd init failed: %s",
+                   ZSTD_getErrorName(ret));
+        ZSTD_freeCStream(zcs);
+        return NULL;
+    }
+    return zcs;
+}
+
+static void zstd_send_cleanup(void *opaque)
+{
+    ZSTD_freeCStream(opaque);
+}
+
+static ssize_t zstd_send_prepare(void *opaque, const struct iovec *iov,
+                                 int niov, uint8_t *buf, size_t size,
+                                 Error **errp)
+{
+    ZSTD_CStream *zcs = opaque;
+    ZSTD_outBuffer out = { .dst = buf, .size = size };
+    int i;
+
+    for (i = 0; i < niov; i++) {
+        ZSTD_inBuffer in = { .src = iov[i].iov_base, .size = iov[i].iov_len };
+        ZSTD_EndDirective mode = i == niov - 1 ? ZSTD_e_flush
+                                               : ZSTD_e_continue;
+        /* Returns when the input is consumed and, if flushing, all out */
+        size_t ret = ZSTD_compressStream2(zcs, &out, &in, mode);
+
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd: zstd compression failed: %s",
+                       ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (in.pos != in.size || (mode == ZSTD_e_flush && ret)) {
+            error_setg(errp, "multifd: zstd output buffer full");
+            return -1;
+        }
+    }
+    return out.pos;
+}
+
+static void *zstd_recv_setup(Error **errp)
+{
+    ZSTD_DStream *zds = ZSTD_createDStream();
+    size_t ret;
+
+    if (!zds) {
+        error_setg(errp, "multifd: could not create zstd stream");
+        return NULL;
+    }
+    ret = ZSTD_initDStream(zds);
+    if (ZSTD_isError(ret)) {
+        error_setg(errp, "multifd: zstd init failed: %s",
+                   ZSTD_getErrorName(ret));
+        ZSTD_freeDStream(zds);
+        return NULL;
+    }
+    return zds;
+}
+
+static void zstd_recv_cleanup(void *opaque)
+{
+    ZSTD_freeDStream(opaque);
+}
+
+static int zstd_recv_pages(void *opaque, const uint8_t *buf, size_t size,
+                           const struct iovec *iov, int niov, Error **errp)
+{
+    ZSTD_DStream *zds = opaque;
+    ZSTD_inBuffer in = { .src = buf, .size = size };
+    int i;
+
+    for (i = 0; i < niov; i++) {
+        ZSTD_outBuffer out = { .dst = iov[i].iov_base,
+                               .size = iov[i].iov_len };
+        size_t ret;
+
+        do {
+            ret = ZSTD_decompressStream(zds, &out, &in);
+        } while (!ZSTD_isError(ret) && ret && in.pos < in.size &&
+                 out.pos < out.size);
+
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd: zstd decompression failed on page "
+                       "%d of %d: %s", i, niov, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (out.pos != out.size) {
+            error_setg(errp, "multifd: short zstd packet, page %d of %d",
+                       i, niov);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const MultiFDCompressMethods multifd_zstd_methods = {
+    .send_setup = zstd_send_setup,
+    .send_cleanup = zstd_send_cleanup,
+    .send_prepare = zstd_send_prepare,
+    .recv_setup = zstd_recv_setup,
+    .recv_cleanup = zstd_recv_cleanup,
+    .recv_pages = zstd_recv_pages,
+};
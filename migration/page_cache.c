@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, the set is the page number modulo the
+ * number of sets
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +19,8 @@
 #include "qapi/error.h"
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -31,19 +34,34 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * Pages are looked up in a set of PAGE_CACHE_WAYS entries selected by
+ * their address, so that a few hot pages that map to the same set do
+ * not keep evicting each other.
+ */
+#define PAGE_CACHE_WAYS 8
+
+/* Sets share this many locks at most */
+#define PAGE_CACHE_LOCKS 64
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint32_t it_hits;
     uint8_t *it_data;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    QemuMutex *locks;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_ways;
+    size_t num_sets;
+    size_t num_locks;
 };
 
 PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
@@ -75,8 +93,12 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
+    cache->num_locks = MIN(cache->num_sets, PAGE_CACHE_LOCKS);
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %zu, %zu ways\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -91,9 +113,15 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
+    cache->locks = g_new(QemuMutex, cache->num_locks);
+    for (i = 0; i < cache->num_locks; i++) {
+        qemu_mutex_init(&cache->locks[i]);
+    }
+
     return cache;
 }
 
@@ -107,34 +135,61 @@ void cache_fini(PageCache *cache)
     for (i = 0; i < cache->max_num_items; i++) {
         g_free(cache->page_cache[i].it_data);
     }
+    for (i = 0; i < cache->num_locks; i++) {
+        qemu_mutex_destroy(&cache->locks[i]);
+    }
 
+    g_free(cache->locks);
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Consecutive pages go to consecutive sets, so a sequential run is spread */
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_set_items(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    return &cache->page_cache[cache_get_set(cache, addr) * cache->num_ways];
+}
 
-    return &cache->page_cache[pos];
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set_items(cache, addr);
+    size_t i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_data && set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
+
+void cache_lock(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_lock(&cache->locks[cache_get_set(cache, addr) %
+                                  cache->num_locks]);
+}
+
+void cache_unlock(PageCache *cache, uint64_t addr)
+{
+    qemu_mutex_unlock(&cache->locks[cache_get_set(cache, addr) %
+                                    cache->num_locks]);
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -144,28 +199,71 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        if (it->it_hits < UINT32_MAX) {
+            it->it_hits++;
+        }
         return true;
     }
     return false;
 }
 
+/*
+ * Pages that keep being dirtied are worth more than pages that were
+ * hit a lot in the past: halve the number of hits for every generation
+ * in which the page was not looked up.
+ */
+static uint32_t cache_item_score(const CacheItem *it, uint64_t current_age)
+{
+    uint64_t idle = current_age - it->it_age;
+
+    return idle >= 32 ? 0 : it->it_hits >> idle;
+}
+
+static CacheItem *cache_find_victim(const PageCache *cache, uint64_t addr,
+                                    uint64_t current_age)
+{
+    CacheItem *set = cache_get_set_items(cache, addr);
+    CacheItem *victim = NULL;
+    size_t i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (!it->it_data || it->it_addr == addr) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim ||
+            cache_item_score(it, current_age) <
+            cache_item_score(victim, current_age) ||
+            (cache_item_score(it, current_age) ==
+             cache_item_score(victim, current_age) &&
+             it->it_age < victim->it_age)) {
+            victim = it;
+        }
+    }
+    return victim;
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
 
     CacheItem *it;
+    int ret = 0;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
+    it = cache_find_victim(cache, addr, current_age);
+    if (!it) {
         return -1;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -173,7 +271,10 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
             DPRINTF("Error allocating page\n");
             return -1;
         }
-        cache->num_items++;
+        atomic_inc(&cache->num_items);
+    } else if (it->it_addr != addr) {
+        it->it_hits = 0;
+        ret = 1;
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
@@ -181,5 +282,5 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     it->it_age = current_age;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
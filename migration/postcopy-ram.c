@@ -111,6 +111,14 @@ typedef struct PostcopyBlocktimeContext {
     Notifier exit_notifier;
 } PostcopyBlocktimeContext;
 
+/* One of the threads that handle the userfaults of the guest */
+typedef struct PostcopyFaultThread {
+    QemuThread thread;
+    MigrationIncomingState *mis;
+    /* The primary thread also handles the faults of shared memory users */
+    bool primary;
+} PostcopyFaultThread;
+
 static void destroy_blocktime_context(struct PostcopyBlocktimeContext *ctx)
 {
     g_free(ctx->page_fault_vcpu_time);
@@ -538,12 +546,27 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
+        int i;
 
-        /* Let the fault thread quit */
+        /* Let the fault threads quit, even those waiting for a resume */
         atomic_set(&mis->fault_thread_quit, 1);
         postcopy_fault_thread_notify(mis);
+        qemu_mutex_lock(&mis->postcopy_pause_mutex);
+        qemu_cond_broadcast(&mis->postcopy_pause_cond);
+        qemu_mutex_unlock(&mis->postcopy_pause_mutex);
         trace_postcopy_ram_incoming_cleanup_join();
-        qemu_thread_join(&mis->fault_thread);
+        for (i = 0; i < mis->nr_fault_threads; i++) {
+            qemu_thread_join(&mis->fault_threads[i].thread);
+        }
+        g_free(mis->fault_threads);
+        mis->fault_threads = NULL;
+        mis->nr_fault_threads = 0;
+
+        qemu_mutex_lock(&mis->page_stats_mutex);
+        g_hash_table_destroy(mis->page_requested);
+        mis->page_requested = NULL;
+        atomic_set(&mis->page_requested_count, 0);
+        qemu_mutex_unlock(&mis->page_stats_mutex);
 
         if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_END, &local_err)) {
             error_report_err(local_err);
@@ -679,6 +702,134 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     return ret;
 }
 
+/*
+ * Ask the source for @len bytes at @start in @rb.  All the fault threads
+ * send their requests through here, so that a request without a RAMBlock
+ * name always follows one for the same RAMBlock.
+ */
+static int postcopy_request_pages(MigrationIncomingState *mis, RAMBlock *rb,
+                                  ram_addr_t start, size_t len)
+{
+    int ret;
+
+    trace_postcopy_request_pages(qemu_ram_get_idstr(rb), start, len);
+    qemu_mutex_lock(&mis->page_request_mutex);
+    if (rb != mis->last_rb) {
+        mis->last_rb = rb;
+        ret = migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
+                                        start, len);
+    } else {
+        /* Save some space */
+        ret = migrate_send_rp_req_pages(mis, NULL, start, len);
+    }
+    if (ret) {
+        /* The source may not have got the RAMBlock name */
+        mis->last_rb = NULL;
+    }
+    qemu_mutex_unlock(&mis->page_request_mutex);
+
+    if (!ret) {
+        qemu_mutex_lock(&mis->page_stats_mutex);
+        mis->page_requests++;
+        mis->page_prefetches += len / qemu_ram_pagesize(rb) - 1;
+        qemu_mutex_unlock(&mis->page_stats_mutex);
+    }
+
+    return ret;
+}
+
+/*
+ * Length of the request for the host page at @rb_offset: the page itself,
+ * followed by up to postcopy-prefetch-pages pages that have not been
+ * received yet, since the guest is likely to touch them next.
+ */
+static size_t postcopy_request_len(RAMBlock *rb, ram_addr_t rb_offset)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    ram_addr_t end = qemu_ram_get_used_length(rb);
+    size_t len = pagesize;
+    int i;
+
+    for (i = 0; i < migrate_postcopy_prefetch_pages(); i++) {
+        /* The length of a request is 32 bits on the wire */
+        if (rb_offset + len >= end || len + pagesize > UINT32_MAX ||
+            ramblock_recv_bitmap_test_byte_offset(rb, rb_offset + len)) {
+            break;
+        }
+        len += pagesize;
+    }
+
+    return len;
+}
+
+/*
+ * Remember when the guest faulted on the host page at @rb_offset, for the
+ * latency histogram.  Returns false if the page was placed in the
+ * meantime, so it need not be requested.
+ */
+static bool postcopy_request_begin(MigrationIncomingState *mis, RAMBlock *rb,
+                                   ram_addr_t rb_offset)
+{
+    void *host = qemu_ram_get_host_addr(rb) + rb_offset;
+
+    qemu_mutex_lock(&mis->page_stats_mutex);
+    if (!g_hash_table_contains(mis->page_requested, host)) {
+        int64_t *start = g_new(int64_t, 1);
+
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(mis->page_requested, host, start);
+        atomic_inc(&mis->page_requested_count);
+    }
+    qemu_mutex_unlock(&mis->page_stats_mutex);
+
+    /*
+     * Pages are marked as received, with a full barrier, before
+     * postcopy_request_end reads page_requested_count, and atomic_inc
+     * is a full barrier too: either it finds the entry or we see the
+     * page here.
+     */
+    if (ramblock_recv_bitmap_test_byte_offset(rb, rb_offset)) {
+        qemu_mutex_lock(&mis->page_stats_mutex);
+        if (g_hash_table_remove(mis->page_requested, host)) {
+            atomic_dec(&mis->page_requested_count);
+        }
+        qemu_mutex_unlock(&mis->page_stats_mutex);
+        return false;
+    }
+
+    return true;
+}
+
+/* Account the latency of the host page at @host if the guest faulted on it */
+static void postcopy_request_end(MigrationIncomingState *mis, void *host)
+{
+    int64_t *start;
+    uint64_t latency;
+    int bucket;
+
+    /* Most placed pages were not faulted on, spare them the lock */
+    if (!atomic_read(&mis->page_requested_count)) {
+        return;
+    }
+
+    qemu_mutex_lock(&mis->page_stats_mutex);
+    start = mis->page_requested ?
+            g_hash_table_lookup(mis->page_requested, host) : NULL;
+    if (start) {
+        latency = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *start) / SCALE_US;
+        /* Less than 32us, then one bucket per power of two */
+        bucket = latency < 32 ? 0 : 59 - clz64(latency);
+        mis->page_request_latency[MIN(bucket,
+                                      POSTCOPY_LATENCY_BUCKETS - 1)]++;
+        mis->page_request_latency_max = MAX(mis->page_request_latency_max,
+                                            latency);
+        g_hash_table_remove(mis->page_requested, host);
+        atomic_dec(&mis->page_requested_count);
+        trace_postcopy_request_end(host, latency);
+    }
+    qemu_mutex_unlock(&mis->page_stats_mutex);
+}
+
 /*
  * Callback from shared fault handlers to ask for a page,
  * the page must be specified by a RAMBlock and an offset in that rb
@@ -698,14 +849,7 @@ int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                         qemu_ram_get_idstr(rb), rb_offset);
         return postcopy_wake_shared(pcfd, client_addr, rb);
     }
-    if (rb != mis->last_rb) {
-        mis->last_rb = rb;
-        migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
-                                  aligned_rbo, pagesize);
-    } else {
-        /* Save some space */
-        migrate_send_rp_req_pages(mis, NULL, aligned_rbo, pagesize);
-    }
+    postcopy_request_pages(mis, rb, aligned_rbo, pagesize);
     return 0;
 }
 
@@ -851,15 +995,111 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
                                       affected_cpu);
 }
 
-static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
+/*
+ * Number of times postcopy resumed, read by a fault thread before it
+ * uses the return path.
+ */
+static unsigned int postcopy_resume_count(MigrationIncomingState *mis)
+{
+    unsigned int count;
+
+    qemu_mutex_lock(&mis->postcopy_pause_mutex);
+    count = mis->postcopy_resume_count;
+    qemu_mutex_unlock(&mis->postcopy_pause_mutex);
+    return count;
+}
+
+/*
+ * Wait until postcopy resumes after the return path failure seen by the
+ * caller, which read @resume_count before.  Any number of fault threads
+ * can wait, and none waits if the return path was rebuilt meanwhile.
+ * Returns false if the fault threads must quit instead.
+ */
+static bool postcopy_pause_fault_thread(MigrationIncomingState *mis,
+                                        unsigned int resume_count)
 {
+    bool quit;
+
     trace_postcopy_pause_fault_thread();
 
-    qemu_sem_wait(&mis->postcopy_pause_sem_fault);
+    qemu_mutex_lock(&mis->postcopy_pause_mutex);
+    while (mis->postcopy_resume_count == resume_count &&
+           !atomic_read(&mis->fault_thread_quit)) {
+        qemu_cond_wait(&mis->postcopy_pause_cond, &mis->postcopy_pause_mutex);
+    }
+    quit = atomic_read(&mis->fault_thread_quit);
+    qemu_mutex_unlock(&mis->postcopy_pause_mutex);
 
     trace_postcopy_pause_fault_thread_continued();
 
-    return true;
+    return !quit;
+}
+
+/*
+ * Handle a fault of the guest on its RAM.  Returns 0 on success, or
+ * nonzero if the fault thread cannot continue.
+ */
+static int postcopy_handle_fault(MigrationIncomingState *mis,
+                                 struct uffd_msg *msg)
+{
+    RAMBlock *rb;
+    ram_addr_t rb_offset;
+    size_t len;
+    int ret;
+
+    rb = qemu_ram_block_from_host(
+             (void *)(uintptr_t)msg->arg.pagefault.address,
+             true, &rb_offset);
+    if (!rb) {
+        error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                     PRIx64, (uint64_t)msg->arg.pagefault.address);
+        return -1;
+    }
+
+    rb_offset &= ~(qemu_ram_pagesize(rb) - 1);
+    trace_postcopy_ram_fault_thread_request(msg->arg.pagefault.address,
+                                            qemu_ram_get_idstr(rb),
+                                            rb_offset,
+                                            msg->arg.pagefault.feat.ptid);
+    mark_postcopy_blocktime_begin(
+            (uintptr_t)(msg->arg.pagefault.address),
+                        msg->arg.pagefault.feat.ptid, rb);
+
+    if (mis->lazy_restore) {
+        /* The page is in the migration file, no need to ask */
+        ram_lazy_restore_page(rb, rb_offset);
+        return 0;
+    }
+
+    if (!postcopy_request_begin(mis, rb, rb_offset)) {
+        /* Placing the page woke the guest up already */
+        return 0;
+    }
+
+    /*
+     * Send the request to the source - we want to request one
+     * of our host page sizes (which is >= TPS), and maybe the
+     * following ones
+     */
+    len = postcopy_request_len(rb, rb_offset);
+    for (;;) {
+        unsigned int resume_count = postcopy_resume_count(mis);
+
+        ret = postcopy_request_pages(mis, rb, rb_offset, len);
+        if (!ret) {
+            break;
+        }
+        /* May be network failure, try to wait for recovery */
+        if (ret != -EIO || !postcopy_pause_fault_thread(mis, resume_count)) {
+            /* This is a unavoidable fault */
+            error_report("%s: migrate_send_rp_req_pages() get %d",
+                         __func__, ret);
+            return ret;
+        }
+        /* We got reconnected somehow, try to continue */
+    }
+
+    return 0;
 }
 
 /*
@@ -867,20 +1107,22 @@ static bool postcopy_pause_fault_thread(MigrationIncomingState *mis)
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
-    MigrationIncomingState *mis = opaque;
+    PostcopyFaultThread *pft = opaque;
+    MigrationIncomingState *mis = pft->mis;
     struct uffd_msg msg;
     int ret;
     size_t index;
-    RAMBlock *rb = NULL;
 
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
-    mis->last_rb = NULL; /* last RAMBlock we sent part of */
     qemu_sem_post(&mis->fault_thread_sem);
 
     struct pollfd *pfd;
-    size_t pfd_len = 2 + mis->postcopy_remote_fds->len;
+    size_t pfd_len = 2;
 
+    if (pft->primary) {
+        pfd_len += mis->postcopy_remote_fds->len;
+    }
     pfd = g_new0(struct pollfd, pfd_len);
 
     pfd[0].fd = mis->userfault_fd;
@@ -888,7 +1130,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     pfd[1].fd = mis->userfault_event_fd;
     pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
     trace_postcopy_ram_fault_thread_fds_core(pfd[0].fd, pfd[1].fd);
-    for (index = 0; index < mis->postcopy_remote_fds->len; index++) {
+    for (index = 0; index < pfd_len - 2; index++) {
         struct PostCopyFD *pcfd = &g_array_index(mis->postcopy_remote_fds,
                                                  struct PostCopyFD, index);
         pfd[2 + index].fd = pcfd->fd;
@@ -898,7 +1140,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     }
 
     while (true) {
-        ram_addr_t rb_offset;
+        unsigned int resume_count;
         int poll_result;
 
         /*
@@ -913,18 +1155,20 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        if (!mis->to_src_file) {
+        resume_count = postcopy_resume_count(mis);
+        if (!mis->to_src_file && !mis->lazy_restore) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
              * the channel is rebuilt.
              */
-            if (postcopy_pause_fault_thread(mis)) {
+            if (postcopy_pause_fault_thread(mis, resume_count)) {
+                qemu_mutex_lock(&mis->page_request_mutex);
                 mis->last_rb = NULL;
+                qemu_mutex_unlock(&mis->page_request_mutex);
                 /* Continue to read the userfaultfd */
             } else {
-                error_report("%s: paused but don't allow to continue",
-                             __func__);
+                trace_postcopy_ram_fault_thread_quit();
                 break;
             }
         }
@@ -932,16 +1176,18 @@ static void *postcopy_ram_fault_thread(void *opaque)
         if (pfd[1].revents) {
             uint64_t tmp64 = 0;
 
-            /* Consume the signal */
-            if (read(mis->userfault_event_fd, &tmp64, 8) != 8) {
-                /* Nothing obviously nicer than posting this error. */
-                error_report("%s: read() failed", __func__);
-            }
-
+            /* Leave the eventfd set, so that every fault thread quits */
             if (atomic_read(&mis->fault_thread_quit)) {
                 trace_postcopy_ram_fault_thread_quit();
                 break;
             }
+
+            /* Consume the signal, unless another fault thread did */
+            if (read(mis->userfault_event_fd, &tmp64, 8) != 8 &&
+                errno != EAGAIN) {
+                /* Nothing obviously nicer than posting this error. */
+                error_report("%s: read() failed", __func__);
+            }
         }
 
         if (pfd[0].revents) {
@@ -973,56 +1219,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
                 continue; /* It's not a page fault, shouldn't happen */
             }
 
-            rb = qemu_ram_block_from_host(
-                     (void *)(uintptr_t)msg.arg.pagefault.address,
-                     true, &rb_offset);
-            if (!rb) {
-                error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                             PRIx64, (uint64_t)msg.arg.pagefault.address);
+            if (postcopy_handle_fault(mis, &msg)) {
                 break;
             }
-
-            rb_offset &= ~(qemu_ram_pagesize(rb) - 1);
-            trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset,
-                                                msg.arg.pagefault.feat.ptid);
-            mark_postcopy_blocktime_begin(
-                    (uintptr_t)(msg.arg.pagefault.address),
-                                msg.arg.pagefault.feat.ptid, rb);
-
-retry:
-            /*
-             * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
-             */
-            if (rb != mis->last_rb) {
-                mis->last_rb = rb;
-                ret = migrate_send_rp_req_pages(mis,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset,
-                                                qemu_ram_pagesize(rb));
-            } else {
-                /* Save some space */
-                ret = migrate_send_rp_req_pages(mis,
-                                                NULL,
-                                                rb_offset,
-                                                qemu_ram_pagesize(rb));
-            }
-
-            if (ret) {
-                /* May be network failure, try to wait for recovery */
-                if (ret == -EIO && postcopy_pause_fault_thread(mis)) {
-                    /* We got reconnected somehow, try to continue */
-                    mis->last_rb = NULL;
-                    goto retry;
-                } else {
-                    /* This is a unavoidable fault */
-                    error_report("%s: migrate_send_rp_req_pages() get %d",
-                                 __func__, ret);
-                    break;
-                }
-            }
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1089,6 +1288,8 @@ retry:
 
 int postcopy_ram_enable_notify(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1105,8 +1306,11 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
-    /* Now an eventfd we use to tell the fault-thread to quit */
-    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC);
+    /*
+     * Now an eventfd we use to tell the fault-thread to quit; it is
+     * non-blocking because all the fault threads poll it
+     */
+    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
     if (mis->userfault_event_fd == -1) {
         error_report("%s: Opening userfault_event_fd: %s", __func__,
                      strerror(errno));
@@ -1114,10 +1318,32 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    qemu_mutex_lock(&mis->page_stats_mutex);
+    mis->page_requested = g_hash_table_new_full(g_direct_hash, NULL,
+                                                NULL, g_free);
+    atomic_set(&mis->page_requested_count, 0);
+    mis->page_requests = 0;
+    mis->page_prefetches = 0;
+    mis->page_request_latency_max = 0;
+    memset(mis->page_request_latency, 0, sizeof(mis->page_request_latency));
+    qemu_mutex_unlock(&mis->page_stats_mutex);
+
+    /* Lazy restore reads the faulting pages from the file one at a time */
+    mis->nr_fault_threads = mis->lazy_restore ?
+                            1 : migrate_postcopy_fault_threads();
+    mis->fault_threads = g_new0(PostcopyFaultThread, mis->nr_fault_threads);
     qemu_sem_init(&mis->fault_thread_sem, 0);
-    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
-                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
-    qemu_sem_wait(&mis->fault_thread_sem);
+    for (i = 0; i < mis->nr_fault_threads; i++) {
+        PostcopyFaultThread *pft = &mis->fault_threads[i];
+
+        pft->mis = mis;
+        pft->primary = i == 0;
+        qemu_thread_create(&pft->thread, "postcopy/fault",
+                           postcopy_ram_fault_thread, pft,
+                           QEMU_THREAD_JOINABLE);
+        qemu_sem_wait(&mis->fault_thread_sem);
+    }
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
 
@@ -1160,6 +1386,7 @@ static int qemu_ufd_copy_ioctl(int userfault_fd, void *host_addr,
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
         mark_postcopy_blocktime_end((uintptr_t)host_addr);
+        postcopy_request_end(migration_incoming_get_current(), host_addr);
 
     }
     return ret;
@@ -1351,6 +1578,37 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Populate MigrationInfo with the statistics of the page requests,
+ * once the destination has requested pages
+ */
+void fill_destination_postcopy_request_info(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyRequestStats *stats;
+    intList **tail;
+    int i;
+
+    qemu_mutex_lock(&mis->page_stats_mutex);
+    if (mis->page_requests) {
+        stats = g_new0(PostcopyRequestStats, 1);
+        stats->requests = mis->page_requests;
+        stats->prefetched_pages = mis->page_prefetches;
+        stats->latency_max = mis->page_request_latency_max;
+        tail = &stats->latency_histogram;
+        for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+            intList *entry = g_new0(intList, 1);
+
+            entry->value = mis->page_request_latency[i];
+            *tail = entry;
+            tail = &entry->next;
+        }
+        info->has_postcopy_requests = true;
+        info->postcopy_requests = stats;
+    }
+    qemu_mutex_unlock(&mis->page_stats_mutex);
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
@@ -1366,6 +1624,15 @@ void postcopy_fault_thread_notify(MigrationIncomingState *mis)
     }
 }
 
+/* Wake up the fault threads paused by a return path failure */
+void postcopy_resume_fault_threads(MigrationIncomingState *mis)
+{
+    qemu_mutex_lock(&mis->postcopy_pause_mutex);
+    mis->postcopy_resume_count++;
+    qemu_cond_broadcast(&mis->postcopy_pause_cond);
+    qemu_mutex_unlock(&mis->postcopy_pause_mutex);
+}
+
 /**
  * postcopy_discard_send_init: Called at the start of each RAMBlock before
  *   asking to discard individual ranges.
@@ -115,6 +115,7 @@ PostcopyState postcopy_state_get(void);
 PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
+void postcopy_resume_fault_threads(MigrationIncomingState *mis);
 
 /*
  * To be called once at the start before any device initialisation
@@ -27,6 +27,7 @@
 #include "exec/cpu-common.h"
 #include "qemu-file.h"
 #include "io/channel-socket.h"
+#include "io/channel-file.h"
 #include "qemu/iov.h"
 
 
@@ -145,6 +146,78 @@ static int channel_set_blocking(void *opaque,
     return 0;
 }
 
+#ifndef _WIN32
+/*
+ * Only plain files are accessed at random; the fd of other channels may be a
+ * pipe or a socket, and buffered channels have no fd at all.
+ */
+static int64_t channel_seek(void *opaque, int64_t offset, int whence)
+{
+    QIOChannelFile *fioc;
+    off_t ret;
+
+    fioc = (QIOChannelFile *)object_dynamic_cast(OBJECT(opaque),
+                                                 TYPE_QIO_CHANNEL_FILE);
+    if (!fioc) {
+        return -ENOTSUP;
+    }
+
+    ret = lseek(fioc->fd, offset, whence);
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret;
+}
+
+
+static ssize_t channel_read_at(void *opaque,
+                               uint8_t *buf,
+                               int64_t offset,
+                               size_t size)
+{
+    QIOChannelFile *fioc = QIO_CHANNEL_FILE(opaque);
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t len = pread(fioc->fd, buf + done, size - done, offset + done);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            break;
+        }
+        done += len;
+    }
+    return done;
+}
+
+static ssize_t channel_write_at(void *opaque,
+                                const uint8_t *buf,
+                                int64_t offset,
+                                size_t size)
+{
+    QIOChannelFile *fioc = QIO_CHANNEL_FILE(opaque);
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t len = pwrite(fioc->fd, buf + done, size - done, offset + done);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += len;
+    }
+    return done;
+}
+#endif
+
 static QEMUFile *channel_get_input_return_path(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -165,6 +238,10 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+#ifndef _WIN32
+    .seek = channel_seek,
+    .read_at = channel_read_at,
+#endif
 };
 
 
@@ -174,6 +251,10 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+#ifndef _WIN32
+    .seek = channel_seek,
+    .write_at = channel_write_at,
+#endif
 };
 
 
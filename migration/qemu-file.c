@@ -46,6 +46,8 @@ struct QEMUFile {
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
+    /* offset of the stream in the backing file, -1 if not known */
+    int64_t base;
 
     DECLARE_BITMAP(may_free, MAX_IOV_SIZE);
     struct iovec iov[MAX_IOV_SIZE];
@@ -98,6 +100,7 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 
     f->opaque = opaque;
     f->ops = ops;
+    f->base = -1;
     return f;
 }
 
@@ -313,6 +316,15 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Count 'size' bytes that were sent on the side, e.g. written at their
+ * place in the file, against the rate limit of the stream.
+ */
+void qemu_file_update_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -427,6 +439,111 @@ void qemu_file_skip(QEMUFile *f, int size)
     }
 }
 
+/*
+ * Whether the file supports qemu_file_read_at() or qemu_file_write_at(),
+ * depending on its direction, and qemu_file_seek_forward().  Output
+ * is flushed.
+ */
+bool qemu_file_has_random_access(QEMUFile *f)
+{
+    int64_t offset;
+
+    if (f->base >= 0) {
+        return true;
+    }
+    if (!f->ops->seek ||
+        !(qemu_file_is_writable(f) ? f->ops->write_at : f->ops->read_at)) {
+        return false;
+    }
+
+    qemu_fflush(f);
+    offset = f->ops->seek(f->opaque, 0, SEEK_CUR);
+    if (offset < 0) {
+        return false;
+    }
+    /* f->pos is the amount of data read or written so far */
+    f->base = offset - f->pos;
+    return true;
+}
+
+/*
+ * Offset in the backing file of the next byte that the stream reads or
+ * writes.  The file must have random access.
+ */
+int64_t qemu_file_offset(QEMUFile *f)
+{
+    assert(f->base >= 0);
+
+    if (qemu_file_is_writable(f)) {
+        return f->base + qemu_ftell_fast(f);
+    }
+    return f->base + f->pos - (f->buf_size - f->buf_index);
+}
+
+/*
+ * Continue the stream at 'offset' in the backing file, which must not be
+ * before qemu_file_offset().  Input in between is skipped without reading
+ * it if possible; output leaves a hole, which the caller may fill with
+ * qemu_file_write_at().  Either way it does not count as transferred.
+ *
+ * Returns 0 or a negative errno value.
+ */
+int qemu_file_seek_forward(QEMUFile *f, int64_t offset)
+{
+    int64_t cur = qemu_file_offset(f);
+    int64_t ret;
+
+    assert(offset >= cur);
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        ret = qemu_file_get_error(f);
+        if (ret < 0) {
+            return ret;
+        }
+    } else if (offset - cur <= f->buf_size - f->buf_index) {
+        f->buf_index += offset - cur;
+        return 0;
+    }
+
+    ret = f->ops->seek(f->opaque, offset, SEEK_SET);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    f->base = offset - f->pos;
+    f->buf_index = 0;
+    f->buf_size = 0;
+    return 0;
+}
+
+/*
+ * Read 'size' bytes at 'offset' in a file with random access.  This may be
+ * called from any thread, and does not affect the stream.
+ *
+ * Returns the number of bytes read, which is less than 'size' only at the
+ * end of the file, or a negative errno value.
+ */
+ssize_t qemu_file_read_at(QEMUFile *f, uint8_t *buf, int64_t offset,
+                          size_t size)
+{
+    return f->ops->read_at(f->opaque, buf, offset, size);
+}
+
+/*
+ * Write 'size' bytes at 'offset' in a file with random access.  Like
+ * qemu_file_read_at(), this may be called from any thread.  Writing past
+ * qemu_file_offset() is not allowed, because the stream would overwrite
+ * the data.
+ *
+ * Returns 'size' or a negative errno value.
+ */
+ssize_t qemu_file_write_at(QEMUFile *f, const uint8_t *buf, int64_t offset,
+                           size_t size)
+{
+    return f->ops->write_at(f->opaque, buf, offset, size);
+}
+
 /*
  * Read 'size' bytes from file (at 'offset') without moving the
  * pointer and set 'buf' to point to that data.
@@ -590,6 +707,12 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/* Number of bytes that the caller has read from an input stream so far */
+int64_t qemu_file_consumed(QEMUFile *f)
+{
+    return f->pos - (f->buf_size - f->buf_index);
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -99,6 +99,28 @@ typedef QEMUFile *(QEMURetPathFunc)(void *opaque);
  */
 typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
+/*
+ * Move the position of the backing file like lseek() does; returns the
+ * new offset or a negative errno value.  Only files with random access
+ * provide this, together with read_at for input or write_at for output.
+ */
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset, int whence);
+
+/*
+ * Read a chunk of data at the given offset of the backing file, without
+ * moving its position.  Unlike the other operations, this one may be
+ * called from any thread while the QEMUFile is in use.
+ */
+typedef ssize_t (QEMUFileReadAtFunc)(void *opaque, uint8_t *buf,
+                                     int64_t offset, size_t size);
+
+/*
+ * Write a chunk of data at the given offset of the backing file, without
+ * moving its position.  Like read_at, this may be called from any thread.
+ */
+typedef ssize_t (QEMUFileWriteAtFunc)(void *opaque, const uint8_t *buf,
+                                      int64_t offset, size_t size);
+
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
@@ -106,6 +128,9 @@ typedef struct QEMUFileOps {
     QEMUFileWritevBufferFunc *writev_buffer;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileSeekFunc *seek;
+    QEMUFileReadAtFunc *read_at;
+    QEMUFileWriteAtFunc *write_at;
 } QEMUFileOps;
 
 typedef struct QEMUFileHooks {
@@ -121,6 +146,7 @@ int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
 int64_t qemu_ftell_fast(QEMUFile *f);
+int64_t qemu_file_consumed(QEMUFile *f);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
@@ -145,7 +171,15 @@ int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
  */
 int qemu_peek_byte(QEMUFile *f, int offset);
 void qemu_file_skip(QEMUFile *f, int size);
+bool qemu_file_has_random_access(QEMUFile *f);
+int64_t qemu_file_offset(QEMUFile *f);
+int qemu_file_seek_forward(QEMUFile *f, int64_t offset);
+ssize_t qemu_file_read_at(QEMUFile *f, uint8_t *buf, int64_t offset,
+                          size_t size);
+ssize_t qemu_file_write_at(QEMUFile *f, const uint8_t *buf, int64_t offset,
+                           size_t size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, size_t size);
 void qemu_file_reset_rate_limit(QEMUFile *f);
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate);
 int64_t qemu_file_get_rate_limit(QEMUFile *f);
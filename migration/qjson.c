@@ -88,6 +88,21 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/*
+ * Append the members written to @from, which must be a new and unfinished
+ * QJSON, to the current object of @json.
+ */
+void json_merge_object(QJSON *json, QJSON *from)
+{
+    const char *members = qjson_get_str(from) + strlen("{ ");
+
+    if (from->omit_comma) {
+        return;
+    }
+    json_emit_element(json, NULL);
+    qstring_append(json->str, members);
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
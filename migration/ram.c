@@ -30,6 +30,7 @@
 #include "cpu.h"
 #include <zlib.h>
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -57,6 +58,7 @@
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "multifd-compress.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -351,6 +353,8 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* Threads that help migration_bitmap_sync, NULL if there are none */
+    BitmapSyncPool *bitmap_sync_pool;
 };
 typedef struct RAMState RAMState;
 
@@ -412,6 +416,10 @@ typedef struct PageSearchStatus PageSearchStatus;
 
 CompressionStats compression_counters;
 
+DirtySyncStats dirty_sync_counters;
+
+typedef struct BitmapSyncPool BitmapSyncPool;
+
 struct CompressParam {
     bool done;
     bool quit;
@@ -580,9 +588,16 @@ exit:
 
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
+/* Packets can carry zero pages, with the x-multifd-zero-page capability */
+#define MULTIFD_VERSION_ZERO_PAGE 2
 
 #define MULTIFD_FLAG_SYNC (1 << 0)
 
+/* The pages of the packet are compressed with the method in these bits */
+#define MULTIFD_FLAG_COMPRESSION_MASK (3 << 1)
+#define MULTIFD_FLAG_ZLIB (1 << 1)
+#define MULTIFD_FLAG_ZSTD (2 << 1)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -605,7 +620,10 @@ typedef struct {
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* number of zero pages, whose offsets follow the used ones */
+    uint32_t zero_pages;
+    uint32_t unused32[1];  /* Reserved for future use */
+    uint64_t unused64[3];  /* Reserved for future use */
     char ramblock[256];
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -621,6 +639,10 @@ typedef struct {
     ram_addr_t *offset;
     /* pointer to each page */
     struct iovec *iov;
+    /* number of zero pages, found by the channel threads */
+    uint32_t zero_num;
+    /* offset of each zero page */
+    ram_addr_t *zero;
     RAMBlock *block;
 } MultiFDPages_t;
 
@@ -661,6 +683,13 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages not yet accounted by the migration thread */
+    uint64_t zero_pending;
+    /* compression stream, NULL if pages are sent as they are */
+    void *compress;
+    /* buffer for the compressed pages of a packet */
+    uint8_t *zbuf;
+    uint32_t zbuf_len;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
 }  MultiFDSendParams;
@@ -696,17 +725,28 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* decompression stream, NULL if pages are sent as they are */
+    void *compress;
+    /* buffer for the compressed pages of a packet */
+    uint8_t *zbuf;
+    uint32_t zbuf_len;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
 } MultiFDRecvParams;
 
+static uint32_t multifd_version(void)
+{
+    return migrate_multifd_zero_page() ? MULTIFD_VERSION_ZERO_PAGE
+                                       : MULTIFD_VERSION;
+}
+
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
     MultiFDInit_t msg;
     int ret;
 
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
-    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.version = cpu_to_be32(multifd_version());
     msg.id = p->id;
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
@@ -736,9 +776,9 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
-    if (msg.version != MULTIFD_VERSION) {
+    if (msg.version != multifd_version()) {
         error_setg(errp, "multifd: received packet version %d "
-                   "expected %d", msg.version, MULTIFD_VERSION);
+                   "expected %d", msg.version, multifd_version());
         return -1;
     }
 
@@ -755,7 +795,7 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
 
     if (msg.id > migrate_multifd_channels()) {
         error_setg(errp, "multifd: received channel version %d "
-                   "expected %d", msg.version, MULTIFD_VERSION);
+                   "expected %d", msg.version, multifd_version());
         return -1;
     }
 
@@ -769,6 +809,7 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
     pages->allocated = size;
     pages->iov = g_new0(struct iovec, size);
     pages->offset = g_new0(ram_addr_t, size);
+    pages->zero = g_new0(ram_addr_t, size);
 
     return pages;
 }
@@ -783,22 +824,48 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     pages->iov = NULL;
     g_free(pages->offset);
     pages->offset = NULL;
+    pages->zero_num = 0;
+    g_free(pages->zero);
+    pages->zero = NULL;
     g_free(pages);
 }
 
-static void multifd_send_fill_packet(MultiFDSendParams *p)
+static const MultiFDCompressMethods *multifd_compress_methods(uint32_t *flag,
+                                                             int *level)
+{
+    switch (migrate_multifd_compression()) {
+    case MULTIFD_COMPRESSION_ZLIB:
+        *flag = MULTIFD_FLAG_ZLIB;
+        *level = migrate_multifd_zlib_level();
+        return &multifd_zlib_methods;
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ZSTD:
+        *flag = MULTIFD_FLAG_ZSTD;
+        *level = migrate_multifd_zstd_level();
+        return &multifd_zstd_methods;
+#endif
+    default:
+        *flag = 0;
+        *level = 0;
+        return NULL;
+    }
+}
+
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t flags,
+                                     uint64_t packet_num)
 {
     MultiFDPacket_t *packet = p->packet;
     uint32_t page_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     int i;
 
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-    packet->version = cpu_to_be32(MULTIFD_VERSION);
-    packet->flags = cpu_to_be32(p->flags);
+    packet->version = cpu_to_be32(multifd_version());
+    packet->flags = cpu_to_be32(flags);
     packet->pages_alloc = cpu_to_be32(page_max);
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
-    packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->packet_num = cpu_to_be64(packet_num);
+    packet->zero_pages = cpu_to_be32(p->pages->zero_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -807,6 +874,32 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     for (i = 0; i < p->pages->used; i++) {
         packet->offset[i] = cpu_to_be64(p->pages->offset[i]);
     }
+    for (i = 0; i < p->pages->zero_num; i++) {
+        packet->offset[p->pages->used + i] =
+            cpu_to_be64(p->pages->zero[i]);
+    }
+}
+
+/*
+ * Move the zero pages of @pages out of the ones to send, so that only
+ * their offsets go in the packet.  This runs in the channel threads,
+ * which spreads the scanning of RAM over all of them.
+ */
+static void multifd_send_zero_scan(MultiFDPages_t *pages)
+{
+    uint32_t i, used = 0;
+
+    pages->zero_num = 0;
+    for (i = 0; i < pages->used; i++) {
+        if (buffer_is_zero(pages->iov[i].iov_base, pages->iov[i].iov_len)) {
+            pages->zero[pages->zero_num++] = pages->offset[i];
+        } else {
+            pages->offset[used] = pages->offset[i];
+            pages->iov[used] = pages->iov[i];
+            used++;
+        }
+    }
+    pages->used = used;
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -825,10 +918,10 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (packet->version != multifd_version()) {
         error_setg(errp, "multifd: received packet "
                    "version %d and expected version %d",
-                   packet->version, MULTIFD_VERSION);
+                   packet->version, multifd_version());
         return -1;
     }
 
@@ -862,10 +955,23 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    /* Version 1 packets keep that field reserved */
+    p->pages->zero_num = 0;
+    if (packet->version == MULTIFD_VERSION_ZERO_PAGE) {
+        p->pages->zero_num = be32_to_cpu(packet->zero_pages);
+    }
+    if (p->pages->zero_num > packet->pages_alloc - p->pages->used) {
+        error_setg(errp, "multifd: received packet "
+                   "with %d zero pages and expected maximum zero pages are %d",
+                   p->pages->zero_num, packet->pages_alloc - p->pages->used);
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used) {
+    p->pages->block = NULL;
+    if (p->pages->used || p->pages->zero_num) {
         /* make sure that ramblock is 0 terminated */
         packet->ramblock[255] = 0;
         block = qemu_ram_block_by_name(packet->ramblock);
@@ -874,9 +980,10 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        packet->ramblock);
             return -1;
         }
+        p->pages->block = block;
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->pages->zero_num; i++) {
         ram_addr_t offset = be64_to_cpu(packet->offset[i]);
 
         if (offset > (block->used_length - TARGET_PAGE_SIZE)) {
@@ -885,8 +992,12 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
+        if (i < p->pages->used) {
+            p->pages->iov[i].iov_base = block->host + offset;
+            p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
+        } else {
+            p->pages->zero[i - p->pages->used] = offset;
+        }
     }
 
     return 0;
@@ -904,6 +1015,11 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* compression methods, NULL if pages are sent as they are */
+    const MultiFDCompressMethods *ops;
+    int level;
+    /* MULTIFD_FLAG_* bits for the compression method */
+    uint32_t compress_flag;
 } *multifd_send_state;
 
 /*
@@ -924,6 +1040,21 @@ struct {
  * false.
  */
 
+/*
+ * Pages are accounted as normal when they are queued; fix up the ones
+ * that the channel found to be zero since.  Called with p->mutex held.
+ */
+static void multifd_send_account_zero_pages(MultiFDSendParams *p)
+{
+    uint64_t bytes = p->zero_pending * TARGET_PAGE_SIZE;
+
+    ram_counters.duplicate += p->zero_pending;
+    ram_counters.normal -= p->zero_pending;
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    p->zero_pending = 0;
+}
+
 static void multifd_send_pages(void)
 {
     int i;
@@ -937,6 +1068,7 @@ static void multifd_send_pages(void)
         p = &multifd_send_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
+        multifd_send_account_zero_pages(p);
         if (!p->pending_job) {
             p->pending_job++;
             next_channel = (i + 1) % migrate_multifd_channels();
@@ -1035,6 +1167,8 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->zbuf);
+        p->zbuf = NULL;
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     qemu_sem_destroy(&multifd_send_state->sem_sync);
@@ -1075,12 +1209,21 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_send_state->sem_sync);
     }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account_zero_pages(p);
+        qemu_mutex_unlock(&p->mutex);
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
+    const MultiFDCompressMethods *ops = multifd_send_state->ops;
+    bool zero_copy = migrate_zero_copy_send();
     Error *local_err = NULL;
     int ret;
 
@@ -1093,6 +1236,20 @@ static void *multifd_send_thread(void *opaque)
     /* initial packet */
     p->num_packets = 1;
 
+    if (ops) {
+        p->compress = ops->send_setup(multifd_send_state->level, &local_err);
+        if (!p->compress) {
+            goto out;
+        }
+    }
+
+    if (zero_copy &&
+        !qio_channel_has_feature(p->c, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd: channel %d does not support "
+                   "zero copy send", p->id);
+        goto out;
+    }
+
     while (true) {
         qemu_sem_wait(&p->sem);
         qemu_mutex_lock(&p->mutex);
@@ -1100,17 +1257,41 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
-            uint32_t flags = p->flags;
+            uint32_t flags = p->flags | multifd_send_state->compress_flag;
+            uint32_t zero_num;
 
-            p->next_packet_size = used * qemu_target_page_size();
-            multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
-            p->pages->used = 0;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            /*
+             * The pages belong to this thread until pending_job is
+             * decremented, so they are scanned and compressed without
+             * the lock.
+             */
+            if (migrate_multifd_zero_page()) {
+                multifd_send_zero_scan(p->pages);
+            }
+            used = p->pages->used;
+            zero_num = p->pages->zero_num;
+
+            if (used && p->compress) {
+                ssize_t size = ops->send_prepare(p->compress, p->pages->iov,
+                                                 used, p->zbuf, p->zbuf_len,
+                                                 &local_err);
+                if (size < 0) {
+                    break;
+                }
+                p->next_packet_size = size;
+            } else {
+                p->next_packet_size = used * qemu_target_page_size();
+            }
+            multifd_send_fill_packet(p, flags, packet_num);
+            p->pages->used = 0;
+            p->pages->zero_num = 0;
+
+            trace_multifd_send(p->id, packet_num, used, zero_num, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -1119,7 +1300,19 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
-            if (used) {
+            if (used && p->compress) {
+                ret = qio_channel_write_all(p->c, (void *)p->zbuf,
+                                            p->next_packet_size, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else if (used && zero_copy) {
+                ret = qio_channel_writev_zero_copy_all(p->c, p->pages->iov,
+                                                       used, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            } else if (used) {
                 ret = qio_channel_writev_all(p->c, p->pages->iov,
                                              used, &local_err);
                 if (ret != 0) {
@@ -1127,8 +1320,29 @@ static void *multifd_send_thread(void *opaque)
                 }
             }
 
+            /*
+             * With zero copy, the kernel reads the pages after they
+             * were queued, so it may send a newer version than the one
+             * we meant to.  That is harmless: their dirty bits were
+             * cleared before they were queued, so any write to them is
+             * caught by the next bitmap sync and they are sent again
+             * after this sync point.  Waiting for all completions here
+             * also makes sure nothing is still in flight when the
+             * migration completes.
+             */
+            if (zero_copy && (flags & MULTIFD_FLAG_SYNC)) {
+                ret = qio_channel_flush(p->c, &local_err);
+                if (ret < 0) {
+                    break;
+                }
+                if (ret == 1) {
+                    trace_multifd_send_zero_copy_copied(p->id);
+                }
+            }
+
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
+            p->zero_pending += zero_num;
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
@@ -1148,6 +1362,10 @@ out:
     if (local_err) {
         multifd_send_terminate_threads(local_err);
     }
+    if (p->compress) {
+        ops->send_cleanup(p->compress);
+        p->compress = NULL;
+    }
 
     qemu_mutex_lock(&p->mutex);
     p->running = false;
@@ -1195,6 +1413,9 @@ int multifd_save_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    multifd_send_state->ops =
+        multifd_compress_methods(&multifd_send_state->compress_flag,
+                                 &multifd_send_state->level);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1209,6 +1430,11 @@ int multifd_save_setup(void)
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
+        if (multifd_send_state->ops) {
+            /* Room for data that does not compress well */
+            p->zbuf_len = 2 * page_count * qemu_target_page_size();
+            p->zbuf = g_malloc(p->zbuf_len);
+        }
         p->name = g_strdup_printf("multifdsend_%d", i);
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
@@ -1223,6 +1449,10 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* decompression methods, NULL if pages are sent as they are */
+    const MultiFDCompressMethods *ops;
+    /* MULTIFD_FLAG_* bits expected in every packet */
+    uint32_t compress_flag;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -1278,6 +1508,8 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        g_free(p->zbuf);
+        p->zbuf = NULL;
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
@@ -1318,15 +1550,23 @@ static void multifd_recv_sync_main(void)
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
+    const MultiFDCompressMethods *ops = multifd_recv_state->ops;
     Error *local_err = NULL;
     int ret;
 
     trace_multifd_recv_thread_start(p->id);
     rcu_register_thread();
 
-    while (true) {
+    if (ops) {
+        p->compress = ops->recv_setup(&local_err);
+    }
+
+    while (!local_err) {
         uint32_t used;
+        uint32_t zero_num;
         uint32_t flags;
+        uint32_t size;
+        uint32_t i;
 
         ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
                                        p->packet_len, &local_err);
@@ -1345,14 +1585,40 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero_num = p->pages->zero_num;
         flags = p->flags;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
-                           p->next_packet_size);
+        size = p->next_packet_size;
+        trace_multifd_recv(p->id, p->packet_num, used, zero_num, flags, size);
         p->num_packets++;
-        p->num_pages += used;
+        p->num_pages += used + zero_num;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
+        if ((flags & MULTIFD_FLAG_COMPRESSION_MASK) !=
+            multifd_recv_state->compress_flag) {
+            error_setg(&local_err, "multifd: received packet with "
+                       "compression flags 0x%x, expected 0x%x",
+                       flags & MULTIFD_FLAG_COMPRESSION_MASK,
+                       multifd_recv_state->compress_flag);
+            break;
+        }
+
+        if (used && p->compress) {
+            if (size > p->zbuf_len) {
+                error_setg(&local_err, "multifd: compressed packet size %u "
+                           "larger than %u", size, p->zbuf_len);
+                break;
+            }
+            ret = qio_channel_read_all(p->c, (void *)p->zbuf, size,
+                                       &local_err);
+            if (ret != 0) {
+                break;
+            }
+            ret = ops->recv_pages(p->compress, p->zbuf, size, p->pages->iov,
+                                  used, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        } else if (used) {
             ret = qio_channel_readv_all(p->c, p->pages->iov,
                                         used, &local_err);
             if (ret != 0) {
@@ -1360,6 +1626,11 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        for (i = 0; i < zero_num; i++) {
+            ram_handle_compressed(p->pages->block->host + p->pages->zero[i],
+                                  0, TARGET_PAGE_SIZE);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1369,6 +1640,10 @@ static void *multifd_recv_thread(void *opaque)
     if (local_err) {
         multifd_recv_terminate_threads(local_err);
     }
+    if (p->compress) {
+        ops->recv_cleanup(p->compress);
+        p->compress = NULL;
+    }
     qemu_mutex_lock(&p->mutex);
     p->running = false;
     qemu_mutex_unlock(&p->mutex);
@@ -1381,7 +1656,7 @@ static void *multifd_recv_thread(void *opaque)
 
 int multifd_load_setup(void)
 {
-    int thread_count;
+    int thread_count, level;
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     uint8_t i;
 
@@ -1393,6 +1668,8 @@ int multifd_load_setup(void)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    multifd_recv_state->ops =
+        multifd_compress_methods(&multifd_recv_state->compress_flag, &level);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1404,6 +1681,10 @@ int multifd_load_setup(void)
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
+        if (multifd_recv_state->ops) {
+            p->zbuf_len = 2 * page_count * qemu_target_page_size();
+            p->zbuf = g_malloc(p->zbuf_len);
+        }
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
     return 0;
@@ -1542,8 +1823,12 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    cache_lock(XBZRLE.cache, current_addr);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count)) {
+        xbzrle_counters.cache_collision++;
+    }
+    cache_unlock(XBZRLE.cache, current_addr);
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -1556,7 +1841,9 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
  *          -1 means that xbzrle would be longer than normal
  *
  * @rs: current RAM state
- * @current_data: pointer to the address of the page contents
+ * @current_data: pointer to the address of the page contents; on -1, it
+ *                may be changed to XBZRLE.current_buf, which holds a copy
+ *                of the cached page to send instead
  * @current_addr: addr of the page
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
@@ -1566,24 +1853,35 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
+    cache_lock(XBZRLE.cache, current_addr);
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
-                return -1;
-            } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret) {
+                xbzrle_counters.cache_collision++;
+            }
+            if (ret != -1) {
+                /*
+                 * Send what was inserted into the cache.  Other threads
+                 * may replace the cached page once it is unlocked, so
+                 * send a copy of it.
+                 */
+                memcpy(XBZRLE.current_buf,
+                       get_cached_data(XBZRLE.cache, current_addr),
+                       TARGET_PAGE_SIZE);
+                *current_data = XBZRLE.current_buf;
             }
         }
+        cache_unlock(XBZRLE.cache, current_addr);
         return -1;
     }
+    xbzrle_counters.cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -1596,22 +1894,28 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                                        TARGET_PAGE_SIZE);
     if (encoded_len == 0) {
         trace_save_xbzrle_page_skipping();
+        xbzrle_counters.cache_useful_hit++;
+        cache_unlock(XBZRLE.cache, current_addr);
         return 0;
     } else if (encoded_len == -1) {
         trace_save_xbzrle_page_overflow();
         xbzrle_counters.overflow++;
         /* update data in the cache */
         if (!last_stage) {
-            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
-            *current_data = prev_cached_page;
+            /* XBZRLE.current_buf is what the cache now holds */
+            memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+            *current_data = XBZRLE.current_buf;
         }
+        cache_unlock(XBZRLE.cache, current_addr);
         return -1;
     }
+    xbzrle_counters.cache_useful_hit++;
 
     /* we need to update the data in the cache, in order to get the same data */
     if (!last_stage) {
         memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
     }
+    cache_unlock(XBZRLE.cache, current_addr);
 
     /* Send XBZRLE based compressed page */
     bytes_xbzrle = save_page_header(rs, rs->f, block,
@@ -1688,6 +1992,190 @@ static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
                                               &rs->num_dirty_pages_period);
 }
 
+/*
+ * Range of RAM merged by one thread at a time.  It is a multiple of
+ * BITS_PER_LONG pages, so that two threads never write the same word of
+ * a migration bitmap.
+ */
+#define BITMAP_SYNC_CHUNK (1 * GiB)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncChunk;
+
+typedef struct {
+    BitmapSyncPool *pool;
+    /* results of this thread for the current sync */
+    uint64_t num_dirty;
+    uint64_t real_dirty;
+} BitmapSyncWorker;
+
+struct BitmapSyncPool {
+    /* helper threads; the migration thread does its share too */
+    int nthreads;
+    QemuThread *threads;
+    /* nthreads + 1 entries, the last one for the migration thread */
+    BitmapSyncWorker *workers;
+    /* posted once per thread to start a sync, or to quit */
+    QemuSemaphore start;
+    /* posted by each thread when it finds no chunk left */
+    QemuSemaphore done;
+    bool quit;
+    GArray *chunks;
+    /* next chunk to take */
+    unsigned int next;
+};
+
+static void bitmap_sync_work(BitmapSyncWorker *w)
+{
+    BitmapSyncPool *pool = w->pool;
+    unsigned int i;
+
+    while ((i = atomic_fetch_inc(&pool->next)) < pool->chunks->len) {
+        BitmapSyncChunk *c = &g_array_index(pool->chunks, BitmapSyncChunk, i);
+
+        w->num_dirty += cpu_physical_memory_sync_dirty_bitmap(c->block,
+                                                              c->start,
+                                                              c->length,
+                                                              &w->real_dirty);
+    }
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncWorker *w = opaque;
+    BitmapSyncPool *pool = w->pool;
+
+    rcu_register_thread();
+    for (;;) {
+        qemu_sem_wait(&pool->start);
+        if (atomic_read(&pool->quit)) {
+            break;
+        }
+        /*
+         * The migration thread holds its own read lock meanwhile, but
+         * that does not protect the blocks walked by this thread.
+         */
+        rcu_read_lock();
+        bitmap_sync_work(w);
+        rcu_read_unlock();
+        qemu_sem_post(&pool->done);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static BitmapSyncPool *bitmap_sync_pool_new(int nthreads)
+{
+    BitmapSyncPool *pool = g_new0(BitmapSyncPool, 1);
+    int i;
+
+    pool->nthreads = nthreads;
+    pool->threads = g_new0(QemuThread, nthreads);
+    pool->workers = g_new0(BitmapSyncWorker, nthreads + 1);
+    pool->chunks = g_array_new(false, false, sizeof(BitmapSyncChunk));
+    qemu_sem_init(&pool->start, 0);
+    qemu_sem_init(&pool->done, 0);
+
+    for (i = 0; i <= nthreads; i++) {
+        pool->workers[i].pool = pool;
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_create(&pool->threads[i], "bitmap-sync",
+                           bitmap_sync_thread, &pool->workers[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    return pool;
+}
+
+static void bitmap_sync_pool_free(BitmapSyncPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+    atomic_set(&pool->quit, true);
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_sem_post(&pool->start);
+    }
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    qemu_sem_destroy(&pool->start);
+    qemu_sem_destroy(&pool->done);
+    g_array_free(pool->chunks, true);
+    g_free(pool->workers);
+    g_free(pool->threads);
+    g_free(pool);
+}
+
+/*
+ * Merge the dirty logs of all blocks into the migration bitmap, split in
+ * chunks that the pool threads and the migration thread take in turn.
+ * The pool follows the bitmap-sync-threads parameter, which may change
+ * between syncs, without going over the number of host CPUs.
+ * Called with the RCU read lock and bitmap_mutex held.
+ */
+static void migration_bitmap_sync_blocks(RAMState *rs)
+{
+    BitmapSyncPool *pool = rs->bitmap_sync_pool;
+    int nthreads = MIN(migrate_bitmap_sync_threads(),
+                       (int)g_get_num_processors());
+    RAMBlock *block;
+    int i;
+
+    if (pool && pool->nthreads != nthreads - 1) {
+        bitmap_sync_pool_free(pool);
+        pool = rs->bitmap_sync_pool = NULL;
+    }
+
+    if (nthreads <= 1) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            migration_bitmap_sync_range(rs, block, 0, block->used_length);
+        }
+        dirty_sync_counters.threads = 1;
+        return;
+    }
+
+    if (!pool) {
+        pool = rs->bitmap_sync_pool = bitmap_sync_pool_new(nthreads - 1);
+    }
+
+    g_array_set_size(pool->chunks, 0);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        BitmapSyncChunk c = { .block = block };
+
+        for (c.start = 0; c.start < block->used_length;
+             c.start += BITMAP_SYNC_CHUNK) {
+            c.length = MIN(BITMAP_SYNC_CHUNK, block->used_length - c.start);
+            g_array_append_val(pool->chunks, c);
+        }
+    }
+    for (i = 0; i <= pool->nthreads; i++) {
+        pool->workers[i].num_dirty = 0;
+        pool->workers[i].real_dirty = 0;
+    }
+    pool->next = 0;
+
+    /* The semaphores order these stores before the threads' loads */
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_sem_post(&pool->start);
+    }
+    bitmap_sync_work(&pool->workers[pool->nthreads]);
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_sem_wait(&pool->done);
+    }
+
+    for (i = 0; i <= pool->nthreads; i++) {
+        rs->migration_dirty_pages += pool->workers[i].num_dirty;
+        rs->num_dirty_pages_period += pool->workers[i].real_dirty;
+    }
+    dirty_sync_counters.threads = pool->nthreads + 1;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1757,8 +2245,7 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
 
 static void migration_bitmap_sync(RAMState *rs)
 {
-    RAMBlock *block;
-    int64_t end_time;
+    int64_t end_time, t0, t1, t2;
     uint64_t bytes_xfer_now;
 
     ram_counters.dirty_sync_count++;
@@ -1768,18 +2255,26 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    t0 = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
+    t1 = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
-    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        migration_bitmap_sync_range(rs, block, 0, block->used_length);
-    }
+    migration_bitmap_sync_blocks(rs);
     ram_counters.remaining = ram_bytes_remaining();
     rcu_read_unlock();
     qemu_mutex_unlock(&rs->bitmap_mutex);
+    t2 = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    dirty_sync_counters.log_sync = t1 - t0;
+    dirty_sync_counters.bitmap_merge = t2 - t1;
+    dirty_sync_counters.total_log_sync += t1 - t0;
+    dirty_sync_counters.total_bitmap_merge += t2 - t1;
 
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    dirty_sync_counters.threads,
+                                    t1 - t0, t2 - t1);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1790,7 +2285,8 @@ static void migration_bitmap_sync(RAMState *rs)
         /* During block migration the auto-converge logic incorrectly detects
          * that ram migration makes no progress. Avoid this by disabling the
          * throttling logic during the bulk phase of block migration. */
-        if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+        if ((migrate_auto_converge() || migrate_dirty_limit()) &&
+            !blk_mig_bulk_active()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
@@ -1802,7 +2298,11 @@ static void migration_bitmap_sync(RAMState *rs)
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
                     rs->dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
+                    if (migrate_dirty_limit()) {
+                        cpu_dirty_limit_set(migrate_vcpu_dirty_limit());
+                    } else {
+                        mig_throttle_guest_down();
+                    }
             }
         }
 
@@ -2441,61 +2941,375 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
-/**
- * ram_save_target_page: save one target page
+/*
+ * Mapped RAM
  *
- * Returns the number of pages written
+ * With the x-mapped-ram capability, the stream only contains the RAM block
+ * list.  Each RAM block gets a region of the migration file that holds a
+ * bitmap of the pages that are present, and then every page of the block
+ * at a fixed offset.  The region follows the description of the block
+ * in the stream, which simply continues after it.
  *
- * @rs: current RAM state
- * @pss: data about the page we want to send
- * @last_stage: if we are at the completion stage
+ * Pages are written in place with qemu_file_write_at() by a pool of
+ * threads, so the file is no larger than RAM however often the pages are
+ * dirtied.  Zero pages are left out of the bitmap instead of written.  The
+ * bitmaps are written at the end, once they are final.
  */
-static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
-                                bool last_stage)
+
+/* Alignment of the pages in the file, for huge pages and direct I/O */
+#define MAPPED_RAM_ALIGN        (1 * MiB)
+/* Contiguous dirty pages are written together up to this size */
+#define MAPPED_RAM_MAX_WRITE    (1 * MiB)
+/* Writes queued for each thread before the migration thread waits */
+#define MAPPED_RAM_QUEUE_DEPTH  8
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t size;
+} MappedRAMWrite;
+
+typedef struct {
+    QEMUFile *file;
+    QemuThread *threads;
+    int nthreads;
+    /* Protects the fields below */
+    QemuMutex lock;
+    /* Signalled when writes are queued, or on exit */
+    QemuCond work_cond;
+    /* Signalled when a write completes */
+    QemuCond done_cond;
+    MappedRAMWrite *queue;
+    unsigned int queue_size;
+    unsigned int head;
+    unsigned int count;
+    unsigned int in_flight;
+    int error;
+    bool quit;
+    /* Owned by the migration thread: contiguous pages not yet queued */
+    MappedRAMWrite pending;
+} MappedRAMSaveState;
+
+static MappedRAMSaveState *mapped_ram_save;
+
+/* Size of the bitmap of a block in the file, in bytes */
+static uint64_t mapped_ram_bitmap_size(uint64_t pages)
 {
-    RAMBlock *block = pss->block;
-    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
-    int res;
+    return ROUND_UP(pages, 64) / BITS_PER_BYTE;
+}
 
-    if (control_save_page(rs, block, offset, &res)) {
-        return res;
-    }
+static void *mapped_ram_write_thread(void *opaque)
+{
+    MappedRAMSaveState *mr = opaque;
 
-    if (save_compress_page(rs, block, offset)) {
-        return 1;
-    }
+    rcu_register_thread();
 
-    res = save_zero_page(rs, block, offset);
-    if (res > 0) {
-        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
-         * page would be stale
-         */
-        if (!save_page_use_compression(rs)) {
-            XBZRLE_cache_lock();
-            xbzrle_cache_zero_page(rs, block->offset + offset);
-            XBZRLE_cache_unlock();
+    qemu_mutex_lock(&mr->lock);
+    while (true) {
+        MappedRAMWrite w;
+        ssize_t ret;
+
+        while (!mr->count && !mr->quit) {
+            qemu_cond_wait(&mr->work_cond, &mr->lock);
         }
-        ram_release_pages(block->idstr, offset, res);
-        return res;
+        if (mr->quit) {
+            break;
+        }
+
+        w = mr->queue[mr->head];
+        mr->head = (mr->head + 1) % mr->queue_size;
+        mr->count--;
+        mr->in_flight++;
+        qemu_mutex_unlock(&mr->lock);
+
+        rcu_read_lock();
+        ret = qemu_file_write_at(mr->file, w.block->host + w.offset,
+                                 w.block->pages_offset + w.offset, w.size);
+        rcu_read_unlock();
+        trace_ram_mapped_write(w.block->idstr, w.offset, w.size);
+
+        qemu_mutex_lock(&mr->lock);
+        if (ret < 0 && !mr->error) {
+            mr->error = ret;
+        }
+        mr->in_flight--;
+        qemu_cond_broadcast(&mr->done_cond);
     }
+    qemu_mutex_unlock(&mr->lock);
 
-    /*
-     * do not use multifd for compression as the first page in the new
-     * block should be posted out before sending the compressed page
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
-        return ram_save_multifd_page(rs, block, offset);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void mapped_ram_save_cleanup(void)
+{
+    MappedRAMSaveState *mr = mapped_ram_save;
+    int i;
+
+    if (!mr) {
+        return;
     }
 
-    return ram_save_page(rs, pss, last_stage);
+    /* Writes still queued are dropped, the migration failed anyway */
+    qemu_mutex_lock(&mr->lock);
+    mr->quit = true;
+    qemu_cond_broadcast(&mr->work_cond);
+    qemu_mutex_unlock(&mr->lock);
+    for (i = 0; i < mr->nthreads; i++) {
+        qemu_thread_join(&mr->threads[i]);
+    }
+
+    qemu_cond_destroy(&mr->done_cond);
+    qemu_cond_destroy(&mr->work_cond);
+    qemu_mutex_destroy(&mr->lock);
+    g_free(mr->queue);
+    g_free(mr->threads);
+    g_free(mr);
+    mapped_ram_save = NULL;
 }
 
-/**
- * ram_save_host_page: save a whole host page
- *
- * Starting at *offset send pages up to the end of the current host
- * page. It's valid for the initial offset to point into the middle of
- * a host page in which case the remainder of the hostpage is sent.
+static int mapped_ram_save_setup(QEMUFile *f)
+{
+    MappedRAMSaveState *mr;
+    int i;
+
+    if (!qemu_file_has_random_access(f)) {
+        error_report("Mapped RAM needs a migration file that can be "
+                     "written at random");
+        return -EINVAL;
+    }
+
+    mr = g_new0(MappedRAMSaveState, 1);
+    mr->file = f;
+    mr->nthreads = migrate_multifd_channels();
+    mr->threads = g_new0(QemuThread, mr->nthreads);
+    mr->queue_size = mr->nthreads * MAPPED_RAM_QUEUE_DEPTH;
+    mr->queue = g_new0(MappedRAMWrite, mr->queue_size);
+    qemu_mutex_init(&mr->lock);
+    qemu_cond_init(&mr->work_cond);
+    qemu_cond_init(&mr->done_cond);
+    mapped_ram_save = mr;
+
+    for (i = 0; i < mr->nthreads; i++) {
+        char *name = g_strdup_printf("mapped-ram-%d", i);
+
+        qemu_thread_create(&mr->threads[i], name, mapped_ram_write_thread,
+                           mr, QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+    return 0;
+}
+
+/*
+ * Reserve the region of @block right after its description in the
+ * stream, and describe it.
+ */
+static int mapped_ram_save_block_header(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t pages = block->max_length >> TARGET_PAGE_BITS;
+
+    block->file_bmap = bitmap_new(ROUND_UP(pages, 64));
+    block->bitmap_offset = qemu_file_offset(f) + 3 * sizeof(uint64_t);
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(pages),
+                                   MAPPED_RAM_ALIGN);
+
+    qemu_put_be64(f, pages);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    return qemu_file_seek_forward(f, block->pages_offset +
+                                  (pages << TARGET_PAGE_BITS));
+}
+
+static void mapped_ram_queue_pending(MappedRAMSaveState *mr)
+{
+    if (!mr->pending.size) {
+        return;
+    }
+
+    qemu_mutex_lock(&mr->lock);
+    while (mr->count == mr->queue_size) {
+        qemu_cond_wait(&mr->done_cond, &mr->lock);
+    }
+    mr->queue[(mr->head + mr->count) % mr->queue_size] = mr->pending;
+    mr->count++;
+    qemu_cond_signal(&mr->work_cond);
+    qemu_mutex_unlock(&mr->lock);
+
+    ram_counters.mapped_ram_bytes += mr->pending.size;
+    ram_counters.transferred += mr->pending.size;
+    mr->pending.size = 0;
+}
+
+/*
+ * Wait until every page queued so far is in the file.
+ *
+ * Returns 0 or the first error of the write threads.
+ */
+static int mapped_ram_flush(void)
+{
+    MappedRAMSaveState *mr = mapped_ram_save;
+    int ret;
+
+    if (!mr) {
+        return 0;
+    }
+
+    mapped_ram_queue_pending(mr);
+
+    qemu_mutex_lock(&mr->lock);
+    while (mr->count || mr->in_flight) {
+        qemu_cond_wait(&mr->done_cond, &mr->lock);
+    }
+    ret = mr->error;
+    qemu_mutex_unlock(&mr->lock);
+    return ret;
+}
+
+/**
+ * ram_save_mapped_page: save a target page at its place in the file
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    MappedRAMSaveState *mr = mapped_ram_save;
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    MappedRAMWrite *pending = &mr->pending;
+
+    if (!block->file_bmap) {
+        /* Added after the setup, so it has no region in the file */
+        error_report("RAM block %s is not in the migration file",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    if (buffer_is_zero(block->host + offset, TARGET_PAGE_SIZE)) {
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    ram_counters.normal++;
+    /* Like a page in the stream, it counts against max-bandwidth */
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+
+    if (pending->size && pending->block == block &&
+        pending->offset + pending->size == offset &&
+        pending->size < MAPPED_RAM_MAX_WRITE) {
+        pending->size += TARGET_PAGE_SIZE;
+        return 1;
+    }
+
+    mapped_ram_queue_pending(mr);
+    pending->block = block;
+    pending->offset = offset;
+    pending->size = TARGET_PAGE_SIZE;
+    return 1;
+}
+
+/* Write the final bitmaps, after the pages */
+static int mapped_ram_save_bitmaps(void)
+{
+    RAMBlock *block;
+    int ret = mapped_ram_flush();
+
+    if (ret) {
+        return ret;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t pages = block->max_length >> TARGET_PAGE_BITS;
+        unsigned long *le_bitmap = bitmap_new(ROUND_UP(pages, 64));
+        uint64_t size = mapped_ram_bitmap_size(pages);
+
+        bitmap_to_le(le_bitmap, block->file_bmap, pages);
+        ret = qemu_file_write_at(mapped_ram_save->file, (uint8_t *)le_bitmap,
+                                 block->bitmap_offset, size);
+        g_free(le_bitmap);
+        if (ret < 0) {
+            return ret;
+        }
+        ram_counters.mapped_ram_bytes += size;
+        ram_counters.transferred += size;
+    }
+    return 0;
+}
+
+/**
+ * ram_save_target_page: save one target page
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
+                                bool last_stage)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+    int res;
+
+    if (control_save_page(rs, block, offset, &res)) {
+        return res;
+    }
+
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
+    if (save_compress_page(rs, block, offset)) {
+        return 1;
+    }
+
+    /*
+     * The multifd channels can look for zero pages themselves.  In
+     * postcopy the zero page must be known here to release it.
+     */
+    if (!save_page_use_compression(rs) && migrate_use_multifd() &&
+        migrate_multifd_zero_page() && !migration_in_postcopy()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    res = save_zero_page(rs, block, offset);
+    if (res > 0) {
+        /* Must let xbzrle know, otherwise a previous (now 0'd) cached
+         * page would be stale
+         */
+        if (!save_page_use_compression(rs)) {
+            XBZRLE_cache_lock();
+            xbzrle_cache_zero_page(rs, block->offset + offset);
+            XBZRLE_cache_unlock();
+        }
+        ram_release_pages(block->idstr, offset, res);
+        return res;
+    }
+
+    /*
+     * do not use multifd for compression as the first page in the new
+     * block should be posted out before sending the compressed page
+     */
+    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    return ram_save_page(rs, pss, last_stage);
+}
+
+/**
+ * ram_save_host_page: save a whole host page
+ *
+ * Starting at *offset send pages up to the end of the current host
+ * page. It's valid for the initial offset to point into the middle of
+ * a host page in which case the remainder of the hostpage is sent.
  * Only dirty target pages are sent. Note that the host page size may
  * be a huge page for this block.
  * The saving stops at the boundary of the used_length of the block
@@ -2565,7 +3379,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -2582,7 +3396,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
     do {
         again = true;
-        found = get_queued_page(rs, &pss);
+        found = urgent = get_queued_page(rs, &pss);
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -2594,6 +3408,15 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         }
     } while (!pages && again);
 
+    /*
+     * The destination is waiting for a requested page; do not leave it in
+     * the buffer behind background pages once the queue is drained
+     */
+    if (urgent && pages > 0 &&
+        QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
+        qemu_fflush(rs->f);
+    }
+
     rs->last_seen_block = pss.block;
     rs->last_page = pss.page;
 
@@ -2651,6 +3474,7 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        bitmap_sync_pool_free((*rsp)->bitmap_sync_pool);
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2690,9 +3514,12 @@ static void ram_save_cleanup(void *opaque)
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
+    mapped_ram_save_cleanup();
     compress_threads_save_cleanup();
     ram_state_cleanup(rsp);
 }
@@ -3182,6 +4009,7 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    memset(&dirty_sync_counters, 0, sizeof(dirty_sync_counters));
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -3360,6 +4188,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->f = f;
 
+    if (migrate_mapped_ram() && mapped_ram_save_setup(f)) {
+        return -1;
+    }
+
     rcu_read_lock();
 
     qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
@@ -3375,6 +4207,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             qemu_put_be64(f, block->mr->addr);
             qemu_put_byte(f, ramblock_is_ignored(block) ? 1 : 0);
         }
+        if (migrate_mapped_ram() && !ramblock_is_ignored(block) &&
+            mapped_ram_save_block_header(f, block)) {
+            rcu_read_unlock();
+            return -1;
+        }
     }
 
     rcu_read_unlock();
@@ -3461,6 +4298,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         i++;
     }
+
+    /* The write threads use the blocks */
+    ret = mapped_ram_flush();
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
     rcu_read_unlock();
 
     /*
@@ -3524,6 +4367,10 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    if (!ret && migrate_mapped_ram()) {
+        ret = mapped_ram_save_bitmaps();
+    }
+
     flush_compressed_data(rs);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
@@ -3957,11 +4804,419 @@ void colo_release_ram_cache(void)
     }
 
     rcu_read_unlock();
+    bitmap_sync_pool_free(ram_state->bitmap_sync_pool);
     qemu_mutex_destroy(&ram_state->bitmap_mutex);
     g_free(ram_state);
     ram_state = NULL;
 }
 
+/*
+ * Lazy restore
+ *
+ * When loading a file in the mapped RAM format, the destination need not
+ * copy the pages into guest RAM before the guest starts.  The bitmaps of
+ * the file tell where each page is, without reading any page data, and
+ * the postcopy fault thread reads the pages that the guest touches while
+ * a background thread loads the rest.  Guest RAM is registered with the
+ * userfaultfd as soon as the RAM block list is known, so that loading the
+ * device state can already fault pages in.
+ */
+typedef struct {
+    QEMUFile *file;
+    /*
+     * Protects lazy_offsets, and makes sure that the loaders place every
+     * host page only once
+     */
+    QemuMutex lock;
+    QemuThread thread;
+    /* One host page for each thread that loads pages from the file */
+    uint8_t *fault_buf;
+    uint8_t *load_buf;
+    uint64_t fault_pages;
+    uint64_t background_pages;
+} RAMLazyRestoreState;
+
+static RAMLazyRestoreState *lazy_restore;
+
+/*
+ * A page that cannot be loaded leaves guest RAM incomplete, and the vCPU
+ * that faulted on it waiting forever, so the guest can neither go on nor
+ * be stopped.  Like a failed postcopy, give up before guest RAM is taken
+ * away from the userfaultfd, after which the missing pages read as zeros.
+ */
+static void QEMU_NORETURN ram_lazy_restore_abort(void)
+{
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Load the host page at @offset of @block into guest RAM, unless it is
+ * there already.  Called with lazy_restore->lock held.
+ */
+static void ram_lazy_place(RAMBlock *block, ram_addr_t offset, uint8_t *buf)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    size_t page_size = block->page_size;
+    bool zero = true;
+    size_t i;
+    int ret;
+
+    offset = QEMU_ALIGN_DOWN(offset, page_size);
+    if (ramblock_recv_bitmap_test_byte_offset(block, offset)) {
+        return;
+    }
+
+    for (i = 0; i < page_size; i += TARGET_PAGE_SIZE) {
+        uint64_t pos = block->lazy_offsets[(offset + i) >> TARGET_PAGE_BITS];
+
+        if (!pos) {
+            memset(buf + i, 0, TARGET_PAGE_SIZE);
+            continue;
+        }
+        if (qemu_file_read_at(lazy_restore->file, buf + i, pos,
+                              TARGET_PAGE_SIZE) != TARGET_PAGE_SIZE) {
+            error_report("Failed to read page " RAM_ADDR_FMT " of %s from "
+                         "the migration file", offset + i, block->idstr);
+            ram_lazy_restore_abort();
+        }
+        zero = false;
+    }
+
+    trace_ram_lazy_place(block->idstr, offset, zero);
+    if (zero) {
+        ret = postcopy_place_page_zero(mis, block->host + offset, block);
+    } else {
+        ret = postcopy_place_page(mis, block->host + offset, buf, block);
+    }
+    if (ret) {
+        /* It reported why */
+        ram_lazy_restore_abort();
+    }
+}
+
+/*
+ * ram_lazy_restore_page: load a page that the guest faulted on
+ *
+ * Called by the postcopy fault thread during lazy restore.  Exits if
+ * the page cannot be loaded.
+ *
+ * @block: RAMBlock of the page
+ * @offset: offset of the page in @block
+ */
+void ram_lazy_restore_page(RAMBlock *block, ram_addr_t offset)
+{
+    qemu_mutex_lock(&lazy_restore->lock);
+    ram_lazy_place(block, offset, lazy_restore->fault_buf);
+    lazy_restore->fault_pages++;
+    qemu_mutex_unlock(&lazy_restore->lock);
+}
+
+/*
+ * Called once the RAM block list of the stream is known, before any page
+ * is loaded.
+ */
+static int ram_lazy_restore_setup(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    size_t page_size = qemu_ram_pagesize_largest();
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        /* Other processes would not fault on the missing pages */
+        if (qemu_ram_is_shared(block)) {
+            error_report("Lazy restore does not support shared RAM block %s",
+                         block->idstr);
+            return -EINVAL;
+        }
+    }
+
+    /* It reports why if not */
+    if (!postcopy_ram_supported_by_host(mis)) {
+        return -EINVAL;
+    }
+
+    trace_ram_lazy_restore_setup();
+    lazy_restore = g_new0(RAMLazyRestoreState, 1);
+    lazy_restore->file = f;
+    qemu_mutex_init(&lazy_restore->lock);
+    lazy_restore->fault_buf = qemu_memalign(page_size, page_size);
+    lazy_restore->load_buf = qemu_memalign(page_size, page_size);
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        block->lazy_offsets = g_new0(uint64_t,
+                                     block->max_length >> TARGET_PAGE_BITS);
+    }
+
+    /* Empty guest RAM, so that it faults on every page until it is loaded */
+    if (postcopy_ram_incoming_init(mis)) {
+        return -EINVAL;
+    }
+
+    mis->lazy_restore = true;
+    if (postcopy_ram_enable_notify(mis)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void ram_lazy_restore_cleanup_bh(void *opaque)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    RAMBlock *block;
+
+    qemu_thread_join(&lazy_restore->thread);
+
+    /* Stops the fault thread and unregisters guest RAM */
+    postcopy_ram_incoming_cleanup(mis);
+    mis->lazy_restore = false;
+
+    trace_ram_lazy_restore_complete(lazy_restore->fault_pages,
+                                    lazy_restore->background_pages);
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        g_free(block->lazy_offsets);
+        block->lazy_offsets = NULL;
+        g_free(block->receivedmap);
+        block->receivedmap = NULL;
+    }
+
+    /*
+     * If the incoming migration has not finished yet,
+     * migration_incoming_state_destroy() will close the file
+     */
+    if (mis->from_src_file != lazy_restore->file) {
+        qemu_fclose(lazy_restore->file);
+    }
+
+    qemu_vfree(lazy_restore->fault_buf);
+    qemu_vfree(lazy_restore->load_buf);
+    qemu_mutex_destroy(&lazy_restore->lock);
+    g_free(lazy_restore);
+    lazy_restore = NULL;
+}
+
+static void *ram_lazy_restore_thread(void *opaque)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    rcu_register_thread();
+    rcu_read_lock();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        for (offset = 0; offset < block->used_length;
+             offset += block->page_size) {
+            /* Skip what the guest faulted in already without the lock */
+            if (ramblock_recv_bitmap_test_byte_offset(block, offset)) {
+                continue;
+            }
+
+            qemu_mutex_lock(&lazy_restore->lock);
+            ram_lazy_place(block, offset, lazy_restore->load_buf);
+            lazy_restore->background_pages++;
+            qemu_mutex_unlock(&lazy_restore->lock);
+        }
+    }
+
+    rcu_read_unlock();
+
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            ram_lazy_restore_cleanup_bh, NULL);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Read the description of the region of @block in a mapped RAM file and
+ * its bitmap, and continue the stream after the region.
+ */
+static int mapped_ram_load_block_header(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t pages = qemu_get_be64(f);
+    uint64_t bitmap_offset = qemu_get_be64(f);
+    uint64_t pages_offset = qemu_get_be64(f);
+    uint64_t size = mapped_ram_bitmap_size(pages);
+    unsigned long *le_bitmap;
+    ssize_t ret;
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    if (!qemu_file_has_random_access(f)) {
+        error_report("Mapped RAM needs a migration file that can be "
+                     "read at random");
+        return -EINVAL;
+    }
+    if (pages > block->max_length >> TARGET_PAGE_BITS ||
+        block->used_length > pages << TARGET_PAGE_BITS ||
+        bitmap_offset < qemu_file_offset(f) ||
+        pages_offset < bitmap_offset + size) {
+        error_report("Invalid mapped RAM region for block %s", block->idstr);
+        return -EINVAL;
+    }
+
+    le_bitmap = bitmap_new(ROUND_UP(pages, 64));
+    ret = qemu_file_read_at(f, (uint8_t *)le_bitmap, bitmap_offset, size);
+    if (ret == size) {
+        block->file_bmap = bitmap_new(ROUND_UP(pages, 64));
+        bitmap_from_le(block->file_bmap, le_bitmap, pages);
+    }
+    g_free(le_bitmap);
+    if (ret != size) {
+        error_report("Could not read the mapped RAM bitmap of block %s",
+                     block->idstr);
+        return ret < 0 ? ret : -EIO;
+    }
+
+    block->bitmap_offset = bitmap_offset;
+    block->pages_offset = pages_offset;
+    trace_ram_mapped_load_block(block->idstr, pages, pages_offset);
+    return qemu_file_seek_forward(f, pages_offset +
+                                  (pages << TARGET_PAGE_BITS));
+}
+
+/* Pages are loaded by chunks of this size, so that the threads balance */
+#define MAPPED_RAM_LOAD_CHUNK   (64 * MiB)
+
+typedef struct {
+    QEMUFile *file;
+    GArray *chunks;
+    /* Index of the next chunk to load */
+    unsigned int next;
+    /* Set by the first thread that fails */
+    int error;
+} MappedRAMLoadState;
+
+typedef struct {
+    RAMBlock *block;
+    unsigned long start;
+    unsigned long end;
+} MappedRAMChunk;
+
+static int mapped_ram_load_chunk(QEMUFile *f, MappedRAMChunk *c)
+{
+    RAMBlock *block = c->block;
+    unsigned long page = c->start;
+
+    while (page < c->end) {
+        unsigned long next;
+        uint8_t *host = block->host + (page << TARGET_PAGE_BITS);
+
+        if (test_bit(page, block->file_bmap)) {
+            size_t size;
+            ssize_t ret;
+
+            next = find_next_zero_bit(block->file_bmap, c->end, page);
+            size = (next - page) << TARGET_PAGE_BITS;
+            ret = qemu_file_read_at(f, host, block->pages_offset +
+                                    (page << TARGET_PAGE_BITS), size);
+            if (ret != size) {
+                return ret < 0 ? ret : -EIO;
+            }
+        } else {
+            /* Left out because it is zero */
+            next = find_next_bit(block->file_bmap, c->end, page);
+            for (; page < next; page++, host += TARGET_PAGE_SIZE) {
+                ram_handle_compressed(host, 0, TARGET_PAGE_SIZE);
+            }
+        }
+        page = next;
+    }
+
+    ramblock_recv_bitmap_set_range(block, block->host +
+                                   (c->start << TARGET_PAGE_BITS),
+                                   c->end - c->start);
+    return 0;
+}
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRAMLoadState *s = opaque;
+    unsigned int i;
+    int ret = 0;
+
+    rcu_register_thread();
+    rcu_read_lock();
+
+    while (!ret && !atomic_read(&s->error)) {
+        i = atomic_fetch_inc(&s->next);
+        if (i >= s->chunks->len) {
+            break;
+        }
+        ret = mapped_ram_load_chunk(s->file,
+                                    &g_array_index(s->chunks,
+                                                   MappedRAMChunk, i));
+    }
+    if (ret) {
+        atomic_cmpxchg(&s->error, 0, ret);
+    }
+
+    rcu_read_unlock();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Load the pages of every block from their place in the file, in
+ * parallel, or for lazy restore just take note of where they are.
+ */
+static int mapped_ram_load(QEMUFile *f)
+{
+    MappedRAMLoadState s = { .file = f };
+    unsigned long chunk_pages = MAPPED_RAM_LOAD_CHUNK >> TARGET_PAGE_BITS;
+    QemuThread *threads;
+    RAMBlock *block;
+    int nthreads = migrate_multifd_channels();
+    int i;
+
+    if (lazy_restore) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+            unsigned long page;
+
+            for (page = find_first_bit(block->file_bmap, pages); page < pages;
+                 page = find_next_bit(block->file_bmap, pages, page + 1)) {
+                block->lazy_offsets[page] = block->pages_offset +
+                                            (page << TARGET_PAGE_BITS);
+            }
+        }
+        return 0;
+    }
+
+    s.chunks = g_array_new(false, false, sizeof(MappedRAMChunk));
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        MappedRAMChunk c = { .block = block };
+
+        for (c.start = 0; c.start < pages; c.start = c.end) {
+            c.end = MIN(c.start + chunk_pages, pages);
+            g_array_append_val(s.chunks, c);
+        }
+    }
+
+    trace_ram_mapped_load_start(s.chunks->len, nthreads);
+    threads = g_new0(QemuThread, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        char *name = g_strdup_printf("mapped-ram-%d", i);
+
+        qemu_thread_create(&threads[i], name, mapped_ram_load_thread, &s,
+                           QEMU_THREAD_JOINABLE);
+        g_free(name);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+    g_array_free(s.chunks, true);
+
+    if (s.error) {
+        error_report("Could not load mapped RAM: %s", strerror(-s.error));
+    }
+    return s.error;
+}
+
 /**
  * ram_load_setup: Setup RAM for migration incoming side
  *
@@ -3990,11 +5245,22 @@ static int ram_load_cleanup(void *opaque)
         if (ramblock_is_pmem(rb)) {
             pmem_persist(rb->host, rb->used_length);
         }
+        g_free(rb->file_bmap);
+        rb->file_bmap = NULL;
     }
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
 
+    if (lazy_restore) {
+        /* The receivedmap stays until all of RAM is loaded */
+        trace_ram_lazy_restore_start();
+        qemu_thread_create(&lazy_restore->thread, "lazy-restore",
+                           ram_lazy_restore_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+        return 0;
+    }
+
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
@@ -4355,6 +5621,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram() &&
+                        !ramblock_is_ignored(block)) {
+                        ret = mapped_ram_load_block_header(f, block);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4365,6 +5635,18 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
                 total_ram_bytes -= length;
             }
+
+            if (!ret && migrate_lazy_restore()) {
+                if (postcopy_advised) {
+                    error_report("Lazy restore is not possible with postcopy");
+                    ret = -EINVAL;
+                } else {
+                    ret = ram_lazy_restore_setup(f);
+                }
+            }
+            if (!ret && migrate_mapped_ram()) {
+                ret = mapped_ram_load(f);
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -37,6 +37,7 @@
 extern MigrationStats ram_counters;
 extern XBZRLECacheStats xbzrle_counters;
 extern CompressionStats compression_counters;
+extern DirtySyncStats dirty_sync_counters;
 
 int xbzrle_cache_resize(int64_t new_size, Error **errp);
 uint64_t ram_bytes_remaining(void);
@@ -60,6 +61,7 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+void ram_lazy_restore_page(RAMBlock *block, ram_addr_t offset);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -52,6 +52,7 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/rcu.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -81,6 +82,7 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_DEVICE_STATE,      /* Sections to load in parallel */
     MIG_CMD_MAX
 };
 
@@ -100,6 +102,7 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_DEVICE_STATE]     = { .len =  4, .name = "DEVICE_STATE" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -226,6 +229,21 @@ typedef struct CompatEntry {
     int instance_id;
 } CompatEntry;
 
+typedef enum SectionPhase {
+    SECTION_PHASE_SETUP,
+    SECTION_PHASE_ITERATE,
+    SECTION_PHASE_COMPLETE,
+    SECTION_PHASE_LOAD,
+    SECTION_PHASE__MAX
+} SectionPhase;
+
+/* Time spent in one phase by the sections of an entry, and their size */
+typedef struct SectionStats {
+    uint64_t time_ns;
+    uint64_t bytes;
+    uint64_t count;
+} SectionStats;
+
 typedef struct SaveStateEntry {
     QTAILQ_ENTRY(SaveStateEntry) entry;
     char idstr[256];
@@ -242,6 +260,8 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Cleared when saving or loading starts, protected by section_stats_lock */
+    SectionStats stats[SECTION_PHASE__MAX];
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -265,6 +285,8 @@ static bool should_validate_capability(int capability)
     /* Validate only new capabilities to keep compatibility. */
     switch (capability) {
     case MIGRATION_CAPABILITY_X_IGNORE_SHARED:
+    case MIGRATION_CAPABILITY_X_MAPPED_RAM:
+    case MIGRATION_CAPABILITY_X_MULTIFD_ZERO_PAGE:
         return true;
     default:
         return false;
@@ -820,6 +842,58 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
     }
 }
 
+/*
+ * Sections are saved and loaded outside the BQL, by the migration thread,
+ * the postcopy listen thread and the device state threads, while QMP
+ * reads the statistics under the BQL.
+ */
+static QemuMutex section_stats_lock;
+
+static void __attribute__((__constructor__)) section_stats_init(void)
+{
+    qemu_mutex_init(&section_stats_lock);
+}
+
+static void section_stats_reset(bool load)
+{
+    SaveStateEntry *se;
+
+    qemu_mutex_lock(&section_stats_lock);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (load) {
+            memset(&se->stats[SECTION_PHASE_LOAD], 0, sizeof(SectionStats));
+        } else {
+            memset(se->stats, 0, SECTION_PHASE_LOAD * sizeof(SectionStats));
+        }
+    }
+    qemu_mutex_unlock(&section_stats_lock);
+}
+
+/*
+ * Account a section of @se that started at @start_ns and took @bytes in
+ * the stream
+ */
+static void section_stats_add(SaveStateEntry *se, SectionPhase phase,
+                              int64_t start_ns, int64_t bytes)
+{
+    static const char *const phase_name[SECTION_PHASE__MAX] = {
+        [SECTION_PHASE_SETUP] = "setup",
+        [SECTION_PHASE_ITERATE] = "iterate",
+        [SECTION_PHASE_COMPLETE] = "complete",
+        [SECTION_PHASE_LOAD] = "load",
+    };
+    SectionStats *stats = &se->stats[phase];
+    int64_t ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+
+    qemu_mutex_lock(&section_stats_lock);
+    stats->time_ns += ns;
+    stats->bytes += bytes;
+    stats->count++;
+    qemu_mutex_unlock(&section_stats_lock);
+    trace_vmstate_section_stats(se->idstr, se->instance_id, phase_name[phase],
+                                ns, bytes);
+}
+
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
 {
     trace_vmstate_load(se->idstr, se->vmsd ? se->vmsd->name : "(old)");
@@ -1085,13 +1159,157 @@ void qemu_savevm_state_header(QEMUFile *f)
     }
 }
 
+/*
+ * With the x-parallel-device-state capability, the sections of the devices
+ * whose VMStateDescription is marked parallel are saved into separate
+ * buffers by a few threads, and sent in one MIG_CMD_DEVICE_STATE after the
+ * other sections of the same priority.  The destination loads them in
+ * parallel as well, except those only marked parallel_save.
+ */
+typedef struct DeviceStateJob {
+    SaveStateEntry *se;
+    /* The whole section, from the section type to the footer */
+    QEMUFile *f;
+    QIOChannelBuffer *bioc;
+    QJSON *vmdesc;
+    int ret;
+} DeviceStateJob;
+
+typedef struct DeviceStateBatch {
+    GArray *jobs;
+    void (*run)(DeviceStateJob *job);
+    /* next job to take */
+    unsigned int next;
+} DeviceStateBatch;
+
+static void device_state_work(DeviceStateBatch *batch)
+{
+    unsigned int i;
+
+    while ((i = atomic_fetch_inc(&batch->next)) < batch->jobs->len) {
+        batch->run(&g_array_index(batch->jobs, DeviceStateJob, i));
+    }
+}
+
+/*
+ * Helper threads, started with the migration rather than when the guest
+ * is stopped, so that creating them does not add to the downtime.
+ */
+typedef struct DeviceStatePool {
+    int nthreads;
+    QemuThread *threads;
+    /* posted once per thread to run the current batch, or to quit */
+    QemuSemaphore start;
+    /* posted by each thread when it finds no job left */
+    QemuSemaphore done;
+    bool quit;
+    DeviceStateBatch *batch;
+} DeviceStatePool;
+
+/* One pool to save and one to load, NULL if the capability is off */
+static DeviceStatePool *device_state_save_pool;
+static DeviceStatePool *device_state_load_pool;
+
+static void *device_state_thread(void *opaque)
+{
+    DeviceStatePool *pool = opaque;
+
+    rcu_register_thread();
+    for (;;) {
+        qemu_sem_wait(&pool->start);
+        if (atomic_read(&pool->quit)) {
+            break;
+        }
+        device_state_work(pool->batch);
+        qemu_sem_post(&pool->done);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* The calling thread is one of the device-state-threads */
+static DeviceStatePool *device_state_pool_new(void)
+{
+    DeviceStatePool *pool;
+    int i;
+
+    if (!migrate_parallel_device_state() ||
+        migrate_device_state_threads() <= 1) {
+        return NULL;
+    }
+
+    pool = g_new0(DeviceStatePool, 1);
+    pool->nthreads = migrate_device_state_threads() - 1;
+    pool->threads = g_new0(QemuThread, pool->nthreads);
+    qemu_sem_init(&pool->start, 0);
+    qemu_sem_init(&pool->done, 0);
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_thread_create(&pool->threads[i], "device-state",
+                           device_state_thread, pool, QEMU_THREAD_JOINABLE);
+    }
+    return pool;
+}
+
+static void device_state_pool_free(DeviceStatePool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+    atomic_set(&pool->quit, true);
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_sem_post(&pool->start);
+    }
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+    qemu_sem_destroy(&pool->start);
+    qemu_sem_destroy(&pool->done);
+    g_free(pool->threads);
+    g_free(pool);
+}
+
+/*
+ * Run all the jobs of @batch, the calling thread doing its share.  Without
+ * a @pool, the calling thread runs them all.
+ */
+static void device_state_run_batch(DeviceStatePool *pool,
+                                   DeviceStateBatch *batch)
+{
+    int nthreads = 0;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int i;
+
+    batch->next = 0;
+    if (pool) {
+        nthreads = MIN(pool->nthreads, (int)batch->jobs->len - 1);
+        pool->batch = batch;
+    }
+    /* The semaphores order these stores before the threads' loads */
+    for (i = 0; i < nthreads; i++) {
+        qemu_sem_post(&pool->start);
+    }
+    device_state_work(batch);
+    for (i = 0; i < nthreads; i++) {
+        qemu_sem_wait(&pool->done);
+    }
+    trace_device_state_run_batch(batch->jobs->len, nthreads + 1,
+                                 qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                 start);
+}
+
 void qemu_savevm_state_setup(QEMUFile *f)
 {
     SaveStateEntry *se;
     Error *local_err = NULL;
+    int64_t start, pos;
     int ret;
 
     trace_savevm_state_setup();
+    section_stats_reset(false);
+    device_state_pool_free(device_state_save_pool);
+    device_state_save_pool = device_state_pool_new();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->save_setup) {
             continue;
@@ -1101,10 +1319,14 @@ void qemu_savevm_state_setup(QEMUFile *f)
                 continue;
             }
         }
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_START);
 
         ret = se->ops->save_setup(f, se->opaque);
         save_section_footer(f, se);
+        section_stats_add(se, SECTION_PHASE_SETUP, start,
+                          qemu_ftell_fast(f) - pos);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             break;
@@ -1150,6 +1372,7 @@ int qemu_savevm_state_resume_prepare(MigrationState *s)
 int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
+    int64_t start, pos;
     int ret = 1;
 
     trace_savevm_state_iterate();
@@ -1182,11 +1405,15 @@ int qemu_savevm_state_iterate(QEMUFile *f, bool postcopy)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_PART);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        section_stats_add(se, SECTION_PHASE_ITERATE, start,
+                          qemu_ftell_fast(f) - pos);
 
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -1219,6 +1446,7 @@ static bool should_send_vmdesc(void)
 void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 {
     SaveStateEntry *se;
+    int64_t start, pos;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1231,6 +1459,8 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
             }
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        pos = qemu_ftell_fast(f);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
@@ -1238,6 +1468,8 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
         ret = se->ops->save_live_complete_postcopy(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        section_stats_add(se, SECTION_PHASE_COMPLETE, start,
+                          qemu_ftell_fast(f) - pos);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             return;
@@ -1248,14 +1480,105 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+static void device_state_save_job(DeviceStateJob *job)
+{
+    SaveStateEntry *se = job->se;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+    save_section_header(job->f, se, QEMU_VM_SECTION_FULL);
+    job->ret = vmstate_save(job->f, se, job->vmdesc);
+    trace_savevm_section_end(se->idstr, se->section_id, job->ret);
+    save_section_footer(job->f, se);
+    section_stats_add(se, SECTION_PHASE_COMPLETE, start,
+                      qemu_ftell_fast(job->f));
+    qemu_fflush(job->f);
+    if (!job->ret) {
+        job->ret = qemu_file_get_error(job->f);
+    }
+}
+
+/*
+ * Save the sections of @jobs in parallel and send them in order.  Payload
+ * format:
+ *
+ * count (be32), then for each section: length (be32) + section
+ */
+static int qemu_savevm_state_save_parallel(QEMUFile *f, QJSON *vmdesc,
+                                           GArray *jobs)
+{
+    DeviceStateBatch batch = {
+        .jobs = jobs,
+        .run = device_state_save_job,
+    };
+    uint32_t count = cpu_to_be32(jobs->len);
+    DeviceStateJob *job;
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < jobs->len; i++) {
+        job = &g_array_index(jobs, DeviceStateJob, i);
+        job->bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc),
+                             "migration-device-state-buffer");
+        job->f = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+        object_unref(OBJECT(job->bioc));
+        job->vmdesc = qjson_new();
+    }
+
+    trace_savevm_send_device_state(jobs->len);
+    device_state_run_batch(device_state_save_pool, &batch);
+
+    for (i = 0; i < jobs->len && !ret; i++) {
+        job = &g_array_index(jobs, DeviceStateJob, i);
+        if (job->ret) {
+            ret = job->ret;
+        } else if (job->bioc->usage > MAX_VM_CMD_PACKAGED_SIZE) {
+            error_report("%s: Unreasonably large state for '%s': %zu",
+                         __func__, job->se->idstr, job->bioc->usage);
+            ret = -E2BIG;
+        }
+    }
+
+    if (!ret) {
+        qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE, sizeof(count),
+                                 (uint8_t *)&count);
+    }
+    for (i = 0; i < jobs->len; i++) {
+        job = &g_array_index(jobs, DeviceStateJob, i);
+        if (!ret) {
+            qemu_put_be32(f, job->bioc->usage);
+            qemu_put_buffer(f, job->bioc->data, job->bioc->usage);
+
+            json_start_object(vmdesc, NULL);
+            json_prop_str(vmdesc, "name", job->se->idstr);
+            json_prop_int(vmdesc, "instance_id", job->se->instance_id);
+            json_merge_object(vmdesc, job->vmdesc);
+            json_end_object(vmdesc);
+        }
+        qemu_fclose(job->f);
+        qjson_destroy(job->vmdesc);
+    }
+    g_array_set_size(jobs, 0);
+
+    if (ret) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
                                        bool inactivate_disks)
 {
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start, pos;
     int ret;
     bool in_postcopy = migration_in_postcopy();
+    bool parallel = migrate_parallel_device_state();
+    MigrationPriority priority = MIG_PRI_DEFAULT;
+    GArray *jobs;
     Error *local_err = NULL;
 
     if (precopy_notify(PRECOPY_NOTIFY_COMPLETE, &local_err)) {
@@ -1282,11 +1605,15 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
+        section_stats_add(se, SECTION_PHASE_COMPLETE, start,
+                          qemu_ftell_fast(f) - pos);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             return -1;
@@ -1300,6 +1627,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", qemu_target_page_size());
     json_start_array(vmdesc, "devices");
+    jobs = g_array_new(false, true, sizeof(DeviceStateJob));
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
@@ -1310,23 +1638,50 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
             continue;
         }
 
+        /* Parallel sections go after the others of the same priority */
+        if (jobs->len && save_state_priority(se) != priority) {
+            ret = qemu_savevm_state_save_parallel(f, vmdesc, jobs);
+            if (ret) {
+                g_array_free(jobs, true);
+                return ret;
+            }
+        }
+        if (parallel && se->vmsd &&
+            (se->vmsd->parallel || se->vmsd->parallel_save)) {
+            DeviceStateJob job = { .se = se };
+
+            priority = save_state_priority(se);
+            g_array_append_val(jobs, job);
+            continue;
+        }
+
         trace_savevm_section_start(se->idstr, se->section_id);
 
         json_start_object(vmdesc, NULL);
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        pos = qemu_ftell_fast(f);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
+            g_array_free(jobs, true);
             return ret;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        section_stats_add(se, SECTION_PHASE_COMPLETE, start,
+                          qemu_ftell_fast(f) - pos);
 
         json_end_object(vmdesc);
     }
+    ret = jobs->len ? qemu_savevm_state_save_parallel(f, vmdesc, jobs) : 0;
+    g_array_free(jobs, true);
+    if (ret) {
+        return ret;
+    }
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -1405,6 +1760,8 @@ void qemu_savevm_state_cleanup(void)
             se->ops->save_cleanup(se->opaque);
         }
     }
+    device_state_pool_free(device_state_save_pool);
+    device_state_save_pool = NULL;
 }
 
 static int qemu_savevm_state(QEMUFile *f, Error **errp)
@@ -1921,12 +2278,12 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
 
     /*
      * This means source VM is ready to resume the postcopy migration.
-     * It's time to switch state and release the fault thread to
+     * It's time to switch state and release the fault threads to
      * continue service page faults.
      */
     migrate_set_state(&mis->state, MIGRATION_STATUS_POSTCOPY_RECOVER,
                       MIGRATION_STATUS_POSTCOPY_ACTIVE);
-    qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    postcopy_resume_fault_threads(mis);
 
     trace_loadvm_postcopy_handle_resume();
 
@@ -2033,6 +2390,8 @@ static int loadvm_process_enable_colo(MigrationIncomingState *mis)
     return colo_init_ram_cache();
 }
 
+static int loadvm_handle_cmd_device_state(QEMUFile *f);
+
 /*
  * Process an incoming 'QEMU_VM_COMMAND'
  * 0           just a normal return
@@ -2115,6 +2474,9 @@ static int loadvm_process_command(QEMUFile *f)
 
     case MIG_CMD_ENABLE_COLO:
         return loadvm_process_enable_colo(mis);
+
+    case MIG_CMD_DEVICE_STATE:
+        return loadvm_handle_cmd_device_state(f);
     }
 
     return 0;
@@ -2163,8 +2525,11 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
-static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * Read the header of a QEMU_VM_SECTION_FULL, whose type was already read,
+ * and find the entry that it is for
+ */
+static int qemu_loadvm_section_full_header(QEMUFile *f, SaveStateEntry **pse)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2215,24 +2580,187 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    *pse = se;
+    return 0;
+}
+
+/*
+ * Load the state and footer of a QEMU_VM_SECTION_FULL for @se, whose
+ * header started at @pos in @f
+ */
+static int qemu_loadvm_section_full_state(QEMUFile *f, SaveStateEntry *se,
+                                          int64_t pos)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%x of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", se->instance_id, se->idstr);
         return ret;
     }
     if (!check_section_footer(f, se)) {
         return -EINVAL;
     }
+    section_stats_add(se, SECTION_PHASE_LOAD, start,
+                      qemu_file_consumed(f) - pos);
 
     return 0;
 }
 
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+{
+    /* Count the section type that the caller read, like the source does */
+    int64_t pos = qemu_file_consumed(f) - 1;
+    SaveStateEntry *se;
+    int ret;
+
+    ret = qemu_loadvm_section_full_header(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+    return qemu_loadvm_section_full_state(f, se, pos);
+}
+
+static void device_state_load_job(DeviceStateJob *job)
+{
+    job->ret = qemu_loadvm_section_full_state(job->f, job->se, 0);
+}
+
+static unsigned int savevm_handlers_count(void)
+{
+    SaveStateEntry *se;
+    unsigned int n = 0;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Load the sections of a MIG_CMD_DEVICE_STATE.  The headers are read
+ * first, so that only the devices that allow it are loaded by the
+ * threads; those that were only saved in parallel are loaded by this
+ * thread, which holds the BQL.
+ */
+static int loadvm_handle_cmd_device_state(QEMUFile *f)
+{
+    DeviceStateBatch batch = {
+        .run = device_state_load_job,
+    };
+    uint32_t count = qemu_get_be32(f);
+    GArray *jobs, *serial_jobs;
+    GHashTable *seen;
+    QIOChannelBuffer *bioc;
+    DeviceStateJob job, *j;
+    size_t length;
+    uint8_t section_type;
+    unsigned int i;
+    int ret = 0;
+
+    trace_loadvm_handle_cmd_device_state(count);
+    /* Each section is for a different handler, see below */
+    if (count > savevm_handlers_count()) {
+        error_report("CMD_DEVICE_STATE: Too many sections: %u", count);
+        return -EINVAL;
+    }
+
+    batch.jobs = g_array_new(false, true, sizeof(DeviceStateJob));
+    serial_jobs = g_array_new(false, true, sizeof(DeviceStateJob));
+    seen = g_hash_table_new(NULL, NULL);
+
+    for (i = 0; i < count; i++) {
+        length = qemu_get_be32(f);
+        if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+            error_report("CMD_DEVICE_STATE: Unreasonably large section %u:"
+                         " %zu", i, length);
+            ret = -EINVAL;
+            break;
+        }
+        bioc = qio_channel_buffer_new(length);
+        qio_channel_set_name(QIO_CHANNEL(bioc),
+                             "migration-loadvm-device-state-buffer");
+        if (qemu_get_buffer(f, bioc->data, length) != length) {
+            object_unref(OBJECT(bioc));
+            error_report("CMD_DEVICE_STATE: Buffer receive fail for section"
+                         " %u, length %zu", i, length);
+            ret = -EINVAL;
+            break;
+        }
+        bioc->usage = length;
+
+        memset(&job, 0, sizeof(job));
+        job.f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+        object_unref(OBJECT(bioc));
+
+        section_type = qemu_get_byte(job.f);
+        if (section_type != QEMU_VM_SECTION_FULL) {
+            error_report("CMD_DEVICE_STATE: Unexpected section type %d",
+                         section_type);
+            qemu_fclose(job.f);
+            ret = -EINVAL;
+            break;
+        }
+        ret = qemu_loadvm_section_full_header(job.f, &job.se);
+        if (ret < 0) {
+            qemu_fclose(job.f);
+            break;
+        }
+        if (!job.se->vmsd ||
+            !(job.se->vmsd->parallel || job.se->vmsd->parallel_save)) {
+            error_report("CMD_DEVICE_STATE: Section '%s' cannot be saved"
+                         " in parallel", job.se->idstr);
+            qemu_fclose(job.f);
+            ret = -EINVAL;
+            break;
+        }
+        /* Two threads must not load the same device */
+        if (!g_hash_table_add(seen, job.se)) {
+            error_report("CMD_DEVICE_STATE: Section '%s' sent twice",
+                         job.se->idstr);
+            qemu_fclose(job.f);
+            ret = -EINVAL;
+            break;
+        }
+        jobs = job.se->vmsd->parallel ? batch.jobs : serial_jobs;
+        g_array_append_val(jobs, job);
+    }
+
+    for (i = 0; i < serial_jobs->len && !ret; i++) {
+        j = &g_array_index(serial_jobs, DeviceStateJob, i);
+        ret = qemu_loadvm_section_full_state(j->f, j->se, 0);
+    }
+    if (!ret && batch.jobs->len) {
+        device_state_run_batch(device_state_load_pool, &batch);
+    }
+    for (i = 0; i < batch.jobs->len; i++) {
+        j = &g_array_index(batch.jobs, DeviceStateJob, i);
+        if (!ret && j->ret < 0) {
+            ret = j->ret;
+        }
+        qemu_fclose(j->f);
+    }
+    for (i = 0; i < serial_jobs->len; i++) {
+        qemu_fclose(g_array_index(serial_jobs, DeviceStateJob, i).f);
+    }
+    g_array_free(batch.jobs, true);
+    g_array_free(serial_jobs, true);
+    g_hash_table_destroy(seen);
+
+    return ret;
+}
+
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
+    /* Count the section type that the caller read, like the source does */
+    int64_t pos = qemu_file_consumed(f) - 1;
     uint32_t section_id;
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     section_id = qemu_get_be32(f);
@@ -2255,6 +2783,7 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state section id %d(%s)",
@@ -2264,6 +2793,8 @@ qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, se)) {
         return -EINVAL;
     }
+    section_stats_add(se, SECTION_PHASE_LOAD, start,
+                      qemu_file_consumed(f) - pos);
 
     return 0;
 }
@@ -2274,6 +2805,7 @@ static int qemu_loadvm_state_setup(QEMUFile *f)
     int ret;
 
     trace_loadvm_state_setup();
+    section_stats_reset(true);
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->load_setup) {
             continue;
@@ -2291,6 +2823,9 @@ static int qemu_loadvm_state_setup(QEMUFile *f)
             return ret;
         }
     }
+
+    device_state_pool_free(device_state_load_pool);
+    device_state_load_pool = device_state_pool_new();
     return 0;
 }
 
@@ -2304,6 +2839,8 @@ void qemu_loadvm_state_cleanup(void)
             se->ops->load_cleanup(se->opaque);
         }
     }
+    device_state_pool_free(device_state_load_pool);
+    device_state_load_pool = NULL;
 }
 
 /* Return true if we should continue the migration, or false. */
@@ -2654,6 +3191,55 @@ int save_snapshot(const char *name, Error **errp)
     return ret;
 }
 
+static MigrationSectionStats *section_stats_info(SectionStats *stats)
+{
+    MigrationSectionStats *info = g_new0(MigrationSectionStats, 1);
+
+    info->time = stats->time_ns / SCALE_US;
+    info->bytes = stats->bytes;
+    info->count = stats->count;
+    return info;
+}
+
+MigrationSectionInfoList *qmp_query_migrate_sections(Error **errp)
+{
+    MigrationSectionInfoList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+    int i;
+
+    qemu_mutex_lock(&section_stats_lock);
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        MigrationSectionInfoList *entry;
+        MigrationSectionInfo *info;
+
+        for (i = 0; i < SECTION_PHASE__MAX; i++) {
+            if (se->stats[i].count) {
+                break;
+            }
+        }
+        if (i == SECTION_PHASE__MAX) {
+            continue;
+        }
+
+        info = g_new0(MigrationSectionInfo, 1);
+        info->name = g_strdup(se->idstr);
+        info->instance_id = se->instance_id;
+        info->setup = section_stats_info(&se->stats[SECTION_PHASE_SETUP]);
+        info->iterate = section_stats_info(&se->stats[SECTION_PHASE_ITERATE]);
+        info->complete =
+            section_stats_info(&se->stats[SECTION_PHASE_COMPLETE]);
+        info->load = section_stats_info(&se->stats[SECTION_PHASE_LOAD]);
+
+        entry = g_new0(MigrationSectionInfoList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    qemu_mutex_unlock(&section_stats_lock);
+
+    return head;
+}
+
 void qmp_xen_save_devices_state(const char *filename, bool has_live, bool live,
                                 Error **errp)
 {
@@ -35,6 +35,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU in bytes\n"
+    "                kvm-dirty-ring-size=entries of the KVM dirty ring of each vCPU (default: 0)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                igd-passthru=on|off controls IGD GFX passthrough support (default=off)\n"
@@ -79,6 +80,11 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=entries
+Makes KVM log the pages dirtied by each vCPU in a ring of @var{entries}
+entries, a power of 2, instead of a bitmap for the whole guest.  This lets
+the @code{dirty-limit} migration capability know which vCPU dirtied each
+page.  The default is 0, which uses bitmaps.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -3887,6 +3893,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                load a migration stream from the given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3905,6 +3913,10 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Load a migration stream that was saved to the given file, for example with
+@code{migrate file:@var{filename}}.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
@@ -4079,6 +4091,23 @@ HXCOMM HX does not support conditional compilation of text.
 @include qemu-option-trace.texi
 ETEXI
 
+DEF("exec-trace", HAS_ARG, QEMU_OPTION_exec_trace,
+    "-exec-trace [file=]<file>[,mem=on|off]\n"
+    "                write a binary trace of executed translation blocks\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -exec-trace [file=]@var{file}[,mem=on|off]
+@findex -exec-trace
+Record every translation block executed by TCG vCPUs into @var{file}, using
+compact binary records that are buffered per vCPU and written out by a
+background thread.  With @option{mem=on}, the virtual address and access
+size of every guest load and store are recorded as well.  The disassembly
+of each translation block is stored once, when the block is translated;
+@file{scripts/exec-trace-decode.py} turns the file into an instruction trace.
+In user mode emulation, a process created by @code{fork} writes its own
+trace to @var{file}.@var{pid}.
+ETEXI
+
 HXCOMM Internal use
 DEF("qtest", HAS_ARG, QEMU_OPTION_qtest, "", QEMU_ARCH_ALL)
 DEF("qtest-log", HAS_ARG, QEMU_OPTION_qtest_log, "", QEMU_ARCH_ALL)
@@ -0,0 +1,163 @@
+#!/usr/bin/env python
+#
+# Decoder for binary execution trace files (-exec-trace)
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: exec-trace-decode.py [--tb-only] [--cpu N] <trace-file>
+#
+# Translation block definitions may be written after the first records that
+# refer to them, so the file is read twice: once to collect the disassembly
+# of every TB, once to print the per-vCPU instruction stream.
+
+from __future__ import print_function
+import struct
+import sys
+import argparse
+
+EXEC_TRACE_MAGIC = 0x5145584543545243
+EXEC_TRACE_VERSION = 1
+EXEC_TRACE_F_MEM = 1
+
+CHUNK_RECORDS = 1
+CHUNK_TB = 2
+
+REC_TB = 1
+REC_MEM = 2
+
+# See trace/mem-internal.h
+TRACE_MEM_SZ_SHIFT_MASK = 0x7
+TRACE_MEM_SE = 1 << 3
+TRACE_MEM_BE = 1 << 4
+TRACE_MEM_ST = 1 << 5
+
+header_fmt = 'QII'
+chunk_fmt = 'IIII'
+tbdef_fmt = 'QIIII'
+
+
+class TB(object):
+    def __init__(self, pc, size, icount, disas):
+        self.pc = pc
+        self.size = size
+        self.icount = icount
+        self.disas = disas
+
+
+def read_struct(fobj, endian, fmt):
+    fmt = endian + fmt
+    size = struct.calcsize(fmt)
+    data = fobj.read(size)
+    if len(data) != size:
+        return None
+    return struct.unpack(fmt, data)
+
+
+def read_header(fobj):
+    for endian in ('<', '>'):
+        fobj.seek(0)
+        hdr = read_struct(fobj, endian, header_fmt)
+        if hdr is None:
+            break
+        if hdr[0] == EXEC_TRACE_MAGIC:
+            if hdr[1] != EXEC_TRACE_VERSION:
+                raise ValueError('unsupported trace version %d' % hdr[1])
+            return endian, hdr[2]
+    raise ValueError('not an exec trace file')
+
+
+def chunks(fobj, endian):
+    '''Yield (type, cpu_index, dropped, payload) for every chunk'''
+    while True:
+        chunk = read_struct(fobj, endian, chunk_fmt)
+        if chunk is None:
+            return
+        ctype, cpu_index, length, dropped = chunk
+        payload = fobj.read(length)
+        if len(payload) != length:
+            return
+        yield ctype, cpu_index, dropped, payload
+
+
+def parse_tbs(payload, endian, tbs):
+    fmt = endian + tbdef_fmt
+    size = struct.calcsize(fmt)
+    off = 0
+    while off + size <= len(payload):
+        pc, tb_id, tb_size, icount, disas_len = \
+            struct.unpack_from(fmt, payload, off)
+        off += size
+        disas = payload[off:off + disas_len].decode('utf-8', 'replace')
+        off += disas_len
+        tbs[tb_id] = TB(pc, tb_size, icount, disas.rstrip('\n'))
+
+
+def format_mem(info, vaddr):
+    size = 1 << (info & TRACE_MEM_SZ_SHIFT_MASK)
+    op = 'st' if info & TRACE_MEM_ST else 'ld'
+    flags = ''
+    if info & TRACE_MEM_SE:
+        flags += 's'
+    flags += 'be' if info & TRACE_MEM_BE else 'le'
+    return '    %s%d%s 0x%016x' % (op, size, flags, vaddr)
+
+
+def decode(fobj, tb_only, only_cpu, out):
+    endian, flags = read_header(fobj)
+    tbs = {}
+    for ctype, cpu_index, dropped, payload in chunks(fobj, endian):
+        if ctype == CHUNK_TB:
+            parse_tbs(payload, endian, tbs)
+
+    read_header(fobj)
+    for ctype, cpu_index, dropped, payload in chunks(fobj, endian):
+        if ctype != CHUNK_RECORDS:
+            continue
+        if only_cpu is not None and cpu_index != only_cpu:
+            continue
+        if dropped:
+            out.write('cpu %d: %d records dropped\n' % (cpu_index, dropped))
+        words = struct.unpack(endian + 'Q' * (len(payload) // 8), payload)
+        i = 0
+        while i < len(words):
+            word = words[i]
+            rtype = word & 0xff
+            if rtype == REC_TB:
+                tb_id = word >> 32
+                tb = tbs.get(tb_id)
+                if tb is None:
+                    out.write('cpu %d: unknown TB %d\n' % (cpu_index, tb_id))
+                elif tb_only or not tb.disas:
+                    out.write('cpu %d: TB %d 0x%016x (%d insns)\n' %
+                              (cpu_index, tb_id, tb.pc, tb.icount))
+                else:
+                    out.write('cpu %d: TB %d\n%s\n' %
+                              (cpu_index, tb_id, tb.disas))
+                i += 1
+            elif rtype == REC_MEM:
+                if i + 1 >= len(words):
+                    break
+                if not tb_only:
+                    out.write(format_mem((word >> 8) & 0xff, words[i + 1]) +
+                              '\n')
+                i += 2
+            else:
+                raise ValueError('bad record type %d' % rtype)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode an exec trace file')
+    parser.add_argument('--tb-only', action='store_true',
+                        help='print one line per TB instead of disassembly')
+    parser.add_argument('--cpu', type=int, default=None,
+                        help='only print records of this vCPU')
+    parser.add_argument('file', help='trace file written by -exec-trace')
+    args = parser.parse_args()
+
+    with open(args.file, 'rb') as fobj:
+        decode(fobj, args.tb_only, args.cpu, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,42 @@
+#!/bin/sh -e
+#
+# Rebuild the guest vDSO of a linux-user target and regenerate the C array
+# that linux-user/vdso.c embeds.  The image is checked in so that building
+# QEMU does not need a cross toolchain for every target.
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+target="$1"
+cc="${2:-${CROSS_CC:-cc}}"
+dir="$(dirname "$0")/../linux-user/$target"
+
+if [ -z "$target" ] || ! [ -f "$dir/vdso.S" ]; then
+    cat << EOF
+usage: gen-vdso-image.sh TARGET [CC]
+
+TARGET is a linux-user target directory with a vdso.S, e.g. x86_64.
+CC must be a compiler for that target (default: \$CROSS_CC or cc);
+set STRIP if the host strip does not handle the target.
+EOF
+    exit 1
+fi
+
+tmpdir=$(mktemp -d)
+trap 'rm -rf "$tmpdir"' EXIT
+
+"$cc" -nostdlib -shared -fPIC -I"$dir" \
+    -Wl,-T,"$dir/vdso.ld" -Wl,-soname=linux-vdso.so.1 \
+    -Wl,--hash-style=both -Wl,--eh-frame-hdr -Wl,-Bsymbolic \
+    -Wl,--build-id=none -Wl,-z,max-page-size=4096 \
+    -o "$tmpdir/vdso.so" "$dir/vdso.S"
+"${STRIP:-strip}" -o "$tmpdir/vdso-stripped.so" "$tmpdir/vdso.so"
+
+{
+    echo "/* Generated by scripts/gen-vdso-image.sh from vdso.S; do not edit. */"
+    echo
+    echo "static const uint8_t vdso_image[] = {"
+    od -An -v -tx1 -w12 "$tmpdir/vdso-stripped.so" |
+        sed -e 's/ \([0-9a-f][0-9a-f]\)/ 0x\1,/g' -e 's/^ */    /' -e 's/ *$//'
+    echo "};"
+} > "$dir/vdso-image.inc"
@@ -751,7 +751,10 @@ static void x86_cpu_vendor_words2str(char *dst, uint32_t vendor1,
           CPUID_EXT3_CR8LEG | CPUID_EXT3_ABM | CPUID_EXT3_SSE4A)
 #define TCG_EXT4_FEATURES 0
 #define TCG_SVM_FEATURES CPUID_SVM_NPT
-#define TCG_KVM_FEATURES 0
+/* kvmclock is emulated by target/i386/pvclock.c */
+#define TCG_KVM_FEATURES ((1 << KVM_FEATURE_CLOCKSOURCE) | \
+          (1 << KVM_FEATURE_CLOCKSOURCE2))
+#define TCG_KVM_HINTS_FEATURES 0
 #define TCG_7_0_EBX_FEATURES (CPUID_7_0_EBX_SMEP | CPUID_7_0_EBX_SMAP | \
           CPUID_7_0_EBX_BMI1 | CPUID_7_0_EBX_BMI2 | CPUID_7_0_EBX_ADX | \
           CPUID_7_0_EBX_PCOMMIT | CPUID_7_0_EBX_CLFLUSHOPT |            \
@@ -923,7 +926,7 @@ static FeatureWordInfo feature_word_info[FEATURE_WORDS] = {
             NULL, NULL, NULL, NULL,
         },
         .cpuid = { .eax = KVM_CPUID_FEATURES, .reg = R_EDX, },
-        .tcg_features = TCG_KVM_FEATURES,
+        .tcg_features = TCG_KVM_HINTS_FEATURES,
         /*
          * KVM hints aren't auto-enabled by -cpu host, they need to be
          * explicitly enabled in the command-line.
@@ -4422,7 +4425,14 @@ void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
          * CPUID code in kvm_arch_init_vcpu() ignores stuff
          * set here, but we restrict to TCG none the less.
          */
-        if (tcg_enabled() && cpu->expose_tcg) {
+        if (tcg_enabled() && env->features[FEAT_KVM]) {
+            /* Guests only look for kvmclock behind the KVM signature */
+            memcpy(signature, "KVMKVMKVM\0\0\0", 12);
+            *eax = KVM_CPUID_FEATURES;
+            *ebx = signature[0];
+            *ecx = signature[1];
+            *edx = signature[2];
+        } else if (tcg_enabled() && cpu->expose_tcg) {
             memcpy(signature, "TCGTCGTCGTCG", 12);
             *eax = 0x40000001;
             *ebx = signature[0];
@@ -4436,7 +4446,7 @@ void cpu_x86_cpuid(CPUX86State *env, uint32_t index, uint32_t count,
         }
         break;
     case 0x40000001:
-        *eax = 0;
+        *eax = tcg_enabled() ? env->features[FEAT_KVM] : 0;
         *ebx = 0;
         *ecx = 0;
         *edx = 0;
@@ -5010,7 +5020,7 @@ static void x86_cpu_expand_features(X86CPU *cpu, Error **errp)
         }
     }
 
-    if (!kvm_enabled() || !cpu->expose_kvm) {
+    if (!(kvm_enabled() || tcg_enabled()) || !cpu->expose_kvm) {
         env->features[FEAT_KVM] = 0;
     }
 
@@ -5376,6 +5386,12 @@ static void x86_cpu_unrealizefn(DeviceState *dev, Error **errp)
 #ifndef CONFIG_USER_ONLY
     cpu_remove_sync(CPU(dev));
     qemu_unregister_reset(x86_cpu_machine_reset_cb, dev);
+
+    if (cpu->pvclock_timer) {
+        timer_del(cpu->pvclock_timer);
+        timer_free(cpu->pvclock_timer);
+        cpu->pvclock_timer = NULL;
+    }
 #endif
 
     if (cpu->apic_state) {
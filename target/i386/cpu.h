@@ -1486,6 +1486,12 @@ struct X86CPU {
     int32_t thread_id;
 
     int32_t hv_max_vps;
+
+    /* kvmclock emulation under TCG, see pvclock.c */
+    struct QEMUTimer *pvclock_timer;
+    uint64_t pvclock_tsc;
+    int64_t pvclock_ns;
+    uint64_t pvclock_tsc_hz;
 };
 
 static inline X86CPU *x86_env_get_cpu(CPUX86State *env)
@@ -1692,6 +1698,11 @@ void cpu_x86_update_dr7(CPUX86State *env, uint32_t new_dr7);
 /* hw/pc.c */
 uint64_t cpu_get_tsc(CPUX86State *env);
 
+/* pvclock.c */
+void x86_pvclock_set_system_time(X86CPU *cpu, uint64_t val);
+void x86_pvclock_set_wall_clock(X86CPU *cpu, uint64_t gpa);
+void x86_pvclock_post_load(X86CPU *cpu);
+
 #define TARGET_PAGE_BITS 12
 
 #ifdef TARGET_X86_64
@@ -297,6 +297,10 @@ static int cpu_post_load(void *opaque, int version_id)
         dr7 = env->dr[7];
         env->dr[7] = dr7 & ~(DR7_GLOBAL_BP_MASK | DR7_LOCAL_BP_MASK);
         cpu_x86_update_dr7(env, dr7);
+
+#ifdef CONFIG_TCG
+        x86_pvclock_post_load(cpu);
+#endif
     }
     tlb_flush(cs);
     return 0;
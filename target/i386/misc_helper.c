@@ -24,6 +24,7 @@
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "exec/address-spaces.h"
+#include "standard-headers/asm-x86/kvm_para.h"
 
 void helper_outb(CPUX86State *env, uint32_t port, uint32_t data)
 {
@@ -371,6 +372,26 @@ void helper_wrmsr(CPUX86State *env)
         env->msr_bndcfgs = val;
         cpu_sync_bndcs_hflags(env);
         break;
+    case MSR_KVM_SYSTEM_TIME:
+    case MSR_KVM_SYSTEM_TIME_NEW:
+        if (!(env->features[FEAT_KVM] & ((1 << KVM_FEATURE_CLOCKSOURCE) |
+                                         (1 << KVM_FEATURE_CLOCKSOURCE2)))) {
+            break;
+        }
+        qemu_mutex_lock_iothread();
+        x86_pvclock_set_system_time(x86_env_get_cpu(env), val);
+        qemu_mutex_unlock_iothread();
+        break;
+    case MSR_KVM_WALL_CLOCK:
+    case MSR_KVM_WALL_CLOCK_NEW:
+        if (!(env->features[FEAT_KVM] & ((1 << KVM_FEATURE_CLOCKSOURCE) |
+                                         (1 << KVM_FEATURE_CLOCKSOURCE2)))) {
+            break;
+        }
+        qemu_mutex_lock_iothread();
+        x86_pvclock_set_wall_clock(x86_env_get_cpu(env), val);
+        qemu_mutex_unlock_iothread();
+        break;
     default:
         if ((uint32_t)env->regs[R_ECX] >= MSR_MC0_CTL
             && (uint32_t)env->regs[R_ECX] < MSR_MC0_CTL +
@@ -522,6 +543,14 @@ void helper_rdmsr(CPUX86State *env)
     case MSR_IA32_BNDCFGS:
         val = env->msr_bndcfgs;
         break;
+    case MSR_KVM_SYSTEM_TIME:
+    case MSR_KVM_SYSTEM_TIME_NEW:
+        val = env->system_time_msr;
+        break;
+    case MSR_KVM_WALL_CLOCK:
+    case MSR_KVM_WALL_CLOCK_NEW:
+        val = env->wall_clock_msr;
+        break;
     default:
         if ((uint32_t)env->regs[R_ECX] >= MSR_MC0_CTL
             && (uint32_t)env->regs[R_ECX] < MSR_MC0_CTL +
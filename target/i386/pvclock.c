@@ -0,0 +1,220 @@
+/*
+ * kvmclock-compatible paravirtual clock for TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Under KVM the kernel maintains the pvclock page; under TCG we do it
+ * ourselves so that guest kernels can read time with a plain load and
+ * rdtsc instead of going through an emulated HPET or ACPI PM timer.
+ *
+ * The page maps the guest TSC to QEMU_CLOCK_VIRTUAL nanoseconds.  The
+ * TSC frequency is not known in advance under TCG (without icount it runs
+ * at the host TSC rate), so the scale factor is recomputed from the
+ * observed TSC/clock ratio every time the page is refreshed.  The stable
+ * bit is never set, which makes the guest clamp readings against the last
+ * value returned and keeps time monotonic across refreshes.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "cpu.h"
+#include "exec/address-spaces.h"
+#include "sysemu/cpus.h"
+#include "standard-headers/asm-x86/kvm_para.h"
+
+/* How often the TSC to nanoseconds scale is re-estimated */
+#define PVCLOCK_REFRESH_NS  NANOSECONDS_PER_SECOND
+
+/* Minimum interval to trust the TSC rate measured between two refreshes */
+#define PVCLOCK_MIN_SAMPLE_NS  (10 * SCALE_MS)
+
+struct pvclock_vcpu_time_info {
+    uint32_t   version;
+    uint32_t   pad0;
+    uint64_t   tsc_timestamp;
+    uint64_t   system_time;
+    uint32_t   tsc_to_system_mul;
+    int8_t     tsc_shift;
+    uint8_t    flags;
+    uint8_t    pad[2];
+} QEMU_PACKED; /* 32 bytes */
+
+struct pvclock_wall_clock {
+    uint32_t   version;
+    uint32_t   sec;
+    uint32_t   nsec;
+} QEMU_PACKED;
+
+static uint64_t pvclock_read_tsc(CPUX86State *env)
+{
+    return cpu_get_tsc(env) + env->tsc_offset;
+}
+
+/* Same computation as kvm_get_time_scale() in the Linux kernel */
+static void pvclock_get_time_scale(uint64_t scaled_hz, uint64_t base_hz,
+                                   int8_t *pshift, uint32_t *pmultiplier)
+{
+    uint64_t scaled64 = scaled_hz;
+    uint64_t tps64 = base_hz;
+    uint32_t tps32;
+    int32_t shift = 0;
+
+    while (tps64 > scaled64 * 2 || tps64 & 0xffffffff00000000ULL) {
+        tps64 >>= 1;
+        shift--;
+    }
+
+    tps32 = (uint32_t)tps64;
+    while (tps32 <= scaled64 || scaled64 & 0xffffffff00000000ULL) {
+        if (scaled64 & 0xffffffff00000000ULL || tps32 & 0x80000000) {
+            scaled64 >>= 1;
+        } else {
+            tps32 <<= 1;
+        }
+        shift++;
+    }
+
+    *pshift = shift;
+    *pmultiplier = (scaled64 << 32) / tps32;
+}
+
+/* TSC frequency to use when there is no previous sample to compare with */
+static uint64_t pvclock_initial_tsc_hz(CPUX86State *env)
+{
+    int64_t ns0, ns1;
+    uint64_t tsc0, tsc1;
+
+    if (use_icount) {
+        /* cpu_get_ticks() counts virtual nanoseconds */
+        return NANOSECONDS_PER_SECOND;
+    }
+    if (env->tsc_khz) {
+        return env->tsc_khz * 1000ULL;
+    }
+
+    ns0 = get_clock();
+    tsc0 = cpu_get_host_ticks();
+    g_usleep(1000);
+    ns1 = get_clock();
+    tsc1 = cpu_get_host_ticks();
+    return muldiv64(tsc1 - tsc0, NANOSECONDS_PER_SECOND, ns1 - ns0);
+}
+
+static void x86_pvclock_update(X86CPU *cpu)
+{
+    CPUX86State *env = &cpu->env;
+    AddressSpace *as = CPU(cpu)->as;
+    hwaddr gpa = env->system_time_msr & ~(uint64_t)KVM_MSR_ENABLED;
+    uint64_t tsc = pvclock_read_tsc(env);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint64_t tsc_hz;
+    uint32_t version, mul;
+    int8_t shift;
+
+    if (cpu->pvclock_ns && now - cpu->pvclock_ns >= PVCLOCK_MIN_SAMPLE_NS &&
+        tsc > cpu->pvclock_tsc) {
+        tsc_hz = muldiv64(tsc - cpu->pvclock_tsc, NANOSECONDS_PER_SECOND,
+                          now - cpu->pvclock_ns);
+    } else if (cpu->pvclock_tsc_hz) {
+        tsc_hz = cpu->pvclock_tsc_hz;
+    } else {
+        tsc_hz = pvclock_initial_tsc_hz(env);
+    }
+    cpu->pvclock_tsc_hz = tsc_hz;
+    cpu->pvclock_tsc = tsc;
+    cpu->pvclock_ns = now;
+
+    pvclock_get_time_scale(NANOSECONDS_PER_SECOND, tsc_hz, &shift, &mul);
+
+    /* An odd version tells the guest that an update is in progress */
+    version = address_space_ldl_le(as, gpa, MEMTXATTRS_UNSPECIFIED, NULL);
+    version = (version + 1) | 1;
+    address_space_stl_le(as, gpa, version, MEMTXATTRS_UNSPECIFIED, NULL);
+    smp_wmb();
+    address_space_stq_le(as, gpa +
+                         offsetof(struct pvclock_vcpu_time_info, tsc_timestamp),
+                         tsc, MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stq_le(as, gpa +
+                         offsetof(struct pvclock_vcpu_time_info, system_time),
+                         now, MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stl_le(as, gpa +
+                         offsetof(struct pvclock_vcpu_time_info,
+                                  tsc_to_system_mul),
+                         mul, MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stb(as, gpa +
+                      offsetof(struct pvclock_vcpu_time_info, tsc_shift),
+                      (uint8_t)shift, MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stb(as, gpa + offsetof(struct pvclock_vcpu_time_info, flags),
+                      0, MEMTXATTRS_UNSPECIFIED, NULL);
+    smp_wmb();
+    address_space_stl_le(as, gpa, version + 1, MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static void x86_pvclock_timer_cb(void *opaque)
+{
+    X86CPU *cpu = opaque;
+
+    if (cpu->env.system_time_msr & KVM_MSR_ENABLED) {
+        x86_pvclock_update(cpu);
+        timer_mod(cpu->pvclock_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + PVCLOCK_REFRESH_NS);
+    }
+}
+
+/* Called with the iothread lock held */
+void x86_pvclock_set_system_time(X86CPU *cpu, uint64_t val)
+{
+    CPUX86State *env = &cpu->env;
+
+    env->system_time_msr = val;
+    if (!(val & KVM_MSR_ENABLED)) {
+        if (cpu->pvclock_timer) {
+            timer_del(cpu->pvclock_timer);
+        }
+        return;
+    }
+
+    if (!cpu->pvclock_timer) {
+        cpu->pvclock_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                          x86_pvclock_timer_cb, cpu);
+    }
+    cpu->pvclock_ns = 0;
+    x86_pvclock_timer_cb(cpu);
+}
+
+/* Called with the iothread lock held */
+void x86_pvclock_set_wall_clock(X86CPU *cpu, uint64_t gpa)
+{
+    AddressSpace *as = CPU(cpu)->as;
+    int64_t boot_ns = qemu_clock_get_ns(QEMU_CLOCK_HOST) -
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t version;
+
+    cpu->env.wall_clock_msr = gpa;
+
+    version = address_space_ldl_le(as, gpa, MEMTXATTRS_UNSPECIFIED, NULL);
+    version = (version + 1) | 1;
+    address_space_stl_le(as, gpa, version, MEMTXATTRS_UNSPECIFIED, NULL);
+    smp_wmb();
+    address_space_stl_le(as, gpa + offsetof(struct pvclock_wall_clock, sec),
+                         boot_ns / NANOSECONDS_PER_SECOND,
+                         MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stl_le(as, gpa + offsetof(struct pvclock_wall_clock, nsec),
+                         boot_ns % NANOSECONDS_PER_SECOND,
+                         MEMTXATTRS_UNSPECIFIED, NULL);
+    smp_wmb();
+    address_space_stl_le(as, gpa, version + 1, MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+/* Re-publish the clock after incoming migration or loadvm */
+void x86_pvclock_post_load(X86CPU *cpu)
+{
+    if (cpu->env.system_time_msr & KVM_MSR_ENABLED) {
+        x86_pvclock_set_system_time(cpu, cpu->env.system_time_msr);
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * Compares the throughput of every encoder that the host supports on a
+ * few typical kinds of page updates.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define PAGES 256
+
+typedef struct XBZRLEBenchCase {
+    const char *name;
+    int runs;           /* changed runs per page */
+    int run_len;        /* bytes per run */
+} XBZRLEBenchCase;
+
+static const XBZRLEBenchCase cases[] = {
+    { "unchanged", 0, 0 },
+    { "counters", 8, 8 },           /* a few scattered words */
+    { "record", 1, 256 },           /* one contiguous update */
+    { "dense", 64, 16 },            /* close to the overflow limit */
+};
+
+static void fill_pages(uint8_t *old, uint8_t *new,
+                       const XBZRLEBenchCase *c)
+{
+    int i, j, k;
+
+    for (i = 0; i < PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, PAGES * PAGE_SIZE);
+
+    for (i = 0; i < PAGES; i++) {
+        for (j = 0; j < c->runs; j++) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE - c->run_len);
+
+            for (k = start; k < start + c->run_len; k++) {
+                new[i * PAGE_SIZE + k] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+}
+
+static double bench_encode(uint8_t *old, uint8_t *new, uint8_t *dst)
+{
+    double total = 0.0;
+    int i;
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < PAGES; i++) {
+            xbzrle_encode_buffer(old + i * PAGE_SIZE, new + i * PAGE_SIZE,
+                                 PAGE_SIZE, dst, PAGE_SIZE);
+        }
+        total += PAGES * PAGE_SIZE;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    return total / MiB / g_test_timer_last();
+}
+
+static void test_encode_speed(void)
+{
+    uint8_t *old[ARRAY_SIZE(cases)], *new[ARRAY_SIZE(cases)];
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        old[i] = g_malloc(PAGES * PAGE_SIZE);
+        new[i] = g_malloc(PAGES * PAGE_SIZE);
+        fill_pages(old[i], new[i], &cases[i]);
+    }
+
+    /* Selecting the next encoder cannot be undone, so go over all cases */
+    do {
+        for (i = 0; i < ARRAY_SIZE(cases); i++) {
+            g_print("xbzrle encode %-8s %-10s %.2f MB/sec\n",
+                    test_xbzrle_encode_accel_name(), cases[i].name,
+                    bench_encode(old[i], new[i], dst));
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        g_free(old[i]);
+        g_free(new[i]);
+    }
+    g_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/encode/speed", test_encode_speed);
+
+    return g_test_run();
+}
@@ -15,6 +15,7 @@
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
@@ -33,6 +34,8 @@ unsigned start_address;
 unsigned end_address;
 bool got_stop;
 static bool uffd_feature_thread_id;
+/* Number of pc-dimms, each a RAMBlock, that x86 guests are started with */
+static unsigned dimm_count;
 
 #if defined(__linux__)
 #include <sys/syscall.h>
@@ -189,6 +192,33 @@ static QDict *wait_command(QTestState *who, const char *command, ...)
     return qtest_qmp_receive_success(who, stop_cb, NULL);
 }
 
+/*
+ * Like wait_command, for commands that return a list.  The caller must
+ * unref the list.
+ */
+static QList *wait_command_list(QTestState *who, const char *command)
+{
+    QDict *rsp;
+    QList *ret;
+
+    qtest_qmp_send(who, command);
+    for (;;) {
+        rsp = qtest_qmp_receive(who);
+        g_assert(!qdict_haskey(rsp, "error"));
+        if (qdict_haskey(rsp, "return")) {
+            break;
+        }
+        stop_cb(NULL, qdict_get_str(rsp, "event"), NULL);
+        qobject_unref(rsp);
+    }
+
+    ret = qdict_get_qlist(rsp, "return");
+    g_assert(ret);
+    qobject_ref(ret);
+    qobject_unref(rsp);
+    return ret;
+}
+
 /*
  * Note: caller is responsible to free the returned object via
  * qobject_unref() after use
@@ -347,6 +377,23 @@ static char *get_shmem_opts(const char *mem_size, const char *shmem_path)
                            mem_size, shmem_path);
 }
 
+static char *get_dimm_opts(unsigned count)
+{
+    GString *opts = g_string_new("");
+    unsigned i;
+
+    if (count) {
+        g_string_append_printf(opts, ",slots=%u,maxmem=%uM",
+                               count, 150 + count * 2);
+    }
+    for (i = 0; i < count; i++) {
+        g_string_append_printf(opts, " -object memory-backend-ram,id=dimm%u"
+                               ",size=2M -device pc-dimm,memdev=dimm%u",
+                               i, i);
+    }
+    return g_string_free(opts, false);
+}
+
 static char *SocketAddress_to_str(SocketAddress *addr)
 {
     switch (addr->type) {
@@ -426,6 +473,23 @@ static void migrate_set_parameter(QTestState *who, const char *parameter,
     migrate_check_parameter(who, parameter, value);
 }
 
+static void migrate_set_parameter_str(QTestState *who, const char *parameter,
+                                      const char *value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %s } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate-parameters' }");
+    g_assert_cmpstr(qdict_get_str(rsp, parameter), ==, value);
+    qobject_unref(rsp);
+}
+
 static void migrate_pause(QTestState *who)
 {
     QDict *rsp;
@@ -505,6 +569,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     gchar *cmd_src, *cmd_dst;
     char *bootpath = NULL;
     char *extra_opts = NULL;
+    char *dimm_opts = NULL;
     char *shmem_path = NULL;
     const char *arch = qtest_get_arch();
     const char *accel = "kvm:tcg";
@@ -522,18 +587,19 @@ static int test_migrate_start(QTestState **from, QTestState **to,
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
         init_bootfile(bootpath, x86_bootsect);
         extra_opts = use_shmem ? get_shmem_opts("150M", shmem_path) : NULL;
-        cmd_src = g_strdup_printf("-machine accel=%s -m 150M"
+        dimm_opts = get_dimm_opts(dimm_count);
+        cmd_src = g_strdup_printf("-machine accel=%s -m 150M%s"
                                   " -name source,debug-threads=on"
                                   " -serial file:%s/src_serial"
                                   " -drive file=%s,format=raw %s",
-                                  accel, tmpfs, bootpath,
+                                  accel, dimm_opts, tmpfs, bootpath,
                                   extra_opts ? extra_opts : "");
-        cmd_dst = g_strdup_printf("-machine accel=%s -m 150M"
+        cmd_dst = g_strdup_printf("-machine accel=%s -m 150M%s"
                                   " -name target,debug-threads=on"
                                   " -serial file:%s/dest_serial"
                                   " -drive file=%s,format=raw"
                                   " -incoming %s %s",
-                                  accel, tmpfs, bootpath, uri,
+                                  accel, dimm_opts, tmpfs, bootpath, uri,
                                   extra_opts ? extra_opts : "");
         start_address = X86_TEST_MEM_START;
         end_address = X86_TEST_MEM_END;
@@ -599,6 +665,7 @@ static int test_migrate_start(QTestState **from, QTestState **to,
 
     g_free(bootpath);
     g_free(extra_opts);
+    g_free(dimm_opts);
 
     if (hide_stderr) {
         gchar *tmp;
@@ -771,6 +838,55 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+/*
+ * Each fault on the destination is resolved with
+ * qemu_ram_block_from_host(), and TCG looks blocks up by ram_addr_t and
+ * by host address as it runs the guest.  Check that the RAMBlock index
+ * still finds the right block when there are many of them.
+ */
+static void test_postcopy_many_ram_blocks(void)
+{
+    QTestState *from, *to;
+    int ret;
+
+    dimm_count = 128;
+    ret = migrate_postcopy_prepare(&from, &to, false);
+    dimm_count = 0;
+    if (ret) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_prefetch(void)
+{
+    QTestState *from, *to;
+    QDict *rsp, *requests;
+
+    if (migrate_postcopy_prepare(&from, &to, false)) {
+        return;
+    }
+    /* The fault threads start when postcopy does */
+    migrate_set_parameter(to, "postcopy-prefetch-pages", 8);
+    migrate_set_parameter(to, "postcopy-fault-threads", 4);
+    migrate_postcopy_start(from, to);
+
+    wait_for_migration_complete(from);
+    wait_for_serial("dest_serial");
+
+    /* The guest keeps writing to its memory, so it must have faulted */
+    rsp = migrate_query(to);
+    requests = qdict_get_qdict(rsp, "postcopy-requests");
+    g_assert(requests);
+    g_assert_cmpint(qdict_get_int(requests, "requests"), >, 0);
+    g_assert_cmpint(qlist_size(qdict_get_qlist(requests,
+                                               "latency-histogram")), ==, 16);
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, true);
+}
+
 static void test_postcopy_recovery(void)
 {
     QTestState *from, *to;
@@ -854,6 +970,51 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
+/* Return the statistics of the entry @name of the migration stream */
+static QDict *query_migrate_section(QTestState *who, const char *name)
+{
+    QList *sections;
+    const QListEntry *e;
+    QDict *ret = NULL;
+
+    sections = wait_command_list(who,
+                                 "{ 'execute': 'query-migrate-sections' }");
+    QLIST_FOREACH_ENTRY(sections, e) {
+        QDict *section = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (!strcmp(qdict_get_str(section, "name"), name)) {
+            ret = section;
+            qobject_ref(ret);
+            break;
+        }
+    }
+    qobject_unref(sections);
+    g_assert(ret);
+    return ret;
+}
+
+/* RAM must have been accounted for on both sides */
+static void check_section_stats(QTestState *from, QTestState *to)
+{
+    QDict *ram, *stats;
+
+    ram = query_migrate_section(from, "ram");
+    stats = qdict_get_qdict(ram, "iterate");
+    g_assert_cmpint(qdict_get_int(stats, "count"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "bytes"), >, 0);
+    stats = qdict_get_qdict(ram, "complete");
+    g_assert_cmpint(qdict_get_int(stats, "count"), ==, 1);
+    stats = qdict_get_qdict(ram, "load");
+    g_assert_cmpint(qdict_get_int(stats, "count"), ==, 0);
+    qobject_unref(ram);
+
+    ram = query_migrate_section(to, "ram");
+    stats = qdict_get_qdict(ram, "load");
+    g_assert_cmpint(qdict_get_int(stats, "count"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "bytes"), >, 0);
+    qobject_unref(ram);
+}
+
 static void test_precopy_unix(void)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -891,6 +1052,135 @@ static void test_precopy_unix(void)
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
 
+    check_section_stats(from, to);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+/*
+ * Like test_precopy_unix, with the pages sent over multifd channels and
+ * compressed with @method.  With @zero_page, the channels look for zero
+ * pages themselves, using the newer packet format.  The destination must
+ * know about multifd before it listens, so it starts with "-incoming defer".
+ */
+static void test_multifd(const char *method, bool zero_page)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter(from, "multifd-channels", 4);
+    migrate_set_parameter(to, "multifd-channels", 4);
+    migrate_set_parameter_str(from, "multifd-compression", method);
+    migrate_set_parameter_str(to, "multifd-compression", method);
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+    if (zero_page) {
+        migrate_set_capability(from, "x-multifd-zero-page", true);
+        migrate_set_capability(to, "x-multifd-zero-page", true);
+    }
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s } }", uri);
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_multifd_none(void)
+{
+    test_multifd("none", false);
+}
+
+static void test_multifd_zlib(void)
+{
+    test_multifd("zlib", false);
+}
+
+static void test_multifd_zero_page(void)
+{
+    test_multifd("none", true);
+}
+
+#ifdef CONFIG_ZSTD
+static void test_multifd_zstd(void)
+{
+    test_multifd("zstd", false);
+}
+#endif
+
+/*
+ * Like test_precopy_unix, with the devices that allow it saved and loaded
+ * in parallel
+ */
+static void test_parallel_device_state(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, false, false)) {
+        return;
+    }
+
+    migrate_set_capability(from, "x-parallel-device-state", true);
+    migrate_set_capability(to, "x-parallel-device-state", true);
+    migrate_set_parameter(from, "device-state-threads", 2);
+    migrate_set_parameter(to, "device-state-threads", 2);
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
     test_migrate_end(from, to, true);
     g_free(uri);
 }
@@ -984,6 +1274,190 @@ static void test_xbzrle_unix(void)
     g_free(uri);
 }
 
+/*
+ * Save to a file with mapped RAM while the guest keeps dirtying pages,
+ * then restore it in the destination, which waits with "-incoming defer".
+ * With @lazy, the destination starts the guest before loading RAM.
+ */
+static void test_mapped_ram(bool lazy)
+{
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge, so pages are written again */
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "x-mapped-ram", true);
+    migrate_set_capability(to, "x-mapped-ram", true);
+    if (lazy) {
+        migrate_set_capability(to, "x-lazy-restore", true);
+    }
+    migrate_set_parameter(from, "multifd-channels", 4);
+    migrate_set_parameter(to, "multifd-channels", 4);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s } }", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+
+    /* With lazy restore, this also reads the pages that are not in yet */
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    g_free(uri);
+}
+
+static void test_mapped_ram_file(void)
+{
+    test_mapped_ram(false);
+}
+
+static void test_mapped_ram_lazy(void)
+{
+    test_mapped_ram(true);
+}
+
+static void test_dirty_rate(void)
+{
+    QTestState *from, *to;
+    QDict *rsp;
+    QList *blocks;
+    const char *status;
+
+    if (test_migrate_start(&from, &to, "defer", false, false)) {
+        return;
+    }
+
+    /* The guest keeps writing to all of its memory */
+    wait_for_serial("src_serial");
+
+    rsp = wait_command(from, "{ 'execute': 'calc-dirty-rate',"
+                             "  'arguments': { 'calc-time': 1 } }");
+    qobject_unref(rsp);
+
+    for (;;) {
+        rsp = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+        status = qdict_get_str(rsp, "status");
+        g_assert(!strcmp(status, "measuring") || !strcmp(status, "measured"));
+        if (!strcmp(status, "measured")) {
+            break;
+        }
+        qobject_unref(rsp);
+        usleep(100 * 1000);
+    }
+
+    g_assert_cmpint(qdict_get_int(rsp, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(rsp, "dirty-rate"), >, 0);
+    blocks = qdict_get_qlist(rsp, "blocks");
+    g_assert(blocks && !qlist_empty(blocks));
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, false);
+}
+
+/* Return the dirty limit state of the first vcpu */
+static QDict *query_vcpu_dirty_limit(QTestState *who)
+{
+    QList *vcpus;
+    QDict *ret;
+
+    vcpus = wait_command_list(who,
+                              "{ 'execute': 'query-vcpu-dirty-limit' }");
+    g_assert(!qlist_empty(vcpus));
+    ret = qobject_to(QDict, qlist_peek(vcpus));
+    qobject_ref(ret);
+    qobject_unref(vcpus);
+    return ret;
+}
+
+/*
+ * Migrate slowly enough that the dirty limit kicks in, and check that the
+ * vcpu is throttled before letting the migration converge.
+ */
+static void test_dirty_limit(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp, *vcpu;
+
+    if (test_migrate_start(&from, &to, uri, false, false)) {
+        return;
+    }
+
+    /* KVM only accounts dirty pages to each vcpu with dirty rings */
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                          "  'arguments': { 'capabilities': [ {"
+                          "    'capability': 'dirty-limit',"
+                          "    'state': true } ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        test_migrate_end(from, to, false);
+        g_free(uri);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 100MB/s, slower than the guest dirties its memory */
+    migrate_set_parameter(from, "max-bandwidth", 100000000);
+    migrate_set_parameter(from, "vcpu-dirty-limit", 1);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    for (;;) {
+        vcpu = query_vcpu_dirty_limit(from);
+        if (qdict_get_int(vcpu, "throttle-percentage") > 0) {
+            g_assert_cmpint(qdict_get_int(vcpu, "limit-rate"), ==, 1);
+            qobject_unref(vcpu);
+            break;
+        }
+        qobject_unref(vcpu);
+        usleep(100 * 1000);
+    }
+
+    /* 1GB/s and 300 ms should converge */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 static void test_precopy_tcp(void)
 {
     char *uri;
@@ -1075,12 +1549,31 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/prefetch", test_postcopy_prefetch);
+    if (g_str_equal(qtest_get_arch(), "i386") ||
+        g_str_equal(qtest_get_arch(), "x86_64")) {
+        qtest_add_func("/migration/postcopy/many_ram_blocks",
+                       test_postcopy_many_ram_blocks);
+    }
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/multifd/unix/none", test_multifd_none);
+    qtest_add_func("/migration/multifd/unix/zlib", test_multifd_zlib);
+    qtest_add_func("/migration/multifd/unix/zero_page",
+                   test_multifd_zero_page);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/multifd/unix/zstd", test_multifd_zstd);
+#endif
+    qtest_add_func("/migration/precopy/parallel_device_state",
+                   test_parallel_device_state);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/mapped_ram/file", test_mapped_ram_file);
+    qtest_add_func("/migration/mapped_ram/lazy", test_mapped_ram_lazy);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
+    qtest_add_func("/migration/dirty_limit", test_dirty_limit);
 
     ret = g_test_run();
 
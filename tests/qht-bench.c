@@ -391,11 +391,30 @@ static void pr_stats(void)
            (double)s.rm / (s.rm + s.not_rm) * 100,
            (double)(s.rm + s.not_rm) / 1e6);
 
+    tx = (s.rd + s.not_rd) / 1e6 / duration;
+    printf(" Lookups:           %.2f MT/s (%.2f MT/s/thread)\n",
+           tx, tx / n_rw_threads);
+    tx = (s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
+    printf(" Updates:           %.2f MT/s (%.2f MT/s/thread)\n",
+           tx, tx / n_rw_threads);
+
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
 }
 
+static void pr_qht_stats(void)
+{
+    struct qht_stats ss;
+
+    qht_statistics_init(&ht, &ss);
+    printf(" Table resizes:     %zu\n", ss.resizes);
+    printf(" Head buckets:      %zu (%zu pending migration)\n",
+           ss.head_buckets, ss.migrating_head_buckets);
+    printf(" Entries:           %zu\n", ss.entries);
+    qht_statistics_destroy(&ss);
+}
+
 static void run_test(void)
 {
     int i;
@@ -496,5 +515,6 @@ int main(int argc, char *argv[])
     create_threads();
     run_test();
     pr_stats();
+    pr_qht_stats();
     return 0;
 }
@@ -0,0 +1,176 @@
+/*
+ * Benchmark of mmap-heavy guest programs
+ *
+ * Mimics what language runtimes and allocators do with the address space:
+ * reserve huge PROT_NONE regions and commit pages sparsely inside them,
+ * churn through many small mappings, and pass large buffers to syscalls.
+ * Every phase checks its results, so the program doubles as a test.
+ *
+ * Usage: mmap-bench [scale]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define fail_unless(x)                                                  \
+    do {                                                                \
+        if (!(x)) {                                                     \
+            fprintf(stderr, "FAILED at %s:%d\n", __FILE__, __LINE__);   \
+            exit(EXIT_FAILURE);                                         \
+        }                                                               \
+    } while (0)
+
+static size_t pagesize;
+static unsigned int scale = 1;
+static unsigned long rand_state = 1;
+
+/* Large enough to be painful page by page, small enough for 32-bit guests */
+static size_t reserve_size(void)
+{
+    return sizeof(void *) == 8 ? (size_t)16 << 30 : (size_t)512 << 20;
+}
+
+static unsigned long next_rand(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 16;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, unsigned long ops, double start)
+{
+    double secs = now() - start;
+
+    printf("%-10s %8lu ops %10.3f ms %12.0f ops/s\n", name, ops,
+           secs * 1e3, secs > 0 ? ops / secs : 0);
+}
+
+static void *reserve(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    fail_unless(p != MAP_FAILED);
+    return p;
+}
+
+/* Reserve and release huge regions, as done for heaps and thread stacks */
+static void bench_reserve(void)
+{
+    unsigned long i, n = 64 * scale;
+    double start = now();
+
+    for (i = 0; i < n; i++) {
+        void *p = reserve(reserve_size());
+
+        fail_unless(munmap(p, reserve_size()) == 0);
+    }
+    report("reserve", n, start);
+}
+
+/* Commit scattered pages of a huge reservation, then decommit it at once */
+static void bench_sparse(void)
+{
+    size_t size = reserve_size();
+    size_t npages = size / pagesize;
+    unsigned long i, n = 4096 * scale;
+    char *base = reserve(size);
+    double start = now();
+
+    for (i = 0; i < n; i++) {
+        char *page = base + (next_rand() % npages) * pagesize;
+
+        fail_unless(mprotect(page, pagesize, PROT_READ | PROT_WRITE) == 0);
+        page[0] = (char)i;
+        fail_unless(page[0] == (char)i);
+    }
+    fail_unless(mprotect(base, size, PROT_NONE) == 0);
+    fail_unless(mprotect(base, pagesize, PROT_READ) == 0);
+    fail_unless(munmap(base, size) == 0);
+    report("sparse", n + 3, start);
+}
+
+/* Many small mappings of random sizes, like a malloc for large objects */
+static void bench_churn(void)
+{
+    enum { SLOTS = 256 };
+    struct {
+        char *p;
+        size_t len;
+    } slots[SLOTS] = { { NULL } };
+    unsigned long i, n = 16384 * scale;
+    double start = now();
+
+    for (i = 0; i < n; i++) {
+        unsigned int s = next_rand() % SLOTS;
+
+        if (slots[s].p) {
+            fail_unless(slots[s].p[slots[s].len - 1] == (char)s);
+            fail_unless(munmap(slots[s].p, slots[s].len) == 0);
+            slots[s].p = NULL;
+        } else {
+            slots[s].len = (1 + next_rand() % 64) * pagesize;
+            slots[s].p = mmap(NULL, slots[s].len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            fail_unless(slots[s].p != MAP_FAILED);
+            slots[s].p[slots[s].len - 1] = (char)s;
+        }
+    }
+    for (i = 0; i < SLOTS; i++) {
+        if (slots[i].p) {
+            fail_unless(munmap(slots[i].p, slots[i].len) == 0);
+        }
+    }
+    report("churn", n, start);
+}
+
+/* Syscalls on big buffers check that the whole range is accessible */
+static void bench_syscall(void)
+{
+    size_t size = 64 << 20;
+    unsigned long i, n = 64 * scale;
+    int fd = open("/dev/null", O_WRONLY);
+    char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    double start = now();
+
+    fail_unless(fd >= 0);
+    fail_unless(buf != MAP_FAILED);
+    for (i = 0; i < n; i++) {
+        fail_unless(write(fd, buf, size) == (ssize_t)size);
+    }
+    fail_unless(munmap(buf, size) == 0);
+    close(fd);
+    report("syscall", n, start);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        scale = atoi(argv[1]);
+        fail_unless(scale > 0);
+    }
+    pagesize = getpagesize();
+
+    bench_reserve();
+    bench_sparse();
+    bench_churn();
+    bench_syscall();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,112 @@
+/*
+ * Test the time functions of the vDSO, if there is one
+ *
+ * The C library calls into the vDSO for these; compare the results with
+ * the corresponding system calls, in this process and in a forked child,
+ * which gets a time page of its own.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#define fail_unless(x)                                                  \
+    do {                                                                \
+        if (!(x)) {                                                     \
+            fprintf(stderr, "FAILED at %s:%d\n", __FILE__, __LINE__);   \
+            exit(EXIT_FAILURE);                                         \
+        }                                                               \
+    } while (0)
+
+/* Generous, since the emulator can be preempted between two calls */
+#define TOLERANCE_NS    (100 * 1000 * 1000LL)
+
+static int64_t ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int64_t sys_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    fail_unless(syscall(SYS_clock_gettime, clock, &ts) == 0);
+    return ts_ns(&ts);
+}
+
+static int64_t lib_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    fail_unless(clock_gettime(clock, &ts) == 0);
+    return ts_ns(&ts);
+}
+
+static void check_clock(clockid_t clock, int64_t *last)
+{
+    int64_t before = sys_clock_ns(clock);
+    int64_t now = lib_clock_ns(clock);
+    int64_t after = sys_clock_ns(clock);
+
+    fail_unless(now >= *last);
+    fail_unless(now >= before - TOLERANCE_NS);
+    fail_unless(now <= after + TOLERANCE_NS);
+    *last = now;
+}
+
+/* Call the functions for a while, across at least one update of the page */
+static void check_times(double seconds)
+{
+    int64_t last_mono = 0, last_real = 0;
+    int64_t end = sys_clock_ns(CLOCK_MONOTONIC) + seconds * 1e9;
+    unsigned long calls = 0;
+
+    while (last_mono < end) {
+        struct timeval tv;
+        time_t t;
+
+        check_clock(CLOCK_MONOTONIC, &last_mono);
+        check_clock(CLOCK_REALTIME, &last_real);
+
+        fail_unless(gettimeofday(&tv, NULL) == 0);
+        fail_unless(tv.tv_usec >= 0 && tv.tv_usec < 1000000);
+        fail_unless(llabs(tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL -
+                          last_real) <= TOLERANCE_NS + 1000000000LL);
+
+        t = time(NULL);
+        fail_unless(llabs((int64_t)t * 1000000000LL - last_real) <=
+                    TOLERANCE_NS + 1000000000LL);
+        calls++;
+    }
+    fail_unless(sched_getcpu() >= 0);
+    printf("%lu iterations\n", calls);
+}
+
+int main(void)
+{
+    pid_t pid;
+    int status;
+
+    check_times(0.2);
+    fflush(stdout);
+
+    pid = fork();
+    fail_unless(pid >= 0);
+    if (pid == 0) {
+        check_times(1.5);
+        exit(EXIT_SUCCESS);
+    }
+    fail_unless(waitpid(pid, &status, 0) == pid);
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    return EXIT_SUCCESS;
+}
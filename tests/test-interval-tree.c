@@ -0,0 +1,338 @@
+/*
+ * Interval tree tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/interval-tree.h"
+
+#define N 1000
+
+static IntervalTreeRoot root;
+static IntervalTreeNode nodes[N];
+static bool in_tree[N];
+
+/* Checks the AVL and augmentation invariants; returns the subtree height */
+static int check_subtree(IntervalTreeNode *node, IntervalTreeNode *parent,
+                         int *count)
+{
+    int hl, hr;
+    uint64_t subtree_last;
+
+    if (!node) {
+        return 0;
+    }
+    g_assert(node->parent == parent);
+    if (node->left) {
+        g_assert_cmpuint(node->left->start, <=, node->start);
+    }
+    if (node->right) {
+        g_assert_cmpuint(node->right->start, >=, node->start);
+    }
+    hl = check_subtree(node->left, node, count);
+    hr = check_subtree(node->right, node, count);
+    g_assert_cmpint(ABS(hl - hr), <=, 1);
+    g_assert_cmpint(node->height, ==, MAX(hl, hr) + 1);
+
+    subtree_last = node->last;
+    if (node->left) {
+        subtree_last = MAX(subtree_last, node->left->subtree_last);
+    }
+    if (node->right) {
+        subtree_last = MAX(subtree_last, node->right->subtree_last);
+    }
+    g_assert_cmpuint(node->subtree_last, ==, subtree_last);
+    (*count)++;
+    return node->height;
+}
+
+static void check_tree(void)
+{
+    int count = 0;
+    int expected = 0;
+    int i;
+
+    check_subtree(root.root, NULL, &count);
+    for (i = 0; i < N; i++) {
+        expected += in_tree[i];
+    }
+    g_assert_cmpint(count, ==, expected);
+}
+
+/* Compare a range query against a linear scan of the nodes */
+static void check_query(uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node;
+    uint64_t prev_start = 0;
+    int found = 0;
+    int expected = 0;
+    int i;
+
+    for (i = 0; i < N; i++) {
+        if (in_tree[i] && nodes[i].start <= last && start <= nodes[i].last) {
+            expected++;
+        }
+    }
+
+    for (node = interval_tree_iter_first(&root, start, last); node;
+         node = interval_tree_iter_next(node, start, last)) {
+        i = node - nodes;
+        g_assert_true(in_tree[i]);
+        g_assert_cmpuint(node->start, <=, last);
+        g_assert_cmpuint(node->last, >=, start);
+        g_assert_cmpuint(node->start, >=, prev_start);
+        prev_start = node->start;
+        found++;
+    }
+    g_assert_cmpint(found, ==, expected);
+}
+
+static void reset(void)
+{
+    root.root = NULL;
+    memset(nodes, 0, sizeof(nodes));
+    memset(in_tree, 0, sizeof(in_tree));
+}
+
+static void insert(int i, uint64_t start, uint64_t last)
+{
+    g_assert_false(in_tree[i]);
+    nodes[i].start = start;
+    nodes[i].last = last;
+    interval_tree_insert(&nodes[i], &root);
+    in_tree[i] = true;
+}
+
+static void remove_node(int i)
+{
+    g_assert_true(in_tree[i]);
+    interval_tree_remove(&nodes[i], &root);
+    in_tree[i] = false;
+}
+
+static void test_empty(void)
+{
+    reset();
+    g_assert_true(interval_tree_is_empty(&root));
+    g_assert_null(interval_tree_iter_first(&root, 0, UINT64_MAX));
+}
+
+static void test_boundaries(void)
+{
+    IntervalTreeNode *node;
+
+    reset();
+    insert(0, 0, 0);
+    insert(1, 10, 19);
+    insert(2, UINT64_MAX - 9, UINT64_MAX);
+    check_tree();
+
+    g_assert_true(interval_tree_iter_first(&root, 0, 0) == &nodes[0]);
+    g_assert_null(interval_tree_iter_first(&root, 1, 9));
+    g_assert_true(interval_tree_iter_first(&root, 5, 10) == &nodes[1]);
+    g_assert_true(interval_tree_iter_first(&root, 19, 19) == &nodes[1]);
+    g_assert_null(interval_tree_iter_first(&root, 20, UINT64_MAX - 10));
+    g_assert_true(interval_tree_iter_first(&root, UINT64_MAX, UINT64_MAX) ==
+                  &nodes[2]);
+
+    node = interval_tree_iter_first(&root, 0, UINT64_MAX);
+    g_assert_true(node == &nodes[0]);
+    node = interval_tree_iter_next(node, 0, UINT64_MAX);
+    g_assert_true(node == &nodes[1]);
+    node = interval_tree_iter_next(node, 0, UINT64_MAX);
+    g_assert_true(node == &nodes[2]);
+    g_assert_null(interval_tree_iter_next(node, 0, UINT64_MAX));
+
+    remove_node(1);
+    check_tree();
+    g_assert_null(interval_tree_iter_first(&root, 5, 25));
+}
+
+/* A long interval hidden below many short ones must still be found */
+static void test_nested(void)
+{
+    int i;
+
+    reset();
+    insert(0, 0, 1000000);
+    for (i = 1; i < N; i++) {
+        insert(i, i * 100, i * 100 + 9);
+    }
+    check_tree();
+    check_query(99990, 99995);
+    check_query(1000000, 1000000);
+    check_query(1000001, UINT64_MAX);
+    check_query(50, 99);
+}
+
+static void test_remove_in_iteration(void)
+{
+    IntervalTreeNode *node, *next;
+    int i;
+
+    reset();
+    for (i = 0; i < N; i++) {
+        insert(i, i * 10, i * 10 + 14);
+    }
+    for (node = interval_tree_iter_first(&root, 1000, 4999); node;
+         node = next) {
+        next = interval_tree_iter_next(node, 1000, 4999);
+        remove_node(node - nodes);
+    }
+    check_tree();
+    g_assert_null(interval_tree_iter_first(&root, 1000, 4999));
+    check_query(0, UINT64_MAX);
+}
+
+static void test_random(void)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+    int iter;
+
+    reset();
+    for (iter = 0; iter < 20 * N; iter++) {
+        int i = g_rand_int_range(rand, 0, N);
+        uint64_t start = g_rand_int_range(rand, 0, 100000);
+        uint64_t len = g_rand_int_range(rand, 0, 1000);
+
+        if (in_tree[i]) {
+            remove_node(i);
+        } else {
+            insert(i, start, start + len);
+        }
+        if (iter % 64 == 0) {
+            check_tree();
+            check_query(start, start + len);
+            check_query(start + len, start + len);
+        }
+    }
+    check_tree();
+    g_rand_free(rand);
+}
+
+/* Slots of disjoint intervals, like RAM blocks in ram_addr_t space */
+#define SLOT_SIZE   0x100000
+
+static uint64_t slot_start(int i)
+{
+    return (uint64_t)i * SLOT_SIZE;
+}
+
+static void insert_in_slot(GRand *rand, int i)
+{
+    uint64_t len = g_rand_int_range(rand, 1, SLOT_SIZE);
+
+    insert(i, slot_start(i), slot_start(i) + len - 1);
+}
+
+static void check_point(uint64_t addr)
+{
+    IntervalTreeNode *node = interval_tree_iter_first(&root, addr, addr);
+    int i = addr / SLOT_SIZE;
+
+    if (in_tree[i] && addr <= nodes[i].last) {
+        g_assert_true(node == &nodes[i]);
+    } else {
+        g_assert_null(node);
+    }
+}
+
+static void test_disjoint(void)
+{
+    GRand *rand = g_rand_new_with_seed(2);
+    int i, j;
+
+    reset();
+    for (i = 0; i < N; i++) {
+        /* Insert in a scrambled order */
+        j = (i * 7919) % N;
+        insert_in_slot(rand, j);
+    }
+    check_tree();
+    for (i = 0; i < N; i += 2) {
+        remove_node(i);
+    }
+    check_tree();
+    for (i = 0; i < N; i++) {
+        check_point(slot_start(i));
+        check_point(nodes[i].last);
+        check_point(nodes[i].last + 1);
+        check_point(slot_start(i) + SLOT_SIZE - 1);
+    }
+    check_query(0, UINT64_MAX);
+    g_rand_free(rand);
+}
+
+static bool stop_lookups;
+
+/* Look up the odd slots, which stay in the tree, while the others change */
+static void *lookup_thread(void *opaque)
+{
+    unsigned long *misses = opaque;
+    int i = 1;
+
+    while (!atomic_read(&stop_lookups)) {
+        IntervalTreeNode *node =
+            interval_tree_iter_first(&root, slot_start(i), slot_start(i));
+
+        if (!node) {
+            (*misses)++;
+        } else {
+            g_assert_true(node == &nodes[i]);
+        }
+        i = (i + 2) % N;
+    }
+    return NULL;
+}
+
+static void test_concurrent_lookup(void)
+{
+    GRand *rand = g_rand_new_with_seed(3);
+    unsigned long misses = 0;
+    QemuThread thread;
+    int i, iter;
+
+    reset();
+    stop_lookups = false;
+    for (i = 0; i < N; i++) {
+        insert_in_slot(rand, i);
+    }
+
+    qemu_thread_create(&thread, "lookup", lookup_thread, &misses,
+                       QEMU_THREAD_JOINABLE);
+    for (iter = 0; iter < 200 * N; iter++) {
+        i = g_rand_int_range(rand, 0, N / 2) * 2;
+        if (in_tree[i]) {
+            remove_node(i);
+        } else {
+            insert_in_slot(rand, i);
+        }
+    }
+    atomic_set(&stop_lookups, true);
+    qemu_thread_join(&thread);
+
+    check_tree();
+    for (i = 1; i < N; i += 2) {
+        check_point(slot_start(i));
+    }
+    g_test_message("%lu lookups missed during updates", misses);
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/boundaries", test_boundaries);
+    g_test_add_func("/interval-tree/nested", test_nested);
+    g_test_add_func("/interval-tree/remove-in-iteration",
+                    test_remove_in_iteration);
+    g_test_add_func("/interval-tree/random", test_random);
+    g_test_add_func("/interval-tree/disjoint", test_disjoint);
+    g_test_add_func("/interval-tree/concurrent-lookup",
+                    test_concurrent_lookup);
+    return g_test_run();
+}
@@ -251,10 +251,71 @@ static void test_resize(void)
     qht_test(QHT_MODE_AUTO_RESIZE);
 }
 
+static size_t migrating_head_buckets(void)
+{
+    struct qht_stats stats;
+    size_t ret;
+
+    qht_statistics_init(&ht, &stats);
+    ret = stats.migrating_head_buckets;
+    qht_statistics_destroy(&stats);
+    return ret;
+}
+
+/*
+ * Exercise the table right after each automatic resize, i.e. while entries
+ * are still spread between the old and the new map.
+ */
+static void test_resize_incremental(void)
+{
+    struct qht_stats stats;
+    size_t resizes = 0;
+    bool seen_pending = false;
+    int i;
+
+    qht_init(&ht, is_equal, 0, QHT_MODE_AUTO_RESIZE);
+    for (i = 0; i < N; i++) {
+        int mid = i / 2;
+
+        insert(i, i + 1);
+
+        qht_statistics_init(&ht, &stats);
+        g_assert_cmpuint(stats.entries, ==, i + 1);
+        if (stats.resizes == resizes) {
+            qht_statistics_destroy(&stats);
+            continue;
+        }
+        resizes = stats.resizes;
+        /* insert() has already migrated a few buckets; small maps are done */
+        if (stats.migrating_head_buckets) {
+            seen_pending = true;
+        }
+        qht_statistics_destroy(&stats);
+
+        check(0, i + 1, true);
+        check(i + 1, i + 100, false);
+        rm(mid, mid + 1);
+        rm_nonexist(mid, mid + 1);
+        check_n(i);
+        check(mid, mid + 1, false);
+        insert(mid, mid + 1);
+        check_n(i + 1);
+
+        /* iterating completes the migration */
+        iter_check(i + 1);
+        g_assert_cmpuint(migrating_head_buckets(), ==, 0);
+        check(0, i + 1, true);
+    }
+    g_assert_cmpuint(resizes, >, 0);
+    g_assert_true(seen_pending);
+    qht_destroy(&ht);
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/qht/mode/default", test_default);
     g_test_add_func("/qht/mode/resize", test_resize);
+    g_test_add_func("/qht/resize/incremental", test_resize_incremental);
     return g_test_run();
 }
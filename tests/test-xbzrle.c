@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +176,137 @@ static void test_encode_decode(void)
     }
 }
 
+/* 2 sets of 8 pages; pages that are 2 * PAGE_SIZE apart share a set */
+#define CACHE_PAGES 16
+
+static void test_cache_set_associative(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t i;
+
+    for (i = 0; i < 8; i++) {
+        page[0] = i;
+        g_assert_cmpint(cache_insert(cache, i * 2 * PAGE_SIZE, page, 0),
+                        ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, i * 2 * PAGE_SIZE, 0));
+        g_assert_cmpint(get_cached_data(cache, i * 2 * PAGE_SIZE)[0], ==, i);
+    }
+
+    /* The other set is still empty */
+    g_assert(!cache_is_cached(cache, PAGE_SIZE, 0));
+    g_assert_cmpint(cache_insert(cache, PAGE_SIZE, page, 0), ==, 0);
+
+    /* Fresh pages are never evicted */
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, 1), ==, -1);
+    g_assert(!cache_is_cached(cache, 16 * PAGE_SIZE, 1));
+
+    cache_fini(cache);
+    g_free(page);
+}
+
+static void test_cache_eviction(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t i;
+
+    for (i = 0; i < 8; i++) {
+        g_assert_cmpint(cache_insert(cache, i * 2 * PAGE_SIZE, page, 0),
+                        ==, 0);
+    }
+
+    /* Page 0 is hit often but a while ago, the others once recently */
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, 0, 1));
+    }
+    for (i = 1; i < 8; i++) {
+        g_assert(cache_is_cached(cache, i * 2 * PAGE_SIZE, 2));
+    }
+
+    /* The least used of the oldest pages goes */
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, 4), ==, 1);
+    g_assert(get_cached_data(cache, 16 * PAGE_SIZE));
+    g_assert(get_cached_data(cache, 0));
+    g_assert(!get_cached_data(cache, 2 * PAGE_SIZE));
+    for (i = 2; i < 8; i++) {
+        g_assert(get_cached_data(cache, i * 2 * PAGE_SIZE));
+    }
+
+    /* Updating a cached page does not evict anything */
+    g_assert_cmpint(cache_insert(cache, 16 * PAGE_SIZE, page, 5), ==, 0);
+
+    cache_fini(cache);
+    g_free(page);
+}
+
+#define ACCEL_PAGES 64
+
+/* Every encoder must produce the same stream as the first one.  */
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_PAGES][2];
+    int i, j, n, dlen;
+    bool first = true;
+
+    for (i = 0; i < ACCEL_PAGES * PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, ACCEL_PAGES * PAGE_SIZE);
+
+    /* Page 0 is unchanged, the others have more and longer runs */
+    for (i = 1; i < ACCEL_PAGES; i++) {
+        n = g_test_rand_int_range(1, i * 4);
+        while (n--) {
+            int start = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, i + 1);
+
+            for (j = start; j < MIN(start + len, PAGE_SIZE); j++) {
+                new[i * PAGE_SIZE + j] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            uint8_t *o = old + i * PAGE_SIZE, *d = new + i * PAGE_SIZE;
+
+            dlen = xbzrle_encode_buffer(o, d, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            if (first) {
+                ref_len[i][0] = dlen;
+                memcpy(ref + i * PAGE_SIZE, compressed, MAX(dlen, 0));
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i][0]);
+                g_assert(memcmp(compressed, ref + i * PAGE_SIZE,
+                                MAX(dlen, 0)) == 0);
+            }
+
+            /* Also hit the overflow checks */
+            dlen = xbzrle_encode_buffer(o, d, PAGE_SIZE, compressed, i * 8);
+            if (first) {
+                ref_len[i][1] = dlen;
+            } else {
+                g_assert_cmpint(dlen, ==, ref_len[i][1]);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +319,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/cache/set_associative",
+                    test_cache_set_associative);
+    g_test_add_func("/xbzrle/cache/eviction", test_cache_eviction);
+    /* Must come last, it disables the accelerated encoders one by one */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -0,0 +1,124 @@
+/*
+ * QTest testcase and benchmark for machines with many PCI devices
+ *
+ * Starts a PC with N virtio-rng-pci devices and measures the startup time,
+ * then the time it takes to toggle memory and I/O decoding of all of
+ * them, which commits a memory transaction each time.  Both are dominated
+ * by memory topology updates once N is large.
+ *
+ * N defaults to a small value; set QTEST_VIRTIO_STARTUP_DEVICES (up to 240)
+ * and run with --verbose for a benchmark.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+#include "standard-headers/linux/virtio_pci.h"
+
+#define DEFAULT_DEVICES     16
+/* Slots 0 and 1 hold the host bridge and the ISA bridge */
+#define FIRST_SLOT          2
+#define MAX_DEVICES         ((32 - FIRST_SLOT) * 8)
+#define TOGGLE_ROUNDS       4
+
+typedef struct TestDevice {
+    QPCIDevice *dev;
+    QPCIBar bar;
+    uint32_t features;
+} TestDevice;
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
+{
+    GPtrArray *devs = data;
+
+    g_ptr_array_add(devs, dev);
+}
+
+static unsigned get_ndevices(void)
+{
+    const char *s = getenv("QTEST_VIRTIO_STARTUP_DEVICES");
+    unsigned long n;
+
+    if (!s || qemu_strtoul(s, NULL, 0, &n) < 0 || !n) {
+        return DEFAULT_DEVICES;
+    }
+    return MIN(n, MAX_DEVICES);
+}
+
+static void test_startup(void)
+{
+    unsigned i, round, n = get_ndevices();
+    GString *cmd = g_string_new("-nodefaults");
+    GPtrArray *devs = g_ptr_array_new();
+    TestDevice *td;
+    QPCIBus *pcibus;
+    int64_t start, startup_us, toggle_us;
+
+    for (i = 0; i < n; i++) {
+        g_string_append_printf(cmd, " -device virtio-rng-pci,addr=%x.%x%s",
+                               FIRST_SLOT + i / 8, i % 8,
+                               i % 8 ? "" : ",multifunction=on");
+    }
+
+    start = g_get_monotonic_time();
+    qtest_start(cmd->str);
+    startup_us = g_get_monotonic_time() - start;
+
+    pcibus = qpci_new_pc(global_qtest, NULL);
+    qpci_device_foreach(pcibus, 0x1af4, 0x1005, save_fn, devs);
+    g_assert_cmpuint(devs->len, ==, n);
+
+    td = g_new0(TestDevice, n);
+    for (i = 0; i < n; i++) {
+        td[i].dev = g_ptr_array_index(devs, i);
+        qpci_device_enable(td[i].dev);
+        td[i].bar = qpci_iomap(td[i].dev, 0, NULL);
+        td[i].features = qpci_io_readl(td[i].dev, td[i].bar,
+                                       VIRTIO_PCI_HOST_FEATURES);
+    }
+
+    start = g_get_monotonic_time();
+    for (round = 0; round < TOGGLE_ROUNDS; round++) {
+        for (i = 0; i < n; i++) {
+            uint16_t command = qpci_config_readw(td[i].dev, PCI_COMMAND);
+
+            qpci_config_writew(td[i].dev, PCI_COMMAND, command &
+                               ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+            qpci_config_writew(td[i].dev, PCI_COMMAND, command);
+        }
+    }
+    toggle_us = g_get_monotonic_time() - start;
+
+    /* The devices must be reachable exactly where they were */
+    for (i = 0; i < n; i++) {
+        g_assert_cmphex(qpci_io_readl(td[i].dev, td[i].bar,
+                                      VIRTIO_PCI_HOST_FEATURES),
+                        ==, td[i].features);
+        qpci_iounmap(td[i].dev, td[i].bar);
+        g_free(td[i].dev);
+    }
+
+    g_test_message("%u devices: startup %" PRId64 " ms, "
+                   "%.1f us per decode toggle",
+                   n, startup_us / 1000,
+                   (double)toggle_us / (TOGGLE_ROUNDS * n * 2));
+
+    g_free(td);
+    g_ptr_array_free(devs, true);
+    g_string_free(cmd, true);
+    qpci_free_pc(pcibus);
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/virtio/startup", test_startup);
+    return g_test_run();
+}
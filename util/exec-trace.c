@@ -0,0 +1,395 @@
+/*
+ * Binary execution trace
+ *
+ * Copyright (c) 2019 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/config-file.h"
+#include "qemu/error-report.h"
+#include "qemu/exec-trace.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+
+/*
+ * Each vCPU writes into its own ring; the writer thread (or whoever calls
+ * exec_trace_flush) is the only consumer, so head and tail can be updated
+ * without atomic read-modify-write operations.
+ */
+#define EXEC_TRACE_RING_BITS        16
+#define EXEC_TRACE_RING_WORDS       (1u << EXEC_TRACE_RING_BITS)
+#define EXEC_TRACE_RING_MASK        (EXEC_TRACE_RING_WORDS - 1)
+#define EXEC_TRACE_KICK_THRESHOLD   (EXEC_TRACE_RING_WORDS / 4)
+
+/* Flush TB definitions once this many bytes have accumulated */
+#define EXEC_TRACE_TB_THRESHOLD     (64 * 1024)
+
+/* Upper bound on the time records sit in a ring before being written */
+#define EXEC_TRACE_FLUSH_MS         100
+
+struct ExecTraceBuffer {
+    uint64_t ring[EXEC_TRACE_RING_WORDS];
+    unsigned int head;          /* written by the producer only */
+    unsigned int tail;          /* written by the consumer only */
+    unsigned int dropped;
+    bool kicked;
+    bool released;
+    int cpu_index;
+    QLIST_ENTRY(ExecTraceBuffer) next;
+};
+
+bool exec_trace_enabled;
+bool exec_trace_mem_enabled;
+
+static char *exec_trace_file_name;
+static FILE *exec_trace_fp;
+static QemuThread exec_trace_thread;
+static QemuSemaphore exec_trace_sem;
+static uint32_t exec_trace_next_tb_id;
+
+/* Protects exec_trace_buffers, exec_trace_fp and serializes consumers */
+static QemuMutex exec_trace_lock;
+static QLIST_HEAD(, ExecTraceBuffer) exec_trace_buffers =
+    QLIST_HEAD_INITIALIZER(exec_trace_buffers);
+
+/* Protects exec_trace_tb_defs; never held across file I/O */
+static QemuMutex exec_trace_tb_lock;
+static GByteArray *exec_trace_tb_defs;
+
+QemuOptsList qemu_exec_trace_opts = {
+    .name = "exec-trace",
+    .implied_opt_name = "file",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_exec_trace_opts.head),
+    .desc = {
+        {
+            .name = "file",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "mem",
+            .type = QEMU_OPT_BOOL,
+        },
+        { /* end of list */ }
+    },
+};
+
+void exec_trace_opt_parse(const char *optarg)
+{
+    QemuOpts *opts = qemu_opts_parse_noisily(qemu_find_opts("exec-trace"),
+                                             optarg, true);
+    if (!opts) {
+        exit(1);
+    }
+    g_free(exec_trace_file_name);
+    exec_trace_file_name = g_strdup(qemu_opt_get(opts, "file"));
+    if (!exec_trace_file_name) {
+        exec_trace_file_name = g_strdup_printf("exec-trace-%d", getpid());
+    }
+    exec_trace_mem_enabled = qemu_opt_get_bool(opts, "mem", false);
+    exec_trace_enabled = true;
+    qemu_opts_del(opts);
+}
+
+static void exec_trace_write_chunk(uint32_t type, int cpu_index,
+                                   uint32_t dropped,
+                                   const void *data1, size_t len1,
+                                   const void *data2, size_t len2)
+{
+    ExecTraceChunk chunk = {
+        .type = type,
+        .cpu_index = cpu_index,
+        .length = len1 + len2,
+        .dropped = dropped,
+    };
+    size_t unused __attribute__ ((unused));
+
+    unused = fwrite(&chunk, sizeof(chunk), 1, exec_trace_fp);
+    if (len1) {
+        unused = fwrite(data1, len1, 1, exec_trace_fp);
+    }
+    if (len2) {
+        unused = fwrite(data2, len2, 1, exec_trace_fp);
+    }
+}
+
+static void exec_trace_write_tb_defs(void)
+{
+    GByteArray *defs;
+
+    qemu_mutex_lock(&exec_trace_tb_lock);
+    defs = exec_trace_tb_defs;
+    exec_trace_tb_defs = g_byte_array_new();
+    qemu_mutex_unlock(&exec_trace_tb_lock);
+
+    if (defs->len) {
+        exec_trace_write_chunk(EXEC_TRACE_CHUNK_TB, -1, 0,
+                               defs->data, defs->len, NULL, 0);
+    }
+    g_byte_array_free(defs, true);
+}
+
+/* Called with exec_trace_lock held */
+static void exec_trace_drain(ExecTraceBuffer *buf)
+{
+    unsigned int head = atomic_load_acquire(&buf->head);
+    unsigned int tail = buf->tail;
+    unsigned int count = head - tail;
+    unsigned int first = tail & EXEC_TRACE_RING_MASK;
+    unsigned int len1 = MIN(count, EXEC_TRACE_RING_WORDS - first);
+    unsigned int dropped = atomic_xchg(&buf->dropped, 0);
+
+    if (count || dropped) {
+        exec_trace_write_chunk(EXEC_TRACE_CHUNK_RECORDS, buf->cpu_index,
+                               dropped,
+                               &buf->ring[first], len1 * sizeof(uint64_t),
+                               &buf->ring[0],
+                               (count - len1) * sizeof(uint64_t));
+    }
+    atomic_store_release(&buf->tail, head);
+    atomic_set(&buf->kicked, false);
+}
+
+/* Called with exec_trace_lock held */
+static void exec_trace_flush_locked(void)
+{
+    ExecTraceBuffer *buf, *next_buf;
+
+    exec_trace_write_tb_defs();
+    QLIST_FOREACH_SAFE(buf, &exec_trace_buffers, next, next_buf) {
+        bool released = atomic_load_acquire(&buf->released);
+
+        exec_trace_drain(buf);
+        if (released) {
+            QLIST_REMOVE(buf, next);
+            g_free(buf);
+        }
+    }
+    fflush(exec_trace_fp);
+}
+
+void exec_trace_flush(void)
+{
+    if (!exec_trace_fp) {
+        return;
+    }
+
+    qemu_mutex_lock(&exec_trace_lock);
+    exec_trace_flush_locked();
+    qemu_mutex_unlock(&exec_trace_lock);
+}
+
+static void *exec_trace_writeout_thread(void *opaque)
+{
+    for (;;) {
+        qemu_sem_timedwait(&exec_trace_sem, EXEC_TRACE_FLUSH_MS);
+        exec_trace_flush();
+    }
+    return NULL;
+}
+
+static bool exec_trace_open(const char *name, Error **errp)
+{
+    ExecTraceHeader header = {
+        .magic = EXEC_TRACE_MAGIC,
+        .version = EXEC_TRACE_VERSION,
+        .flags = exec_trace_mem_enabled ? EXEC_TRACE_F_MEM : 0,
+    };
+
+    exec_trace_fp = fopen(name, "wb");
+    if (!exec_trace_fp) {
+        error_setg_errno(errp, errno, "Could not open exec trace file '%s'",
+                         name);
+        exec_trace_enabled = exec_trace_mem_enabled = false;
+        return false;
+    }
+    if (fwrite(&header, sizeof(header), 1, exec_trace_fp) != 1) {
+        error_setg_errno(errp, errno, "Could not write exec trace file '%s'",
+                         name);
+        fclose(exec_trace_fp);
+        exec_trace_fp = NULL;
+        exec_trace_enabled = exec_trace_mem_enabled = false;
+        return false;
+    }
+    return true;
+}
+
+static void exec_trace_init_locks(void)
+{
+    qemu_mutex_init(&exec_trace_lock);
+    qemu_mutex_init(&exec_trace_tb_lock);
+}
+
+static void exec_trace_start_thread(void)
+{
+    qemu_sem_init(&exec_trace_sem, 0);
+    qemu_thread_create(&exec_trace_thread, "exec-trace",
+                       exec_trace_writeout_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+bool exec_trace_init(Error **errp)
+{
+    if (!exec_trace_enabled) {
+        return true;
+    }
+
+    if (!exec_trace_open(exec_trace_file_name, errp)) {
+        return false;
+    }
+    exec_trace_tb_defs = g_byte_array_new();
+    exec_trace_init_locks();
+    exec_trace_start_thread();
+    atexit(exec_trace_flush);
+    return true;
+}
+
+void exec_trace_fork_start(void)
+{
+    if (!exec_trace_fp) {
+        return;
+    }
+
+    qemu_mutex_lock(&exec_trace_lock);
+    exec_trace_flush_locked();
+    qemu_mutex_lock(&exec_trace_tb_lock);
+}
+
+void exec_trace_fork_end(int child, ExecTraceBuffer *keep)
+{
+    ExecTraceBuffer *buf, *next_buf;
+    Error *local_err = NULL;
+    char *name;
+
+    if (!exec_trace_fp) {
+        return;
+    }
+    if (!child) {
+        qemu_mutex_unlock(&exec_trace_tb_lock);
+        qemu_mutex_unlock(&exec_trace_lock);
+        return;
+    }
+
+    /*
+     * Like mmap_fork_end, re-initialize the locks taken in
+     * exec_trace_fork_start, before opening the file can fail.
+     */
+    exec_trace_init_locks();
+
+    /*
+     * The parent wrote out everything up to the fork, and the threads
+     * that owned the other buffers do not exist in the child.
+     */
+    QLIST_FOREACH_SAFE(buf, &exec_trace_buffers, next, next_buf) {
+        if (buf != keep) {
+            QLIST_REMOVE(buf, next);
+            g_free(buf);
+        }
+    }
+    if (keep) {
+        keep->tail = keep->head;
+        keep->dropped = 0;
+        keep->kicked = false;
+    }
+
+    /* The stream was flushed, so this only closes the child's descriptor */
+    fclose(exec_trace_fp);
+    exec_trace_fp = NULL;
+    name = g_strdup_printf("%s.%d", exec_trace_file_name, getpid());
+    if (exec_trace_open(name, &local_err)) {
+        exec_trace_start_thread();
+    } else {
+        /* Records pile up in the rings and are dropped */
+        warn_report_err(local_err);
+    }
+    g_free(name);
+}
+
+ExecTraceBuffer *exec_trace_buffer_new(int cpu_index)
+{
+    ExecTraceBuffer *buf = g_new0(ExecTraceBuffer, 1);
+
+    buf->cpu_index = cpu_index;
+    qemu_mutex_lock(&exec_trace_lock);
+    QLIST_INSERT_HEAD(&exec_trace_buffers, buf, next);
+    qemu_mutex_unlock(&exec_trace_lock);
+    return buf;
+}
+
+void exec_trace_buffer_release(ExecTraceBuffer *buf)
+{
+    if (buf) {
+        atomic_store_release(&buf->released, true);
+        qemu_sem_post(&exec_trace_sem);
+    }
+}
+
+static inline void exec_trace_put(ExecTraceBuffer *buf,
+                                  const uint64_t *words, unsigned int n)
+{
+    unsigned int head = buf->head;
+    unsigned int used = head - atomic_load_acquire(&buf->tail);
+    unsigned int i;
+
+    if (unlikely(used + n > EXEC_TRACE_RING_WORDS)) {
+        atomic_inc(&buf->dropped);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        buf->ring[(head + i) & EXEC_TRACE_RING_MASK] = words[i];
+    }
+    atomic_store_release(&buf->head, head + n);
+
+    if (unlikely(used + n >= EXEC_TRACE_KICK_THRESHOLD) &&
+        !atomic_read(&buf->kicked)) {
+        atomic_set(&buf->kicked, true);
+        qemu_sem_post(&exec_trace_sem);
+    }
+}
+
+void exec_trace_record_tb(ExecTraceBuffer *buf, uint32_t id)
+{
+    uint64_t word = EXEC_TRACE_REC_TB | ((uint64_t)id << 32);
+
+    exec_trace_put(buf, &word, 1);
+}
+
+void exec_trace_record_mem(ExecTraceBuffer *buf, uint64_t vaddr,
+                           uint8_t info)
+{
+    uint64_t words[2] = { EXEC_TRACE_REC_MEM | ((uint64_t)info << 8), vaddr };
+
+    exec_trace_put(buf, words, 2);
+}
+
+uint32_t exec_trace_new_tb_id(void)
+{
+    return atomic_fetch_inc(&exec_trace_next_tb_id);
+}
+
+void exec_trace_define_tb(uint32_t id, uint64_t pc, uint32_t size,
+                          uint32_t icount, const char *disas, size_t len)
+{
+    ExecTraceTBDef def = {
+        .pc = pc,
+        .id = id,
+        .size = size,
+        .icount = icount,
+        .disas_len = len,
+    };
+    bool kick;
+
+    qemu_mutex_lock(&exec_trace_tb_lock);
+    g_byte_array_append(exec_trace_tb_defs, (const guint8 *)&def, sizeof(def));
+    g_byte_array_append(exec_trace_tb_defs, (const guint8 *)disas, len);
+    kick = exec_trace_tb_defs->len >= EXEC_TRACE_TB_THRESHOLD;
+    qemu_mutex_unlock(&exec_trace_tb_lock);
+
+    if (kick) {
+        qemu_sem_post(&exec_trace_sem);
+    }
+}
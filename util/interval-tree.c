@@ -0,0 +1,263 @@
+/*
+ * Augmented interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The tree is an AVL tree with parent pointers.  Every node caches its
+ * height and the maximum @last of its subtree; both are recomputed bottom-up
+ * along the path from the modified node to the root after every update,
+ * which also takes care of rebalancing.
+ *
+ * Child pointers are written with atomic_set, and new nodes are published
+ * with atomic_rcu_set, so that lockless lookups always see initialized
+ * nodes; see interval-tree.h for what they can miss.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(const IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+static void node_update(IntervalTreeNode *node)
+{
+    uint64_t subtree_last = node->last;
+
+    if (node->left && node->left->subtree_last > subtree_last) {
+        subtree_last = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > subtree_last) {
+        subtree_last = node->right->subtree_last;
+    }
+    atomic_set(&node->subtree_last, subtree_last);
+    node->height = MAX(node_height(node->left), node_height(node->right)) + 1;
+}
+
+/* Make @parent (or @root, if @parent is NULL) point to @new instead of @old */
+static void change_child(IntervalTreeNode *old, IntervalTreeNode *new,
+                         IntervalTreeNode *parent, IntervalTreeRoot *root)
+{
+    if (!parent) {
+        atomic_set(&root->root, new);
+    } else if (parent->left == old) {
+        atomic_set(&parent->left, new);
+    } else {
+        atomic_set(&parent->right, new);
+    }
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *node,
+                                     IntervalTreeRoot *root)
+{
+    IntervalTreeNode *parent = node->parent;
+    IntervalTreeNode *right = node->right;
+    IntervalTreeNode *moved = right->left;
+
+    atomic_set(&node->right, moved);
+    if (moved) {
+        moved->parent = node;
+    }
+    atomic_set(&right->left, node);
+    node->parent = right;
+    right->parent = parent;
+    change_child(node, right, parent, root);
+
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *node,
+                                      IntervalTreeRoot *root)
+{
+    IntervalTreeNode *parent = node->parent;
+    IntervalTreeNode *left = node->left;
+    IntervalTreeNode *moved = left->right;
+
+    atomic_set(&node->left, moved);
+    if (moved) {
+        moved->parent = node;
+    }
+    atomic_set(&left->right, node);
+    node->parent = left;
+    left->parent = parent;
+    change_child(node, left, parent, root);
+
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+/* Returns the node that takes the place of @node in the tree */
+static IntervalTreeNode *rebalance(IntervalTreeNode *node,
+                                   IntervalTreeRoot *root)
+{
+    int balance = node_height(node->left) - node_height(node->right);
+
+    if (balance > 1) {
+        IntervalTreeNode *left = node->left;
+
+        if (node_height(left->left) < node_height(left->right)) {
+            rotate_left(left, root);
+        }
+        return rotate_right(node, root);
+    }
+    if (balance < -1) {
+        IntervalTreeNode *right = node->right;
+
+        if (node_height(right->right) < node_height(right->left)) {
+            rotate_right(right, root);
+        }
+        return rotate_left(node, root);
+    }
+    node_update(node);
+    return node;
+}
+
+static void rebalance_to_root(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    while (node) {
+        node = rebalance(node, root)->parent;
+    }
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode **link = &root->root;
+    IntervalTreeNode *parent = NULL;
+
+    while (*link) {
+        parent = *link;
+        link = node->start < parent->start ? &parent->left : &parent->right;
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->subtree_last = node->last;
+    node->height = 1;
+    atomic_rcu_set(link, node);
+
+    rebalance_to_root(parent, root);
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode *parent = node->parent;
+    IntervalTreeNode *fixup;
+
+    if (node->left && node->right) {
+        /* Put the in-order successor in place of @node */
+        IntervalTreeNode *succ = node->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+        if (succ->parent != node) {
+            IntervalTreeNode *succ_parent = succ->parent;
+
+            atomic_set(&succ_parent->left, succ->right);
+            if (succ->right) {
+                succ->right->parent = succ_parent;
+            }
+            atomic_set(&succ->right, node->right);
+            node->right->parent = succ;
+            fixup = succ_parent;
+        } else {
+            fixup = succ;
+        }
+        atomic_set(&succ->left, node->left);
+        node->left->parent = succ;
+        succ->parent = parent;
+        change_child(node, succ, parent, root);
+    } else {
+        IntervalTreeNode *child = node->left ? node->left : node->right;
+
+        if (child) {
+            child->parent = parent;
+        }
+        change_child(node, child, parent, root);
+        fixup = parent;
+    }
+
+    rebalance_to_root(fixup, root);
+}
+
+/*
+ * Find the leftmost node of the subtree rooted at @node that overlaps
+ * [start, last].  The caller guarantees that @node->subtree_last >= start.
+ */
+static IntervalTreeNode *subtree_search(IntervalTreeNode *node,
+                                        uint64_t start, uint64_t last)
+{
+    for (;;) {
+        IntervalTreeNode *left = atomic_rcu_read(&node->left);
+
+        /*
+         * If something in the left subtree ends at or after @start, the
+         * leftmost such node is the only candidate: everything to its
+         * right starts even later.
+         */
+        if (left && start <= atomic_read(&left->subtree_last)) {
+            node = left;
+            continue;
+        }
+        if (node->start <= last) {
+            if (start <= node->last) {
+                return node;
+            }
+            node = atomic_rcu_read(&node->right);
+            if (node && start <= atomic_read(&node->subtree_last)) {
+                continue;
+            }
+        }
+        return NULL;
+    }
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node = atomic_rcu_read(&root->root);
+
+    if (!node || atomic_read(&node->subtree_last) < start) {
+        return NULL;
+    }
+    return subtree_search(node, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *right = node->right;
+    IntervalTreeNode *prev;
+
+    for (;;) {
+        if (right && start <= right->subtree_last) {
+            return subtree_search(right, start, last);
+        }
+
+        /* Go up until we come from a left child */
+        do {
+            prev = node;
+            node = node->parent;
+            if (!node) {
+                return NULL;
+            }
+            right = node->right;
+        } while (prev == right);
+
+        if (last < node->start) {
+            return NULL;
+        }
+        if (start <= node->last) {
+            return node;
+        }
+    }
+}
@@ -38,9 +38,12 @@
 #include <libgen.h>
 #include <sys/signal.h>
 #include "qemu/cutils.h"
+#include "qemu/bitops.h"
+#include "qemu/thread.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
+#include <sched.h>
 #endif
 
 #ifdef __FreeBSD__
@@ -59,20 +62,52 @@
 #include "qemu/error-report.h"
 #endif
 
+/* Per preallocation, shared by all the regions that are touched together */
 #define MAX_MEM_PREALLOC_THREAD_COUNT 16
+/* Interval between progress reports of long preallocations */
+#define MEM_PREALLOC_PROGRESS_MS 1000
 
 struct MemsetThread {
     char *addr;
     size_t numpages;
     size_t hpagesize;
+    size_t touched;
+    int64_t end_us;
+    bool failed;
+#ifdef CONFIG_LINUX
+    cpu_set_t *cpus;
+#endif
+    QemuSemaphore *done;
     QemuThread pgthread;
     sigjmp_buf env;
 };
 typedef struct MemsetThread MemsetThread;
 
+/* Threads of one region of a preallocation batch */
+typedef struct MemsetRegion {
+    const MemPrealloc *req;
+    size_t hpagesize;
+    int first_thread;
+    int num_threads;
+    int num_cpus;
+#ifdef CONFIG_LINUX
+    cpu_set_t cpus;
+#endif
+} MemsetRegion;
+
+/*
+ * Preallocations are serialized, so that the threads of concurrent ones
+ * do not add up beyond the limit of each host node, and they do not step
+ * on each other's SIGBUS handler and memset_thread array.
+ */
+static QemuMutex memset_lock;
 static MemsetThread *memset_thread;
 static int memset_num_threads;
-static bool memset_thread_failed;
+
+static void __attribute__((constructor)) memset_lock_init(void)
+{
+    qemu_mutex_init(&memset_lock);
+}
 
 int qemu_get_thread_id(void)
 {
@@ -401,13 +436,20 @@ static void *do_touch_pages(void *arg)
     MemsetThread *memset_args = (MemsetThread *)arg;
     sigset_t set, oldset;
 
+#ifdef CONFIG_LINUX
+    if (memset_args->cpus) {
+        /* Best effort: if this fails, the pages are touched from anywhere */
+        sched_setaffinity(0, sizeof(*memset_args->cpus), memset_args->cpus);
+    }
+#endif
+
     /* unblock SIGBUS */
     sigemptyset(&set);
     sigaddset(&set, SIGBUS);
     pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
 
     if (sigsetjmp(memset_args->env, 1)) {
-        memset_thread_failed = true;
+        memset_args->failed = true;
     } else {
         char *addr = memset_args->addr;
         size_t numpages = memset_args->numpages;
@@ -428,80 +470,312 @@ static void *do_touch_pages(void *arg)
              */
             *(volatile char *)addr = *addr;
             addr += hpagesize;
+            atomic_set(&memset_args->touched, i + 1);
         }
     }
     pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    memset_args->end_us = g_get_monotonic_time();
+    qemu_sem_post(memset_args->done);
     return NULL;
 }
 
-static inline int get_memset_num_threads(int smp_cpus)
+#ifdef CONFIG_LINUX
+/* Add the CPUs in a list such as "0-3,8-11" to @cpus */
+static void cpulist_parse(const char *s, cpu_set_t *cpus)
+{
+    unsigned long first, last;
+
+    while (qemu_strtoul(s, &s, 10, &first) == 0) {
+        last = first;
+        if (*s == '-' && qemu_strtoul(s + 1, &s, 10, &last) < 0) {
+            return;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, cpus);
+        }
+        if (*s != ',') {
+            return;
+        }
+        s++;
+    }
+}
+
+/*
+ * Fill @cpus with the CPUs of the host NUMA nodes in @nodes that this
+ * process may run on, and return how many there are.
+ */
+static int host_nodes_cpus(const unsigned long *nodes, unsigned long max_node,
+                           cpu_set_t *cpus)
+{
+    cpu_set_t allowed;
+    unsigned long node;
+
+    CPU_ZERO(cpus);
+    for (node = find_first_bit(nodes, max_node); node < max_node;
+         node = find_next_bit(nodes, max_node, node + 1)) {
+        char *path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist",
+                                     node);
+        gchar *contents;
+
+        if (g_file_get_contents(path, &contents, NULL, NULL)) {
+            cpulist_parse(contents, cpus);
+            g_free(contents);
+        }
+        g_free(path);
+    }
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        CPU_AND(cpus, cpus, &allowed);
+    }
+    return CPU_COUNT(cpus);
+}
+#endif
+
+static inline int get_memset_num_threads(int smp_cpus, int host_procs,
+                                         size_t numpages)
 {
-    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
     int ret = 1;
 
     if (host_procs > 0) {
         ret = MIN(MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT), smp_cpus);
     }
     /* In case sysconf() fails, we fall back to single threaded */
-    return ret;
+    return MAX(MIN(ret, numpages), 1);
+}
+
+static void memset_region_init(MemsetRegion *r, const MemPrealloc *req,
+                               int smp_cpus)
+{
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    r->req = req;
+    r->hpagesize = qemu_fd_getpagesize(req->fd);
+    r->num_cpus = 0;
+#ifdef CONFIG_LINUX
+    if (req->host_nodes) {
+        r->num_cpus = host_nodes_cpus(req->host_nodes, req->max_node,
+                                      &r->cpus);
+    }
+    if (r->num_cpus) {
+        host_procs = r->num_cpus;
+    }
+#endif
+    r->num_threads = get_memset_num_threads(smp_cpus, host_procs,
+                                            DIV_ROUND_UP(req->size,
+                                                         r->hpagesize));
+}
+
+/* Whether the threads of @a and @b run on the same host CPUs */
+static bool memset_regions_share_cpus(const MemsetRegion *a,
+                                      const MemsetRegion *b)
+{
+#ifdef CONFIG_LINUX
+    if (a->num_cpus || b->num_cpus) {
+        return a->num_cpus == b->num_cpus && CPU_EQUAL(&a->cpus, &b->cpus);
+    }
+#endif
+    return true;
+}
+
+/*
+ * Bring the total number of threads of @r down to @max_threads, sharing
+ * them according to the size of each region.  Each region keeps at least
+ * one thread, since its pages are touched at the same time as the others.
+ */
+static void memset_regions_limit(MemsetRegion **r, int nregions,
+                                 int max_threads)
+{
+    uint64_t total_pages = 0;
+    int spare = MAX(max_threads - nregions, 0);
+    int total = 0;
+    int i;
+
+    for (i = 0; i < nregions; i++) {
+        total += r[i]->num_threads;
+        total_pages += DIV_ROUND_UP(r[i]->req->size, r[i]->hpagesize);
+    }
+    if (total <= max_threads) {
+        return;
+    }
+    for (i = 0; i < nregions; i++) {
+        uint64_t pages = DIV_ROUND_UP(r[i]->req->size, r[i]->hpagesize);
+        int share = 1 + spare * pages / total_pages;
+
+        r[i]->num_threads = MIN(r[i]->num_threads, share);
+    }
 }
 
-static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                            int smp_cpus)
+/*
+ * Regions bound to the same host nodes compete for the same CPUs, so
+ * limit the threads of each such group like those of a single region.
+ * Regions on other nodes get their own threads, as do the regions that
+ * are not bound to any node.
+ */
+static void memset_regions_limit_per_node(MemsetRegion *r, int nregions,
+                                          int smp_cpus)
 {
-    size_t numpages_per_thread;
-    size_t size_per_thread;
-    char *addr = area;
-    int i = 0;
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    MemsetRegion **group = g_new(MemsetRegion *, nregions);
+    bool *grouped = g_new0(bool, nregions);
+    int i, j, n;
+
+    for (i = 0; i < nregions; i++) {
+        if (grouped[i]) {
+            continue;
+        }
+        n = 0;
+        for (j = i; j < nregions; j++) {
+            if (!grouped[j] && memset_regions_share_cpus(&r[i], &r[j])) {
+                grouped[j] = true;
+                group[n++] = &r[j];
+            }
+        }
+        memset_regions_limit(group, n,
+                             get_memset_num_threads(smp_cpus,
+                                                    r[i].num_cpus ?
+                                                    r[i].num_cpus : host_procs,
+                                                    SIZE_MAX));
+    }
+    g_free(grouped);
+    g_free(group);
+}
+
+static size_t memset_region_touched(MemsetRegion *r)
+{
+    size_t pages = 0;
+    int i;
+
+    for (i = 0; i < r->num_threads; i++) {
+        pages += atomic_read(&memset_thread[r->first_thread + i].touched);
+    }
+    return MIN(pages * r->hpagesize, r->req->size);
+}
+
+/*
+ * Touch all pages of @regions, and return the index of the first region
+ * that could not be fully allocated, or -1 on success.
+ */
+static int touch_all_pages(const MemPrealloc *regions, int nregions,
+                           int smp_cpus)
+{
+    MemsetRegion *r = g_new0(MemsetRegion, nregions);
+    QemuSemaphore done;
+    int64_t start_us = g_get_monotonic_time();
+    int failed = -1;
+    int i, j, n, remaining;
+
+    for (i = 0; i < nregions; i++) {
+        memset_region_init(&r[i], &regions[i], smp_cpus);
+    }
+    memset_regions_limit_per_node(r, nregions, smp_cpus);
+    memset_num_threads = 0;
+    for (i = 0; i < nregions; i++) {
+        r[i].first_thread = memset_num_threads;
+        memset_num_threads += r[i].num_threads;
+    }
 
-    memset_thread_failed = false;
-    memset_num_threads = get_memset_num_threads(smp_cpus);
+    qemu_sem_init(&done, 0);
     memset_thread = g_new0(MemsetThread, memset_num_threads);
-    numpages_per_thread = (numpages / memset_num_threads);
-    size_per_thread = (hpagesize * numpages_per_thread);
-    for (i = 0; i < memset_num_threads; i++) {
-        memset_thread[i].addr = addr;
-        memset_thread[i].numpages = (i == (memset_num_threads - 1)) ?
-                                    numpages : numpages_per_thread;
-        memset_thread[i].hpagesize = hpagesize;
-        qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
-                           do_touch_pages, &memset_thread[i],
+    for (i = 0; i < nregions; i++) {
+        size_t numpages = DIV_ROUND_UP(regions[i].size, r[i].hpagesize);
+        size_t numpages_per_thread = numpages / r[i].num_threads;
+        char *addr = regions[i].area;
+
+        trace_os_mem_prealloc_start(regions[i].name, regions[i].area,
+                                    regions[i].size, r[i].hpagesize,
+                                    r[i].num_threads, r[i].num_cpus);
+        for (j = 0; j < r[i].num_threads; j++) {
+            MemsetThread *t = &memset_thread[r[i].first_thread + j];
+
+            t->addr = addr;
+            t->numpages = (j == (r[i].num_threads - 1)) ?
+                          numpages : numpages_per_thread;
+            t->hpagesize = r[i].hpagesize;
+#ifdef CONFIG_LINUX
+            t->cpus = r[i].num_cpus ? &r[i].cpus : NULL;
+#endif
+            t->done = &done;
+            addr += numpages_per_thread * r[i].hpagesize;
+            numpages -= numpages_per_thread;
+        }
+    }
+    /* Only start the threads once the array is complete, for sigbus_handler */
+    for (n = 0; n < memset_num_threads; n++) {
+        qemu_thread_create(&memset_thread[n].pgthread, "touch_pages",
+                           do_touch_pages, &memset_thread[n],
                            QEMU_THREAD_JOINABLE);
-        addr += size_per_thread;
-        numpages -= numpages_per_thread;
     }
-    for (i = 0; i < memset_num_threads; i++) {
-        qemu_thread_join(&memset_thread[i].pgthread);
+
+    remaining = memset_num_threads;
+    while (remaining) {
+        if (qemu_sem_timedwait(&done, MEM_PREALLOC_PROGRESS_MS) == 0) {
+            remaining--;
+            continue;
+        }
+        for (i = 0; i < nregions; i++) {
+            trace_os_mem_prealloc_progress(regions[i].name,
+                                           memset_region_touched(&r[i]),
+                                           regions[i].size);
+        }
+    }
+
+    for (n = 0; n < memset_num_threads; n++) {
+        qemu_thread_join(&memset_thread[n].pgthread);
     }
+
+    for (i = 0; i < nregions; i++) {
+        int64_t end_us = start_us;
+        bool region_failed = false;
+
+        for (j = 0; j < r[i].num_threads; j++) {
+            MemsetThread *t = &memset_thread[r[i].first_thread + j];
+
+            end_us = MAX(end_us, t->end_us);
+            region_failed |= t->failed;
+        }
+        trace_os_mem_prealloc_done(regions[i].name, regions[i].size,
+                                   (end_us - start_us) / 1000, region_failed);
+        if (region_failed && failed < 0) {
+            failed = i;
+        }
+    }
+
     g_free(memset_thread);
     memset_thread = NULL;
-
-    return memset_thread_failed;
+    memset_num_threads = 0;
+    qemu_sem_destroy(&done);
+    g_free(r);
+    return failed;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
-                     Error **errp)
+void os_mem_prealloc_batch(const MemPrealloc *regions, int nregions,
+                           int smp_cpus, Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
-    size_t hpagesize = qemu_fd_getpagesize(fd);
-    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+
+    if (!nregions) {
+        return;
+    }
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
     act.sa_flags = 0;
 
+    qemu_mutex_lock(&memset_lock);
     ret = sigaction(SIGBUS, &act, &oldact);
     if (ret) {
         error_setg_errno(errp, errno,
             "os_mem_prealloc: failed to install signal handler");
+        qemu_mutex_unlock(&memset_lock);
         return;
     }
 
     /* touch pages simultaneously */
-    if (touch_all_pages(area, hpagesize, numpages, smp_cpus)) {
+    ret = touch_all_pages(regions, nregions, smp_cpus);
+    if (ret >= 0) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
-            "pages available to allocate guest RAM");
+            "pages available to allocate %s", regions[ret].name);
     }
 
     ret = sigaction(SIGBUS, &oldact, NULL);
@@ -510,6 +784,20 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
         perror("os_mem_prealloc: failed to reinstall signal handler");
         exit(1);
     }
+    qemu_mutex_unlock(&memset_lock);
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
+                     Error **errp)
+{
+    MemPrealloc region = {
+        .name = "guest RAM",
+        .fd = fd,
+        .area = area,
+        .size = memory,
+    };
+
+    os_mem_prealloc_batch(&region, 1, smp_cpus, errp);
 }
 
 uint64_t qemu_get_pmem_size(const char *filename, Error **errp)
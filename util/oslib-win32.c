@@ -560,6 +560,17 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+void os_mem_prealloc_batch(const MemPrealloc *regions, int nregions,
+                           int smp_cpus, Error **errp)
+{
+    int i;
+
+    for (i = 0; i < nregions; i++) {
+        os_mem_prealloc(regions[i].fd, regions[i].area, regions[i].size,
+                        smp_cpus, errp);
+    }
+}
+
 uint64_t qemu_get_pmem_size(const char *filename, Error **errp)
 {
     error_setg(errp, "pmem support not available");
@@ -22,8 +22,8 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold. Resizing is done concurrently with readers and
+ *   writers; see below.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,14 +43,25 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Resizing is incremental. A resize publishes a new, empty map whose @old
+ * field points to the previous map; head buckets are then migrated one at a
+ * time, each under its old head bucket lock plus the lock of the destination
+ * bucket in the new map. Writers migrate the old bucket their hash maps to
+ * (plus a small batch of other buckets) before touching the new map, so that
+ * an insertion cannot miss a duplicate still sitting in the old map.
+ * Whoever migrates the last old bucket clears @old and frees the old map
+ * after an RCU grace period. Lookups that race with a resize check the old
+ * bucket first and then the new one: migration inserts into the new map
+ * before removing from the old one, so an entry cannot be missed.
+ *
+ * Operations on the whole table (reset, iteration, explicit resizes) first
+ * complete any pending migration while holding ht->lock, and then take all
+ * bucket locks of the current map.
  *
  * Writers check for concurrent resizes by comparing ht->map before and after
  * acquiring their bucket lock. If they don't match, a resize has occured
- * while the bucket spinlock was being acquired.
+ * while the bucket spinlock was being acquired. Lookups that fail compare
+ * ht->map again, since a resize may have moved the entry they are after.
  *
  * Related Work:
  * - Idea of cacheline-sized buckets with full hashes taken from:
@@ -68,6 +79,7 @@
 #include "qemu/osdep.h"
 #include "qemu/qht.h"
 #include "qemu/atomic.h"
+#include "qemu/processor.h"
 #include "qemu/rcu.h"
 
 //#define QHT_DEBUG
@@ -159,6 +171,12 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @old: map being migrated into this one, or NULL if no resize is ongoing.
+ * @migrated: for a map that is being migrated, one flag per head bucket
+ *            telling whether the bucket has been moved to the new map.
+ *            Set with the head bucket lock held.
+ * @n_migrated: number of head buckets already migrated.
+ * @migrate_next: index of the next head bucket to be migrated in batch.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -168,14 +186,24 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    struct qht_map *old;
+    bool *migrated;
+    size_t n_migrated;
+    size_t migrate_next;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
-static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
-                                bool reset);
+/* number of extra old head buckets migrated by each writer during a resize */
+#define QHT_MIGRATE_BATCH 4
+
+static void qht_do_reset_resize(struct qht *ht, struct qht_map *new);
 static void qht_grow_maybe(struct qht *ht);
+static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
+                                struct qht_bucket *head, void *p, uint32_t hash,
+                                bool *needs_resize);
+static void qht_bucket_reset__locked(struct qht_bucket *head);
 
 #ifdef QHT_DEBUG
 
@@ -274,10 +302,134 @@ static inline bool qht_map_is_stale__locked(const struct qht *ht,
     return map != ht->map;
 }
 
+/* pass only an orphan map */
+static void qht_map_destroy(struct qht_map *map);
+
+/*
+ * Move the entries of @old's head bucket @idx (and its chain) to @new.
+ * Call under an RCU read-critical section, since @old might be retired
+ * concurrently by another thread.
+ */
+static void qht_map_migrate_bucket(const struct qht *ht, struct qht_map *new,
+                                   struct qht_map *old, size_t idx)
+{
+    struct qht_bucket *head = &old->buckets[idx];
+    struct qht_bucket *b = head;
+    bool done = false;
+    int i;
+
+    if (atomic_read(&old->migrated[idx])) {
+        return;
+    }
+
+    qemu_spin_lock(&head->lock);
+    if (old->migrated[idx]) {
+        qemu_spin_unlock(&head->lock);
+        return;
+    }
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            struct qht_bucket *dest;
+
+            if (b->pointers[i] == NULL) {
+                goto out;
+            }
+            dest = qht_map_to_bucket(new, b->hashes[i]);
+            qemu_spin_lock(&dest->lock);
+            qht_insert__locked(ht, new, dest, b->pointers[i], b->hashes[i],
+                               NULL);
+            qemu_spin_unlock(&dest->lock);
+        }
+        b = b->next;
+    } while (b);
+ out:
+    /* entries are now visible in @new; only then remove them from @old */
+    qht_bucket_reset__locked(head);
+    atomic_set(&old->migrated[idx], true);
+    done = atomic_fetch_inc(&old->n_migrated) + 1 == old->n_buckets;
+    qemu_spin_unlock(&head->lock);
+
+    if (done) {
+        atomic_rcu_set(&new->old, NULL);
+        call_rcu(old, qht_map_destroy, rcu);
+    }
+}
+
+/*
+ * Make sure that @hash's entries are not left behind in @map->old, and help
+ * the ongoing resize make progress.
+ */
+static __attribute__((noinline))
+void qht_map_migrate__slowpath(const struct qht *ht, struct qht_map *map,
+                               uint32_t hash)
+{
+    struct qht_map *old;
+
+    rcu_read_lock();
+    old = atomic_rcu_read(&map->old);
+    if (old) {
+        size_t start, i;
+
+        qht_map_migrate_bucket(ht, map, old, hash & (old->n_buckets - 1));
+
+        start = atomic_fetch_add(&old->migrate_next, QHT_MIGRATE_BATCH);
+        for (i = start; i < start + QHT_MIGRATE_BATCH && i < old->n_buckets;
+             i++) {
+            qht_map_migrate_bucket(ht, map, old, i);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/*
+ * Complete the ongoing resize, if any.
+ * Call with ht->lock held.
+ */
+static void qht_map_finish_migration__htlocked(struct qht *ht)
+{
+    struct qht_map *map = ht->map;
+    struct qht_map *old;
+    size_t i;
+
+    rcu_read_lock();
+    old = atomic_rcu_read(&map->old);
+    if (old) {
+        for (i = 0; i < old->n_buckets; i++) {
+            qht_map_migrate_bucket(ht, map, old, i);
+        }
+    }
+    rcu_read_unlock();
+
+    /* the thread that migrated the last bucket might not have retired it */
+    while (atomic_read(&map->old)) {
+        cpu_relax();
+    }
+}
+
+/*
+ * Publish @new as the current map and start migrating the entries of the
+ * current map into it.
+ * Call with ht->lock held and no resize in progress.
+ */
+static void qht_map_start_migration__htlocked(struct qht *ht,
+                                              struct qht_map *new)
+{
+    struct qht_map *old = ht->map;
+
+    g_assert(old->old == NULL);
+    g_assert(new->n_buckets != old->n_buckets);
+
+    old->migrated = g_new0(bool, old->n_buckets);
+    new->old = old;
+    atomic_inc(&ht->n_resizes);
+    atomic_rcu_set(&ht->map, new);
+}
+
 /*
- * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
+ * Grab all bucket locks, and set @pmap after making sure the map isn't stale
+ * and that no resize is in progress.
  *
- * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
+ * Pairs with qht_map_unlock_buckets__no_stale(), hence the pass-by-reference.
  *
  * Note: callers cannot have ht->lock held.
  */
@@ -286,25 +438,23 @@ void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
 {
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
-    }
-    qht_map_unlock_buckets(map);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
     qht_lock(ht);
+    qht_map_finish_migration__htlocked(ht);
     map = ht->map;
     qht_map_lock_buckets(map);
-    qht_unlock(ht);
     *pmap = map;
-    return;
+}
+
+static inline
+void qht_map_unlock_buckets__no_stale(struct qht *ht, struct qht_map *map)
+{
+    qht_map_unlock_buckets(map);
+    qht_unlock(ht);
 }
 
 /*
- * Get a head bucket and lock it, making sure its parent map is not stale.
+ * Get a head bucket and lock it, making sure its parent map is not stale
+ * and that the corresponding old bucket, if any, has been migrated.
  * @pmap is filled with a pointer to the bucket's parent map.
  *
  * Unlock with qemu_spin_unlock(&b->lock).
@@ -318,24 +468,21 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
     struct qht_bucket *b;
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
+    for (;;) {
+        map = atomic_rcu_read(&ht->map);
+        if (unlikely(atomic_read(&map->old))) {
+            qht_map_migrate__slowpath(ht, map, hash);
+        }
+        b = qht_map_to_bucket(map, hash);
 
-    qemu_spin_lock(&b->lock);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return b;
+        qemu_spin_lock(&b->lock);
+        if (likely(!qht_map_is_stale__locked(ht, map))) {
+            *pmap = map;
+            return b;
+        }
+        /* we raced with a resize; retry with the updated ht->map */
+        qemu_spin_unlock(&b->lock);
     }
-    qemu_spin_unlock(&b->lock);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qemu_spin_lock(&b->lock);
-    qht_unlock(ht);
-    *pmap = map;
-    return b;
 }
 
 static inline bool qht_map_needs_resize(const struct qht_map *map)
@@ -364,6 +511,7 @@ static void qht_map_destroy(struct qht_map *map)
         qht_chain_destroy(&map->buckets[i]);
     }
     qemu_vfree(map->buckets);
+    g_free(map->migrated);
     g_free(map);
 }
 
@@ -372,7 +520,7 @@ static struct qht_map *qht_map_create(size_t n_buckets)
     struct qht_map *map;
     size_t i;
 
-    map = g_malloc(sizeof(*map));
+    map = g_malloc0(sizeof(*map));
     map->n_buckets = n_buckets;
 
     map->n_added_buckets = 0;
@@ -401,6 +549,7 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
     g_assert(cmp);
     ht->cmp = cmp;
     ht->mode = mode;
+    ht->n_resizes = 0;
     qemu_mutex_init(&ht->lock);
     map = qht_map_create(n_buckets);
     atomic_rcu_set(&ht->map, map);
@@ -409,6 +558,9 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    if (ht->map->old) {
+        qht_map_destroy(ht->map->old);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -450,17 +602,7 @@ void qht_reset(struct qht *ht)
 
     qht_map_lock_buckets__no_stale(ht, &map);
     qht_map_reset__all_locked(map);
-    qht_map_unlock_buckets(map);
-}
-
-static inline void qht_do_resize(struct qht *ht, struct qht_map *new)
-{
-    qht_do_resize_reset(ht, new, false);
-}
-
-static inline void qht_do_resize_and_reset(struct qht *ht, struct qht_map *new)
-{
-    qht_do_resize_reset(ht, new, true);
+    qht_map_unlock_buckets__no_stale(ht, map);
 }
 
 bool qht_reset_size(struct qht *ht, size_t n_elems)
@@ -472,11 +614,12 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qht_lock(ht);
+    qht_map_finish_migration__htlocked(ht);
     map = ht->map;
     if (n_buckets != map->n_buckets) {
         new = qht_map_create(n_buckets);
     }
-    qht_do_resize_and_reset(ht, new);
+    qht_do_reset_resize(ht, new);
     qht_unlock(ht);
 
     return !!new;
@@ -509,9 +652,9 @@ void *qht_do_lookup(const struct qht_bucket *head, qht_lookup_func_t func,
     return NULL;
 }
 
-static __attribute__((noinline))
-void *qht_lookup__slowpath(const struct qht_bucket *b, qht_lookup_func_t func,
-                           const void *userp, uint32_t hash)
+static inline
+void *qht_lookup__bucket(const struct qht_bucket *b, qht_lookup_func_t func,
+                         const void *userp, uint32_t hash)
 {
     unsigned int version;
     void *ret;
@@ -523,6 +666,40 @@ void *qht_lookup__slowpath(const struct qht_bucket *b, qht_lookup_func_t func,
     return ret;
 }
 
+/*
+ * Look up in both maps if a resize is in progress, and retry if ht->map
+ * changed under our feet: the entry might have been migrated to a map we
+ * have not looked at.
+ */
+static __attribute__((noinline))
+void *qht_lookup__slowpath(const struct qht *ht, const struct qht_map *map,
+                           qht_lookup_func_t func, const void *userp,
+                           uint32_t hash)
+{
+    const struct qht_map *old;
+    void *ret;
+
+    for (;;) {
+        old = atomic_rcu_read(&map->old);
+        if (unlikely(old)) {
+            size_t idx = hash & (old->n_buckets - 1);
+
+            if (!atomic_read(&old->migrated[idx])) {
+                ret = qht_lookup__bucket(&old->buckets[idx], func, userp, hash);
+                if (ret) {
+                    return ret;
+                }
+            }
+        }
+        ret = qht_lookup__bucket(qht_map_to_bucket(map, hash), func, userp,
+                                 hash);
+        if (ret || likely(map == atomic_rcu_read(&ht->map))) {
+            return ret;
+        }
+        map = atomic_rcu_read(&ht->map);
+    }
+}
+
 void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
                         qht_lookup_func_t func)
 {
@@ -532,18 +709,21 @@ void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
     void *ret;
 
     map = atomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
+    if (likely(!atomic_read(&map->old))) {
+        b = qht_map_to_bucket(map, hash);
 
-    version = seqlock_read_begin(&b->sequence);
-    ret = qht_do_lookup(b, func, userp, hash);
-    if (likely(!seqlock_read_retry(&b->sequence, version))) {
-        return ret;
+        version = seqlock_read_begin(&b->sequence);
+        ret = qht_do_lookup(b, func, userp, hash);
+        if (likely(!seqlock_read_retry(&b->sequence, version)) &&
+            (likely(ret) || likely(map == atomic_read(&ht->map)))) {
+            return ret;
+        }
     }
     /*
      * Removing the do/while from the fastpath gives a 4% perf. increase when
      * running a 100%-lookup microbenchmark.
      */
-    return qht_lookup__slowpath(b, func, userp, hash);
+    return qht_lookup__slowpath(ht, map, func, userp, hash);
 }
 
 void *qht_lookup(const struct qht *ht, const void *userp, uint32_t hash)
@@ -617,7 +797,8 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
     if (qht_map_needs_resize(map)) {
         struct qht_map *new = qht_map_create(map->n_buckets * 2);
 
-        qht_do_resize(ht, new);
+        qht_map_finish_migration__htlocked(ht);
+        qht_map_start_migration__htlocked(ht, new);
     }
     qht_unlock(ht);
 }
@@ -802,10 +983,9 @@ do_qht_iter(struct qht *ht, const struct qht_iter *iter, void *userp)
 {
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
+    qht_map_lock_buckets__no_stale(ht, &map);
     qht_map_iter__all_locked(map, iter, userp);
-    qht_map_unlock_buckets(map);
+    qht_map_unlock_buckets__no_stale(ht, map);
 }
 
 void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
@@ -828,41 +1008,18 @@ void qht_iter_remove(struct qht *ht, qht_iter_bool_func_t func, void *userp)
     do_qht_iter(ht, &iter, userp);
 }
 
-struct qht_map_copy_data {
-    struct qht *ht;
-    struct qht_map *new;
-};
-
-static void qht_map_copy(void *p, uint32_t hash, void *userp)
-{
-    struct qht_map_copy_data *data = userp;
-    struct qht *ht = data->ht;
-    struct qht_map *new = data->new;
-    struct qht_bucket *b = qht_map_to_bucket(new, hash);
-
-    /* no need to acquire b->lock because no thread has seen this map yet */
-    qht_insert__locked(ht, new, b, p, hash, NULL);
-}
-
 /*
- * Atomically perform a resize and/or reset.
- * Call with ht->lock held.
+ * Atomically perform a reset, and switch to @new if it is not NULL.
+ * Since the table is emptied, there is nothing to migrate.
+ * Call with ht->lock held and no resize in progress.
  */
-static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
+static void qht_do_reset_resize(struct qht *ht, struct qht_map *new)
 {
     struct qht_map *old;
-    const struct qht_iter iter = {
-        .f.retvoid = qht_map_copy,
-        .type = QHT_ITER_VOID,
-    };
-    struct qht_map_copy_data data;
 
     old = ht->map;
     qht_map_lock_buckets(old);
-
-    if (reset) {
-        qht_map_reset__all_locked(old);
-    }
+    qht_map_reset__all_locked(old);
 
     if (new == NULL) {
         qht_map_unlock_buckets(old);
@@ -870,11 +1027,7 @@ static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
     }
 
     g_assert(new->n_buckets != old->n_buckets);
-    data.ht = ht;
-    data.new = new;
-    qht_map_iter__all_locked(old, &iter, &data);
-    qht_map_debug__all_locked(new);
-
+    atomic_inc(&ht->n_resizes);
     atomic_rcu_set(&ht->map, new);
     qht_map_unlock_buckets(old);
     call_rcu(old, qht_map_destroy, rcu);
@@ -886,11 +1039,14 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     size_t ret = false;
 
     qht_lock(ht);
+    qht_map_finish_migration__htlocked(ht);
     if (n_buckets != ht->map->n_buckets) {
         struct qht_map *new;
 
         new = qht_map_create(n_buckets);
-        qht_do_resize(ht, new);
+        /* concurrent writers keep going, and help with the migration */
+        qht_map_start_migration__htlocked(ht, new);
+        qht_map_finish_migration__htlocked(ht);
         ret = true;
     }
     qht_unlock(ht);
@@ -899,15 +1055,48 @@ bool qht_resize(struct qht *ht, size_t n_elems)
 }
 
 /* pass @stats to qht_statistics_destroy() when done */
+static void qht_chain_count(const struct qht_bucket *head, size_t *pbuckets,
+                            size_t *pentries)
+{
+    const struct qht_bucket *b;
+    unsigned int version;
+    size_t buckets;
+    size_t entries;
+    int j;
+
+    do {
+        version = seqlock_read_begin(&head->sequence);
+        buckets = 0;
+        entries = 0;
+        b = head;
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (atomic_read(&b->pointers[j]) == NULL) {
+                    break;
+                }
+                entries++;
+            }
+            buckets++;
+            b = atomic_rcu_read(&b->next);
+        } while (b);
+    } while (seqlock_read_retry(&head->sequence, version));
+
+    *pbuckets = buckets;
+    *pentries = entries;
+}
+
 void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
 {
     const struct qht_map *map;
+    const struct qht_map *old;
     int i;
 
     map = atomic_rcu_read(&ht->map);
 
     stats->used_head_buckets = 0;
     stats->entries = 0;
+    stats->migrating_head_buckets = 0;
+    stats->resizes = atomic_read(&ht->n_resizes);
     qdist_init(&stats->chain);
     qdist_init(&stats->occupancy);
     /* bail out if the qht has not yet been initialized */
@@ -918,30 +1107,10 @@ void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
     stats->head_buckets = map->n_buckets;
 
     for (i = 0; i < map->n_buckets; i++) {
-        const struct qht_bucket *head = &map->buckets[i];
-        const struct qht_bucket *b;
-        unsigned int version;
         size_t buckets;
         size_t entries;
-        int j;
-
-        do {
-            version = seqlock_read_begin(&head->sequence);
-            buckets = 0;
-            entries = 0;
-            b = head;
-            do {
-                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
-                    if (atomic_read(&b->pointers[j]) == NULL) {
-                        break;
-                    }
-                    entries++;
-                }
-                buckets++;
-                b = atomic_rcu_read(&b->next);
-            } while (b);
-        } while (seqlock_read_retry(&head->sequence, version));
 
+        qht_chain_count(&map->buckets[i], &buckets, &entries);
         if (entries) {
             qdist_inc(&stats->chain, buckets);
             qdist_inc(&stats->occupancy,
@@ -952,6 +1121,24 @@ void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
             qdist_inc(&stats->occupancy, 0);
         }
     }
+
+    /* entries not yet migrated by an ongoing resize */
+    rcu_read_lock();
+    old = atomic_rcu_read(&map->old);
+    if (old) {
+        for (i = 0; i < old->n_buckets; i++) {
+            size_t buckets;
+            size_t entries;
+
+            if (atomic_read(&old->migrated[i])) {
+                continue;
+            }
+            qht_chain_count(&old->buckets[i], &buckets, &entries);
+            stats->migrating_head_buckets++;
+            stats->entries += entries;
+        }
+    }
+    rcu_read_unlock();
 }
 
 void qht_statistics_destroy(struct qht_stats *stats)
@@ -75,6 +75,7 @@ int main(int argc, char **argv)
 #include "ui/input.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/numa.h"
+#include "sysemu/hostmem.h"
 #include "exec/gdbstub.h"
 #include "qemu/timer.h"
 #include "chardev/char.h"
@@ -108,6 +109,7 @@ int main(int argc, char **argv)
 
 #include "trace-root.h"
 #include "trace/control.h"
+#include "qemu/exec-trace.h"
 #include "qemu/queue.h"
 #include "sysemu/arch_init.h"
 
@@ -3049,6 +3051,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_global_opts);
     qemu_add_opts(&qemu_mon_opts);
     qemu_add_opts(&qemu_trace_opts);
+    qemu_add_opts(&qemu_exec_trace_opts);
     qemu_add_opts(&qemu_option_rom_opts);
     qemu_add_opts(&qemu_machine_opts);
     qemu_add_opts(&qemu_accel_opts);
@@ -3831,6 +3834,9 @@ int main(int argc, char **argv, char **envp)
                 g_free(trace_file);
                 trace_file = trace_opt_parse(optarg);
                 break;
+            case QEMU_OPTION_exec_trace:
+                exec_trace_opt_parse(optarg);
+                break;
             case QEMU_OPTION_readconfig:
                 {
                     int ret = qemu_read_config_file(optarg);
@@ -4059,6 +4065,7 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     trace_init_file(trace_file);
+    exec_trace_init(&error_fatal);
 
     /* Open the logfile at this point and set the log mask if necessary.
      */
@@ -4403,9 +4410,11 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    host_memory_backend_prealloc_begin();
     qemu_opts_foreach(qemu_find_opts("object"),
                       user_creatable_add_opts_foreach,
                       object_create_delayed, &error_fatal);
+    host_memory_backend_prealloc_end(&error_fatal);
 
     tpm_init();
 